@@ -0,0 +1,123 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/buffer_pool.h"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+
+using std::shared_ptr;
+using std::unique_ptr;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+// Buffers up to this size are in classes of |kSmallClassStep| bytes.
+constexpr size_t kSmallClassLimit = 4 * 1024;
+constexpr size_t kSmallClassStep = 64;
+
+// Returns the capacity of the buffers in the size class of |size|. Above
+// |kSmallClassLimit| there are four classes between consecutive powers of two,
+// so at most 25% of a buffer is unused.
+size_t GetClassSize(size_t size) {
+  if (size <= kSmallClassLimit) {
+    return std::max((size + kSmallClassStep - 1) / kSmallClassStep, size_t(1)) *
+           kSmallClassStep;
+  }
+  size_t power = kSmallClassLimit;
+  while (power * 2 < size) {
+    power *= 2;
+  }
+  auto step = power / 4;
+  return (size + step - 1) / step * step;
+}
+
+// The unused buffers of a |BufferPool|. It is shared with the deleters of the
+// buffers handed out, so it lives as long as any of them.
+class FreeLists {
+ public:
+  explicit FreeLists(size_t max_pooled_bytes)
+      : max_pooled_bytes_(max_pooled_bytes), pooled_bytes_(0) {}
+
+  // Returns an unused buffer with a capacity of |class_size| or nullptr if
+  // there is none.
+  unique_ptr<Buffer> Take(size_t class_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = lists_.find(class_size);
+    if (iter == lists_.end() || iter->second.empty()) {
+      return nullptr;
+    }
+    auto buffer = std::move(iter->second.back());
+    iter->second.pop_back();
+    pooled_bytes_ -= class_size;
+    return buffer;
+  }
+
+  // Keeps |buffer| for reuse if it fits in the pool, otherwise frees it.
+  void Put(unique_ptr<Buffer> buffer) {
+    auto capacity = buffer->capacity();
+    // The buffer might have grown out of its size class.
+    if (GetClassSize(capacity) != capacity) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pooled_bytes_ + capacity > max_pooled_bytes_) {
+      return;
+    }
+    pooled_bytes_ += capacity;
+    lists_[capacity].push_back(std::move(buffer));
+  }
+
+ private:
+  std::mutex mutex_;
+  // The unused buffers by their capacity.
+  std::map<size_t, vector<unique_ptr<Buffer>>> lists_;
+  const size_t max_pooled_bytes_;
+  // The total capacity of the buffers in |lists_|.
+  size_t pooled_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(FreeLists);
+};
+
+class BufferPool : public BufferPoolInterface {
+ public:
+  explicit BufferPool(size_t max_pooled_bytes)
+      : free_lists_(std::make_shared<FreeLists>(max_pooled_bytes)) {}
+  ~BufferPool() override = default;
+
+  shared_ptr<Buffer> Acquire(size_t size) override {
+    auto class_size = GetClassSize(size);
+    auto buffer = free_lists_->Take(class_size);
+    if (!buffer) {
+      buffer.reset(new Buffer());
+      buffer->reserve(class_size);
+    }
+    buffer->resize(size);
+    auto free_lists = free_lists_;
+    return shared_ptr<Buffer>(buffer.release(), [free_lists](Buffer* buffer) {
+      free_lists->Put(unique_ptr<Buffer>(buffer));
+    });
+  }
+
+ private:
+  shared_ptr<FreeLists> free_lists_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+}  // namespace
+
+shared_ptr<BufferPoolInterface> CreateBufferPool(size_t max_pooled_bytes) {
+  return std::make_shared<BufferPool>(max_pooled_bytes);
+}
+
+}  // namespace puffin
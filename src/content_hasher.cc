@@ -0,0 +1,87 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/content_hasher.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace puffin {
+
+constexpr uint64_t ContentHasher::kPrime1;
+constexpr uint64_t ContentHasher::kPrime2;
+constexpr uint64_t ContentHasher::kPrime3;
+constexpr uint64_t ContentHasher::kPrime4;
+constexpr uint64_t ContentHasher::kPrime5;
+constexpr size_t ContentHasher::kStripeSize;
+
+void ContentHasher::Update(const uint8_t* data, size_t length) {
+  total_length_ += length;
+  if (pending_length_ > 0) {
+    auto copy_length = std::min(length, kStripeSize - pending_length_);
+    memcpy(pending_ + pending_length_, data, copy_length);
+    pending_length_ += copy_length;
+    data += copy_length;
+    length -= copy_length;
+    if (pending_length_ < kStripeSize) {
+      return;
+    }
+    ProcessStripe(pending_);
+    pending_length_ = 0;
+  }
+  for (; length >= kStripeSize; data += kStripeSize, length -= kStripeSize) {
+    ProcessStripe(data);
+  }
+  memcpy(pending_, data, length);
+  pending_length_ = length;
+}
+
+uint64_t ContentHasher::Final() const {
+  uint64_t hash;
+  if (total_length_ >= kStripeSize) {
+    hash =
+        Rotate(v1_, 1) + Rotate(v2_, 7) + Rotate(v3_, 12) + Rotate(v4_, 18);
+    hash = MergeRound(hash, v1_);
+    hash = MergeRound(hash, v2_);
+    hash = MergeRound(hash, v3_);
+    hash = MergeRound(hash, v4_);
+  } else {
+    hash = kPrime5;
+  }
+  hash += total_length_;
+
+  const uint8_t* data = pending_;
+  size_t length = pending_length_;
+  for (; length >= 8; data += 8, length -= 8) {
+    hash ^= Round(0, Read<uint64_t>(data));
+    hash = Rotate(hash, 27) * kPrime1 + kPrime4;
+  }
+  if (length >= 4) {
+    hash ^= Read<uint32_t>(data) * kPrime1;
+    hash = Rotate(hash, 23) * kPrime2 + kPrime3;
+    data += 4;
+    length -= 4;
+  }
+  for (; length > 0; data++, length--) {
+    hash ^= *data * kPrime5;
+    hash = Rotate(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void ContentHasher::ProcessStripe(const uint8_t* data) {
+  v1_ = Round(v1_, Read<uint64_t>(data));
+  v2_ = Round(v2_, Read<uint64_t>(data + 8));
+  v3_ = Round(v3_, Read<uint64_t>(data + 16));
+  v4_ = Round(v4_, Read<uint64_t>(data + 24));
+}
+
+}  // namespace puffin
@@ -0,0 +1,78 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_CONTENT_HASHER_H_
+#define SRC_CONTENT_HASHER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// A streaming implementation of the XXH64 hash. It is not cryptographically
+// secure, but it is fast and good enough to detect a changed input.
+class ContentHasher {
+ public:
+  ContentHasher()
+      : v1_(kPrime1 + kPrime2),
+        v2_(kPrime2),
+        v3_(0),
+        v4_(0 - kPrime1),
+        total_length_(0),
+        pending_length_(0) {}
+  ~ContentHasher() = default;
+
+  // Adds the |length| bytes of |data| to the hashed content.
+  void Update(const uint8_t* data, size_t length);
+
+  // Returns the hash of all the content added so far.
+  uint64_t Final() const;
+
+ private:
+  static constexpr uint64_t kPrime1 = 11400714785074694791ULL;
+  static constexpr uint64_t kPrime2 = 14029467366897019727ULL;
+  static constexpr uint64_t kPrime3 = 1609587929392839161ULL;
+  static constexpr uint64_t kPrime4 = 9650029242287828579ULL;
+  static constexpr uint64_t kPrime5 = 2870177450012600261ULL;
+  static constexpr size_t kStripeSize = 32;
+
+  static uint64_t Rotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  // Reads a little-endian value from the possibly unaligned |data|.
+  template <typename T>
+  static uint64_t Read(const uint8_t* data) {
+    uint64_t value = 0;
+    for (size_t idx = 0; idx < sizeof(T); idx++) {
+      value |= static_cast<uint64_t>(data[idx]) << (idx * 8);
+    }
+    return value;
+  }
+
+  static uint64_t Round(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    return Rotate(acc, 31) * kPrime1;
+  }
+
+  static uint64_t MergeRound(uint64_t acc, uint64_t value) {
+    acc ^= Round(0, value);
+    return acc * kPrime1 + kPrime4;
+  }
+
+  void ProcessStripe(const uint8_t* data);
+
+  uint64_t v1_, v2_, v3_, v4_;
+  uint64_t total_length_;
+  uint8_t pending_[kStripeSize];
+  size_t pending_length_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContentHasher);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_CONTENT_HASHER_H_
@@ -0,0 +1,484 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// An end-to-end benchmark that runs |PuffDiff| and |PuffPatch| over pairs of
+// files with the same name in a source and a target corpus directory. For each
+// pair it reports the wall time, throughput and peak RSS of every phase, the
+// patch size and how many source deflates were puffed while patching, how many
+// of them were puffed again after being evicted from the puff cache and how
+// many reads were served from that cache. The results can be saved as a
+// baseline and later runs can be compared against it with configurable
+// regression thresholds.
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef USE_BRILLO
+#include "brillo/flag_helper.h"
+#else
+#include "gflags/gflags.h"
+#endif
+
+#include "puffin/src/file_stream.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
+#include "puffin/src/include/puffin/puffdiff.h"
+#include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/stream_stats.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/memory_stream.h"
+
+using puffin::BitExtent;
+using puffin::Buffer;
+using puffin::DeflateIndex;
+using puffin::FileStream;
+using puffin::MemoryStream;
+using puffin::PuffinStreamStats;
+using puffin::UniqueStreamPtr;
+using std::string;
+using std::vector;
+
+namespace {
+
+const uint64_t kDefaultPuffCacheSize = 50 * 1024 * 1024;  // 50 MB
+
+// The phases of a single diff/patch run.
+enum Phase { kLocate, kPuffSize, kDiff, kPatch, kNumPhases };
+const char* const kPhaseNames[kNumPhases] = {"locate", "puff_size", "diff",
+                                             "patch"};
+
+struct PhaseResult {
+  double time_ms = 0;
+  double mb_per_second = 0;
+  uint64_t peak_rss_kb = 0;
+};
+
+struct PairResult {
+  string name;
+  uint64_t src_size = 0;
+  uint64_t dst_size = 0;
+  uint64_t patch_size = 0;
+  // The statistics of the source puff stream while patching.
+  PuffinStreamStats src_stats;
+  PhaseResult phases[kNumPhases];
+};
+
+// Resets the peak RSS of the process to its current RSS so every phase can
+// measure its own peak. This is only supported on Linux; elsewhere the peak
+// of the whole process is reported.
+void ResetPeakRss() {
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (clear_refs) {
+    clear_refs << "5";
+  }
+}
+
+// Returns the peak RSS of the process in kilobytes.
+uint64_t GetPeakRssKb() {
+  std::ifstream status("/proc/self/status");
+  string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      return std::stoull(line.substr(6));
+    }
+  }
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+// Runs |fn| as phase |phase| which processes |bytes| bytes and fills the phase
+// result in |result|. If |iterations| is larger than one, the fastest run is
+// reported.
+bool RunPhase(Phase phase,
+              uint64_t bytes,
+              uint64_t iterations,
+              const std::function<bool()>& fn,
+              PairResult* result) {
+  auto* phase_result = &result->phases[phase];
+  for (uint64_t idx = 0; idx < std::max<uint64_t>(iterations, 1); idx++) {
+    ResetPeakRss();
+    auto start = std::chrono::steady_clock::now();
+    TEST_AND_RETURN_FALSE(fn());
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (idx == 0 || elapsed.count() < phase_result->time_ms) {
+      phase_result->time_ms = elapsed.count();
+    }
+    phase_result->peak_rss_kb =
+        std::max(phase_result->peak_rss_kb, GetPeakRssKb());
+  }
+  if (phase_result->time_ms > 0) {
+    phase_result->mb_per_second =
+        bytes / (1024.0 * 1024.0) / (phase_result->time_ms / 1000.0);
+  }
+  return true;
+}
+
+// Locates the deflates in |stream| based on the extension of |file_name|.
+// Files with an unknown extension are diffed as raw files.
+bool LocateDeflates(const UniqueStreamPtr& stream,
+                    const string& file_name,
+                    vector<BitExtent>* deflates) {
+  deflates->clear();
+  auto last_dot = file_name.find_last_of(".");
+  auto extension =
+      last_dot == string::npos ? string() : file_name.substr(last_dot + 1);
+  if (extension == "zip" || extension == "apk" || extension == "jar") {
+    TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZipArchive(stream, deflates));
+  } else if (extension == "gz" || extension == "gzip" || extension == "tgz") {
+    TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(stream, deflates));
+  } else if (extension == "zlib") {
+    TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(stream, deflates));
+  } else if (extension == "deflate") {
+    TEST_AND_RETURN_FALSE(
+        puffin::LocateDeflatesInDeflateStream(stream, 0, deflates, nullptr));
+  }
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  return true;
+}
+
+bool ReadFile(const string& path, Buffer* data) {
+  auto stream = FileStream::Open(path, true, false);
+  TEST_AND_RETURN_FALSE(stream);
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(stream->GetSize(&size));
+  data->resize(size);
+  TEST_AND_RETURN_FALSE(stream->Read(data->data(), data->size()));
+  return true;
+}
+
+bool RunPair(const string& src_path,
+             const string& dst_path,
+             const string& name,
+             uint64_t iterations,
+             uint64_t cache_size,
+             const string& tmp_file,
+             PairResult* result) {
+  result->name = name;
+  Buffer dst_data;
+  TEST_AND_RETURN_FALSE(ReadFile(dst_path, &dst_data));
+  result->dst_size = dst_data.size();
+  {
+    auto src = FileStream::Open(src_path, true, false);
+    TEST_AND_RETURN_FALSE(src);
+    TEST_AND_RETURN_FALSE(src->GetSize(&result->src_size));
+  }
+  const auto total_size = result->src_size + result->dst_size;
+
+  vector<BitExtent> src_deflates, dst_deflates;
+  TEST_AND_RETURN_FALSE(RunPhase(
+      kLocate, total_size, iterations,
+      [&]() {
+        auto src = FileStream::Open(src_path, true, false);
+        auto dst = MemoryStream::CreateForRead(dst_data);
+        TEST_AND_RETURN_FALSE(src);
+        TEST_AND_RETURN_FALSE(LocateDeflates(src, src_path, &src_deflates));
+        TEST_AND_RETURN_FALSE(LocateDeflates(dst, dst_path, &dst_deflates));
+        return true;
+      },
+      result));
+
+  DeflateIndex src_index, dst_index;
+  TEST_AND_RETURN_FALSE(RunPhase(
+      kPuffSize, total_size, iterations,
+      [&]() {
+        auto src = FileStream::Open(src_path, true, false);
+        auto dst = MemoryStream::CreateForRead(dst_data);
+        TEST_AND_RETURN_FALSE(src);
+        TEST_AND_RETURN_FALSE(
+            puffin::CreateDeflateIndex(src, src_deflates, &src_index));
+        TEST_AND_RETURN_FALSE(
+            puffin::CreateDeflateIndex(dst, dst_deflates, &dst_index));
+        return true;
+      },
+      result));
+
+  Buffer patch;
+  TEST_AND_RETURN_FALSE(RunPhase(
+      kDiff, total_size, iterations,
+      [&]() {
+        auto src = FileStream::Open(src_path, true, false);
+        TEST_AND_RETURN_FALSE(src);
+        TEST_AND_RETURN_FALSE(puffin::PuffDiff(
+            std::move(src), MemoryStream::CreateForRead(dst_data), src_index,
+            dst_index,
+            {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
+            tmp_file, &patch));
+        unlink(tmp_file.c_str());
+        return true;
+      },
+      result));
+  result->patch_size = patch.size();
+
+  Buffer patched;
+  TEST_AND_RETURN_FALSE(RunPhase(
+      kPatch, result->dst_size, iterations,
+      [&]() {
+        auto src = FileStream::Open(src_path, true, false);
+        TEST_AND_RETURN_FALSE(src);
+        patched.clear();
+        TEST_AND_RETURN_FALSE(puffin::PuffPatch(
+            std::move(src), MemoryStream::CreateForWrite(&patched),
+            patch.data(), patch.size(), cache_size, &result->src_stats,
+            nullptr));
+        return true;
+      },
+      result));
+  if (patched != dst_data) {
+    LOG(ERROR) << "Patching " << name << " did not recreate the target.";
+    return false;
+  }
+  return true;
+}
+
+// Returns the sorted names of the regular files in |dir|.
+bool ListFiles(const string& dir, vector<string>* files) {
+  DIR* dirp = opendir(dir.c_str());
+  TEST_AND_RETURN_FALSE(dirp != nullptr);
+  while (auto* entry = readdir(dirp)) {
+    string path = dir + "/" + entry->d_name;
+    if (entry->d_name[0] != '.' && access(path.c_str(), R_OK) == 0 &&
+        entry->d_type != DT_DIR) {
+      files->push_back(entry->d_name);
+    }
+  }
+  closedir(dirp);
+  std::sort(files->begin(), files->end());
+  return true;
+}
+
+// The metrics that are saved into the baseline and compared against it.
+using Metrics = std::map<string, double>;
+
+Metrics GetMetrics(const PairResult& result) {
+  Metrics metrics;
+  metrics["patch_size"] = result.patch_size;
+  metrics["deflates_repuffed"] = result.src_stats.deflates_repuffed;
+  for (size_t phase = 0; phase < kNumPhases; phase++) {
+    string prefix = kPhaseNames[phase];
+    metrics[prefix + "_time_ms"] = result.phases[phase].time_ms;
+    metrics[prefix + "_peak_rss_kb"] = result.phases[phase].peak_rss_kb;
+  }
+  return metrics;
+}
+
+void PrintJson(const vector<PairResult>& results) {
+  printf("{\n  \"pairs\": [\n");
+  for (size_t idx = 0; idx < results.size(); idx++) {
+    const auto& result = results[idx];
+    printf("    {\"name\": \"%s\", \"src_size\": %" PRIu64
+           ", \"dst_size\": %" PRIu64 ", \"patch_size\": %" PRIu64
+           ", \"deflates_puffed\": %" PRIu64
+           ", \"deflates_repuffed\": %" PRIu64 ", \"cache_hits\": %" PRIu64
+           ", \"phases\": {",
+           result.name.c_str(), result.src_size, result.dst_size,
+           result.patch_size, result.src_stats.deflates_puffed,
+           result.src_stats.deflates_repuffed, result.src_stats.cache_hits);
+    for (size_t phase = 0; phase < kNumPhases; phase++) {
+      const auto& phase_result = result.phases[phase];
+      printf("%s\"%s\": {\"time_ms\": %.3f, \"mb_per_second\": %.2f, "
+             "\"peak_rss_kb\": %" PRIu64 "}",
+             phase == 0 ? "" : ", ", kPhaseNames[phase], phase_result.time_ms,
+             phase_result.mb_per_second, phase_result.peak_rss_kb);
+    }
+    printf("}}%s\n", idx + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+void PrintText(const vector<PairResult>& results) {
+  for (const auto& result : results) {
+    printf("%s: src %" PRIu64 " bytes, dst %" PRIu64 " bytes, patch %" PRIu64
+           " bytes, %" PRIu64 " deflates puffed (%" PRIu64
+           " re-puffed), %" PRIu64 " cache hits\n",
+           result.name.c_str(), result.src_size, result.dst_size,
+           result.patch_size, result.src_stats.deflates_puffed,
+           result.src_stats.deflates_repuffed, result.src_stats.cache_hits);
+    for (size_t phase = 0; phase < kNumPhases; phase++) {
+      const auto& phase_result = result.phases[phase];
+      printf("  %-10s %12.3f ms %10.2f MB/s %10" PRIu64 " KB peak RSS\n",
+             kPhaseNames[phase], phase_result.time_ms,
+             phase_result.mb_per_second, phase_result.peak_rss_kb);
+    }
+  }
+}
+
+// The baseline file has one "<pair name> <metric> <value>" entry per line.
+bool SaveBaseline(const string& path, const vector<PairResult>& results) {
+  std::ofstream baseline(path);
+  TEST_AND_RETURN_FALSE(baseline);
+  baseline << std::setprecision(15);
+  for (const auto& result : results) {
+    for (const auto& metric : GetMetrics(result)) {
+      baseline << result.name << " " << metric.first << " " << metric.second
+               << "\n";
+    }
+  }
+  TEST_AND_RETURN_FALSE(baseline);
+  return true;
+}
+
+bool LoadBaseline(const string& path, std::map<string, Metrics>* baseline) {
+  std::ifstream file(path);
+  TEST_AND_RETURN_FALSE(file);
+  string line;
+  while (std::getline(file, line)) {
+    std::istringstream entry(line);
+    string name, metric;
+    double value;
+    if (entry >> name >> metric >> value) {
+      (*baseline)[name][metric] = value;
+    }
+  }
+  return true;
+}
+
+// Compares |results| against |baseline| and logs every metric that regressed
+// more than its threshold (in percent). Time metrics also need to regress more
+// than |time_slack_ms| to ignore the noise of very short phases. Returns the
+// number of regressions.
+size_t CompareWithBaseline(const vector<PairResult>& results,
+                           const std::map<string, Metrics>& baseline,
+                           double time_threshold,
+                           double time_slack_ms,
+                           double size_threshold,
+                           double rss_threshold) {
+  size_t regressions = 0;
+  for (const auto& result : results) {
+    auto base = baseline.find(result.name);
+    if (base == baseline.end()) {
+      LOG(WARNING) << result.name << " is not in the baseline.";
+      continue;
+    }
+    for (const auto& metric : GetMetrics(result)) {
+      auto base_metric = base->second.find(metric.first);
+      if (base_metric == base->second.end()) {
+        continue;
+      }
+      const string& name = metric.first;
+      double threshold = size_threshold;
+      double slack = 0;
+      if (name.find("_time_ms") != string::npos) {
+        threshold = time_threshold;
+        slack = time_slack_ms;
+      } else if (name.find("_peak_rss_kb") != string::npos) {
+        threshold = rss_threshold;
+      }
+      double limit = std::max(base_metric->second * (1 + threshold / 100),
+                              base_metric->second + slack);
+      if (metric.second > limit) {
+        LOG(ERROR) << result.name << " " << name << " regressed from "
+                   << base_metric->second << " to " << metric.second;
+        regressions++;
+      }
+    }
+  }
+  return regressions;
+}
+
+}  // namespace
+
+#define SETUP_FLAGS                                                          \
+  DEFINE_string(src_corpus, "", "The source corpus directory");              \
+  DEFINE_string(tgt_corpus, "",                                              \
+                "The target corpus directory. Files are paired with the "    \
+                "source files by name");                                     \
+  DEFINE_uint64(iterations, 1,                                               \
+                "Number of times to run each phase; the fastest is kept");   \
+  DEFINE_uint64(cache_size, kDefaultPuffCacheSize,                           \
+                "Maximum size to cache the puff stream in puffpatch");       \
+  DEFINE_string(tmp_file, "/tmp/puffin_corpus_benchmark.tmp",                \
+                "A temporary file used by puffdiff");                        \
+  DEFINE_string(format, "text",                                              \
+                "Output format of the results: text or json");               \
+  DEFINE_string(save_baseline, "", "Saves the results into this file");      \
+  DEFINE_string(baseline, "", "Compares the results against this file");     \
+  DEFINE_double(time_threshold, 10,                                          \
+                "Allowed regression of the phase times in percent");         \
+  DEFINE_double(time_slack_ms, 5,                                            \
+                "Time regressions smaller than this are ignored");           \
+  DEFINE_double(size_threshold, 1,                                           \
+                "Allowed regression of patch size and re-puffs in "          \
+                "percent");                                                  \
+  DEFINE_double(rss_threshold, 10,                                           \
+                "Allowed regression of the peak RSS in percent");
+
+#ifndef USE_BRILLO
+SETUP_FLAGS;
+#endif
+
+// Main entry point to the benchmark.
+bool Main(int argc, char** argv) {
+#ifdef USE_BRILLO
+  SETUP_FLAGS;
+  brillo::FlagHelper::Init(argc, argv, "Puffin corpus benchmark");
+#else
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+  TEST_AND_RETURN_FALSE(!FLAGS_src_corpus.empty());
+  TEST_AND_RETURN_FALSE(!FLAGS_tgt_corpus.empty());
+  TEST_AND_RETURN_FALSE(FLAGS_format == "text" || FLAGS_format == "json");
+
+  vector<string> files;
+  TEST_AND_RETURN_FALSE(ListFiles(FLAGS_src_corpus, &files));
+  vector<PairResult> results;
+  for (const auto& file : files) {
+    auto dst_path = FLAGS_tgt_corpus + "/" + file;
+    if (access(dst_path.c_str(), R_OK) != 0) {
+      LOG(WARNING) << "Target file " << dst_path << " does not exist.";
+      continue;
+    }
+    PairResult result;
+    TEST_AND_RETURN_FALSE(RunPair(FLAGS_src_corpus + "/" + file, dst_path, file,
+                                  FLAGS_iterations, FLAGS_cache_size,
+                                  FLAGS_tmp_file, &result));
+    results.push_back(result);
+  }
+
+  if (FLAGS_format == "json") {
+    PrintJson(results);
+  } else {
+    PrintText(results);
+  }
+
+  if (!FLAGS_save_baseline.empty()) {
+    TEST_AND_RETURN_FALSE(SaveBaseline(FLAGS_save_baseline, results));
+  }
+  if (!FLAGS_baseline.empty()) {
+    std::map<string, Metrics> baseline;
+    TEST_AND_RETURN_FALSE(LoadBaseline(FLAGS_baseline, &baseline));
+    auto regressions = CompareWithBaseline(
+        results, baseline, FLAGS_time_threshold, FLAGS_time_slack_ms,
+        FLAGS_size_threshold, FLAGS_rss_threshold);
+    if (regressions > 0) {
+      LOG(ERROR) << regressions << " metrics regressed against the baseline.";
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!Main(argc, argv)) {
+    return 1;
+  }
+  return 0;
+}
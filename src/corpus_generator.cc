@@ -0,0 +1,258 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Generates synthetic deflate, zlib, gzip and zip files with controlled
+// properties, together with a "next version" of each file with a controlled
+// number of edits. The files are written into the "src" and "tgt"
+// subdirectories of the output directory, so they can be used directly by
+// puffin_corpus_benchmark. The output only depends on the flags, so
+// performance results can be reproduced anywhere without private inputs.
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef USE_BRILLO
+#include "brillo/flag_helper.h"
+#else
+#include "gflags/gflags.h"
+#endif
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/synthetic_corpus.h"
+
+using puffin::Buffer;
+using puffin::ContainerType;
+using puffin::ContentType;
+using puffin::DeflateOptions;
+using puffin::DeflateStrategy;
+using puffin::Random;
+using std::string;
+using std::vector;
+
+namespace {
+
+// The properties of one generated file.
+struct FileSpec {
+  string name;
+  ContainerType container;
+  ContentType content;
+  DeflateOptions options;
+  // The number of zip entries. The total size is divided between them.
+  size_t entries;
+};
+
+// The edits applied to create the target of each file.
+struct EditSpec {
+  size_t num_edits;
+  size_t max_edit_size;
+};
+
+// Returns the extension the puffin tools infer the type of |container| from.
+string GetExtension(ContainerType container) {
+  switch (container) {
+    case ContainerType::kDeflate:
+      return "deflate";
+    case ContainerType::kZlib:
+      return "zlib";
+    case ContainerType::kGzip:
+      return "gz";
+    case ContainerType::kZip:
+      return "zip";
+  }
+  return "";
+}
+
+bool MakeDirectory(const string& path) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create directory " << path;
+    return false;
+  }
+  return true;
+}
+
+bool WriteFile(const string& path, const Buffer& data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  TEST_AND_RETURN_FALSE(file);
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  TEST_AND_RETURN_FALSE(file);
+  return true;
+}
+
+// Generates the source and target of |spec| with a total uncompressed size of
+// |size| and writes them into |output_dir|.
+bool GenerateFile(const FileSpec& spec,
+                  size_t size,
+                  const EditSpec& edits,
+                  uint64_t seed,
+                  const string& output_dir) {
+  TEST_AND_RETURN_FALSE(spec.entries > 0);
+  Random random(seed);
+  vector<Buffer> src_entries, tgt_entries;
+  for (size_t idx = 0; idx < spec.entries; idx++) {
+    auto entry_size = size / spec.entries + (idx < size % spec.entries);
+    src_entries.push_back(
+        GenerateContent(spec.content, entry_size, random.Next()));
+  }
+  // Spread the edits randomly over the entries.
+  vector<size_t> entry_edits(spec.entries);
+  for (size_t idx = 0; idx < edits.num_edits; idx++) {
+    entry_edits[random.Next() % spec.entries]++;
+  }
+  for (size_t idx = 0; idx < spec.entries; idx++) {
+    tgt_entries.push_back(EditContent(src_entries[idx], spec.content,
+                                      entry_edits[idx], edits.max_edit_size,
+                                      random.Next()));
+  }
+
+  Buffer src, tgt;
+  TEST_AND_RETURN_FALSE(
+      CreateContainer(spec.container, src_entries, spec.options, &src));
+  TEST_AND_RETURN_FALSE(
+      CreateContainer(spec.container, tgt_entries, spec.options, &tgt));
+  auto file_name = spec.name + "." + GetExtension(spec.container);
+  TEST_AND_RETURN_FALSE(WriteFile(output_dir + "/src/" + file_name, src));
+  TEST_AND_RETURN_FALSE(WriteFile(output_dir + "/tgt/" + file_name, tgt));
+  printf("%s: src %zu bytes, tgt %zu bytes\n", file_name.c_str(), src.size(),
+         tgt.size());
+  return true;
+}
+
+// Returns the standard set of files that covers the block types, compression
+// levels, kinds of content, block boundaries and zip layouts.
+vector<FileSpec> GetSuite(size_t size) {
+  auto options = [](int level, DeflateStrategy strategy, size_t block_size,
+                    bool byte_aligned_blocks) {
+    DeflateOptions options;
+    options.level = level;
+    options.strategy = strategy;
+    options.block_size = block_size;
+    options.byte_aligned_blocks = byte_aligned_blocks;
+    return options;
+  };
+  const auto kDefault = DeflateStrategy::kDefault;
+  const auto kDefaultOptions = options(6, kDefault, 0, false);
+  const size_t kSmallEntrySize = 1024;
+  const size_t kBlockSize = 16 * 1024;
+  return {
+      {"text_dynamic", ContainerType::kDeflate, ContentType::kText,
+       kDefaultOptions, 1},
+      {"text_fixed", ContainerType::kZlib, ContentType::kText,
+       options(6, DeflateStrategy::kFixed, 0, false), 1},
+      {"text_level1", ContainerType::kGzip, ContentType::kText,
+       options(1, kDefault, 0, false), 1},
+      {"text_level9", ContainerType::kGzip, ContentType::kText,
+       options(9, kDefault, 0, false), 1},
+      {"text_stored", ContainerType::kGzip, ContentType::kText,
+       options(0, kDefault, 0, false), 1},
+      {"random", ContainerType::kGzip, ContentType::kRandom, kDefaultOptions,
+       1},
+      {"literal_heavy", ContainerType::kGzip, ContentType::kLiteralHeavy,
+       kDefaultOptions, 1},
+      {"match_heavy", ContainerType::kGzip, ContentType::kMatchHeavy,
+       kDefaultOptions, 1},
+      {"huffman_only", ContainerType::kGzip, ContentType::kText,
+       options(6, DeflateStrategy::kHuffmanOnly, 0, false), 1},
+      {"unaligned_blocks", ContainerType::kDeflate, ContentType::kText,
+       options(6, kDefault, kBlockSize, false), 1},
+      {"aligned_blocks", ContainerType::kZlib, ContentType::kText,
+       options(6, kDefault, kBlockSize, true), 1},
+      {"many_small_entries", ContainerType::kZip, ContentType::kText,
+       kDefaultOptions,
+       std::min<size_t>(std::max<size_t>(size / kSmallEntrySize, 1),
+                        UINT16_MAX)},
+      {"one_large_entry", ContainerType::kZip, ContentType::kText,
+       kDefaultOptions, 1},
+  };
+}
+
+}  // namespace
+
+#define SETUP_FLAGS                                                          \
+  DEFINE_string(output_dir, "",                                              \
+                "The directory to write the src and tgt directories into");  \
+  DEFINE_bool(suite, false,                                                  \
+              "Generates the standard set of files instead of one file "     \
+              "described by the flags below");                               \
+  DEFINE_string(name, "synthetic",                                           \
+                "The name of the file without extension");                   \
+  DEFINE_string(format, "gzip",                                              \
+                "The file format: deflate, zlib, gzip or zip");              \
+  DEFINE_string(content, "text",                                             \
+                "The kind of content: text, literal (literal heavy), match " \
+                "(match heavy) or random");                                  \
+  DEFINE_uint64(size, 1024 * 1024, "The total uncompressed size of a file"); \
+  DEFINE_uint64(entries, 1, "The number of entries in a zip file");          \
+  DEFINE_int32(level, 6, "The compression level, from 0 to 9");              \
+  DEFINE_string(strategy, "default",                                         \
+                "The zlib strategy: default, fixed, huffman_only, rle or "   \
+                "filtered");                                                 \
+  DEFINE_uint64(block_size, 0,                                               \
+                "If non-zero, ends a deflate block after this many bytes "   \
+                "of input");                                                 \
+  DEFINE_bool(byte_aligned_blocks, false,                                    \
+              "Starts the blocks ended by block_size on a byte boundary");   \
+  DEFINE_uint64(edits, 16, "The number of edits in the target files");       \
+  DEFINE_uint64(edit_size, 64, "The maximum size of an edit in bytes");      \
+  DEFINE_uint64(seed, 1, "The seed of the generated content");
+
+#ifndef USE_BRILLO
+SETUP_FLAGS;
+#endif
+
+// Main entry point to the generator.
+bool Main(int argc, char** argv) {
+#ifdef USE_BRILLO
+  SETUP_FLAGS;
+  brillo::FlagHelper::Init(argc, argv, "Puffin corpus generator");
+#else
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+  TEST_AND_RETURN_FALSE(!FLAGS_output_dir.empty());
+  TEST_AND_RETURN_FALSE(FLAGS_level >= 0 && FLAGS_level <= 9);
+  TEST_AND_RETURN_FALSE(MakeDirectory(FLAGS_output_dir));
+  TEST_AND_RETURN_FALSE(MakeDirectory(FLAGS_output_dir + "/src"));
+  TEST_AND_RETURN_FALSE(MakeDirectory(FLAGS_output_dir + "/tgt"));
+
+  vector<FileSpec> specs;
+  if (FLAGS_suite) {
+    specs = GetSuite(FLAGS_size);
+  } else {
+    FileSpec spec;
+    spec.name = FLAGS_name;
+    TEST_AND_RETURN_FALSE(
+        puffin::StringToContainerType(FLAGS_format, &spec.container));
+    TEST_AND_RETURN_FALSE(
+        puffin::StringToContentType(FLAGS_content, &spec.content));
+    TEST_AND_RETURN_FALSE(puffin::StringToDeflateStrategy(
+        FLAGS_strategy, &spec.options.strategy));
+    spec.options.level = FLAGS_level;
+    spec.options.block_size = FLAGS_block_size;
+    spec.options.byte_aligned_blocks = FLAGS_byte_aligned_blocks;
+    spec.entries = FLAGS_entries;
+    TEST_AND_RETURN_FALSE(spec.container == ContainerType::kZip ||
+                          spec.entries == 1);
+    specs.push_back(spec);
+  }
+
+  const EditSpec edits = {FLAGS_edits, FLAGS_edit_size};
+  for (const auto& spec : specs) {
+    TEST_AND_RETURN_FALSE(
+        GenerateFile(spec, FLAGS_size, edits, FLAGS_seed, FLAGS_output_dir));
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!Main(argc, argv)) {
+    return 1;
+  }
+  return 0;
+}
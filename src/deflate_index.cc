@@ -0,0 +1,219 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/deflate_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "puffin/src/content_hasher.h"
+#include "puffin/src/file_stream.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puffin.pb.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+const char kIndexMagic[] = "PFDI";
+const size_t kIndexMagicLength = 4;
+const int kIndexVersion = 1;
+
+const size_t kHashBufferSize = 1024 * 1024;  // 1 MB
+
+bool SaveDeflateIndexWithHash(const string& index_path,
+                              uint64_t content_size,
+                              uint64_t content_hash,
+                              const string& tag,
+                              const DeflateIndex& index) {
+  metadata::DeflateIndex index_proto;
+  index_proto.set_version(kIndexVersion);
+  index_proto.set_content_size(content_size);
+  index_proto.set_content_hash(content_hash);
+  index_proto.set_tag(tag);
+  auto info = index_proto.mutable_info();
+  info->mutable_deflates()->Reserve(index.deflates.size());
+  for (const auto& deflate : index.deflates) {
+    auto extent = info->add_deflates();
+    extent->set_offset(deflate.offset);
+    extent->set_length(deflate.length);
+  }
+  // Puffs are kept in bits, similar to the puffin patch header.
+  info->mutable_puffs()->Reserve(index.puffs.size());
+  for (const auto& puff : index.puffs) {
+    auto extent = info->add_puffs();
+    extent->set_offset(puff.offset * 8);
+    extent->set_length(puff.length * 8);
+  }
+  info->set_puff_length(index.puff_size);
+
+  Buffer buffer(kIndexMagicLength + index_proto.ByteSizeLong());
+  memcpy(buffer.data(), kIndexMagic, kIndexMagicLength);
+  TEST_AND_RETURN_FALSE(index_proto.SerializeToArray(
+      buffer.data() + kIndexMagicLength, buffer.size() - kIndexMagicLength));
+
+  // The index is written into a temporary file in the same directory and
+  // renamed over |index_path|, so a concurrent |LoadOrCreateDeflateIndex| never
+  // reads it half written and concurrent saves do not interleave.
+  auto temp_path = index_path + ".tmp-XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  TEST_AND_RETURN_FALSE(fd >= 0);
+  FileStream index_file(fd);
+  bool written = fchmod(fd, 0644) == 0 &&
+                 index_file.Write(buffer.data(), buffer.size());
+  written = index_file.Close() && written;
+  if (!written || rename(temp_path.c_str(), index_path.c_str()) != 0) {
+    LOG(ERROR) << "Failed to save the deflate index " << index_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool LoadDeflateIndexWithHash(const string& index_path,
+                              uint64_t content_size,
+                              uint64_t content_hash,
+                              const string& tag,
+                              DeflateIndex* index) {
+  if (access(index_path.c_str(), F_OK) != 0) {
+    return false;
+  }
+  auto index_file = FileStream::Open(index_path, true, false);
+  TEST_AND_RETURN_FALSE(index_file);
+  uint64_t index_size;
+  TEST_AND_RETURN_FALSE(index_file->GetSize(&index_size));
+  TEST_AND_RETURN_FALSE(index_size >= kIndexMagicLength);
+  Buffer buffer(index_size);
+  TEST_AND_RETURN_FALSE(index_file->Read(buffer.data(), buffer.size()));
+  TEST_AND_RETURN_FALSE(index_file->Close());
+
+  TEST_AND_RETURN_FALSE(
+      memcmp(buffer.data(), kIndexMagic, kIndexMagicLength) == 0);
+  metadata::DeflateIndex index_proto;
+  TEST_AND_RETURN_FALSE(index_proto.ParseFromArray(
+      buffer.data() + kIndexMagicLength, buffer.size() - kIndexMagicLength));
+  TEST_AND_RETURN_FALSE(index_proto.version() == kIndexVersion);
+
+  // A stale index is not an error, the caller just has to recreate it.
+  if (index_proto.content_size() != content_size ||
+      index_proto.content_hash() != content_hash || index_proto.tag() != tag) {
+    return false;
+  }
+
+  const auto& info = index_proto.info();
+  index->deflates.clear();
+  index->deflates.reserve(info.deflates_size());
+  for (const auto& extent : info.deflates()) {
+    index->deflates.emplace_back(extent.offset(), extent.length());
+  }
+  index->puffs.clear();
+  index->puffs.reserve(info.puffs_size());
+  for (const auto& extent : info.puffs()) {
+    TEST_AND_RETURN_FALSE(extent.offset() % 8 == 0);
+    TEST_AND_RETURN_FALSE(extent.length() % 8 == 0);
+    index->puffs.emplace_back(extent.offset() / 8, extent.length() / 8);
+  }
+  TEST_AND_RETURN_FALSE(index->deflates.size() == index->puffs.size());
+  index->puff_size = info.puff_length();
+  return true;
+}
+
+bool GetStreamKey(const UniqueStreamPtr& stream,
+                  uint64_t* size,
+                  uint64_t* hash) {
+  TEST_AND_RETURN_FALSE(stream->GetSize(size));
+  TEST_AND_RETURN_FALSE(ComputeStreamHash(stream, hash));
+  return true;
+}
+
+}  // namespace
+
+bool ComputeStreamHash(const UniqueStreamPtr& stream, uint64_t* hash) {
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(stream->GetSize(&size));
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+
+  ContentHasher hasher;
+  Buffer buffer(std::min(static_cast<uint64_t>(kHashBufferSize), size));
+  for (uint64_t offset = 0; offset < size;) {
+    auto read_size =
+        std::min(static_cast<uint64_t>(buffer.size()), size - offset);
+    TEST_AND_RETURN_FALSE(stream->Read(buffer.data(), read_size));
+    hasher.Update(buffer.data(), read_size);
+    offset += read_size;
+  }
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  *hash = hasher.Final();
+  return true;
+}
+
+bool CreateDeflateIndex(const UniqueStreamPtr& stream,
+                        const vector<BitExtent>& deflates,
+                        DeflateIndex* index) {
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  index->deflates = deflates;
+  index->puffs.clear();
+  TEST_AND_RETURN_FALSE(FindPuffLocations(stream, index->deflates,
+                                          &index->puffs, &index->puff_size));
+  TEST_AND_RETURN_FALSE(stream->Seek(0));
+  return true;
+}
+
+bool SaveDeflateIndex(const string& index_path,
+                      const UniqueStreamPtr& stream,
+                      const string& tag,
+                      const DeflateIndex& index) {
+  uint64_t content_size, content_hash;
+  TEST_AND_RETURN_FALSE(GetStreamKey(stream, &content_size, &content_hash));
+  return SaveDeflateIndexWithHash(index_path, content_size, content_hash, tag,
+                                  index);
+}
+
+bool LoadDeflateIndex(const string& index_path,
+                      const UniqueStreamPtr& stream,
+                      const string& tag,
+                      DeflateIndex* index) {
+  uint64_t content_size, content_hash;
+  TEST_AND_RETURN_FALSE(GetStreamKey(stream, &content_size, &content_hash));
+  return LoadDeflateIndexWithHash(index_path, content_size, content_hash, tag,
+                                  index);
+}
+
+bool LoadOrCreateDeflateIndex(
+    const string& index_path,
+    const UniqueStreamPtr& stream,
+    const string& tag,
+    const std::function<bool(vector<BitExtent>*)>& locate_deflates,
+    DeflateIndex* index) {
+  uint64_t content_size, content_hash;
+  TEST_AND_RETURN_FALSE(GetStreamKey(stream, &content_size, &content_hash));
+  if (LoadDeflateIndexWithHash(index_path, content_size, content_hash, tag,
+                               index)) {
+    return true;
+  }
+
+  vector<BitExtent> deflates;
+  TEST_AND_RETURN_FALSE(locate_deflates(&deflates));
+  TEST_AND_RETURN_FALSE(CreateDeflateIndex(stream, deflates, index));
+  if (!SaveDeflateIndexWithHash(index_path, content_size, content_hash, tag,
+                                *index)) {
+    // Failing to cache the index should not fail the operation.
+    LOG(WARNING) << "Failed to save the deflate index into " << index_path;
+  }
+  return true;
+}
+
+}  // namespace puffin
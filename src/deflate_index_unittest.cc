@@ -0,0 +1,108 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "puffin/src/file_stream.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
+#include "puffin/src/memory_stream.h"
+#include "puffin/src/unittest_common.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+TEST(DeflateIndexTest, ComputeStreamHashTest) {
+  uint64_t hash;
+  ASSERT_TRUE(ComputeStreamHash(MemoryStream::CreateForRead(Buffer()), &hash));
+  EXPECT_EQ(hash, 0xEF46DB3751D8E999);
+
+  const Buffer abc = {'a', 'b', 'c'};
+  ASSERT_TRUE(ComputeStreamHash(MemoryStream::CreateForRead(abc), &hash));
+  EXPECT_EQ(hash, 0x44BC2CF5AD770999);
+
+  // Any change in the content should change the hash.
+  uint64_t hash1, hash2;
+  Buffer data(kDeflatesSample1);
+  ASSERT_TRUE(ComputeStreamHash(MemoryStream::CreateForRead(data), &hash1));
+  data[data.size() / 2] ^= 1;
+  ASSERT_TRUE(ComputeStreamHash(MemoryStream::CreateForRead(data), &hash2));
+  EXPECT_NE(hash1, hash2);
+}
+
+TEST(DeflateIndexTest, SaveAndLoadTest) {
+  string index_file;
+  ASSERT_TRUE(MakeTempFile(&index_file, nullptr));
+  ScopedPathUnlinker unlinker(index_file);
+  ASSERT_EQ(unlink(index_file.c_str()), 0);
+
+  auto src = MemoryStream::CreateForRead(kDeflatesSample1);
+  DeflateIndex index;
+  // There is no index file yet.
+  EXPECT_FALSE(LoadDeflateIndex(index_file, src, "zip", &index));
+
+  ASSERT_TRUE(
+      CreateDeflateIndex(src, kSubblockDeflateExtentsSample1, &index));
+  EXPECT_EQ(index.deflates, kSubblockDeflateExtentsSample1);
+  EXPECT_EQ(index.puffs, kPuffExtentsSample1);
+  EXPECT_EQ(index.puff_size, kPuffsSample1.size());
+  ASSERT_TRUE(SaveDeflateIndex(index_file, src, "zip", index));
+
+  DeflateIndex loaded_index;
+  ASSERT_TRUE(LoadDeflateIndex(index_file, src, "zip", &loaded_index));
+  EXPECT_EQ(loaded_index.deflates, index.deflates);
+  EXPECT_EQ(loaded_index.puffs, index.puffs);
+  EXPECT_EQ(loaded_index.puff_size, index.puff_size);
+
+  // The index is not valid for a different tag or different content.
+  EXPECT_FALSE(LoadDeflateIndex(index_file, src, "gzip", &loaded_index));
+  Buffer modified(kDeflatesSample1);
+  modified.back() ^= 1;
+  EXPECT_FALSE(LoadDeflateIndex(
+      index_file, MemoryStream::CreateForRead(modified), "zip", &loaded_index));
+
+  // Saving replaces a larger file instead of writing over its start.
+  Buffer garbage(64 * 1024, 0xFF);
+  auto file = FileStream::Open(index_file, false, true);
+  ASSERT_TRUE(file);
+  ASSERT_TRUE(file->Write(garbage.data(), garbage.size()));
+  ASSERT_TRUE(file->Close());
+  ASSERT_TRUE(SaveDeflateIndex(index_file, src, "zip", index));
+  ASSERT_TRUE(LoadDeflateIndex(index_file, src, "zip", &loaded_index));
+  EXPECT_EQ(loaded_index.deflates, index.deflates);
+}
+
+TEST(DeflateIndexTest, LoadOrCreateTest) {
+  string index_file;
+  ASSERT_TRUE(MakeTempFile(&index_file, nullptr));
+  ScopedPathUnlinker unlinker(index_file);
+
+  int locate_calls = 0;
+  auto locate_deflates = [&locate_calls](vector<BitExtent>* deflates) {
+    locate_calls++;
+    *deflates = kSubblockDeflateExtentsSample2;
+    return true;
+  };
+
+  auto src = MemoryStream::CreateForRead(kDeflatesSample2);
+  for (int i = 0; i < 2; i++) {
+    DeflateIndex index;
+    ASSERT_TRUE(
+        LoadOrCreateDeflateIndex(index_file, src, "", locate_deflates, &index));
+    EXPECT_EQ(index.deflates, kSubblockDeflateExtentsSample2);
+    EXPECT_EQ(index.puffs, kPuffExtentsSample2);
+    EXPECT_EQ(index.puff_size, kPuffsSample2.size());
+    // The second call should reuse the index saved by the first one.
+    EXPECT_EQ(locate_calls, 1);
+  }
+}
+
+}  // namespace puffin
@@ -13,9 +13,9 @@
 
 namespace puffin {
 
-// A stream object that allows reading and writing into disk extents. This is
-// only used in main.cc for puffin binary to allow puffpatch on a actual rootfs
-// and kernel images.
+// A stream object that allows reading and writing into disk extents. It is used
+// in main.cc for puffin binary to allow puffpatch on a actual rootfs and kernel
+// images, and by |PuffPatch| for applying each part of a patch made of parts.
 class ExtentStream : public StreamInterface {
  public:
   // Creates a stream only for writing.
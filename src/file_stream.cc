@@ -5,6 +5,8 @@
 #include "puffin/src/file_stream.h"
 
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -87,4 +89,34 @@ bool FileStream::Close() {
   return close(fd_) == 0;
 }
 
+bool FileStream::GetFileDescriptor(int* fd) const {
+  *fd = fd_;
+  return true;
+}
+
+uint64_t CopyFileRange(int src_fd, int dst_fd, uint64_t length) {
+  uint64_t copied = 0;
+#ifdef __NR_copy_file_range
+  // Not every C library has a wrapper for it yet.
+  while (copied < length) {
+    auto bytes_copied = syscall(__NR_copy_file_range, src_fd, nullptr, dst_fd,
+                                nullptr, length - copied, 0);
+    if (bytes_copied <= 0) {
+      break;
+    }
+    copied += bytes_copied;
+  }
+#endif  // __NR_copy_file_range
+  // Older kernels do not support copy_file_range (or not between different
+  // file systems), but sendfile works between any regular files.
+  while (copied < length) {
+    auto bytes_copied = sendfile(dst_fd, src_fd, nullptr, length - copied);
+    if (bytes_copied <= 0) {
+      break;
+    }
+    copied += bytes_copied;
+  }
+  return copied;
+}
+
 }  // namespace puffin
@@ -27,6 +27,7 @@ class FileStream : public StreamInterface {
   bool Read(void* buffer, size_t length) override;
   bool Write(const void* buffer, size_t length) override;
   bool Close() override;
+  bool GetFileDescriptor(int* fd) const override;
 
  protected:
   FileStream() = default;
@@ -38,6 +39,13 @@ class FileStream : public StreamInterface {
   DISALLOW_COPY_AND_ASSIGN(FileStream);
 };
 
+// Copies up to |length| bytes from the current offset of |src_fd| to the
+// current offset of |dst_fd| inside the kernel, with copy_file_range or else
+// sendfile, and advances both offsets. Returns the number of bytes copied. It
+// is less than |length| if the kernel cannot copy between these files, in
+// which case the rest has to be copied through memory.
+uint64_t CopyFileRange(int src_fd, int dst_fd, uint64_t length);
+
 }  // namespace puffin
 
 #endif  // SRC_FILE_STREAM_H_
@@ -28,7 +28,8 @@ bool DecodePatch(const uint8_t* patch,
                  vector<ByteExtent>* src_puffs,
                  vector<ByteExtent>* dst_puffs,
                  uint64_t* src_puff_size,
-                 uint64_t* dst_puff_size);
+                 uint64_t* dst_puff_size,
+                 PuffFormat* format);
 }  // namespace puffin
 
 namespace {
@@ -59,9 +60,10 @@ void FuzzPuffPatch(const uint8_t* data, size_t size) {
   vector<BitExtent> src_deflates, dst_deflates;
   vector<ByteExtent> src_puffs, dst_puffs;
   uint64_t src_puff_size, dst_puff_size;
+  puffin::PuffFormat format;
   if (DecodePatch(data, size, &bsdiff_patch_offset, &bsdiff_patch_size,
                   &src_deflates, &dst_deflates, &src_puffs, &dst_puffs,
-                  &src_puff_size, &dst_puff_size) &&
+                  &src_puff_size, &dst_puff_size, &format) &&
       TestExtentsArrayForFuzzer(src_deflates) &&
       TestExtentsArrayForFuzzer(dst_deflates) &&
       TestExtentsArrayForFuzzer(src_puffs) &&
@@ -21,14 +21,26 @@ using std::string;
 
 namespace puffin {
 
-Huffer::Huffer() : dyn_ht_(new HuffmanTable()), fix_ht_(new HuffmanTable()) {}
+namespace {
+
+// Returns the table the dynamic Huffman table of the current block is built
+// in. Like in |Puffer|, it is per thread scratch space.
+HuffmanTable* GetDynamicHuffmanTable() {
+  thread_local HuffmanTable dyn_ht;
+  return &dyn_ht;
+}
+
+}  // namespace
+
+Huffer::Huffer() {}
 
 Huffer::~Huffer() {}
 
 bool Huffer::HuffDeflate(PuffReaderInterface* pr,
                          BitWriterInterface* bw) const {
   PuffData pd;
-  HuffmanTable* cur_ht = nullptr;
+  HuffmanTable* dyn_ht = GetDynamicHuffmanTable();
+  const HuffmanTable* cur_ht = nullptr;
   // If no bytes left for PuffReader to read, bail out.
   while (pr->BytesLeft() != 0) {
     TEST_AND_RETURN_FALSE(pr->GetNext(&pd));
@@ -68,13 +80,12 @@ bool Huffer::HuffDeflate(PuffReaderInterface* pr,
         continue;
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
+        cur_ht = &GetFixedHuffmanTable();
         break;
 
       case BlockType::kDynamic:
-        cur_ht = dyn_ht_.get();
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+        cur_ht = dyn_ht;
+        TEST_AND_RETURN_FALSE(dyn_ht->BuildDynamicHuffmanTable(
             &pd.block_metadata[1], pd.length - 1, bw));
         break;
 
@@ -43,19 +43,42 @@ const uint8_t kDistanceExtraBits[30] = {0, 0, 0,  0,  1,  1,  2,  2,  3,  3,
                                         4, 4, 5,  5,  6,  6,  7,  7,  8,  8,
                                         9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
 
-// 288 is the maximum number of needed huffman codes for an alphabet. Fixed
-// huffman table needs 288 and dynamic huffman table needs maximum 286.
-// 286 = 256 (coding a byte) +
-//         1 (coding the end of block symbole) +
-//        29 (coding the lengths)
-HuffmanTable::HuffmanTable() : codeindexpairs_(288), initialized_(false) {}
+namespace {
+
+// The bits of each byte in reverse order.
+struct ReversedBits {
+  constexpr ReversedBits() : bytes() {
+    for (size_t idx = 0; idx < 256; idx++) {
+      for (size_t bit = 0; bit < 8; bit++) {
+        if (idx & (1 << bit)) {
+          bytes[idx] |= 0x80 >> bit;
+        }
+      }
+    }
+  }
+  uint8_t bytes[256];
+};
+constexpr ReversedBits kReversedBits;
+
+// Returns the |len| lower bits of |code| in reverse order.
+inline uint16_t ReverseBits(uint16_t code, size_t len) {
+  return ((kReversedBits.bytes[code & 0xFF] << 8) |
+          kReversedBits.bytes[code >> 8]) >>
+         (16 - len);
+}
 
-bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
-  // Temporary buffers used in |InitHuffmanCodes|.
-  uint16_t len_count_[kMaxHuffmanBits + 1] = {0};
-  uint16_t next_code_[kMaxHuffmanBits + 1] = {0};
+}  // namespace
+
+HuffmanTable::HuffmanTable()
+    : lit_len_rcodes_(),
+      distance_rcodes_(),
+      code_rcodes_(),
+      initialized_(false) {}
 
+bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
+  TEST_AND_RETURN_FALSE(lens.size() <= kMaxLitLenAlphabets);
   // 1. Count the number of codes for each length;
+  memset(len_count_, 0, sizeof(len_count_));
   for (auto len : lens) {
     len_count_[len]++;
   }
@@ -76,33 +99,20 @@ bool HuffmanTable::InitHuffmanCodes(const Buffer& lens, size_t* max_bits) {
   }
 
   // 2. Compute the coding of the first element for each length.
+  uint16_t next_code[kMaxHuffmanBits + 1] = {0};
   uint16_t code = 0;
   len_count_[0] = 0;
   for (size_t bits = 1; bits <= kMaxHuffmanBits; bits++) {
     code = (code + len_count_[bits - 1]) << 1;
-    next_code_[bits] = code;
+    next_code[bits] = code;
   }
 
-  codeindexpairs_.clear();
   // 3. Calculate all the code values.
   for (size_t idx = 0; idx < lens.size(); idx++) {
     auto len = lens[idx];
-    if (len == 0) {
-      continue;
+    if (len != 0) {
+      codes_[idx] = ReverseBits(next_code[len]++, len);
     }
-
-    // Reverse the code
-    CodeIndexPair cip;
-    cip.code = 0;
-    auto tmp_code = next_code_[len];
-    for (size_t r = 0; r < len; r++) {
-      cip.code <<= 1;
-      cip.code |= tmp_code & 1U;
-      tmp_code >>= 1;
-    }
-    cip.index = idx;
-    codeindexpairs_.push_back(cip);
-    next_code_[len]++;
   }
   return true;
 }
@@ -111,23 +121,32 @@ bool HuffmanTable::BuildHuffmanCodes(const Buffer& lens,
                                      vector<uint16_t>* hcodes,
                                      size_t* max_bits) {
   TEST_AND_RETURN_FALSE(InitHuffmanCodes(lens, max_bits));
-  // Sort descending based on the bit-length of the code.
-  std::sort(codeindexpairs_.begin(), codeindexpairs_.end(),
-            [&lens](const CodeIndexPair& a, const CodeIndexPair& b) {
-              return lens[a.index] > lens[b.index];
-            });
+  // Sort the alphabets based on the bit-length of their codes (counting sort).
+  uint16_t offsets[kMaxHuffmanBits + 2];
+  offsets[1] = 0;
+  for (size_t len = 1; len <= kMaxHuffmanBits; len++) {
+    offsets[len + 1] = offsets[len] + len_count_[len];
+  }
+  for (size_t idx = 0; idx < lens.size(); idx++) {
+    if (lens[idx] != 0) {
+      sorted_alphabets_[offsets[lens[idx]]++] = idx;
+    }
+  }
 
   // Only zero out the part of hcodes which is valuable.
   memset(hcodes->data(), 0, (1 << *max_bits) * sizeof(uint16_t));
-  for (const auto& cip : codeindexpairs_) {
+  // Go through the codes in descending order of their bit-length.
+  for (size_t idx = offsets[kMaxHuffmanBits + 1]; idx-- > 0;) {
+    auto alphabet = sorted_alphabets_[idx];
+    auto code = codes_[alphabet];
+    auto len = lens[alphabet];
     // The MSB bit of the code in hcodes is set if it is a valid code and its
     // code exists in the input Huffman table.
-    (*hcodes)[cip.code] = cip.index | 0x8000;
-    auto fill_bits = *max_bits - lens[cip.index];
-    for (auto idx = 1; idx < (1 << fill_bits); idx++) {
-      auto location = (idx << lens[cip.index]) | cip.code;
+    (*hcodes)[code] = alphabet | 0x8000;
+    for (size_t location = code + (1 << len); location < (1U << *max_bits);
+         location += 1 << len) {
       if (!((*hcodes)[location] & 0x8000)) {
-        (*hcodes)[location] = cip.index | 0x8000;
+        (*hcodes)[location] = alphabet | 0x8000;
       }
     }
   }
@@ -135,22 +154,15 @@ bool HuffmanTable::BuildHuffmanCodes(const Buffer& lens,
 }
 
 bool HuffmanTable::BuildHuffmanReverseCodes(const Buffer& lens,
-                                            vector<uint16_t>* rcodes,
+                                            uint32_t* rcodes,
+                                            size_t num_rcodes,
                                             size_t* max_bits) {
   TEST_AND_RETURN_FALSE(InitHuffmanCodes(lens, max_bits));
-  // Sort ascending based on the index.
-  std::sort(codeindexpairs_.begin(), codeindexpairs_.end(),
-            [](const CodeIndexPair& a, const CodeIndexPair& b) -> bool {
-              return a.index < b.index;
-            });
-
-  size_t index = 0;
-  for (size_t idx = 0; idx < rcodes->size(); idx++) {
-    if (index < codeindexpairs_.size() && idx == codeindexpairs_[index].index) {
-      (*rcodes)[idx] = codeindexpairs_[index].code;
-      index++;
+  for (size_t idx = 0; idx < num_rcodes; idx++) {
+    if (idx < lens.size() && lens[idx] != 0) {
+      rcodes[idx] = codes_[idx] | (static_cast<uint32_t>(lens[idx]) << 16);
     } else {
-      (*rcodes)[idx] = 0;
+      rcodes[idx] = 0;
     }
   }
   return true;
@@ -163,11 +175,9 @@ bool HuffmanTable::BuildFixedHuffmanTable() {
     // purposes. The total size of data in this class is approximately
     // 2KB. Because it is a constructor return values cannot be checked.
     lit_len_lens_.resize(288);
-    lit_len_rcodes_.resize(288);
     lit_len_hcodes_.resize(1 << 9);
 
     distance_lens_.resize(30);
-    distance_rcodes_.resize(30);
     distance_hcodes_.resize(1 << 5);
 
     size_t i = 0;
@@ -195,17 +205,30 @@ bool HuffmanTable::BuildFixedHuffmanTable() {
     TEST_AND_RETURN_FALSE(BuildHuffmanCodes(distance_lens_, &distance_hcodes_,
                                             &distance_max_bits_));
 
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_));
+    TEST_AND_RETURN_FALSE(
+        BuildHuffmanReverseCodes(lit_len_lens_, lit_len_rcodes_,
+                                 kMaxLitLenAlphabets, &lit_len_max_bits_));
 
-    TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-        distance_lens_, &distance_rcodes_, &distance_max_bits_));
+    TEST_AND_RETURN_FALSE(
+        BuildHuffmanReverseCodes(distance_lens_, distance_rcodes_,
+                                 kMaxDistanceAlphabets, &distance_max_bits_));
 
     initialized_ = true;
   }
   return true;
 }
 
+const HuffmanTable& GetFixedHuffmanTable() {
+  // The initialization of a function local static is thread safe. The table is
+  // intentionally leaked to avoid destruction order issues at exit.
+  static const HuffmanTable* fixed_table = [] {
+    auto table = new HuffmanTable();
+    CHECK(table->BuildFixedHuffmanTable());
+    return table;
+  }();
+  return *fixed_table;
+}
+
 bool HuffmanTable::BuildDynamicHuffmanTable(BitReaderInterface* br,
                                             uint8_t* buffer,
                                             size_t* length) {
@@ -381,14 +404,8 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
   if (!initialized_) {
     // Only resizing the arrays needed.
     code_lens_.resize(19);
-    code_rcodes_.resize(19);
-
     lit_len_lens_.resize(286);
-    lit_len_rcodes_.resize(286);
-
     distance_lens_.resize(30);
-    distance_rcodes_.resize(30);
-
     tmp_lens_.resize(286 + 30);
 
     initialized_ = true;
@@ -430,8 +447,8 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
     code_lens_[kPermutations[idx]] = 0;
   }
 
-  TEST_AND_RETURN_FALSE(
-      BuildHuffmanReverseCodes(code_lens_, &code_rcodes_, &code_max_bits_));
+  TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
+      code_lens_, code_rcodes_, kNumCodeAlphabets, &code_max_bits_));
 
   // Build literal/lengths and distance Huffman code length arrays.
   auto bytes_available = length - index;
@@ -449,12 +466,14 @@ bool HuffmanTable::BuildDynamicHuffmanTable(const uint8_t* buffer,
                         tmp_lens_.end());
 
   // Build literal/lengths Huffman reverse codes.
-  TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-      lit_len_lens_, &lit_len_rcodes_, &lit_len_max_bits_));
+  TEST_AND_RETURN_FALSE(
+      BuildHuffmanReverseCodes(lit_len_lens_, lit_len_rcodes_,
+                               kMaxLitLenAlphabets, &lit_len_max_bits_));
 
   // Build distance Huffman reverse codes.
-  TEST_AND_RETURN_FALSE(BuildHuffmanReverseCodes(
-      distance_lens_, &distance_rcodes_, &distance_max_bits_));
+  TEST_AND_RETURN_FALSE(
+      BuildHuffmanReverseCodes(distance_lens_, distance_rcodes_,
+                               kMaxDistanceAlphabets, &distance_max_bits_));
 
   TEST_AND_RETURN_FALSE(length == index);
 
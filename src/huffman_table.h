@@ -20,6 +20,17 @@ namespace puffin {
 // Maximum Huffman code length based on RFC1951.
 constexpr size_t kMaxHuffmanBits = 15;
 
+// Maximum number of literal/length alphabets (of the fixed Huffman table;
+// dynamic Huffman tables have at most 286).
+constexpr size_t kMaxLitLenAlphabets = 288;
+
+// Maximum number of distance alphabets.
+constexpr size_t kMaxDistanceAlphabets = 30;
+
+// Number of alphabets in the Huffman table used for reading the code lengths
+// of a dynamic Huffman table.
+constexpr size_t kNumCodeAlphabets = 19;
+
 // Permutations of input Huffman code lengths (used only to read
 // |dynamic_code_lens_|).
 extern const uint8_t kPermutations[];
@@ -64,11 +75,11 @@ class HuffmanTable {
 
   // Returns the maximum number of bits used in the current literal/length
   // Huffman codes.
-  inline size_t LitLenMaxBits() { return lit_len_max_bits_; }
+  inline size_t LitLenMaxBits() const { return lit_len_max_bits_; }
 
   // Returns the maximum number of bits used in the current distance Huffman
   // codes.
-  inline size_t DistanceMaxBits() { return distance_max_bits_; }
+  inline size_t DistanceMaxBits() const { return distance_max_bits_; }
 
   // Returns the alphabet associated with the set of input bits for the code
   // length array.
@@ -77,7 +88,9 @@ class HuffmanTable {
   // |alphabet| OUT  The alphabet associated with the given |bits|.
   // |nbits|    OUT  The number of bits in the Huffman code of alphabet.
   // Returns true if there is an alphabet associated with |bits|.
-  inline bool CodeAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
+  inline bool CodeAlphabet(uint32_t bits,
+                           uint16_t* alphabet,
+                           size_t* nbits) const {
     auto hc = code_hcodes_[bits];
     TEST_AND_RETURN_FALSE(hc & 0x8000);
     *alphabet = hc & 0x7FFF;
@@ -92,7 +105,9 @@ class HuffmanTable {
   // |alphabet| OUT  The alphabet associated with the given |bits|.
   // |nbits|    OUT  The number of bits in the Huffman code of the |alphabet|.
   // Returns true if there is an alphabet associated with |bits|.
-  inline bool LitLenAlphabet(uint32_t bits, uint16_t* alphabet, size_t* nbits) {
+  inline bool LitLenAlphabet(uint32_t bits,
+                             uint16_t* alphabet,
+                             size_t* nbits) const {
     auto hc = lit_len_hcodes_[bits];
     TEST_AND_RETURN_FALSE(hc & 0x8000);
     *alphabet = hc & 0x7FFF;
@@ -109,7 +124,7 @@ class HuffmanTable {
   // Returns true if there is an alphabet associated with |bits|.
   inline bool DistanceAlphabet(uint32_t bits,
                                uint16_t* alphabet,
-                               size_t* nbits) {
+                               size_t* nbits) const {
     auto hc = distance_hcodes_[bits];
     TEST_AND_RETURN_FALSE(hc & 0x8000);
     *alphabet = hc & 0x7FFF;
@@ -123,11 +138,11 @@ class HuffmanTable {
   // |huffman|  OUT  The Huffman code for |alphabet|.
   // |nbits|    OUT  The maximum number of bits in the Huffman code of the
   //                 |alphabet|.
-  inline bool CodeHuffman(uint16_t alphabet, uint16_t* huffman, size_t* nbits) {
-    TEST_AND_RETURN_FALSE(alphabet < code_lens_.size());
-    *huffman = code_rcodes_[alphabet];
-    *nbits = code_lens_[alphabet];
-    return true;
+  inline bool CodeHuffman(uint16_t alphabet,
+                          uint16_t* huffman,
+                          size_t* nbits) const {
+    TEST_AND_RETURN_FALSE(alphabet < kNumCodeAlphabets);
+    return UnpackHuffman(code_rcodes_[alphabet], huffman, nbits);
   }
 
   // Returns the Huffman code of a give alphabet for literal/length codes.
@@ -138,14 +153,12 @@ class HuffmanTable {
   //                 |alphabet|.
   inline bool LitLenHuffman(uint16_t alphabet,
                             uint16_t* huffman,
-                            size_t* nbits) {
-    TEST_AND_RETURN_FALSE(alphabet < lit_len_lens_.size());
-    *huffman = lit_len_rcodes_[alphabet];
-    *nbits = lit_len_lens_[alphabet];
-    return true;
+                            size_t* nbits) const {
+    TEST_AND_RETURN_FALSE(alphabet < kMaxLitLenAlphabets);
+    return UnpackHuffman(lit_len_rcodes_[alphabet], huffman, nbits);
   }
 
-  inline bool EndOfBlockBitLength(size_t* nbits) {
+  inline bool EndOfBlockBitLength(size_t* nbits) const {
     TEST_AND_RETURN_FALSE(256 < lit_len_lens_.size());
     *nbits = lit_len_lens_[256];
     return true;
@@ -159,16 +172,13 @@ class HuffmanTable {
   //                 |alphabet|.
   inline bool DistanceHuffman(uint16_t alphabet,
                               uint16_t* huffman,
-                              size_t* nbits) {
-    TEST_AND_RETURN_FALSE(alphabet < distance_lens_.size());
-    *huffman = distance_rcodes_[alphabet];
-    *nbits = distance_lens_[alphabet];
-    return true;
+                              size_t* nbits) const {
+    TEST_AND_RETURN_FALSE(alphabet < kMaxDistanceAlphabets);
+    return UnpackHuffman(distance_rcodes_[alphabet], huffman, nbits);
   }
 
-  // This populates the object with fixed huffman table parameters.
-  // TODO(ahassani): Revamp the use of this function to be initiliazed once in
-  // the lifetime of the program and only one instance needed.
+  // This populates the object with fixed huffman table parameters. Use
+  // |GetFixedHuffmanTable| instead of building a new one.
   bool BuildFixedHuffmanTable();
 
   // This functions first reads the Huffman code length arrays from the input
@@ -198,7 +208,8 @@ class HuffmanTable {
                                 BitWriterInterface* bw);
 
  protected:
-  // Initializes the Huffman codes from an array of lengths.
+  // Initializes the Huffman codes from an array of lengths into |codes_| and
+  // the number of codes of each length into |len_count_|.
   //
   // |lens|     IN   The input array of code lengths.
   // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
@@ -212,12 +223,16 @@ class HuffmanTable {
                          std::vector<uint16_t>* hcodes,
                          size_t* max_bits);
 
-  // Creates the alphabet to Huffman code array.
-  // |lens|     IN   The input array of code lengths.
-  // |rcodes|   OUT  The Huffman to Huffman array.
-  // |max_bits| OUT  The maximum number of bits used for the Huffman codes.
+  // Creates the alphabet to Huffman code array. Each element has the Huffman
+  // code of the alphabet in its lower 16 bits and the length of the code above
+  // them, or is zero if the alphabet has no code.
+  // |lens|        IN   The input array of code lengths.
+  // |rcodes|      OUT  The alphabet to Huffman array.
+  // |num_rcodes|  IN   The number of elements in |rcodes|.
+  // |max_bits|    OUT  The maximum number of bits used for the Huffman codes.
   bool BuildHuffmanReverseCodes(const Buffer& lens,
-                                std::vector<uint16_t>* rcodes,
+                                uint32_t* rcodes,
+                                size_t num_rcodes,
                                 size_t* max_bits);
 
   // Reads a specific Huffman code length array from input. At the same time
@@ -256,23 +271,33 @@ class HuffmanTable {
                                Buffer* lens);
 
  private:
-  // A utility struct used to create Huffman codes.
-  struct CodeIndexPair {
-    uint16_t code;   // The Huffman code
-    uint16_t index;  // The alphabet
-  };
-  // A vector with maximum size of 286 that is only uses as temporary space for
-  // building Huffman codes.
-  std::vector<CodeIndexPair> codeindexpairs_;
+  // Returns the Huffman code and its length packed in |rcode| by
+  // |BuildHuffmanReverseCodes|, or false if there is no code.
+  static inline bool UnpackHuffman(uint32_t rcode,
+                                   uint16_t* huffman,
+                                   size_t* nbits) {
+    TEST_AND_RETURN_FALSE(rcode != 0);
+    *huffman = rcode & 0xFFFF;
+    *nbits = rcode >> 16;
+    return true;
+  }
+
+  // Only used as temporary space for building Huffman codes. They are the
+  // Huffman code of each alphabet (with its bits reversed, the order they are
+  // read from or written into the deflate stream), the alphabets sorted by the
+  // length of their codes and the number of codes of each length.
+  uint16_t codes_[kMaxLitLenAlphabets];
+  uint16_t sorted_alphabets_[kMaxLitLenAlphabets];
+  uint16_t len_count_[kMaxHuffmanBits + 1];
 
   // Used in building Huffman codes for literals/lengths and distances.
   std::vector<uint8_t> lit_len_lens_;
   std::vector<uint16_t> lit_len_hcodes_;
-  std::vector<uint16_t> lit_len_rcodes_;
+  uint32_t lit_len_rcodes_[kMaxLitLenAlphabets];
   size_t lit_len_max_bits_;
   std::vector<uint8_t> distance_lens_;
   std::vector<uint16_t> distance_hcodes_;
-  std::vector<uint16_t> distance_rcodes_;
+  uint32_t distance_rcodes_[kMaxDistanceAlphabets];
   size_t distance_max_bits_;
 
   // The reason for keeping a temporary buffer here is to avoid reallocing each
@@ -283,7 +308,7 @@ class HuffmanTable {
   // distance Huffman code length arrays.
   std::vector<uint8_t> code_lens_;
   std::vector<uint16_t> code_hcodes_;
-  std::vector<uint16_t> code_rcodes_;
+  uint32_t code_rcodes_[kNumCodeAlphabets];
   size_t code_max_bits_;
 
   bool initialized_;
@@ -291,6 +316,11 @@ class HuffmanTable {
   DISALLOW_COPY_AND_ASSIGN(HuffmanTable);
 };
 
+// Returns the fixed Huffman table. It is built once, on the first call, and
+// never changes afterwards, so it can be used from any number of threads
+// through the const lookup functions.
+const HuffmanTable& GetFixedHuffmanTable();
+
 // The type of a block in a deflate stream.
 enum class BlockType : uint8_t {
   kUncompressed = 0x00,
@@ -0,0 +1,37 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_BUFFER_POOL_H_
+#define SRC_INCLUDE_PUFFIN_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <memory>
+
+#include "puffin/common.h"
+
+namespace puffin {
+
+// The interface for providing the scratch buffers of puff and deflate data
+// (and the puff caches) to |PuffPatch| and |PuffDiff|. Implementations must be
+// thread safe.
+class BufferPoolInterface {
+ public:
+  virtual ~BufferPoolInterface() = default;
+
+  // Returns a buffer with a size of |size| bytes. The content of the buffer is
+  // undefined. When the last reference to the returned buffer is gone, the
+  // buffer is given back to the pool (by the deleter of the |shared_ptr|), so
+  // the returned buffers can outlive the pool itself.
+  virtual std::shared_ptr<Buffer> Acquire(size_t size) = 0;
+};
+
+// Creates a pool that recycles the buffers given back to it. The buffers are
+// kept in size classes; the capacity of a buffer is at most 25% (or 64 bytes
+// for small buffers) more than the requested size. At most |max_pooled_bytes|
+// of unused buffers are kept in the pool, the rest are freed.
+std::shared_ptr<BufferPoolInterface> CreateBufferPool(size_t max_pooled_bytes);
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_BUFFER_POOL_H_
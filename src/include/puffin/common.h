@@ -54,6 +54,20 @@ struct BitExtent {
   uint64_t length;
 };
 
+// The layouts of the puff stream of a deflate. Both layouts have the same
+// records and the same size, only their order differs. The value of each
+// layout is the version of the patches that use it.
+enum class PuffFormat {
+  // The literals are written in the middle of the length/distance pairs, in
+  // the order they appear in the deflate.
+  kV1 = 1,
+  // The literal bytes of each block are written together after all the other
+  // records of the block (which still have the lengths of the literal runs),
+  // so bsdiff and the patch compressors do not see the length/distance pairs
+  // in the middle of the literals.
+  kV2 = 2,
+};
+
 }  // namespace puffin
 
 #endif  // SRC_INCLUDE_PUFFIN_COMMON_H_
@@ -0,0 +1,67 @@
+// Copyright 2017 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_DEFLATE_INDEX_H_
+#define SRC_INCLUDE_PUFFIN_DEFLATE_INDEX_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "puffin/common.h"
+#include "puffin/stream.h"
+
+namespace puffin {
+
+// The location of deflates and their corresponding puffs in a stream. This is
+// everything |PuffDiff| needs to know about a stream before puffing it, so
+// saving it into an index file allows skipping the locate and puff sizing
+// phases the next time the same stream is diffed.
+struct DeflateIndex {
+  std::vector<BitExtent> deflates;
+  std::vector<ByteExtent> puffs;
+  uint64_t puff_size = 0;
+};
+
+// Computes a 64-bit content hash of the whole |stream|. The stream is left at
+// offset zero.
+bool ComputeStreamHash(const UniqueStreamPtr& stream, uint64_t* hash);
+
+// Fills |index| with |deflates| and the puff locations computed from them in
+// |stream|. The stream is left at offset zero.
+bool CreateDeflateIndex(const UniqueStreamPtr& stream,
+                        const std::vector<BitExtent>& deflates,
+                        DeflateIndex* index);
+
+// Saves |index| into the file |index_path|, keyed by the content of |stream|
+// and |tag|. |tag| is an arbitrary string describing how the deflates were
+// located (e.g. the file type) so that an index created with different
+// settings is not reused.
+bool SaveDeflateIndex(const std::string& index_path,
+                      const UniqueStreamPtr& stream,
+                      const std::string& tag,
+                      const DeflateIndex& index);
+
+// Loads |index| from the file |index_path|. Returns false if the file does not
+// exist, is corrupted or was not created for the current content of |stream|
+// and |tag|.
+bool LoadDeflateIndex(const std::string& index_path,
+                      const UniqueStreamPtr& stream,
+                      const std::string& tag,
+                      DeflateIndex* index);
+
+// Loads |index| from |index_path| if it holds a valid index for |stream| and
+// |tag|. Otherwise, calls |locate_deflates| to find the deflates in |stream|,
+// creates the index and saves it into |index_path|. The stream is left at
+// offset zero.
+bool LoadOrCreateDeflateIndex(
+    const std::string& index_path,
+    const UniqueStreamPtr& stream,
+    const std::string& tag,
+    const std::function<bool(std::vector<BitExtent>*)>& locate_deflates,
+    DeflateIndex* index);
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_DEFLATE_INDEX_H_
@@ -6,7 +6,6 @@
 #define SRC_INCLUDE_PUFFIN_HUFFER_H_
 
 #include <cstddef>
-#include <memory>
 
 #include "puffin/common.h"
 
@@ -14,8 +13,9 @@ namespace puffin {
 
 class BitWriterInterface;
 class PuffReaderInterface;
-class HuffmanTable;
 
+// Like |Puffer|, a |Huffer| has no mutable state, so one object can be shared
+// and used by multiple threads at the same time.
 class Huffer {
  public:
   Huffer();
@@ -26,9 +26,6 @@ class Huffer {
   bool HuffDeflate(PuffReaderInterface* pr, BitWriterInterface* bw) const;
 
  private:
-  std::unique_ptr<HuffmanTable> dyn_ht_;
-  std::unique_ptr<HuffmanTable> fix_ht_;
-
   DISALLOW_COPY_AND_ASSIGN(Huffer);
 };
 
@@ -0,0 +1,65 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
+#define SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "puffin/common.h"
+
+namespace puffin {
+
+// The interface for keeping the puffs of deflates across runs, so the deflates
+// that did not change since a previous diff (e.g. of the previous night's
+// build) do not need puffing again. The puffs are looked up by the key
+// |ComputePuffCacheKey| returns for their deflates. Implementations must be
+// thread safe.
+class PuffCacheInterface {
+ public:
+  virtual ~PuffCacheInterface() = default;
+
+  // Reads the |puff_size| bytes of the puff of |key| into |puff|. Returns false
+  // if it is not in the cache.
+  virtual bool Get(uint64_t key, uint8_t* puff, uint64_t puff_size) = 0;
+
+  // Adds the |puff_size| bytes of |puff| to the cache as the puff of |key|.
+  // Returns false if it was not added, which is not an error for the caller.
+  virtual bool Put(uint64_t key, const uint8_t* puff, uint64_t puff_size) = 0;
+};
+
+// The puffs smaller than this are not worth caching: puffing them takes about
+// as long as reading them back.
+constexpr uint64_t kMinCachedPuffSize = 16 * 1024;  // 16 KB
+
+// Returns the key of the puff of a deflate in a |PuffCacheInterface|. It is a
+// hash of the bits of the deflate and of everything else the puff depends on.
+// |deflate|    IN  The bytes of the deflate, from the one with its first bit
+//                  to the one with its last bit.
+// |start_bits| IN  The number of bits before the deflate in its first byte.
+// |length|     IN  The length of the deflate in bits.
+// |puff_size|  IN  The size of the puff.
+// |format|     IN  The layout of the puff.
+uint64_t ComputePuffCacheKey(const uint8_t* deflate,
+                             uint64_t start_bits,
+                             uint64_t length,
+                             uint64_t puff_size,
+                             PuffFormat format);
+
+// Creates a cache that keeps each puff in a file of the directory |path|,
+// which is created if it does not exist. Several processes can use the same
+// directory at once: a puff is written into a temporary file and renamed into
+// place, so it is never read half written, and it is checked against a hash of
+// its content when read. When the files add up to more than |max_size| bytes,
+// the least recently used ones are removed. Returns nullptr if the directory
+// cannot be used.
+std::shared_ptr<PuffCacheInterface> CreateDiskPuffCache(
+    const std::string& path, uint64_t max_size);
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_PUFF_CACHE_H_
@@ -5,16 +5,60 @@
 #ifndef SRC_INCLUDE_PUFFIN_PUFFDIFF_H_
 #define SRC_INCLUDE_PUFFIN_PUFFDIFF_H_
 
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "bsdiff/constants.h"
 
 #include "puffin/common.h"
+#include "puffin/deflate_index.h"
+#include "puffin/puff_cache.h"
 #include "puffin/stream.h"
 
 namespace puffin {
 
+// A report of where the time goes in |PuffDiff| and the sizes of what it
+// creates. All times are in nanoseconds.
+struct PuffDiffReport {
+  // The number of deflates and the size of the puff streams.
+  uint64_t src_deflates = 0;
+  uint64_t dst_deflates = 0;
+  uint64_t src_puff_size = 0;
+  uint64_t dst_puff_size = 0;
+
+  // The size of the puffin patch header, the bsdiff patch inside the puffin
+  // patch and the whole puffin patch.
+  uint64_t header_size = 0;
+  uint64_t bsdiff_patch_size = 0;
+  uint64_t patch_size = 0;
+
+  // The time spent in |FindPuffLocations| for |src| and |dst|. These are zero
+  // if the locations were already known from a |DeflateIndex|.
+  uint64_t src_locate_time_ns = 0;
+  uint64_t dst_locate_time_ns = 0;
+  // The time spent puffing |src| and |dst|.
+  uint64_t puff_time_ns = 0;
+  // The number of puffs read from the puff cache instead of being puffed.
+  uint64_t puff_cache_hits = 0;
+  // The time spent in bsdiff for sorting the suffix array of the source puff
+  // stream and matching the destination puff stream against it. bsdiff does
+  // not expose these two separately.
+  uint64_t bsdiff_time_ns = 0;
+  // The time spent compressing the bsdiff streams with all the compressors and
+  // writing the bsdiff patch.
+  uint64_t compress_time_ns = 0;
+  // The time each compressor alone takes to compress the bsdiff streams. When
+  // there is more than one compressor, these are measured by compressing the
+  // streams again with each one, so asking for a report makes |PuffDiff|
+  // slower.
+  std::vector<std::pair<bsdiff::CompressorType, uint64_t>> compressor_time_ns;
+  // The time spent reading back the bsdiff patch and creating the puffin
+  // patch.
+  uint64_t assemble_time_ns = 0;
+};
+
 // Performs a diff operation between input deflate streams and creates a patch
 // that is used in the client to recreate the |dst| from |src|.
 // |src|          IN   Source deflate stream.
@@ -27,23 +71,85 @@ namespace puffin {
 //                     responsibility of unlinking the file after the call to
 //                     |PuffDiff| finishes.
 // |puffin_patch| OUT  The patch that later can be used in |PuffPatch|.
+// |report|       OUT  If not nullptr, it is filled with the time spent in each
+//                     phase and the sizes of what is created.
+// |format|       IN   The layout of the puff streams diffed by bsdiff. It is
+//                     also the version of the patch, so |PuffPatch| uses the
+//                     same layout.
+// |num_threads|  IN   The number of threads puffing the deflates of |src| and
+//                     |dst|, or one per CPU if zero.
+// |puff_cache|   IN   If not null, the puffs of the deflates it has are read
+//                     from it instead of being puffed, and the others are
+//                     added to it. See |PuffinStream::CreateForPuff|.
+// |map_puffs|    IN   If true, the puff streams of |src| and |dst| are written
+//                     into files mapped into memory instead of being kept in
+//                     memory, so the kernel can drop their pages when memory
+//                     runs short. The files are unique files next to
+//                     |tmp_filepath|, whose names start with it and the
+//                     suffixes ".src_puff" and ".dst_puff". Their space is
+//                     reserved before they are mapped, and they are removed
+//                     as soon as they are created.
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
               const std::vector<BitExtent>& src_deflates,
               const std::vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
-              Buffer* patch);
+              Buffer* patch,
+              PuffDiffReport* report = nullptr,
+              PuffFormat format = PuffFormat::kV1,
+              size_t num_threads = 1,
+              std::shared_ptr<PuffCacheInterface> puff_cache = nullptr,
+              bool map_puffs = false);
 
-// Similar to the function above, except that it accepts raw buffer rather than
-// stream.
+// Similar to the function above, except that the deflate and puff locations of
+// |src| and |dst| are already known (e.g. loaded from an index file), so they
+// are not computed again.
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const DeflateIndex& src_index,
+              const DeflateIndex& dst_index,
+              const std::vector<bsdiff::CompressorType>& compressors,
+              const std::string& tmp_filepath,
+              Buffer* patch,
+              PuffDiffReport* report = nullptr,
+              PuffFormat format = PuffFormat::kV1,
+              size_t num_threads = 1,
+              std::shared_ptr<PuffCacheInterface> puff_cache = nullptr,
+              bool map_puffs = false);
+
+// Similar to the function above for two zip archives, except that each entry
+// of |dst| is diffed on its own against the entry of the same name in |src|.
+// The rest of |dst| (the entries without a pair and the bytes between the
+// entries) is diffed against the rest of |src|. The pairs are diffed on
+// |num_threads| threads, or one per CPU if zero, and only their bytes are in
+// memory, so the time and memory of each diff depend on the size of an entry
+// rather than of the archive. Uses |tmp_filepath| with a suffix for each diff.
+// If the entries of either archive cannot be read from its central directory,
+// the whole archives are diffed like the function above.
+bool PuffDiffZipArchive(UniqueStreamPtr src,
+                        UniqueStreamPtr dst,
+                        const DeflateIndex& src_index,
+                        const DeflateIndex& dst_index,
+                        const std::vector<bsdiff::CompressorType>& compressors,
+                        const std::string& tmp_filepath,
+                        Buffer* patch,
+                        PuffFormat format = PuffFormat::kV1,
+                        size_t num_threads = 1,
+                        std::shared_ptr<PuffCacheInterface> puff_cache =
+                            nullptr);
+
+// Similar to the first function above, except that it accepts raw buffer rather
+// than stream.
 bool PuffDiff(const Buffer& src,
               const Buffer& dst,
               const std::vector<BitExtent>& src_deflates,
               const std::vector<BitExtent>& dst_deflates,
               const std::vector<bsdiff::CompressorType>& compressors,
               const std::string& tmp_filepath,
-              Buffer* patch);
+              Buffer* patch,
+              PuffDiffReport* report = nullptr,
+              PuffFormat format = PuffFormat::kV1);
 
 // The default puffdiff function that uses both bz2 and brotli to compress the
 // patch data.
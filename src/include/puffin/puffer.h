@@ -5,7 +5,6 @@
 #ifndef SRC_INCLUDE_PUFFIN_PUFFER_H_
 #define SRC_INCLUDE_PUFFIN_PUFFER_H_
 
-#include <memory>
 #include <vector>
 
 #include "puffin/common.h"
@@ -15,8 +14,37 @@ namespace puffin {
 
 class BitReaderInterface;
 class PuffWriterInterface;
-class HuffmanTable;
+struct PuffState;
 
+// Statistics of the deflate blocks puffed by |Puffer::PuffDeflate|. They are
+// added up over calls, so one object can be used for a whole file.
+struct PuffStats {
+  // The number of blocks of each type.
+  uint64_t uncompressed_blocks = 0;
+  uint64_t fixed_blocks = 0;
+  uint64_t dynamic_blocks = 0;
+  // The number of bytes in uncompressed blocks.
+  uint64_t uncompressed_bytes = 0;
+
+  // The number of literal and length/distance symbols in the fixed and dynamic
+  // blocks. End of block symbols are not counted.
+  uint64_t literals = 0;
+  uint64_t matches = 0;
+  // The sum of the lengths and the distances of all length/distance symbols.
+  uint64_t match_length_sum = 0;
+  uint64_t match_distance_sum = 0;
+  // The largest number of literal and length/distance symbols in one block.
+  uint64_t max_block_symbols = 0;
+
+  // The total size of the Huffman table headers of dynamic blocks in the
+  // deflate stream (in bits) and in the puff stream (in bytes).
+  uint64_t dynamic_header_bits = 0;
+  uint64_t dynamic_header_puff_bytes = 0;
+};
+
+// A |Puffer| only holds its configuration, so one object can be shared and
+// used by multiple threads at the same time. The state of a call lives on the
+// stack, and the dynamic Huffman tables are built in a per thread table.
 class Puffer {
  public:
   // In older versions of puffin, there is a bug in the client which incorrectly
@@ -44,11 +72,30 @@ class Puffer {
                    PuffWriterInterface* pw,
                    std::vector<BitExtent>* deflates) const;
 
+  // Same as above, but if |stats| is not null, the statistics of the puffed
+  // blocks are also added to it. Symbols are counted in local variables and
+  // only added to |stats| at the end of each block, so passing null costs
+  // nothing per symbol.
+  bool PuffDeflate(BitReaderInterface* br,
+                   PuffWriterInterface* pw,
+                   std::vector<BitExtent>* deflates,
+                   PuffStats* stats) const;
+
  private:
-  std::unique_ptr<HuffmanTable> dyn_ht_;
-  std::unique_ptr<HuffmanTable> fix_ht_;
+  friend class PuffDecoder;
+
+  // Puffs the deflate in |br| from where |state| stopped, until the end of the
+  // next block, or until |max_symbols| symbols of the current block have been
+  // puffed. The progress is kept in |state|; |state->done| is set when there
+  // is nothing left to puff. |pw| is not flushed.
+  bool PuffBlocks(BitReaderInterface* br,
+                  PuffWriterInterface* pw,
+                  std::vector<BitExtent>* deflates,
+                  PuffStats* stats,
+                  PuffState* state,
+                  size_t max_symbols) const;
 
-  bool exclude_bad_distance_caches_;
+  const bool exclude_bad_distance_caches_;
 
   DISALLOW_COPY_AND_ASSIGN(Puffer);
 };
@@ -5,13 +5,21 @@
 #ifndef SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
 #define SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
 
+#include <memory>
+
+#include "puffin/buffer_pool.h"
 #include "puffin/common.h"
 #include "puffin/stream.h"
+#include "puffin/stream_stats.h"
 
 namespace puffin {
 
 extern const char kMagic[];
 extern const size_t kMagicLength;
+// The version of the patches made of parts (see |PuffDiffZipArchive|). It is
+// not a |PuffFormat|, so the builds that do not know about parts reject them.
+// Each part is a whole puffin patch with the version of its own format.
+extern const int32_t kPartsPatchVersion;
 
 // Applies the puffin patch to deflate stream |src| to create deflate stream
 // |dst|. This function is used in the client and internally uses bspatch to
@@ -25,12 +33,34 @@ extern const size_t kMagicLength;
 // |patch|         IN  The input patch.
 // |patch_length|  IN  The length of the patch.
 // |max_cache_size|IN  The maximum amount of memory to cache puff buffers.
+//
+// A patch made of parts (see |PuffDiffZipArchive|) applies each part like a
+// whole patch, streaming from and into its extents of |src| and |dst|, so it
+// uses no more memory than a patch without parts. |dst| is written out of
+// order, so it must be a file or otherwise allow seeking anywhere within its
+// final size.
 bool PuffPatch(UniqueStreamPtr src,
                UniqueStreamPtr dst,
                const uint8_t* patch,
                size_t patch_length,
                size_t max_cache_size = 0);
 
+// Same as above, but also returns the statistics of the puff stream created on
+// |src| and the huff stream created on |dst| in |src_stats| and |dst_stats|
+// respectively. Either of them can be nullptr. The scratch and cache buffers
+// of both streams are taken from |pool|. If it is null, a pool is created for
+// this call only. The deflates are puffed and huffed on |num_threads| threads,
+// or one per CPU if zero.
+bool PuffPatch(UniqueStreamPtr src,
+               UniqueStreamPtr dst,
+               const uint8_t* patch,
+               size_t patch_length,
+               size_t max_cache_size,
+               PuffinStreamStats* src_stats,
+               PuffinStreamStats* dst_stats,
+               std::shared_ptr<BufferPoolInterface> pool = nullptr,
+               size_t num_threads = 1);
+
 }  // namespace puffin
 
 #endif  // SRC_INCLUDE_PUFFIN_PUFFPATCH_H_
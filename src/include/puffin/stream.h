@@ -37,6 +37,23 @@ class StreamInterface {
   // Closes the stream and cleans up all associated resources. On error, returns
   // |false|.
   virtual bool Close() = 0;
+
+  // If the stream is a file, sets |fd| to its file descriptor, whose offset is
+  // the offset of the stream. Puffin uses it for copying data between files
+  // inside the kernel. Returns |false| for streams that are not plain files.
+  virtual bool GetFileDescriptor(int* /* fd */) const { return false; }
+
+  // If the stream is in memory, sets |data| to the |length| bytes at |offset|
+  // of the stream without copying them. |data| is valid until the stream is
+  // read from, written into or destroyed, so callers have to copy or use the
+  // bytes before their next |Read| of the stream. Returns |false| if the stream
+  // does not support it (or, for some streams, does not have these bytes in
+  // memory right now).
+  virtual bool GetData(uint64_t /* offset */,
+                       uint64_t /* length */,
+                       const uint8_t** /* data */) const {
+    return false;
+  }
 };
 
 using UniqueStreamPtr = std::unique_ptr<StreamInterface>;
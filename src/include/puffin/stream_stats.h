@@ -0,0 +1,67 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_STREAM_STATS_H_
+#define SRC_INCLUDE_PUFFIN_STREAM_STATS_H_
+
+#include <cstdint>
+
+namespace puffin {
+
+// Statistics collected by a puff or huff stream during its lifetime. They are
+// meant for tuning things like the size of the puff cache for a device class.
+struct PuffinStreamStats {
+  // The puff cache. These are only updated when puffing with a non-zero cache
+  // size.
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+  uint64_t cache_evictions = 0;
+
+  // The number of puffs read from the |PuffCacheInterface| instead of being
+  // puffed.
+  uint64_t puff_cache_hits = 0;
+
+  // The number of deflates puffed and the total size of the created puffs.
+  uint64_t deflates_puffed = 0;
+  uint64_t bytes_puffed = 0;
+  // The number of times a deflate was puffed again after it had already been
+  // puffed once, because it was not in the cache anymore.
+  uint64_t deflates_repuffed = 0;
+
+  // The number of deflates huffed and the total size of the created deflates.
+  uint64_t deflates_huffed = 0;
+  uint64_t bytes_huffed = 0;
+
+  // The time spent in puffing, huffing and reading from or writing into the
+  // underlying deflate stream.
+  uint64_t puff_time_ns = 0;
+  uint64_t huff_time_ns = 0;
+  uint64_t io_time_ns = 0;
+
+  // The number of deflates read from a file on a background thread before they
+  // were puffed.
+  uint64_t deflates_read_ahead = 0;
+
+  // The number of reads from and writes into the deflate stream, not counting
+  // the deflates read ahead and the bytes copied inside the kernel.
+  uint64_t stream_reads = 0;
+  uint64_t stream_writes = 0;
+
+  // The bytes between the deflates copied inside the kernel by
+  // |PuffinStream::ReadInto| and |PuffinStream::WriteFrom|.
+  uint64_t bytes_copied_in_kernel = 0;
+
+  // The number of seeks that changed the offset in the puff stream and their
+  // total distance from the previous offset.
+  uint64_t seeks = 0;
+  uint64_t seek_distance = 0;
+
+  // The peak size of the internal puff and deflate buffers and of the cache.
+  uint64_t peak_buffer_bytes = 0;
+  uint64_t peak_cache_bytes = 0;
+};
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_STREAM_STATS_H_
@@ -0,0 +1,31 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_TRACE_H_
+#define SRC_INCLUDE_PUFFIN_TRACE_H_
+
+#include <string>
+
+namespace puffin {
+
+// Starts recording the trace events of puffin (locating the deflates, puffing
+// and huffing each deflate, puff cache evictions, the I/O calls and the
+// bsdiff/bspatch phases) on all threads. Any previously recorded events are
+// discarded. Until this is called, the instrumented code only pays for one
+// relaxed atomic load per event. If puffin is built with
+// |PUFFIN_DISABLE_TRACING| defined, the events are compiled out and nothing is
+// ever recorded.
+void StartTracing();
+
+// Stops recording and writes the recorded events into |path| in the Chrome
+// trace event JSON format, which can be loaded by chrome://tracing or
+// Perfetto. Returns false if the file could not be written.
+bool StopTracing(const std::string& path);
+
+// Returns true if trace events are being recorded.
+bool IsTracingEnabled();
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_TRACE_H_
@@ -43,6 +43,20 @@ bool LocateDeflatesInDeflateStream(const uint8_t* data,
 // from the zlib stream.
 bool LocateDeflatesInZlib(const Buffer& data, std::vector<BitExtent>* deflates);
 
+// Similar to the function above, but reads the deflate stream starting at
+// |offset| of |src|. The input is read through a window which grows until the
+// whole deflate stream fits in it, so the memory used is proportional to the
+// size of the deflate stream rather than the size of |src|. The offsets in
+// |deflates| are relative to the beginning of |src|.
+bool LocateDeflatesInDeflateStream(const UniqueStreamPtr& src,
+                                   uint64_t offset,
+                                   std::vector<BitExtent>* deflates,
+                                   uint64_t* compressed_size);
+
+// Similar to |LocateDeflatesInZlib| but for a zlib stream |src|.
+bool LocateDeflatesInZlib(const UniqueStreamPtr& src,
+                          std::vector<BitExtent>* deflates);
+
 // Uses the function above, to locate deflates (bit addressed) in a given file
 // |file_path| using the list of zlib blocks |zlibs|.
 bool LocateDeflatesInZlibBlocks(const std::string& file_path,
@@ -53,10 +67,35 @@ bool LocateDeflatesInZlibBlocks(const std::string& file_path,
 // |deflates|.
 bool LocateDeflatesInGzip(const Buffer& data, std::vector<BitExtent>* deflates);
 
+// Similar to the function above, but for a gzip stream |src|. Only the headers
+// and one deflate stream at a time are kept in memory.
+bool LocateDeflatesInGzip(const UniqueStreamPtr& src,
+                          std::vector<BitExtent>* deflates);
+
 // Search for the deflates in a zip archive, and put the result in |deflates|.
 bool LocateDeflatesInZipArchive(const Buffer& data,
                                 std::vector<BitExtent>* deflates);
 
+// Similar to the function above, but for a zip archive |src|. The archive is
+// scanned through a fixed size window and each entry is read separately, so
+// the whole archive is never loaded into memory.
+bool LocateDeflatesInZipArchive(const UniqueStreamPtr& src,
+                                std::vector<BitExtent>* deflates);
+
+// An entry of a zip archive.
+struct ZipEntry {
+  std::string name;
+  // The bytes of the entry in the archive, from its local file header to the
+  // end of its data (including the data descriptor if it has one).
+  ByteExtent extent;
+};
+
+// Reads the entries of the zip archive |src| from its central directory into
+// |entries|, sorted by their offsets. Fails if |src| has no valid central
+// directory, or is a zip64 archive.
+bool LocateZipEntries(const UniqueStreamPtr& src,
+                      std::vector<ZipEntry>* entries);
+
 // Reads the deflates in from |deflates| and returns a list of its subblock
 // locations. Each subblock in practice is a deflate stream by itself.
 // Assumption is that the first subblock in each deflate in |deflates| start in
@@ -0,0 +1,32 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_INCLUDE_PUFFIN_VERIFY_H_
+#define SRC_INCLUDE_PUFFIN_VERIFY_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "puffin/common.h"
+#include "puffin/deflate_index.h"
+#include "puffin/stream.h"
+
+namespace puffin {
+
+// Checks that each deflate of |index| in |stream| can be puffed into a puff
+// with the size in |index| and huffed back into the exact same bits, which is
+// what patching the stream relies on. The deflates are checked independently
+// and in memory on |num_threads| threads (or one per CPU if zero); nothing is
+// written anywhere. The deflates that failed are added to |mismatches| in
+// their order in |index|. Returns false only if |stream| could not be read.
+// |format| is the layout of the puffs, see |PuffFormat|.
+bool VerifyDeflates(const UniqueStreamPtr& stream,
+                    const DeflateIndex& index,
+                    size_t num_threads,
+                    std::vector<BitExtent>* mismatches,
+                    PuffFormat format = PuffFormat::kV1);
+
+}  // namespace puffin
+
+#endif  // SRC_INCLUDE_PUFFIN_VERIFY_H_
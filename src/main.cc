@@ -2,10 +2,20 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <numeric>
 #include <sstream>
+#include <thread>
 
 #ifdef USE_BRILLO
 #include "brillo/flag_helper.h"
@@ -13,25 +23,35 @@
 #include "gflags/gflags.h"
 #endif
 
+#include "puffin/src/bit_reader.h"
 #include "puffin/src/extent_stream.h"
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
 #include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puff_cache.h"
 #include "puffin/src/include/puffin/puffdiff.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
+#include "puffin/src/include/puffin/trace.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/include/puffin/verify.h"
 #include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_writer.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/scoped_timer.h"
+#include "puffin/src/trace_event.h"
 
 using puffin::BitExtent;
 using puffin::Buffer;
 using puffin::ByteExtent;
+using puffin::DeflateIndex;
 using puffin::ExtentStream;
 using puffin::FileStream;
 using puffin::Huffer;
 using puffin::MemoryStream;
+using puffin::PuffFormat;
 using puffin::Puffer;
 using puffin::PuffinStream;
 using puffin::UniqueStreamPtr;
@@ -62,6 +82,54 @@ vector<T> StringToExtents(const string& str) {
 }
 
 const uint64_t kDefaultPuffCacheSize = 50 * 1024 * 1024;  // 50 MB
+const uint64_t kDefaultDiskCacheSize = 4ULL * 1024 * 1024 * 1024;  // 4 GB
+
+// The parameters of one operation of the tool, which come from the flags of
+// the same names or from one line of a batch manifest.
+struct Operation {
+  string operation;
+  string src_file;
+  string dst_file;
+  string patch_file;
+  string src_deflates_byte;
+  string dst_deflates_byte;
+  string src_deflates_bit;
+  string dst_deflates_bit;
+  string src_puffs;
+  string dst_puffs;
+  string src_extents;
+  string dst_extents;
+  string src_file_type;
+  string dst_file_type;
+  string src_index_file;
+  string dst_index_file;
+  // The temporary file used by puffdiff.
+  string tmp_file = "/tmp/patch.tmp";
+  uint64_t cache_size = kDefaultPuffCacheSize;
+  // The directory of the puffs kept across runs of puff and puffdiff, if any.
+  string disk_cache_dir;
+  uint64_t disk_cache_size = kDefaultDiskCacheSize;
+  PuffFormat puff_format = PuffFormat::kV1;
+  // The number of threads puffing (and huffing) the deflates of the verify,
+  // puffdiff and puffpatch operations, or one per CPU if zero.
+  uint64_t threads = 0;
+  // Whether puffdiff diffs the entries of two zip archives separately.
+  bool zip_entries = false;
+  // Whether puffdiff keeps the puff streams in files mapped into memory.
+  bool map_puffs = false;
+  bool verbose = false;
+};
+
+// Sets |format| to the puff format numbered |value|.
+bool ParsePuffFormat(uint64_t value, PuffFormat* format) {
+  if (value != static_cast<uint64_t>(PuffFormat::kV1) &&
+      value != static_cast<uint64_t>(PuffFormat::kV2)) {
+    LOG(ERROR) << "Unknown puff format: " << value;
+    return false;
+  }
+  *format = static_cast<PuffFormat>(value);
+  return true;
+}
 
 // An enum representing the type of compressed files.
 enum class FileType { kDeflate, kZlib, kGzip, kZip, kRaw, kUnknown };
@@ -123,23 +191,22 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
     return true;
   }
 
-  uint64_t stream_size;
-  TEST_AND_RETURN_FALSE(stream->GetSize(&stream_size));
-  Buffer data(stream_size);
-  TEST_AND_RETURN_FALSE(stream->Read(data.data(), data.size()));
+  // The stream-based locators only keep a window of the input in memory, so
+  // large images do not have to be loaded entirely.
   switch (file_type) {
     case FileType::kDeflate:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInDeflateStream(
-          data.data(), data.size(), 0, deflates, nullptr));
+      TEST_AND_RETURN_FALSE(
+          puffin::LocateDeflatesInDeflateStream(stream, 0, deflates, nullptr));
       break;
     case FileType::kZlib:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(data, deflates));
+      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZlib(stream, deflates));
       break;
     case FileType::kGzip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(data, deflates));
+      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInGzip(stream, deflates));
       break;
     case FileType::kZip:
-      TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZipArchive(data, deflates));
+      TEST_AND_RETURN_FALSE(
+          puffin::LocateDeflatesInZipArchive(stream, deflates));
       break;
     default:
       LOG(ERROR) << "Unknown file type: (" << file_type_to_override << ") nor ("
@@ -152,74 +219,120 @@ bool LocateDeflatesBasedOnFileType(const UniqueStreamPtr& stream,
   return true;
 }
 
-}  // namespace
-
-#define SETUP_FLAGS                                                        \
-  DEFINE_string(src_file, "", "Source file");                              \
-  DEFINE_string(dst_file, "", "Target file");                              \
-  DEFINE_string(patch_file, "", "patch file");                             \
-  DEFINE_string(                                                           \
-      src_deflates_byte, "",                                               \
-      "Source deflate byte locations in the format offset:length,...");    \
-  DEFINE_string(                                                           \
-      dst_deflates_byte, "",                                               \
-      "Target deflate byte locations in the format offset:length,...");    \
-  DEFINE_string(                                                           \
-      src_deflates_bit, "",                                                \
-      "Source deflate bit locations in the format offset:length,...");     \
-  DEFINE_string(                                                           \
-      dst_deflates_bit, "",                                                \
-      "Target deflatebit locations in the format offset:length,...");      \
-  DEFINE_string(src_puffs, "",                                             \
-                "Source puff locations in the format offset:length,...");  \
-  DEFINE_string(dst_puffs, "",                                             \
-                "Target puff locations in the format offset:length,...");  \
-  DEFINE_string(src_extents, "",                                           \
-                "Source extents in the format of offset:length,...");      \
-  DEFINE_string(dst_extents, "",                                           \
-                "Target extents in the format of offset:length,...");      \
-  DEFINE_string(operation, "",                                             \
-                "Type of the operation: puff, huff, puffdiff, puffpatch, " \
-                "puffhuff");                                               \
-  DEFINE_string(src_file_type, "",                                         \
-                "Type of the input source file: deflate, gzip, "           \
-                "zlib or zip");                                            \
-  DEFINE_string(dst_file_type, "",                                         \
-                "Same as src_file_type but for the target file");          \
-  DEFINE_bool(verbose, false,                                              \
-              "Logs all the given parameters including internally "        \
-              "generated ones");                                           \
-  DEFINE_uint64(cache_size, kDefaultPuffCacheSize,                         \
-                "Maximum size to cache the puff stream. Used in puffpatch");
-
-#ifndef USE_BRILLO
-SETUP_FLAGS;
-#endif
+// Fills |index| with the deflates and puffs of |stream|. The deflates are
+// |deflates_bit| plus the ones located based on the file type or, if none is
+// found, the sub-blocks of |deflates_byte|. If |index_file| is non-empty and
+// holds a valid index for |stream|, that is used instead. Otherwise the new
+// index is saved into it.
+bool GetDeflateIndex(const UniqueStreamPtr& stream,
+                     const string& file_name,
+                     const string& file_type_to_override,
+                     const vector<ByteExtent>& deflates_byte,
+                     const vector<BitExtent>& deflates_bit,
+                     const string& index_file,
+                     DeflateIndex* index) {
+  auto locate_deflates = [&](vector<BitExtent>* deflates) {
+    *deflates = deflates_bit;
+    TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
+        stream, file_name, file_type_to_override, deflates));
+    if (deflates->empty() && deflates_byte.empty()) {
+      LOG(WARNING) << "You should pass deflates for " << file_name
+                   << ", is this intentional?";
+    }
+    if (deflates->empty()) {
+      TEST_AND_RETURN_FALSE(
+          FindDeflateSubBlocks(stream, deflates_byte, deflates));
+    }
+    return true;
+  };
 
-// Main entry point to the application.
-bool Main(int argc, char** argv) {
-#ifdef USE_BRILLO
-  SETUP_FLAGS;
-  brillo::FlagHelper::Init(argc, argv, "Puffin tool");
-#else
-  // google::InitGoogleLogging(argv[0]);
-  google::ParseCommandLineFlags(&argc, &argv, true);
-#endif
+  if (index_file.empty()) {
+    vector<BitExtent> deflates;
+    TEST_AND_RETURN_FALSE(locate_deflates(&deflates));
+    return puffin::CreateDeflateIndex(stream, deflates, index);
+  }
+  // Everything that affects the located deflates, other than the content of
+  // the stream itself.
+  auto last_dot = file_name.find_last_of(".");
+  auto tag = "type=" + file_type_to_override + ";extension=" +
+             (last_dot == string::npos ? "" : file_name.substr(last_dot + 1)) +
+             ";bytes=" + puffin::ExtentsToString(deflates_byte) +
+             ";bits=" + puffin::ExtentsToString(deflates_bit);
+  return puffin::LoadOrCreateDeflateIndex(index_file, stream, tag,
+                                          locate_deflates, index);
+}
 
-  TEST_AND_RETURN_FALSE(!FLAGS_operation.empty());
-  TEST_AND_RETURN_FALSE(!FLAGS_src_file.empty());
-  TEST_AND_RETURN_FALSE(!FLAGS_dst_file.empty());
+// Prints the statistics of |num_deflates| puffed deflates in |stats|.
+void PrintPuffStats(size_t num_deflates, const puffin::PuffStats& stats) {
+  auto ratio = [](uint64_t a, uint64_t b) { return b ? 1.0 * a / b : 0.0; };
+  auto compressed_blocks = stats.fixed_blocks + stats.dynamic_blocks;
+  auto symbols = stats.literals + stats.matches;
+  std::cout << "deflates: " << num_deflates << std::endl
+            << "uncompressed blocks: " << stats.uncompressed_blocks << " ("
+            << stats.uncompressed_bytes << " bytes)" << std::endl
+            << "fixed blocks: " << stats.fixed_blocks << std::endl
+            << "dynamic blocks: " << stats.dynamic_blocks << std::endl
+            << "symbols per block: "
+            << ratio(symbols, compressed_blocks) << " average, "
+            << stats.max_block_symbols << " max" << std::endl
+            << "literals: " << stats.literals << " ("
+            << 100 * ratio(stats.literals, symbols) << "% of symbols)"
+            << std::endl
+            << "matches: " << stats.matches << " ("
+            << 100 * ratio(stats.matches, symbols) << "% of symbols)"
+            << std::endl
+            << "average match length: "
+            << ratio(stats.match_length_sum, stats.matches) << std::endl
+            << "average match distance: "
+            << ratio(stats.match_distance_sum, stats.matches) << std::endl
+            << "dynamic Huffman headers: " << stats.dynamic_header_bits / 8
+            << " bytes in deflate, " << stats.dynamic_header_puff_bytes
+            << " bytes in puff ("
+            << ratio(stats.dynamic_header_bits, 8 * stats.dynamic_blocks)
+            << " bytes per block in deflate)" << std::endl;
+}
 
-  auto src_deflates_byte = StringToExtents<ByteExtent>(FLAGS_src_deflates_byte);
-  auto dst_deflates_byte = StringToExtents<ByteExtent>(FLAGS_dst_deflates_byte);
-  auto src_deflates_bit = StringToExtents<BitExtent>(FLAGS_src_deflates_bit);
-  auto dst_deflates_bit = StringToExtents<BitExtent>(FLAGS_dst_deflates_bit);
-  auto src_puffs = StringToExtents<ByteExtent>(FLAGS_src_puffs);
-  auto dst_puffs = StringToExtents<ByteExtent>(FLAGS_dst_puffs);
-  auto src_extents = StringToExtents<ByteExtent>(FLAGS_src_extents);
-  auto dst_extents = StringToExtents<ByteExtent>(FLAGS_dst_extents);
+void LogPuffDiffReport(const puffin::PuffDiffReport& report) {
+  auto ms = [](uint64_t time_ns) { return time_ns / 1000000.0; };
+  LOG(INFO) << "src deflates: " << report.src_deflates
+            << ", puff size: " << report.src_puff_size;
+  LOG(INFO) << "dst deflates: " << report.dst_deflates
+            << ", puff size: " << report.dst_puff_size;
+  LOG(INFO) << "patch_size: " << report.patch_size
+            << " (header: " << report.header_size
+            << ", bsdiff: " << report.bsdiff_patch_size << ")";
+  LOG(INFO) << "locate time (ms): src " << ms(report.src_locate_time_ns)
+            << ", dst " << ms(report.dst_locate_time_ns);
+  LOG(INFO) << "puff time (ms): " << ms(report.puff_time_ns)
+            << ", puff cache hits: " << report.puff_cache_hits;
+  LOG(INFO) << "bsdiff time (ms): " << ms(report.bsdiff_time_ns);
+  LOG(INFO) << "compress time (ms): " << ms(report.compress_time_ns);
+  for (const auto& compressor : report.compressor_time_ns) {
+    LOG(INFO) << "  compressor " << static_cast<int>(compressor.first)
+              << " time (ms): " << ms(compressor.second);
+  }
+  LOG(INFO) << "assemble time (ms): " << ms(report.assemble_time_ns);
+}
 
-  auto src_stream = FileStream::Open(FLAGS_src_file, true, false);
+// Runs the operation described by |op|.
+bool RunOperation(const Operation& op) {
+  TRACE_EVENT0("puffin", "RunOperation");
+  TEST_AND_RETURN_FALSE(!op.operation.empty());
+  TEST_AND_RETURN_FALSE(!op.src_file.empty());
+  // The stats and verify operations only print to the standard output.
+  TEST_AND_RETURN_FALSE(op.operation == "stats" || op.operation == "verify" ||
+                        !op.dst_file.empty());
+
+  auto src_deflates_byte = StringToExtents<ByteExtent>(op.src_deflates_byte);
+  auto dst_deflates_byte = StringToExtents<ByteExtent>(op.dst_deflates_byte);
+  auto src_deflates_bit = StringToExtents<BitExtent>(op.src_deflates_bit);
+  auto dst_deflates_bit = StringToExtents<BitExtent>(op.dst_deflates_bit);
+  auto src_puffs = StringToExtents<ByteExtent>(op.src_puffs);
+  auto dst_puffs = StringToExtents<ByteExtent>(op.dst_puffs);
+  auto src_extents = StringToExtents<ByteExtent>(op.src_extents);
+  auto dst_extents = StringToExtents<ByteExtent>(op.dst_extents);
+
+  auto src_stream = FileStream::Open(op.src_file, true, false);
   TEST_AND_RETURN_FALSE(src_stream);
   if (!src_extents.empty()) {
     src_stream =
@@ -227,47 +340,96 @@ bool Main(int argc, char** argv) {
     TEST_AND_RETURN_FALSE(src_stream);
   }
 
-  if (FLAGS_operation == "puff" || FLAGS_operation == "puffhuff") {
-    TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        src_stream, FLAGS_src_file, FLAGS_src_file_type, &src_deflates_bit));
+  std::shared_ptr<puffin::PuffCacheInterface> disk_cache;
+  if (!op.disk_cache_dir.empty()) {
+    disk_cache =
+        puffin::CreateDiskPuffCache(op.disk_cache_dir, op.disk_cache_size);
+    TEST_AND_RETURN_FALSE(disk_cache);
+  }
 
-    if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
-      LOG(WARNING) << "You should pass source deflates, is this intentional?";
+  if (op.operation == "stats") {
+    // Puffs the deflates in the source and prints the statistics of their
+    // blocks. The located deflates do not include uncompressed blocks, so
+    // those are only counted if whole deflate streams are passed in
+    // |src_deflates_byte|.
+    vector<BitExtent> deflates;
+    if (!src_deflates_byte.empty()) {
+      for (const auto& deflate : src_deflates_byte) {
+        deflates.emplace_back(deflate.offset * 8, deflate.length * 8);
+      }
+    } else {
+      DeflateIndex src_index;
+      TEST_AND_RETURN_FALSE(GetDeflateIndex(
+          src_stream, op.src_file, op.src_file_type, src_deflates_byte,
+          src_deflates_bit, op.src_index_file, &src_index));
+      deflates = src_index.deflates;
     }
-    if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit));
+
+    Puffer puffer;
+    puffin::PuffStats stats;
+    Buffer deflate_buffer;
+    for (const auto& deflate : deflates) {
+      auto start_byte = deflate.offset / 8;
+      auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+      deflate_buffer.resize(end_byte - start_byte);
+      TEST_AND_RETURN_FALSE(src_stream->Seek(start_byte));
+      TEST_AND_RETURN_FALSE(
+          src_stream->Read(deflate_buffer.data(), deflate_buffer.size()));
+      puffin::BufferBitReader bit_reader(deflate_buffer.data(),
+                                         deflate_buffer.size());
+      puffin::BufferPuffWriter puff_writer(nullptr, 0);
+      // Drop the first unused bits.
+      TEST_AND_RETURN_FALSE(bit_reader.CacheBits(deflate.offset & 7));
+      bit_reader.DropBits(deflate.offset & 7);
+      TEST_AND_RETURN_FALSE(
+          puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr, &stats));
     }
+    PrintPuffStats(deflates.size(), stats);
+  } else if (op.operation == "verify") {
+    // Puffs and huffs back each deflate of the source in memory and prints
+    // the ones that do not come back the same, so they would break patching.
+    DeflateIndex src_index;
+    TEST_AND_RETURN_FALSE(GetDeflateIndex(
+        src_stream, op.src_file, op.src_file_type, src_deflates_byte,
+        src_deflates_bit, op.src_index_file, &src_index));
+    vector<BitExtent> mismatches;
+    TEST_AND_RETURN_FALSE(puffin::VerifyDeflates(
+        src_stream, src_index, op.threads, &mismatches, op.puff_format));
+    std::cout << "deflates: " << src_index.deflates.size() << std::endl
+              << "mismatches: " << mismatches.size() << std::endl;
+    if (!mismatches.empty()) {
+      std::cout << "mismatching deflates: "
+                << puffin::ExtentsToString(mismatches) << std::endl;
+      return false;
+    }
+  } else if (op.operation == "puff" || op.operation == "puffhuff") {
     TEST_AND_RETURN_FALSE(dst_puffs.empty());
-    uint64_t dst_puff_size;
-    TEST_AND_RETURN_FALSE(FindPuffLocations(src_stream, src_deflates_bit,
-                                            &dst_puffs, &dst_puff_size));
-
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
+    DeflateIndex src_index;
+    TEST_AND_RETURN_FALSE(GetDeflateIndex(
+        src_stream, op.src_file, op.src_file_type, src_deflates_byte,
+        src_deflates_bit, op.src_index_file, &src_index));
+    src_deflates_bit = src_index.deflates;
+    dst_puffs = src_index.puffs;
+    uint64_t dst_puff_size = src_index.puff_size;
+
+    auto dst_stream = FileStream::Open(op.dst_file, false, true);
     TEST_AND_RETURN_FALSE(dst_stream);
     auto puffer = std::make_shared<Puffer>();
-    auto reader =
-        PuffinStream::CreateForPuff(std::move(src_stream), puffer,
-                                    dst_puff_size, src_deflates_bit, dst_puffs);
+    auto reader = PuffinStream::CreateForPuff(
+        std::move(src_stream), puffer, dst_puff_size, src_deflates_bit,
+        dst_puffs, 0, nullptr, op.puff_format, 1, disk_cache);
+    TEST_AND_RETURN_FALSE(reader);
 
     Buffer puff_buffer;
-    auto writer = FLAGS_operation == "puffhuff"
+    auto writer = op.operation == "puffhuff"
                       ? MemoryStream::CreateForWrite(&puff_buffer)
                       : std::move(dst_stream);
-
-    Buffer buffer(1024 * 1024);
-    uint64_t bytes_wrote = 0;
-    while (bytes_wrote < dst_puff_size) {
-      auto write_size = std::min(static_cast<uint64_t>(buffer.size()),
-                                 dst_puff_size - bytes_wrote);
-      TEST_AND_RETURN_FALSE(reader->Read(buffer.data(), write_size));
-      TEST_AND_RETURN_FALSE(writer->Write(buffer.data(), write_size));
-      bytes_wrote += write_size;
-    }
+    TEST_AND_RETURN_FALSE(static_cast<PuffinStream*>(reader.get())
+                              ->ReadInto(writer.get(), dst_puff_size));
 
     // puffhuff operation puffs a stream and huffs it back to the target stream
     // to make sure we can get to the original stream.
-    if (FLAGS_operation == "puffhuff") {
+    if (op.operation == "puffhuff") {
       src_puffs = dst_puffs;
       dst_deflates_byte = src_deflates_byte;
       dst_deflates_bit = src_deflates_bit;
@@ -276,18 +438,13 @@ bool Main(int argc, char** argv) {
       auto huffer = std::make_shared<Huffer>();
       auto huff_writer = PuffinStream::CreateForHuff(
           std::move(dst_stream), huffer, dst_puff_size, dst_deflates_bit,
-          src_puffs);
-
-      uint64_t bytes_read = 0;
-      while (bytes_read < dst_puff_size) {
-        auto read_size = std::min(static_cast<uint64_t>(buffer.size()),
-                                  dst_puff_size - bytes_read);
-        TEST_AND_RETURN_FALSE(read_puff_stream->Read(buffer.data(), read_size));
-        TEST_AND_RETURN_FALSE(huff_writer->Write(buffer.data(), read_size));
-        bytes_read += read_size;
-      }
+          src_puffs, nullptr, op.puff_format);
+      TEST_AND_RETURN_FALSE(huff_writer);
+      TEST_AND_RETURN_FALSE(
+          static_cast<PuffinStream*>(huff_writer.get())
+              ->WriteFrom(read_puff_stream.get(), dst_puff_size));
     }
-  } else if (FLAGS_operation == "huff") {
+  } else if (op.operation == "huff") {
     if (dst_deflates_bit.empty() && src_puffs.empty()) {
       LOG(WARNING) << "You should pass source puffs and destination deflates"
                    << ", is this intentional?";
@@ -295,70 +452,73 @@ bool Main(int argc, char** argv) {
     TEST_AND_RETURN_FALSE(src_puffs.size() == dst_deflates_bit.size());
     uint64_t src_stream_size;
     TEST_AND_RETURN_FALSE(src_stream->GetSize(&src_stream_size));
-    auto dst_file = FileStream::Open(FLAGS_dst_file, false, true);
+    auto dst_file = FileStream::Open(op.dst_file, false, true);
     TEST_AND_RETURN_FALSE(dst_file);
 
     auto huffer = std::make_shared<Huffer>();
-    auto dst_stream = PuffinStream::CreateForHuff(std::move(dst_file), huffer,
-                                                  src_stream_size,
-                                                  dst_deflates_bit, src_puffs);
-
-    Buffer buffer(1024 * 1024);
-    uint64_t bytes_read = 0;
-    while (bytes_read < src_stream_size) {
-      auto read_size = std::min(static_cast<uint64_t>(buffer.size()),
-                                src_stream_size - bytes_read);
-      TEST_AND_RETURN_FALSE(src_stream->Read(buffer.data(), read_size));
-      TEST_AND_RETURN_FALSE(dst_stream->Write(buffer.data(), read_size));
-      bytes_read += read_size;
-    }
-  } else if (FLAGS_operation == "puffdiff") {
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, true, false);
+    auto dst_stream = PuffinStream::CreateForHuff(
+        std::move(dst_file), huffer, src_stream_size, dst_deflates_bit,
+        src_puffs, nullptr, op.puff_format);
+    TEST_AND_RETURN_FALSE(dst_stream);
+    TEST_AND_RETURN_FALSE(static_cast<PuffinStream*>(dst_stream.get())
+                              ->WriteFrom(src_stream.get(), src_stream_size));
+  } else if (op.operation == "puffdiff") {
+    auto dst_stream = FileStream::Open(op.dst_file, true, false);
     TEST_AND_RETURN_FALSE(dst_stream);
 
-    TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        src_stream, FLAGS_src_file, FLAGS_src_file_type, &src_deflates_bit));
-    TEST_AND_RETURN_FALSE(LocateDeflatesBasedOnFileType(
-        dst_stream, FLAGS_dst_file, FLAGS_dst_file_type, &dst_deflates_bit));
-
-    if (src_deflates_bit.empty() && src_deflates_byte.empty()) {
-      LOG(WARNING) << "You should pass source deflates, is this intentional?";
+    DeflateIndex src_index, dst_index;
+    uint64_t src_locate_time_ns = 0, dst_locate_time_ns = 0;
+    {
+      puffin::ScopedTimer timer(&src_locate_time_ns);
+      TEST_AND_RETURN_FALSE(GetDeflateIndex(
+          src_stream, op.src_file, op.src_file_type, src_deflates_byte,
+          src_deflates_bit, op.src_index_file, &src_index));
     }
-    if (dst_deflates_bit.empty() && dst_deflates_byte.empty()) {
-      LOG(WARNING) << "You should pass target deflates, is this intentional?";
+    {
+      puffin::ScopedTimer timer(&dst_locate_time_ns);
+      TEST_AND_RETURN_FALSE(GetDeflateIndex(
+          dst_stream, op.dst_file, op.dst_file_type, dst_deflates_byte,
+          dst_deflates_bit, op.dst_index_file, &dst_index));
     }
+    src_deflates_bit = src_index.deflates;
+    dst_deflates_bit = dst_index.deflates;
+    src_puffs = src_index.puffs;
+    dst_puffs = dst_index.puffs;
+
     if (!dst_extents.empty()) {
       dst_stream =
           ExtentStream::CreateForWrite(std::move(dst_stream), dst_extents);
       TEST_AND_RETURN_FALSE(dst_stream);
     }
 
-    if (src_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(src_stream, src_deflates_byte,
-                                                 &src_deflates_bit));
-    }
-
-    if (dst_deflates_bit.empty()) {
-      TEST_AND_RETURN_FALSE(FindDeflateSubBlocks(dst_stream, dst_deflates_byte,
-                                                 &dst_deflates_bit));
-    }
-
     // TODO(xunchang) add flags to select the bsdiff compressors.
     Buffer puffdiff_delta;
-    TEST_AND_RETURN_FALSE(puffin::PuffDiff(
-        std::move(src_stream), std::move(dst_stream), src_deflates_bit,
-        dst_deflates_bit,
-        {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
-        "/tmp/patch.tmp", &puffdiff_delta));
-    if (FLAGS_verbose) {
-      LOG(INFO) << "patch_size: " << puffdiff_delta.size();
+    puffin::PuffDiffReport report;
+    if (op.zip_entries) {
+      TEST_AND_RETURN_FALSE(puffin::PuffDiffZipArchive(
+          std::move(src_stream), std::move(dst_stream), src_index, dst_index,
+          {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
+          op.tmp_file, &puffdiff_delta, op.puff_format, op.threads,
+          disk_cache));
+    } else {
+      TEST_AND_RETURN_FALSE(puffin::PuffDiff(
+          std::move(src_stream), std::move(dst_stream), src_index, dst_index,
+          {bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli},
+          op.tmp_file, &puffdiff_delta, op.verbose ? &report : nullptr,
+          op.puff_format, op.threads, disk_cache, op.map_puffs));
+    }
+    if (op.verbose && !op.zip_entries) {
+      // Locating the deflates happens here, not in |PuffDiff|.
+      report.src_locate_time_ns = src_locate_time_ns;
+      report.dst_locate_time_ns = dst_locate_time_ns;
+      LogPuffDiffReport(report);
     }
-    auto patch_stream = FileStream::Open(FLAGS_patch_file, false, true);
+    auto patch_stream = FileStream::Open(op.patch_file, false, true);
     TEST_AND_RETURN_FALSE(patch_stream);
     TEST_AND_RETURN_FALSE(
         patch_stream->Write(puffdiff_delta.data(), puffdiff_delta.size()));
-  } else if (FLAGS_operation == "puffpatch") {
-    auto patch_stream = FileStream::Open(FLAGS_patch_file, true, false);
+  } else if (op.operation == "puffpatch") {
+    auto patch_stream = FileStream::Open(op.patch_file, true, false);
     TEST_AND_RETURN_FALSE(patch_stream);
     uint64_t patch_size;
     TEST_AND_RETURN_FALSE(patch_stream->GetSize(&patch_size));
@@ -366,7 +526,7 @@ bool Main(int argc, char** argv) {
     Buffer puffdiff_delta(patch_size);
     TEST_AND_RETURN_FALSE(
         patch_stream->Read(puffdiff_delta.data(), puffdiff_delta.size()));
-    auto dst_stream = FileStream::Open(FLAGS_dst_file, false, true);
+    auto dst_stream = FileStream::Open(op.dst_file, false, true);
     TEST_AND_RETURN_FALSE(dst_stream);
     if (!dst_extents.empty()) {
       dst_stream =
@@ -375,12 +535,36 @@ bool Main(int argc, char** argv) {
     }
     // Apply the patch. Use 50MB cache, it should be enough for most of the
     // operations.
+    puffin::PuffinStreamStats src_stats, dst_stats;
     TEST_AND_RETURN_FALSE(puffin::PuffPatch(
         std::move(src_stream), std::move(dst_stream), puffdiff_delta.data(),
-        puffdiff_delta.size(), FLAGS_cache_size));
+        puffdiff_delta.size(), op.cache_size, &src_stats, &dst_stats, nullptr,
+        op.threads));
+    if (op.verbose) {
+      LOG(INFO) << "src cache hits/misses/evictions: " << src_stats.cache_hits
+                << "/" << src_stats.cache_misses << "/"
+                << src_stats.cache_evictions;
+      LOG(INFO) << "src deflates puffed: " << src_stats.deflates_puffed
+                << " (" << src_stats.deflates_repuffed << " re-puffed, "
+                << src_stats.bytes_puffed << " bytes, "
+                << src_stats.deflates_read_ahead << " read ahead)";
+      LOG(INFO) << "dst deflates huffed: " << dst_stats.deflates_huffed
+                << " (" << dst_stats.bytes_huffed << " bytes)";
+      LOG(INFO) << "src reads: " << src_stats.stream_reads
+                << ", dst writes: " << dst_stats.stream_writes;
+      LOG(INFO) << "puff/huff/io time (ms): "
+                << src_stats.puff_time_ns / 1000000 << "/"
+                << dst_stats.huff_time_ns / 1000000 << "/"
+                << (src_stats.io_time_ns + dst_stats.io_time_ns) / 1000000;
+      LOG(INFO) << "src seeks: " << src_stats.seeks << " ("
+                << src_stats.seek_distance << " bytes)";
+      LOG(INFO) << "peak buffer/cache bytes: "
+                << src_stats.peak_buffer_bytes + dst_stats.peak_buffer_bytes
+                << "/" << src_stats.peak_cache_bytes;
+    }
   }
 
-  if (FLAGS_verbose) {
+  if (op.verbose) {
     LOG(INFO) << "src_deflates_byte: "
               << puffin::ExtentsToString(src_deflates_byte);
     LOG(INFO) << "dst_deflates_byte: "
@@ -397,6 +581,326 @@ bool Main(int argc, char** argv) {
   return true;
 }
 
+// Parses one line of a batch manifest into |op|. A line has the same flags as
+// the command line (without the batch flags) separated by white space, for
+// example "--operation=puffdiff --src_file=a.zip --dst_file=b.zip
+// --patch_file=a_b.puffdiff". The fields not in the line are left as they are.
+bool ParseManifestLine(const string& line, Operation* op) {
+  const std::map<string, string Operation::*> kStringFields = {
+      {"operation", &Operation::operation},
+      {"src_file", &Operation::src_file},
+      {"dst_file", &Operation::dst_file},
+      {"patch_file", &Operation::patch_file},
+      {"src_deflates_byte", &Operation::src_deflates_byte},
+      {"dst_deflates_byte", &Operation::dst_deflates_byte},
+      {"src_deflates_bit", &Operation::src_deflates_bit},
+      {"dst_deflates_bit", &Operation::dst_deflates_bit},
+      {"src_puffs", &Operation::src_puffs},
+      {"dst_puffs", &Operation::dst_puffs},
+      {"src_extents", &Operation::src_extents},
+      {"dst_extents", &Operation::dst_extents},
+      {"src_file_type", &Operation::src_file_type},
+      {"dst_file_type", &Operation::dst_file_type},
+      {"src_index_file", &Operation::src_index_file},
+      {"dst_index_file", &Operation::dst_index_file},
+      {"disk_cache_dir", &Operation::disk_cache_dir},
+  };
+  const std::map<string, bool Operation::*> kBoolFields = {
+      {"zip_entries", &Operation::zip_entries},
+      {"map_puffs", &Operation::map_puffs},
+      {"verbose", &Operation::verbose},
+  };
+  stringstream ss(line);
+  string arg;
+  while (ss >> arg) {
+    TEST_AND_RETURN_FALSE(arg.compare(0, 2, "--") == 0);
+    auto equal = arg.find('=');
+    auto name = arg.substr(2, equal == string::npos ? string::npos : equal - 2);
+    auto value = equal == string::npos ? "" : arg.substr(equal + 1);
+    auto field = kStringFields.find(name);
+    auto bool_field = kBoolFields.find(name);
+    if (field != kStringFields.end()) {
+      op->*(field->second) = value;
+    } else if (bool_field != kBoolFields.end()) {
+      TEST_AND_RETURN_FALSE(value.empty() || value == "true" ||
+                            value == "false");
+      op->*(bool_field->second) = value != "false";
+    } else if (name == "cache_size" || name == "disk_cache_size") {
+      TEST_AND_RETURN_FALSE(!value.empty() &&
+                            value.find_first_not_of("0123456789") ==
+                                string::npos);
+      (name == "cache_size" ? op->cache_size : op->disk_cache_size) =
+          std::stoull(value);
+    } else if (name == "puff_format") {
+      TEST_AND_RETURN_FALSE(!value.empty() &&
+                            value.find_first_not_of("0123456789") ==
+                                string::npos);
+      TEST_AND_RETURN_FALSE(
+          ParsePuffFormat(std::stoull(value), &op->puff_format));
+    } else {
+      LOG(ERROR) << "Unknown flag in the manifest: " << arg;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the size of the file |path| or zero if it does not exist.
+uint64_t GetFileSize(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Returns |str| with the characters that are special in JSON strings escaped.
+string JsonEscape(const string& str) {
+  string escaped;
+  for (auto c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      escaped += buffer;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Runs the operations in the |manifest| file, one per line, on |num_threads|
+// threads (or one per CPU if zero). Empty lines and lines starting with '#'
+// are ignored. Every operation starts from |defaults|. The operations with the
+// largest inputs are started first, so a large one does not end up running
+// alone at the end. A JSON object is printed for each finished operation with
+// its line in the manifest, its result, its running time and the size of its
+// output, followed by a summary. Returns false if any operation failed.
+bool RunBatch(const string& manifest,
+              uint64_t num_threads,
+              const Operation& defaults) {
+  std::ifstream manifest_file(manifest);
+  TEST_AND_RETURN_FALSE(manifest_file);
+  vector<Operation> ops;
+  vector<size_t> line_numbers;
+  string line;
+  for (size_t line_number = 1; std::getline(manifest_file, line);
+       line_number++) {
+    auto first = line.find_first_not_of(" \t\r");
+    if (first == string::npos || line[first] == '#') {
+      continue;
+    }
+    Operation op = defaults;
+    if (!ParseManifestLine(line, &op)) {
+      LOG(ERROR) << "Invalid line " << line_number << " in " << manifest;
+      return false;
+    }
+    // The operations cannot share the temporary file of puffdiff.
+    op.tmp_file = op.patch_file + ".tmp";
+    ops.push_back(op);
+    line_numbers.push_back(line_number);
+  }
+
+  // Largest first.
+  vector<uint64_t> weights;
+  for (const auto& op : ops) {
+    weights.push_back(GetFileSize(op.src_file) +
+                      (op.operation == "puffdiff" ? GetFileSize(op.dst_file)
+                                                  : 0));
+  }
+  vector<size_t> order(ops.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&weights](size_t a, size_t b) {
+    return weights[a] > weights[b];
+  });
+
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  num_threads = std::min<uint64_t>(num_threads, ops.size());
+
+  // The operations take long enough that the threads can take the next one
+  // from a shared queue without contention.
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> failures(0);
+  std::mutex output_mutex;
+  uint64_t batch_time_ns = 0;
+  {
+    puffin::ScopedTimer batch_timer(&batch_time_ns);
+    auto worker = [&]() {
+      for (size_t idx; (idx = next++) < order.size();) {
+        const auto& op = ops[order[idx]];
+        uint64_t time_ns = 0;
+        bool success;
+        {
+          puffin::ScopedTimer timer(&time_ns);
+          success = RunOperation(op);
+        }
+        if (op.operation == "puffdiff") {
+          unlink(op.tmp_file.c_str());
+        }
+        if (!success) {
+          failures++;
+        }
+        auto output_size = GetFileSize(
+            op.operation == "puffdiff" ? op.patch_file : op.dst_file);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        printf("{\"line\": %zu, \"operation\": \"%s\", \"src_file\": \"%s\", "
+               "\"success\": %s, \"time_ms\": %.3f, \"output_size\": %" PRIu64
+               "}\n",
+               line_numbers[order[idx]], JsonEscape(op.operation).c_str(),
+               JsonEscape(op.src_file).c_str(), success ? "true" : "false",
+               time_ns / 1e6, output_size);
+        fflush(stdout);
+      }
+    };
+    vector<std::thread> threads;
+    for (uint64_t idx = 0; idx < num_threads; idx++) {
+      threads.emplace_back(worker);
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  printf("{\"operations\": %zu, \"failed\": %zu, \"threads\": %" PRIu64
+         ", \"time_ms\": %.3f}\n",
+         ops.size(), failures.load(), num_threads, batch_time_ns / 1e6);
+  return failures == 0;
+}
+
+}  // namespace
+
+#define SETUP_FLAGS                                                        \
+  DEFINE_string(src_file, "", "Source file");                              \
+  DEFINE_string(dst_file, "", "Target file");                              \
+  DEFINE_string(patch_file, "", "patch file");                             \
+  DEFINE_string(                                                           \
+      src_deflates_byte, "",                                               \
+      "Source deflate byte locations in the format offset:length,...");    \
+  DEFINE_string(                                                           \
+      dst_deflates_byte, "",                                               \
+      "Target deflate byte locations in the format offset:length,...");    \
+  DEFINE_string(                                                           \
+      src_deflates_bit, "",                                                \
+      "Source deflate bit locations in the format offset:length,...");     \
+  DEFINE_string(                                                           \
+      dst_deflates_bit, "",                                                \
+      "Target deflatebit locations in the format offset:length,...");      \
+  DEFINE_string(src_puffs, "",                                             \
+                "Source puff locations in the format offset:length,...");  \
+  DEFINE_string(dst_puffs, "",                                             \
+                "Target puff locations in the format offset:length,...");  \
+  DEFINE_string(src_extents, "",                                           \
+                "Source extents in the format of offset:length,...");      \
+  DEFINE_string(dst_extents, "",                                           \
+                "Target extents in the format of offset:length,...");      \
+  DEFINE_string(operation, "",                                             \
+                "Type of the operation: puff, huff, puffdiff, puffpatch, " \
+                "puffhuff, stats, verify");                                \
+  DEFINE_string(src_file_type, "",                                         \
+                "Type of the input source file: deflate, gzip, "           \
+                "zlib or zip");                                            \
+  DEFINE_string(dst_file_type, "",                                         \
+                "Same as src_file_type but for the target file");          \
+  DEFINE_bool(verbose, false,                                              \
+              "Logs all the given parameters including internally "        \
+              "generated ones");                                           \
+  DEFINE_bool(zip_entries, false,                                          \
+              "Diffs each entry of the target zip archive against the "    \
+              "source entry of the same name, in parallel. Used in "       \
+              "puffdiff");                                                 \
+  DEFINE_bool(map_puffs, false,                                            \
+              "Keeps the puff streams in temporary files mapped into "     \
+              "memory, so inputs whose puffs do not fit in memory can be " \
+              "diffed. Used in puffdiff");                                 \
+  DEFINE_uint64(cache_size, kDefaultPuffCacheSize,                         \
+                "Maximum size to cache the puff stream. Used in puffpatch"); \
+  DEFINE_string(disk_cache_dir, "",                                        \
+                "A directory to keep the puffs of the deflates in across " \
+                "runs, so unchanged deflates are not puffed again. It can "\
+                "be shared by several processes. Used in puff and "       \
+                "puffdiff");                                               \
+  DEFINE_uint64(disk_cache_size, kDefaultDiskCacheSize,                    \
+                "Maximum size of the puffs in disk_cache_dir");            \
+  DEFINE_uint64(puff_format, 1,                                            \
+                "The layout of the puff streams, 1 or 2. Used in puff, "   \
+                "huff, puffhuff and puffdiff; puffpatch uses the layout "  \
+                "of the patch");                                           \
+  DEFINE_string(src_index_file, "",                                        \
+                "A file to load the source deflate and puff locations "    \
+                "from, or to save them into if it is missing or stale");   \
+  DEFINE_string(dst_index_file, "",                                        \
+                "Same as src_index_file but for the target file");       \
+  DEFINE_string(manifest, "",                                              \
+                "Runs the operations in this file, one per line, each "    \
+                "given with the flags above. The flags on the command "    \
+                "line are the defaults of the operations");                \
+  DEFINE_uint64(threads, 0,                                                \
+                "The number of threads running the operations of "         \
+                "--manifest or the deflates of verify, puffdiff and "      \
+                "puffpatch, or one per CPU if zero");                      \
+  DEFINE_string(trace_file, "",                                            \
+                "If given, writes the trace events of the run into this "  \
+                "file in the Chrome trace event format");
+
+#ifndef USE_BRILLO
+SETUP_FLAGS;
+#endif
+
+// Main entry point to the application.
+bool Main(int argc, char** argv) {
+#ifdef USE_BRILLO
+  SETUP_FLAGS;
+  brillo::FlagHelper::Init(argc, argv, "Puffin tool");
+#else
+  // google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+
+  Operation op;
+  op.operation = FLAGS_operation;
+  op.src_file = FLAGS_src_file;
+  op.dst_file = FLAGS_dst_file;
+  op.patch_file = FLAGS_patch_file;
+  op.src_deflates_byte = FLAGS_src_deflates_byte;
+  op.dst_deflates_byte = FLAGS_dst_deflates_byte;
+  op.src_deflates_bit = FLAGS_src_deflates_bit;
+  op.dst_deflates_bit = FLAGS_dst_deflates_bit;
+  op.src_puffs = FLAGS_src_puffs;
+  op.dst_puffs = FLAGS_dst_puffs;
+  op.src_extents = FLAGS_src_extents;
+  op.dst_extents = FLAGS_dst_extents;
+  op.src_file_type = FLAGS_src_file_type;
+  op.dst_file_type = FLAGS_dst_file_type;
+  op.src_index_file = FLAGS_src_index_file;
+  op.dst_index_file = FLAGS_dst_index_file;
+  op.cache_size = FLAGS_cache_size;
+  op.disk_cache_dir = FLAGS_disk_cache_dir;
+  op.disk_cache_size = FLAGS_disk_cache_size;
+  TEST_AND_RETURN_FALSE(ParsePuffFormat(FLAGS_puff_format, &op.puff_format));
+  // The operations of a manifest already run in parallel.
+  op.threads = FLAGS_manifest.empty() ? FLAGS_threads : 1;
+  op.zip_entries = FLAGS_zip_entries;
+  op.map_puffs = FLAGS_map_puffs;
+  op.verbose = FLAGS_verbose;
+  if (!FLAGS_trace_file.empty()) {
+    puffin::StartTracing();
+  }
+  bool success;
+  if (!FLAGS_manifest.empty()) {
+    // The flags given on the command line are the defaults of all the
+    // operations in the manifest.
+    success = RunBatch(FLAGS_manifest, FLAGS_threads, op);
+  } else {
+    success = RunOperation(op);
+  }
+  if (!FLAGS_trace_file.empty()) {
+    // The trace of a failed run is written too, it might show why it failed.
+    TEST_AND_RETURN_FALSE(puffin::StopTracing(FLAGS_trace_file));
+  }
+  return success;
+}
+
 int main(int argc, char** argv) {
   if (!Main(argc, argv)) {
     return 1;
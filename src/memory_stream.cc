@@ -75,4 +75,15 @@ bool MemoryStream::Close() {
   return true;
 }
 
+bool MemoryStream::GetData(uint64_t offset,
+                           uint64_t length,
+                           const uint8_t** data) const {
+  if (!open_ || read_memory_ == nullptr ||
+      offset + length > read_memory_->size()) {
+    return false;
+  }
+  *data = read_memory_->data() + offset;
+  return true;
+}
+
 }  // namespace puffin
@@ -32,6 +32,9 @@ class MemoryStream : public StreamInterface {
   bool Read(void* buffer, size_t length) override;
   bool Write(const void* buffer, size_t length) override;
   bool Close() override;
+  bool GetData(uint64_t offset,
+               uint64_t length,
+               const uint8_t** data) const override;
 
  private:
   // Ctor. Exactly one of the |read_memory| or |write_memory| should be nullptr.
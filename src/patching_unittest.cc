@@ -2,12 +2,15 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <glob.h>
+
 #include <string>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
 #include "puffin/src/include/puffin/puffdiff.h"
 #include "puffin/src/include/puffin/puffpatch.h"
 #include "puffin/src/include/puffin/utils.h"
@@ -176,6 +179,181 @@ TEST(PatchingTest, Patching1ToNoDeflateTest) {
                kSubblockDeflateExtentsSample1, {}, kPatch1ToNoDeflate);
 }
 
+TEST(PatchingTest, PuffDiffReportTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  const vector<bsdiff::CompressorType> compressors = {
+      bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
+
+  Buffer patch, patch_with_report;
+  ASSERT_TRUE(PuffDiff(kDeflatesSample1, kDeflatesSample2,
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2, compressors, patch_path,
+                       &patch));
+  PuffDiffReport report;
+  ASSERT_TRUE(PuffDiff(kDeflatesSample1, kDeflatesSample2,
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2, compressors, patch_path,
+                       &patch_with_report, &report));
+  // Asking for a report should not change the patch.
+  EXPECT_EQ(patch_with_report, patch);
+
+  EXPECT_EQ(report.src_deflates, kSubblockDeflateExtentsSample1.size());
+  EXPECT_EQ(report.dst_deflates, kSubblockDeflateExtentsSample2.size());
+  EXPECT_EQ(report.src_puff_size, kPuffsSample1.size());
+  EXPECT_EQ(report.dst_puff_size, kPuffsSample2.size());
+  EXPECT_EQ(report.patch_size, patch.size());
+  EXPECT_EQ(report.header_size + report.bsdiff_patch_size + kMagicLength + 4,
+            patch.size());
+  ASSERT_EQ(report.compressor_time_ns.size(), compressors.size());
+  for (size_t idx = 0; idx < compressors.size(); idx++) {
+    EXPECT_EQ(report.compressor_time_ns[idx].first, compressors[idx]);
+  }
+}
+
+// Tests that keeping the puff streams in mapped files does not change the patch
+// and that the files are removed.
+TEST(PatchingTest, PuffDiffMapPuffsTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+
+  Buffer patch, mapped_patch;
+  ASSERT_TRUE(PuffDiff(kDeflatesSample1, kDeflatesSample2,
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2,
+                       {bsdiff::CompressorType::kBZ2}, patch_path, &patch));
+  PuffDiffReport report;
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(kDeflatesSample1),
+                       MemoryStream::CreateForRead(kDeflatesSample2),
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2,
+                       {bsdiff::CompressorType::kBZ2}, patch_path,
+                       &mapped_patch, &report, PuffFormat::kV1, 1, nullptr,
+                       true));
+  EXPECT_EQ(mapped_patch, patch);
+  EXPECT_EQ(report.src_puff_size, kPuffsSample1.size());
+  EXPECT_EQ(report.dst_puff_size, kPuffsSample2.size());
+  glob_t files;
+  EXPECT_EQ(glob((patch_path + ".*_puff*").c_str(), 0, nullptr, &files),
+            GLOB_NOMATCH);
+  globfree(&files);
+
+  // Empty puff streams are not mapped.
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(Buffer()),
+                       MemoryStream::CreateForRead(kDeflatesSample2), {},
+                       kSubblockDeflateExtentsSample2,
+                       {bsdiff::CompressorType::kBZ2}, patch_path,
+                       &mapped_patch, nullptr, PuffFormat::kV1, 1, nullptr,
+                       true));
+  Buffer dst_buf(kDeflatesSample2.size());
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(Buffer()),
+                        MemoryStream::CreateForWrite(&dst_buf),
+                        mapped_patch.data(), mapped_patch.size()));
+  EXPECT_EQ(dst_buf, kDeflatesSample2);
+}
+
+// Tests that a patch with the puff streams in |PuffFormat::kV2| has version 2
+// and is applied with the same format.
+TEST(PatchingTest, PuffFormatV2Test) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+
+  Buffer patch;
+  ASSERT_TRUE(PuffDiff(kDeflatesSample1, kDeflatesSample2,
+                       kSubblockDeflateExtentsSample1,
+                       kSubblockDeflateExtentsSample2,
+                       {bsdiff::CompressorType::kBZ2}, patch_path, &patch,
+                       nullptr, PuffFormat::kV2));
+  // The version is the first field of the header, right after its size.
+  ASSERT_GT(patch.size(), kMagicLength + 6);
+  EXPECT_EQ(patch[kMagicLength + 4], 0x08);
+  EXPECT_EQ(patch[kMagicLength + 5], 0x02);
+
+  Buffer dst_buf(kDeflatesSample2.size());
+  ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(kDeflatesSample1),
+                        MemoryStream::CreateForWrite(&dst_buf), patch.data(),
+                        patch.size()));
+  EXPECT_EQ(dst_buf, kDeflatesSample2);
+
+  // Unknown versions are rejected.
+  patch[kMagicLength + 5] = 0x04;
+  EXPECT_FALSE(PuffPatch(MemoryStream::CreateForRead(kDeflatesSample1),
+                         MemoryStream::CreateForWrite(&dst_buf), patch.data(),
+                         patch.size()));
+}
+
+// Tests that the entries of zip archives are diffed separately, including
+// moved, added and removed entries, and that anything else falls back to a
+// plain patch.
+TEST(PatchingTest, PuffDiffZipArchiveTest) {
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+
+  Buffer deflate1, deflate2, deflate3, puff;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(2, 500, &deflate1, &puff));
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(3, 400, &deflate2, &puff));
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(1, 700, &deflate3, &puff));
+  Buffer src_zip, dst_zip;
+  MakeZipArchive({{"a", deflate1}, {"b", deflate2}, {"c", deflate3}}, &src_zip);
+  MakeZipArchive({{"b", deflate3}, {"a", deflate1}, {"d", deflate2}}, &dst_zip);
+
+  auto create_index = [](const Buffer& zip, DeflateIndex* index) {
+    vector<BitExtent> deflates;
+    ASSERT_TRUE(LocateDeflatesInZipArchive(zip, &deflates));
+    ASSERT_FALSE(deflates.empty());
+    ASSERT_TRUE(
+        CreateDeflateIndex(MemoryStream::CreateForRead(zip), deflates, index));
+  };
+  DeflateIndex src_index, dst_index;
+  create_index(src_zip, &src_index);
+  create_index(dst_zip, &dst_index);
+
+  for (size_t num_threads : {1, 2}) {
+    Buffer patch;
+    ASSERT_TRUE(PuffDiffZipArchive(
+        MemoryStream::CreateForRead(src_zip),
+        MemoryStream::CreateForRead(dst_zip), src_index, dst_index,
+        {bsdiff::CompressorType::kBZ2}, patch_path, &patch, PuffFormat::kV1,
+        num_threads));
+    Buffer dst_buf(dst_zip.size());
+    ASSERT_TRUE(PuffPatch(MemoryStream::CreateForRead(src_zip),
+                          MemoryStream::CreateForWrite(&dst_buf), patch.data(),
+                          patch.size()));
+    EXPECT_EQ(dst_buf, dst_zip);
+
+    // A patch of parts has its own version, and it is refused under the
+    // version of a plain patch.
+    ASSERT_GT(patch.size(), kMagicLength + 6);
+    EXPECT_EQ(patch[kMagicLength + 4], 0x08);
+    EXPECT_EQ(patch[kMagicLength + 5], kPartsPatchVersion);
+    patch[kMagicLength + 5] = static_cast<uint8_t>(PuffFormat::kV1);
+    EXPECT_FALSE(PuffPatch(MemoryStream::CreateForRead(src_zip),
+                           MemoryStream::CreateForWrite(&dst_buf),
+                           patch.data(), patch.size()));
+  }
+
+  DeflateIndex index1, index2;
+  ASSERT_TRUE(CreateDeflateIndex(MemoryStream::CreateForRead(kDeflatesSample1),
+                                 kSubblockDeflateExtentsSample1, &index1));
+  ASSERT_TRUE(CreateDeflateIndex(MemoryStream::CreateForRead(kDeflatesSample2),
+                                 kSubblockDeflateExtentsSample2, &index2));
+  Buffer patch, zip_patch;
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(kDeflatesSample1),
+                       MemoryStream::CreateForRead(kDeflatesSample2), index1,
+                       index2, {bsdiff::CompressorType::kBZ2}, patch_path,
+                       &patch));
+  ASSERT_TRUE(PuffDiffZipArchive(MemoryStream::CreateForRead(kDeflatesSample1),
+                                 MemoryStream::CreateForRead(kDeflatesSample2),
+                                 index1, index2,
+                                 {bsdiff::CompressorType::kBZ2}, patch_path,
+                                 &zip_patch));
+  EXPECT_EQ(zip_patch, patch);
+}
+
 // TODO(ahassani): add tests for:
 //   TestPatchingEmptyTo2
 //   TestPatchingNoDeflateTo2
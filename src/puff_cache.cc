@@ -0,0 +1,322 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/puff_cache.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "puffin/src/content_hasher.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/trace_event.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+const char kEntryMagic[] = "PFPC";
+const size_t kEntryMagicLength = 4;
+const uint32_t kEntryVersion = 1;
+
+// entry file format
+// 0      4     "PFPC"
+// 4      4     version
+// 8      8     key
+// 16     8     puff size
+// 24     8     hash of the puff
+// 32     n     puff
+// The numbers are little-endian.
+const size_t kEntryHeaderSize = 32;
+
+// The prefix of the files the entries are written into before they are
+// renamed. The ones left behind by a crashed process are removed once they are
+// older than |kMaxTempFileAge|.
+const char kTempFilePrefix[] = ".tmp-";
+const time_t kMaxTempFileAge = 24 * 60 * 60;  // 1 day
+
+// Once the entries add up to more than the size of the cache, they are evicted
+// until they fill at most this much of it, so not every new entry needs a scan
+// of the directory.
+const uint64_t kEvictPercent = 90;
+
+void PutUint(uint64_t value, size_t size, uint8_t* data) {
+  for (size_t idx = 0; idx < size; idx++, value >>= 8) {
+    data[idx] = value & 0xFF;
+  }
+}
+
+uint64_t GetUint(const uint8_t* data, size_t size) {
+  uint64_t value = 0;
+  for (size_t idx = 0; idx < size; idx++) {
+    value |= static_cast<uint64_t>(data[idx]) << (idx * 8);
+  }
+  return value;
+}
+
+uint64_t HashPuff(const uint8_t* puff, uint64_t puff_size) {
+  ContentHasher hasher;
+  hasher.Update(puff, puff_size);
+  return hasher.Final();
+}
+
+bool ReadAt(int fd, uint64_t offset, uint8_t* data, uint64_t length) {
+  while (length > 0) {
+    auto count = pread(fd, data, length, offset);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(count > 0);
+    data += count;
+    offset += count;
+    length -= count;
+  }
+  return true;
+}
+
+bool WriteAll(int fd, const uint8_t* data, uint64_t length) {
+  while (length > 0) {
+    auto count = write(fd, data, length);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(count > 0);
+    data += count;
+    length -= count;
+  }
+  return true;
+}
+
+// Returns true if |name| is the name of an entry: the key in 16 hexadecimal
+// digits.
+bool IsEntryName(const char* name) {
+  size_t length = 0;
+  for (; name[length] != '\0'; length++) {
+    if (!isxdigit(name[length])) {
+      return false;
+    }
+  }
+  return length == 16;
+}
+
+class DiskPuffCache : public PuffCacheInterface {
+ public:
+  DiskPuffCache(const string& path, uint64_t max_size)
+      : path_(path), max_size_(max_size), size_(0) {}
+  ~DiskPuffCache() override = default;
+
+  // Finds the size of the entries already in the directory and evicts some if
+  // there are too many.
+  bool Init() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return Evict();
+  }
+
+  bool Get(uint64_t key, uint8_t* puff, uint64_t puff_size) override {
+    auto path = GetEntryPath(key);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    TRACE_EVENT1("cache", "GetPuffCache", "puff_size", puff_size);
+    uint8_t header[kEntryHeaderSize];
+    bool found = ReadAt(fd, 0, header, kEntryHeaderSize) &&
+                 memcmp(header, kEntryMagic, kEntryMagicLength) == 0 &&
+                 GetUint(header + 4, 4) == kEntryVersion &&
+                 GetUint(header + 8, 8) == key &&
+                 GetUint(header + 16, 8) == puff_size &&
+                 ReadAt(fd, kEntryHeaderSize, puff, puff_size) &&
+                 GetUint(header + 24, 8) == HashPuff(puff, puff_size);
+    if (found) {
+      // The modification time is the last use, for evicting.
+      futimens(fd, nullptr);
+    }
+    close(fd);
+    if (!found) {
+      // A truncated or otherwise broken entry is replaced by the next |Put|.
+      LOG(WARNING) << "Ignoring the invalid puff cache entry " << path;
+      unlink(path.c_str());
+    }
+    return found;
+  }
+
+  bool Put(uint64_t key, const uint8_t* puff, uint64_t puff_size) override {
+    uint64_t entry_size = kEntryHeaderSize + puff_size;
+    if (entry_size > max_size_) {
+      return false;
+    }
+    TRACE_EVENT1("cache", "PutPuffCache", "puff_size", puff_size);
+    uint8_t header[kEntryHeaderSize];
+    memcpy(header, kEntryMagic, kEntryMagicLength);
+    PutUint(kEntryVersion, 4, header + 4);
+    PutUint(key, 8, header + 8);
+    PutUint(puff_size, 8, header + 16);
+    PutUint(HashPuff(puff, puff_size), 8, header + 24);
+
+    auto temp_path = path_ + "/" + kTempFilePrefix + "XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    TEST_AND_RETURN_FALSE(fd >= 0);
+    // |mkstemp| creates the file only readable by its owner, but the other
+    // users of the directory may run as other users.
+    bool written = fchmod(fd, 0644) == 0 &&
+                   WriteAll(fd, header, kEntryHeaderSize) &&
+                   WriteAll(fd, puff, puff_size);
+    written = close(fd) == 0 && written;
+    // Renaming replaces the entry atomically if another process added it
+    // meanwhile.
+    auto path = GetEntryPath(key);
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+      LOG(ERROR) << "Failed to add the puff cache entry " << path;
+      unlink(temp_path.c_str());
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_ += entry_size;
+    if (size_ > max_size_) {
+      TEST_AND_RETURN_FALSE(Evict());
+    }
+    return true;
+  }
+
+ private:
+  string GetEntryPath(uint64_t key) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016" PRIx64, key);
+    return path_ + "/" + name;
+  }
+
+  // Removes the least recently used entries until they fill at most
+  // |kEvictPercent| of the cache, and updates |size_|. Other processes may add
+  // or remove entries at the same time, so a missing file is not an error.
+  // |mutex_| must be held.
+  bool Evict() {
+    TRACE_EVENT0("cache", "EvictPuffCache");
+    struct Entry {
+      string path;
+      uint64_t size;
+      struct timespec mtime;
+    };
+    vector<Entry> entries;
+    uint64_t total_size = 0;
+    auto now = time(nullptr);
+    DIR* dir = opendir(path_.c_str());
+    TEST_AND_RETURN_FALSE(dir != nullptr);
+    while (auto dirent = readdir(dir)) {
+      bool is_temp = strncmp(dirent->d_name, kTempFilePrefix,
+                             strlen(kTempFilePrefix)) == 0;
+      if (!is_temp && !IsEntryName(dirent->d_name)) {
+        continue;
+      }
+      auto path = path_ + "/" + dirent->d_name;
+      struct stat st;
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      if (is_temp) {
+        if (now - st.st_mtime > kMaxTempFileAge) {
+          unlink(path.c_str());
+        }
+        continue;
+      }
+      entries.push_back({path, static_cast<uint64_t>(st.st_size), st.st_mtim});
+      total_size += st.st_size;
+    }
+    closedir(dir);
+
+    auto target_size = max_size_ / 100 * kEvictPercent;
+    if (total_size > max_size_) {
+      std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) {
+                  return a.mtime.tv_sec != b.mtime.tv_sec
+                             ? a.mtime.tv_sec < b.mtime.tv_sec
+                             : a.mtime.tv_nsec < b.mtime.tv_nsec;
+                });
+      for (const auto& entry : entries) {
+        if (total_size <= target_size) {
+          break;
+        }
+        if (unlink(entry.path.c_str()) == 0 || errno == ENOENT) {
+          total_size -= entry.size;
+        }
+      }
+    }
+    size_ = total_size;
+    return true;
+  }
+
+  string path_;
+  uint64_t max_size_;
+
+  // Protects |size_|, the size of the entries in the directory as far as this
+  // process knows.
+  std::mutex mutex_;
+  uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(DiskPuffCache);
+};
+
+}  // namespace
+
+uint64_t ComputePuffCacheKey(const uint8_t* deflate,
+                             uint64_t start_bits,
+                             uint64_t length,
+                             uint64_t puff_size,
+                             PuffFormat format) {
+  uint8_t fields[32];
+  PutUint(start_bits, 8, fields);
+  PutUint(length, 8, fields + 8);
+  PutUint(puff_size, 8, fields + 16);
+  PutUint(static_cast<uint64_t>(format), 8, fields + 24);
+  ContentHasher hasher;
+  hasher.Update(fields, sizeof(fields));
+
+  // The bits of the first and last bytes that are not part of the deflate are
+  // masked off.
+  auto num_bytes = (start_bits + length + 7) / 8;
+  auto end_bits = (start_bits + length) & 7;
+  uint8_t last_byte_mask = end_bits ? (1 << end_bits) - 1 : 0xFF;
+  uint8_t first_byte = deflate[0] & (0xFF << start_bits);
+  if (num_bytes == 1) {
+    first_byte &= last_byte_mask;
+  }
+  hasher.Update(&first_byte, 1);
+  if (num_bytes > 1) {
+    hasher.Update(deflate + 1, num_bytes - 2);
+    uint8_t last_byte = deflate[num_bytes - 1] & last_byte_mask;
+    hasher.Update(&last_byte, 1);
+  }
+  return hasher.Final();
+}
+
+std::shared_ptr<PuffCacheInterface> CreateDiskPuffCache(const string& path,
+                                                        uint64_t max_size) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    LOG(ERROR) << "Failed to create the puff cache directory " << path;
+    return nullptr;
+  }
+  auto cache = std::make_shared<DiskPuffCache>(path, max_size);
+  TEST_AND_RETURN_VALUE(cache->Init(), nullptr);
+  return cache;
+}
+
+}  // namespace puffin
@@ -0,0 +1,244 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
+#include "puffin/src/include/puffin/puff_cache.h"
+#include "puffin/src/include/puffin/puffdiff.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/memory_stream.h"
+#include "puffin/src/puffin_stream.h"
+#include "puffin/src/unittest_common.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+// Makes a temporary directory for a cache and removes it with its files when
+// it goes out of scope.
+class ScopedCacheDir {
+ public:
+  ScopedCacheDir() {
+    char path[] = "/tmp/puffin-cache-XXXXXX";
+    if (mkdtemp(path) != nullptr) {
+      path_ = path;
+    }
+  }
+  ~ScopedCacheDir() {
+    for (const auto& name : List()) {
+      unlink((path_ + "/" + name).c_str());
+    }
+    rmdir(path_.c_str());
+  }
+
+  const string& path() const { return path_; }
+
+  // Returns the names of the files in the directory.
+  vector<string> List() const {
+    vector<string> names;
+    DIR* dir = opendir(path_.c_str());
+    if (dir == nullptr) {
+      return names;
+    }
+    while (auto dirent = readdir(dir)) {
+      if (dirent->d_name[0] != '.') {
+        names.push_back(dirent->d_name);
+      }
+    }
+    closedir(dir);
+    return names;
+  }
+
+  // Returns the path of the file of |key|.
+  string GetEntryPath(uint64_t key) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016" PRIx64, key);
+    return path_ + "/" + name;
+  }
+
+ private:
+  string path_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedCacheDir);
+};
+
+// Sets the modification time of |path| to |seconds| after the epoch.
+void SetModificationTime(const string& path, time_t seconds) {
+  struct timespec times[2] = {{seconds, 0}, {seconds, 0}};
+  ASSERT_EQ(utimensat(AT_FDCWD, path.c_str(), times, 0), 0);
+}
+
+}  // namespace
+
+TEST(PuffCacheTest, ComputePuffCacheKeyTest) {
+  const uint8_t deflate[] = {0xA5, 0x12, 0x34, 0x5A};
+  // Bits 3 to 28.
+  auto key = ComputePuffCacheKey(deflate, 3, 26, 100, PuffFormat::kV1);
+  // The bits outside the deflate do not matter.
+  const uint8_t other_bits[] = {0xA4, 0x12, 0x34, 0xFA};
+  EXPECT_EQ(ComputePuffCacheKey(other_bits, 3, 26, 100, PuffFormat::kV1), key);
+
+  // But every bit of the deflate and everything the puff depends on does.
+  const uint8_t changed[] = {0xAD, 0x12, 0x34, 0x5A};
+  EXPECT_NE(ComputePuffCacheKey(changed, 3, 26, 100, PuffFormat::kV1), key);
+  EXPECT_NE(ComputePuffCacheKey(deflate, 3, 27, 100, PuffFormat::kV1), key);
+  EXPECT_NE(ComputePuffCacheKey(deflate, 3, 26, 101, PuffFormat::kV1), key);
+  EXPECT_NE(ComputePuffCacheKey(deflate, 3, 26, 100, PuffFormat::kV2), key);
+
+  // A deflate within one byte.
+  EXPECT_EQ(ComputePuffCacheKey(deflate, 1, 3, 10, PuffFormat::kV1),
+            ComputePuffCacheKey(other_bits, 1, 3, 10, PuffFormat::kV1));
+}
+
+TEST(PuffCacheTest, GetAndPutTest) {
+  ScopedCacheDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  auto cache = CreateDiskPuffCache(dir.path(), 1024 * 1024);
+  ASSERT_TRUE(cache);
+
+  Buffer puff(1000), read_puff(1000);
+  for (size_t idx = 0; idx < puff.size(); idx++) {
+    puff[idx] = idx * 7;
+  }
+  EXPECT_FALSE(cache->Get(1, read_puff.data(), read_puff.size()));
+  ASSERT_TRUE(cache->Put(1, puff.data(), puff.size()));
+  ASSERT_TRUE(cache->Get(1, read_puff.data(), read_puff.size()));
+  EXPECT_EQ(read_puff, puff);
+  // Only the entry is left in the directory, and other users can read it.
+  EXPECT_EQ(dir.List().size(), 1u);
+  struct stat st;
+  ASSERT_EQ(stat(dir.GetEntryPath(1).c_str(), &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644u);
+
+  // Another cache in the same directory sees the entry.
+  auto other_cache = CreateDiskPuffCache(dir.path(), 1024 * 1024);
+  ASSERT_TRUE(other_cache);
+  read_puff.assign(read_puff.size(), 0);
+  ASSERT_TRUE(other_cache->Get(1, read_puff.data(), read_puff.size()));
+  EXPECT_EQ(read_puff, puff);
+
+  // A different size is a miss.
+  Buffer short_puff(999);
+  EXPECT_FALSE(cache->Get(1, short_puff.data(), short_puff.size()));
+
+  // A broken entry is a miss, and it is removed.
+  ASSERT_TRUE(cache->Put(2, puff.data(), puff.size()));
+  auto path = dir.GetEntryPath(2);
+  auto file = fopen(path.c_str(), "r+");
+  ASSERT_NE(file, nullptr);
+  ASSERT_EQ(fseek(file, 500, SEEK_SET), 0);
+  ASSERT_NE(fputc(0xFF, file), EOF);
+  ASSERT_EQ(fclose(file), 0);
+  EXPECT_FALSE(cache->Get(2, read_puff.data(), read_puff.size()));
+  EXPECT_NE(access(path.c_str(), F_OK), 0);
+
+  // Puffs larger than the cache are not added.
+  Buffer large_puff(2 * 1024 * 1024);
+  EXPECT_FALSE(cache->Put(3, large_puff.data(), large_puff.size()));
+}
+
+TEST(PuffCacheTest, EvictTest) {
+  ScopedCacheDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  // Room for three entries of 1000 bytes (and their headers).
+  auto cache = CreateDiskPuffCache(dir.path(), 3500);
+  ASSERT_TRUE(cache);
+
+  Buffer puff(1000, 1), read_puff(1000);
+  for (uint64_t key = 1; key <= 3; key++) {
+    ASSERT_TRUE(cache->Put(key, puff.data(), puff.size()));
+    SetModificationTime(dir.GetEntryPath(key), key * 100);
+  }
+  // Reading the first one makes it the most recently used.
+  ASSERT_TRUE(cache->Get(1, read_puff.data(), read_puff.size()));
+
+  ASSERT_TRUE(cache->Put(4, puff.data(), puff.size()));
+  EXPECT_EQ(dir.List().size(), 3u);
+  EXPECT_FALSE(cache->Get(2, read_puff.data(), read_puff.size()));
+  for (uint64_t key : {1, 3, 4}) {
+    EXPECT_TRUE(cache->Get(key, read_puff.data(), read_puff.size()));
+  }
+
+  // A smaller cache evicts the entries it does not have room for right away.
+  ASSERT_TRUE(CreateDiskPuffCache(dir.path(), 2000));
+  EXPECT_EQ(dir.List().size(), 1u);
+}
+
+// Tests that |PuffinStream| reads the puffs in the cache instead of puffing
+// them, and that they are the same.
+TEST(PuffCacheTest, PuffinStreamTest) {
+  ScopedCacheDir dir;
+  ASSERT_FALSE(dir.path().empty());
+  auto cache = CreateDiskPuffCache(dir.path(), 64 * 1024 * 1024);
+  ASSERT_TRUE(cache);
+
+  Buffer deflate, puff, zip;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(3, 20000, &deflate, &puff));
+  MakeZipArchive({{"a", deflate}}, &zip);
+  vector<BitExtent> deflates;
+  ASSERT_TRUE(LocateDeflatesInZipArchive(zip, &deflates));
+  DeflateIndex index;
+  ASSERT_TRUE(
+      CreateDeflateIndex(MemoryStream::CreateForRead(zip), deflates, &index));
+  uint64_t cached_puffs = 0;
+  for (const auto& puff_extent : index.puffs) {
+    cached_puffs += puff_extent.length >= kMinCachedPuffSize;
+  }
+  ASSERT_GT(cached_puffs, 0u);
+
+  auto puffer = std::make_shared<Puffer>();
+  auto read_puffs = [&](size_t num_threads, Buffer* puff_buffer) {
+    auto stream = PuffinStream::CreateForPuff(
+        MemoryStream::CreateForRead(zip), puffer, index.puff_size,
+        index.deflates, index.puffs, 0, nullptr, PuffFormat::kV1, num_threads,
+        cache);
+    EXPECT_TRUE(stream);
+    puff_buffer->resize(index.puff_size);
+    EXPECT_TRUE(stream->Read(puff_buffer->data(), puff_buffer->size()));
+    return static_cast<PuffinStream*>(stream.get())->GetStats();
+  };
+
+  Buffer expected_puffs, puffs;
+  auto stats = read_puffs(1, &expected_puffs);
+  EXPECT_EQ(stats.puff_cache_hits, 0u);
+  EXPECT_EQ(stats.deflates_puffed, index.deflates.size());
+  EXPECT_EQ(dir.List().size(), cached_puffs);
+
+  for (size_t num_threads : {1, 2}) {
+    stats = read_puffs(num_threads, &puffs);
+    EXPECT_EQ(stats.puff_cache_hits, cached_puffs);
+    EXPECT_EQ(stats.deflates_puffed, index.deflates.size() - cached_puffs);
+    EXPECT_EQ(puffs, expected_puffs);
+  }
+
+  // |PuffDiff| reads them from the cache too.
+  string patch_path;
+  ASSERT_TRUE(MakeTempFile(&patch_path, nullptr));
+  ScopedPathUnlinker scoped_unlinker(patch_path);
+  Buffer patch;
+  PuffDiffReport report;
+  ASSERT_TRUE(PuffDiff(MemoryStream::CreateForRead(zip),
+                       MemoryStream::CreateForRead(zip), index, index,
+                       {bsdiff::CompressorType::kBZ2}, patch_path, &patch,
+                       &report, PuffFormat::kV1, 1, cache));
+  EXPECT_EQ(report.puff_cache_hits, 2 * cached_puffs);
+}
+
+}  // namespace puffin
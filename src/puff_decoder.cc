@@ -0,0 +1,107 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/puff_decoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "puffin/src/logging.h"
+
+using std::unique_ptr;
+
+namespace puffin {
+
+namespace {
+
+// The number of symbols puffed at once when more bytes are needed.
+constexpr size_t kMaxStepSymbols = 4096;
+
+// The most bytes puffing |kMaxStepSymbols| symbols or one block header can add
+// to the buffer (besides the literals kept until the end of the block): 8
+// bytes per symbol is more than a length/distance pair with the header of the
+// literals before it, and a stored block has at most 64 KB.
+constexpr size_t kMaxStepSize = 8 * kMaxStepSymbols + (1 << 16) + 512;
+
+}  // namespace
+
+unique_ptr<PuffDecoder> PuffDecoder::Create(const Puffer* puffer,
+                                            const uint8_t* deflate,
+                                            size_t length,
+                                            size_t start_bits,
+                                            size_t puff_size,
+                                            PuffFormat format) {
+  TEST_AND_RETURN_VALUE(start_bits < 8, nullptr);
+  unique_ptr<PuffDecoder> decoder(
+      new PuffDecoder(puffer, deflate, length, puff_size, format));
+  // Drop the first unused bits.
+  TEST_AND_RETURN_VALUE(decoder->bit_reader_.CacheBits(start_bits), nullptr);
+  decoder->bit_reader_.DropBits(start_bits);
+  return decoder;
+}
+
+PuffDecoder::PuffDecoder(const Puffer* puffer,
+                         const uint8_t* deflate,
+                         size_t length,
+                         size_t puff_size,
+                         PuffFormat format)
+    : puffer_(puffer),
+      length_(length),
+      puff_size_(puff_size),
+      bit_reader_(deflate, length),
+      state_(&dyn_ht_),
+      buffer_offset_(0),
+      puff_writer_(nullptr, 0, format),
+      offset_(0) {}
+
+bool PuffDecoder::Read(uint8_t* buffer, size_t count) {
+  TEST_AND_RETURN_FALSE(offset_ + count <= puff_size_);
+  while (count > 0) {
+    if (buffer_offset_ == puff_writer_.CompleteSize()) {
+      TEST_AND_RETURN_FALSE(PuffMore());
+      continue;
+    }
+    auto length =
+        std::min(count, puff_writer_.CompleteSize() - buffer_offset_);
+    if (buffer != nullptr) {
+      memcpy(buffer, buffer_.data() + buffer_offset_, length);
+      buffer += length;
+    }
+    buffer_offset_ += length;
+    offset_ += length;
+    count -= length;
+  }
+  return true;
+}
+
+bool PuffDecoder::PuffMore() {
+  // The puff was shorter than expected.
+  TEST_AND_RETURN_FALSE(!state_.done);
+
+  // Drop the bytes already read and make room for the next symbols.
+  auto size = puff_writer_.Size() - buffer_offset_;
+  if (buffer_offset_ > 0 && size > 0) {
+    memmove(buffer_.data(), buffer_.data() + buffer_offset_, size);
+  }
+  auto min_size = size + puff_writer_.PendingSize() + kMaxStepSize;
+  if (buffer_.size() < min_size) {
+    buffer_.resize(min_size);
+  }
+  puff_writer_.MoveBuffer(buffer_.data(), buffer_.size(), buffer_offset_);
+  buffer_offset_ = 0;
+
+  TEST_AND_RETURN_FALSE(puffer_->PuffBlocks(&bit_reader_, &puff_writer_,
+                                            nullptr, nullptr, &state_,
+                                            kMaxStepSymbols));
+  if (state_.done) {
+    TEST_AND_RETURN_FALSE(puff_writer_.Flush());
+    TEST_AND_RETURN_FALSE(bit_reader_.Offset() == length_);
+    TEST_AND_RETURN_FALSE(offset_ + puff_writer_.Size() == puff_size_);
+  }
+  return true;
+}
+
+}  // namespace puffin
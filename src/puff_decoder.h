@@ -0,0 +1,115 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_PUFF_DECODER_H_
+#define SRC_PUFF_DECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/huffman_table.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/puff_writer.h"
+
+namespace puffin {
+
+// The state of |Puffer| between the pieces of a deflate it puffs. Everything
+// that only lives during one symbol stays on the stack of |Puffer|.
+struct PuffState {
+  explicit PuffState(HuffmanTable* dyn_ht) : dyn_ht(dyn_ht) {}
+
+  // The table the Huffman codes of a dynamic block are built in, and the
+  // table of the current block.
+  HuffmanTable* dyn_ht;
+  const HuffmanTable* cur_ht = nullptr;
+
+  // True while inside a fixed or dynamic block, after its header.
+  bool in_block = false;
+  // True after the last block has been puffed.
+  bool done = false;
+  // True once the final block has been seen while looking for deflates.
+  bool end_loop = false;
+
+  // The offset of the current block in the deflate.
+  uint64_t start_bit_offset = 0;
+  // Whether the current block is added to the list of deflates.
+  bool include_deflate = true;
+
+  // The statistics of the current block. See |PuffStats|.
+  uint64_t literals = 0;
+  uint64_t matches = 0;
+  uint64_t match_length_sum = 0;
+  uint64_t match_distance_sum = 0;
+};
+
+// Puffs a deflate in pieces. Each call to |Read| only puffs as much of the
+// deflate as the requested bytes need, and the next call continues where the
+// previous one stopped. So the start of a large puff can be read without
+// puffing the whole deflate, and the puff never needs to be in memory at
+// once: only the bytes that can still change (like the header of a run of
+// literals) and the ones past the last read are kept.
+class PuffDecoder {
+ public:
+  ~PuffDecoder() = default;
+
+  // |puffer|     IN  Puffs the deflate. It must be valid during the lifetime of
+  //                  the returned object.
+  // |deflate|    IN  The bytes of the deflate, from the one with its first bit
+  //                  to the one with its last bit. They must be valid during
+  //                  the lifetime of the returned object.
+  // |length|     IN  The number of bytes in |deflate|.
+  // |start_bits| IN  The number of bits before the deflate in its first byte.
+  // |puff_size|  IN  The size of the puff.
+  // |format|     IN  The layout of the puff.
+  static std::unique_ptr<PuffDecoder> Create(const Puffer* puffer,
+                                             const uint8_t* deflate,
+                                             size_t length,
+                                             size_t start_bits,
+                                             size_t puff_size,
+                                             PuffFormat format);
+
+  // Puffs the next |count| bytes of the puff into |buffer|, or skips them if
+  // |buffer| is null.
+  bool Read(uint8_t* buffer, size_t count);
+
+  // Returns the number of bytes of the puff read or skipped so far.
+  size_t Offset() const { return offset_; }
+
+ private:
+  PuffDecoder(const Puffer* puffer,
+              const uint8_t* deflate,
+              size_t length,
+              size_t puff_size,
+              PuffFormat format);
+
+  // Puffs the next symbols of the deflate into |buffer_|, after dropping the
+  // bytes already read.
+  bool PuffMore();
+
+  const Puffer* puffer_;
+  size_t length_;
+  size_t puff_size_;
+
+  BufferBitReader bit_reader_;
+  HuffmanTable dyn_ht_;
+  PuffState state_;
+
+  // The puffed bytes which have not been read yet start at |buffer_offset_|
+  // of |buffer_|. The first byte of |buffer_| is at |offset_ - buffer_offset_|
+  // of the puff.
+  Buffer buffer_;
+  size_t buffer_offset_;
+  BufferPuffWriter puff_writer_;
+
+  size_t offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffDecoder);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_PUFF_DECODER_H_
@@ -43,6 +43,11 @@ bool BufferPuffReader::GetNext(PuffData* data) {
       // End of block. End of block is similar to length/distance but without
       // distance value and length value set to 259.
       if (length == 259) {
+        if (format_ == PuffFormat::kV2) {
+          // All the literals of the block must have been read.
+          TEST_AND_RETURN_FALSE(literals_index_ == block_end_);
+          index_ = block_end_;
+        }
         pd.type = PuffData::Type::kEndOfBlock;
         state_ = State::kReadingBlockMetadata;
         DVLOG(2) << "Read end of block";
@@ -78,14 +83,24 @@ bool BufferPuffReader::GetNext(PuffData* data) {
       }
       length++;
       DVLOG(2) << "Read literals length: " << length;
-      // Boundary check
-      TEST_AND_RETURN_FALSE(index_ + length <= puff_size_);
+      // The literals follow their length in |PuffFormat::kV1|, but they are
+      // after the end of block in |PuffFormat::kV2|.
+      size_t* literals_index = &index_;
+      if (format_ == PuffFormat::kV2) {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(literals_index_ + length <= block_end_);
+        literals_index = &literals_index_;
+      } else {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(index_ + length <= puff_size_);
+      }
       pd.type = PuffData::Type::kLiterals;
       pd.length = length;
-      pd.read_fn = [this, length](uint8_t* buffer, size_t count) mutable {
+      pd.read_fn = [this, literals_index, length](uint8_t* buffer,
+                                                  size_t count) mutable {
         TEST_AND_RETURN_FALSE(count <= length);
-        memcpy(buffer, &puff_buf_in_[index_], count);
-        index_ += count;
+        memcpy(buffer, &puff_buf_in_[*literals_index], count);
+        *literals_index += count;
         length -= count;
         return true;
       };
@@ -105,7 +120,47 @@ bool BufferPuffReader::GetNext(PuffData* data) {
     index_ += length;
     pd.length = length;
     state_ = State::kReadingLenDist;
+    if (format_ == PuffFormat::kV2) {
+      TEST_AND_RETURN_FALSE(FindBlockLiterals());
+    }
+  }
+  return true;
+}
+
+bool BufferPuffReader::FindBlockLiterals() {
+  size_t index = index_;
+  size_t literals_length = 0;
+  while (true) {
+    // Boundary check
+    TEST_AND_RETURN_FALSE(index < puff_size_);
+    size_t length = puff_buf_in_[index] & 0x7F;
+    if (puff_buf_in_[index++] & 0x80) {  // Length/distance.
+      if (length == 127) {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(index < puff_size_);
+        length += puff_buf_in_[index++];
+      }
+      length += 3;
+      TEST_AND_RETURN_FALSE(length <= 259);
+      if (length == 259) {  // End of block.
+        break;
+      }
+      index += 2;
+    } else {  // The length of literals.
+      if (length == 127) {
+        // Boundary check
+        TEST_AND_RETURN_FALSE(index + 1 < puff_size_);
+        length += ReadByteArrayToUint16(&puff_buf_in_[index]);
+        index += 2;
+      }
+      literals_length += length + 1;
+    }
   }
+  // Boundary check
+  TEST_AND_RETURN_FALSE(index <= puff_size_ &&
+                        literals_length <= puff_size_ - index);
+  literals_index_ = index;
+  block_end_ = index + literals_length;
   return true;
 }
 
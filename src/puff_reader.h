@@ -38,10 +38,16 @@ class BufferPuffReader : public PuffReaderInterface {
   // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
   //                 be valid during the lifetime of the object.
   // |puff_size| IN  The size of the puffed stream.
-  BufferPuffReader(const uint8_t* puff_buf, size_t puff_size)
+  // |format|    IN  The layout of the puffed stream.
+  BufferPuffReader(const uint8_t* puff_buf,
+                   size_t puff_size,
+                   PuffFormat format = PuffFormat::kV1)
       : puff_buf_in_(puff_buf),
         puff_size_(puff_size),
+        format_(format),
         index_(0),
+        literals_index_(0),
+        block_end_(0),
         state_(State::kReadingBlockMetadata) {}
 
   ~BufferPuffReader() override = default;
@@ -50,15 +56,28 @@ class BufferPuffReader : public PuffReaderInterface {
   size_t BytesLeft() const override;
 
  private:
+  // For |PuffFormat::kV2|, finds the literals of the block starting at
+  // |index_| (right after its metadata) by going through the lengths of its
+  // literals until the end of block, and sets |literals_index_| and
+  // |block_end_|.
+  bool FindBlockLiterals();
+
   // The pointer to the puffed stream. This should not be deallocated.
   const uint8_t* puff_buf_in_;
 
   // The size of the puffed buffer.
   size_t puff_size_;
 
+  PuffFormat format_;
+
   // Index to the offset of the next data in the puff buffer.
   size_t index_;
 
+  // For |PuffFormat::kV2|, the offset of the next literal of the current block
+  // and the end of the block (and its literals) in the puff buffer.
+  size_t literals_index_;
+  size_t block_end_;
+
   // State when reading from the puffed buffer.
   enum class State {
     kReadingLenDist = 0,
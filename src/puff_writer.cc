@@ -34,6 +34,27 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
     case PuffData::Type::kLiteral: {
       DVLOG(2) << "Write literals length: " << pd.length;
       size_t length = pd.type == PuffData::Type::kLiteral ? 1 : pd.length;
+      if (format_ == PuffFormat::kV2) {
+        // Only the length of the literals is written here. The literals are
+        // kept until the end of the block.
+        if (puff_buf_out_ != nullptr) {
+          if (pd.type == PuffData::Type::kLiteral) {
+            block_literals_.push_back(pd.byte);
+          } else {
+            auto offset = block_literals_.size();
+            block_literals_.resize(offset + length);
+            TEST_AND_RETURN_FALSE(pd.read_fn(&block_literals_[offset], length));
+          }
+        } else if (pd.type == PuffData::Type::kLiterals) {
+          TEST_AND_RETURN_FALSE(pd.read_fn(nullptr, length));
+        }
+        block_literals_length_ += length;
+        cur_literals_length_ += length;
+        if (cur_literals_length_ == kLiteralsMaxLength) {
+          TEST_AND_RETURN_FALSE(FlushLiteralsLength());
+        }
+        break;
+      }
       if (state_ == State::kWritingNonLiteral) {
         len_index_ = index_;
         index_++;
@@ -149,6 +170,9 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
 
       len_index_ = index_;
       state_ = State::kWritingNonLiteral;
+      if (format_ == PuffFormat::kV2) {
+        TEST_AND_RETURN_FALSE(FlushBlockLiterals());
+      }
       break;
 
     default:
@@ -159,6 +183,9 @@ bool BufferPuffWriter::Insert(const PuffData& pd) {
 }
 
 bool BufferPuffWriter::FlushLiterals() {
+  if (format_ == PuffFormat::kV2) {
+    return FlushLiteralsLength();
+  }
   if (cur_literals_length_ == 0) {
     return true;
   }
@@ -200,8 +227,54 @@ bool BufferPuffWriter::FlushLiterals() {
   return true;
 }
 
+bool BufferPuffWriter::FlushLiteralsLength() {
+  if (cur_literals_length_ == 0) {
+    return true;
+  }
+  // The same headers as the literals of |PuffFormat::kV1|.
+  size_t header_size = cur_literals_length_ > 127 ? 3 : 1;
+  if (puff_buf_out_ != nullptr) {
+    // Boundary check
+    TEST_AND_RETURN_FALSE(index_ + header_size <= puff_size_);
+    if (header_size == 1) {
+      puff_buf_out_[index_] =
+          kLiteralsHeader | static_cast<uint8_t>(cur_literals_length_ - 1);
+    } else {
+      puff_buf_out_[index_] = kLiteralsHeader | 127;
+      WriteUint16ToByteArray(
+          static_cast<uint16_t>(cur_literals_length_ - 127 - 1),
+          &puff_buf_out_[index_ + 1]);
+    }
+  }
+  index_ += header_size;
+  len_index_ = index_;
+  DVLOG(2) << "Write literals length: " << cur_literals_length_;
+  cur_literals_length_ = 0;
+  return true;
+}
+
+bool BufferPuffWriter::FlushBlockLiterals() {
+  if (puff_buf_out_ != nullptr) {
+    // Boundary check
+    TEST_AND_RETURN_FALSE(index_ + block_literals_length_ <= puff_size_);
+    if (block_literals_length_ > 0) {
+      memcpy(&puff_buf_out_[index_], block_literals_.data(),
+             block_literals_length_);
+    }
+    block_literals_.clear();
+  }
+  index_ += block_literals_length_;
+  len_index_ = index_;
+  DVLOG(2) << "Write block literals length: " << block_literals_length_;
+  block_literals_length_ = 0;
+  return true;
+}
+
 bool BufferPuffWriter::Flush() {
   TEST_AND_RETURN_FALSE(FlushLiterals());
+  if (format_ == PuffFormat::kV2) {
+    TEST_AND_RETURN_FALSE(FlushBlockLiterals());
+  }
   return true;
 }
 
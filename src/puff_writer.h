@@ -43,12 +43,17 @@ class BufferPuffWriter : public PuffWriterInterface {
   // |puff_buf|  IN  The input puffed stream. It is owned by the caller and must
   //                 be valid during the lifetime of the object.
   // |puff_size| IN  The size of the puffed stream.
-  BufferPuffWriter(uint8_t* puff_buf, size_t puff_size)
+  // |format|    IN  The layout of the puffed stream.
+  BufferPuffWriter(uint8_t* puff_buf,
+                   size_t puff_size,
+                   PuffFormat format = PuffFormat::kV1)
       : puff_buf_out_(puff_buf),
         puff_size_(puff_size),
+        format_(format),
         index_(0),
         len_index_(0),
         cur_literals_length_(0),
+        block_literals_length_(0),
         state_(State::kWritingNonLiteral) {}
 
   ~BufferPuffWriter() override = default;
@@ -57,16 +62,47 @@ class BufferPuffWriter : public PuffWriterInterface {
   bool Flush() override;
   size_t Size() override;
 
+  // Returns the number of bytes at the start of the buffer that will not be
+  // changed anymore. The bytes after them (like a run of literals whose
+  // header is not written yet) can still change.
+  size_t CompleteSize() const { return len_index_; }
+
+  // Returns the number of bytes that are not in the buffer yet, but will be
+  // written at the end of the current block.
+  size_t PendingSize() const { return block_literals_length_; }
+
+  // Continues writing into |puff_buf| of |puff_size| bytes instead. The caller
+  // must have copied the bytes of the current buffer after its first |count|
+  // ones to the start of |puff_buf|. |count| must be at most |CompleteSize()|,
+  // and |Size()| is then relative to |puff_buf|.
+  void MoveBuffer(uint8_t* puff_buf, size_t puff_size, size_t count) {
+    puff_buf_out_ = puff_buf;
+    puff_size_ = puff_size;
+    index_ -= count;
+    len_index_ -= count;
+  }
+
  private:
   // Flushes the literals into the output and resets the state.
   bool FlushLiterals();
 
+  // Same as |FlushLiterals()| for |PuffFormat::kV2|, where only the length of
+  // the literals is written. The literals themselves stay in
+  // |block_literals_|.
+  bool FlushLiteralsLength();
+
+  // Writes the literals of the current block into the output. Only used for
+  // |PuffFormat::kV2|.
+  bool FlushBlockLiterals();
+
   // The pointer to the puffed stream. This should not be deallocated.
   uint8_t* puff_buf_out_;
 
   // The size of the puffed buffer.
   size_t puff_size_;
 
+  PuffFormat format_;
+
   // The offset to the next data in the buffer.
   size_t index_;
 
@@ -77,6 +113,12 @@ class BufferPuffWriter : public PuffWriterInterface {
   // The number of literals currently been written (or cached).
   size_t cur_literals_length_;
 
+  // For |PuffFormat::kV2|, the literals of the current block which are written
+  // after its end of block and their number. |block_literals_| stays empty if
+  // only the size of the puff is computed.
+  Buffer block_literals_;
+  size_t block_literals_length_;
+
   // States when writing into the puffed buffer.
   enum class State {
     kWritingNonLiteral = 0,
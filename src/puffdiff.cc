@@ -5,17 +5,29 @@
 #include "puffin/src/include/puffin/puffdiff.h"
 
 #include <endian.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "bsdiff/bsdiff.h"
 #include "bsdiff/patch_writer_factory.h"
+#include "bsdiff/patch_writer_interface.h"
 
 #include "puffin/src/file_stream.h"
+#include "puffin/src/include/puffin/buffer_pool.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/puffpatch.h"
 #include "puffin/src/include/puffin/utils.h"
@@ -23,6 +35,8 @@
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/scoped_timer.h"
+#include "puffin/src/trace_event.h"
 
 using std::string;
 using std::vector;
@@ -31,6 +45,9 @@ namespace puffin {
 
 namespace {
 const int kBrotliCompressionQuality = 11;
+// The maximum amount of unused buffers kept for reuse while puffing the source
+// and the destination.
+const size_t kMaxPooledBytes = 16 * 1024 * 1024;
 
 template <typename T>
 void CopyVectorToRpf(
@@ -45,6 +62,41 @@ void CopyVectorToRpf(
   }
 }
 
+// Writes |header| into |patch| followed by |bodies|.
+bool SerializePatch(const metadata::PatchHeader& header,
+                    const vector<const Buffer*>& bodies,
+                    Buffer* patch) {
+  const size_t header_size_long = header.ByteSizeLong();
+  TEST_AND_RETURN_FALSE(header_size_long <= UINT32_MAX);
+  const uint32_t header_size = header_size_long;
+
+  uint64_t offset = 0;
+  uint64_t bodies_size = 0;
+  for (const auto* body : bodies) {
+    bodies_size += body->size();
+  }
+  patch->resize(kMagicLength + sizeof(header_size) + header_size +
+                bodies_size);
+
+  memcpy(patch->data() + offset, kMagic, kMagicLength);
+  offset += kMagicLength;
+
+  // Read header size from big-endian mode.
+  uint32_t be_header_size = htobe32(header_size);
+  memcpy(patch->data() + offset, &be_header_size, sizeof(be_header_size));
+  offset += 4;
+
+  TEST_AND_RETURN_FALSE(
+      header.SerializeToArray(patch->data() + offset, header_size));
+  offset += header_size;
+
+  for (const auto* body : bodies) {
+    memcpy(patch->data() + offset, body->data(), body->size());
+    offset += body->size();
+  }
+  return true;
+}
+
 // Structure of a puffin patch
 // +-------+------------------+-------------+--------------+
 // |P|U|F|1| PatchHeader Size | PatchHeader | bsdiff_patch |
@@ -56,9 +108,11 @@ bool CreatePatch(const Buffer& bsdiff_patch,
                  const vector<ByteExtent>& dst_puffs,
                  uint64_t src_puff_size,
                  uint64_t dst_puff_size,
+                 PuffFormat format,
                  Buffer* patch) {
   metadata::PatchHeader header;
-  header.set_version(1);
+  // The version of the patch is the layout of its puff streams.
+  header.set_version(static_cast<int32_t>(format));
 
   CopyVectorToRpf(src_deflates, header.mutable_src()->mutable_deflates(), 1);
   CopyVectorToRpf(dst_deflates, header.mutable_dst()->mutable_deflates(), 1);
@@ -68,88 +122,486 @@ bool CreatePatch(const Buffer& bsdiff_patch,
   header.mutable_src()->set_puff_length(src_puff_size);
   header.mutable_dst()->set_puff_length(dst_puff_size);
 
-  const size_t header_size_long = header.ByteSizeLong();
-  TEST_AND_RETURN_FALSE(header_size_long <= UINT32_MAX);
-  const uint32_t header_size = header_size_long;
+  return SerializePatch(header, {&bsdiff_patch}, patch);
+}
 
+// Structure of a puffin patch made of parts
+// +-------+------------------+-------------+---------+-----+---------+
+// |P|U|F|1| PatchHeader Size | PatchHeader | patch_1 | ... | patch_n |
+// +-------+------------------+-------------+---------+-----+---------+
+// Each part has its own puffin patch, with the version of its puff format.
+bool CreatePartsPatch(const vector<vector<ByteExtent>>& src_extents,
+                      const vector<vector<ByteExtent>>& dst_extents,
+                      const vector<Buffer>& part_patches,
+                      Buffer* patch) {
+  metadata::PatchHeader header;
+  header.set_version(kPartsPatchVersion);
+  vector<const Buffer*> bodies;
+  for (size_t idx = 0; idx < part_patches.size(); idx++) {
+    auto part = header.add_parts();
+    CopyVectorToRpf(src_extents[idx], part->mutable_src_extents(), 8);
+    CopyVectorToRpf(dst_extents[idx], part->mutable_dst_extents(), 8);
+    part->set_patch_length(part_patches[idx].size());
+    bodies.push_back(&part_patches[idx]);
+  }
+  return SerializePatch(header, bodies, patch);
+}
+
+// Returns the ranges of [0, |size|) not covered by |extents|, which are sorted
+// and do not overlap.
+vector<ByteExtent> ComplementExtents(const vector<ByteExtent>& extents,
+                                     uint64_t size) {
+  vector<ByteExtent> complement;
   uint64_t offset = 0;
-  patch->resize(kMagicLength + sizeof(header_size) + header_size +
-                bsdiff_patch.size());
+  for (const auto& extent : extents) {
+    if (extent.offset > offset) {
+      complement.emplace_back(offset, extent.offset - offset);
+    }
+    offset = extent.offset + extent.length;
+  }
+  if (size > offset) {
+    complement.emplace_back(offset, size - offset);
+  }
+  return complement;
+}
 
-  memcpy(patch->data() + offset, kMagic, kMagicLength);
-  offset += kMagicLength;
+// Reads the bytes of |extents| of |stream| one after another into |data|, and
+// puts the deflates of |index| that are inside one of them into |deflates|, at
+// their locations in |data|.
+bool ReadExtents(const UniqueStreamPtr& stream,
+                 const DeflateIndex& index,
+                 const vector<ByteExtent>& extents,
+                 Buffer* data,
+                 vector<BitExtent>* deflates) {
+  uint64_t size = 0;
+  for (const auto& extent : extents) {
+    size += extent.length;
+  }
+  data->resize(size);
+  uint64_t offset = 0;
+  for (const auto& extent : extents) {
+    TEST_AND_RETURN_FALSE(stream->Seek(extent.offset));
+    TEST_AND_RETURN_FALSE(stream->Read(data->data() + offset, extent.length));
+    // The deflates are sorted and do not overlap.
+    auto deflate = std::lower_bound(
+        index.deflates.begin(), index.deflates.end(), extent.offset * 8,
+        [](const BitExtent& deflate, uint64_t bit_offset) {
+          return deflate.offset < bit_offset;
+        });
+    for (; deflate != index.deflates.end() &&
+           deflate->offset + deflate->length <=
+               (extent.offset + extent.length) * 8;
+         ++deflate) {
+      deflates->emplace_back(deflate->offset - (extent.offset - offset) * 8,
+                             deflate->length);
+    }
+    offset += extent.length;
+  }
+  return true;
+}
 
-  // Read header size from big-endian mode.
-  uint32_t be_header_size = htobe32(header_size);
-  memcpy(patch->data() + offset, &be_header_size, sizeof(be_header_size));
-  offset += 4;
+// A patch writer that passes everything to |writer| and measures the time
+// spent in |Close()|, which is where the bsdiff streams are compressed. If
+// |keep_streams| is true, it also keeps a copy of the streams so they can be
+// written again into another patch writer using |Replay()|.
+class ReportingPatchWriter : public bsdiff::PatchWriterInterface {
+ public:
+  ReportingPatchWriter(bsdiff::PatchWriterInterface* writer,
+                       uint64_t* close_time_ns,
+                       bool keep_streams)
+      : writer_(writer),
+        close_time_ns_(close_time_ns),
+        keep_streams_(keep_streams),
+        new_size_(0) {}
+  ~ReportingPatchWriter() override = default;
 
-  TEST_AND_RETURN_FALSE(
-      header.SerializeToArray(patch->data() + offset, header_size));
-  offset += header_size;
+  bool Init(size_t new_size) override {
+    new_size_ = new_size;
+    return writer_->Init(new_size);
+  }
 
-  memcpy(patch->data() + offset, bsdiff_patch.data(), bsdiff_patch.size());
+  bool WriteDiffStream(const uint8_t* data, size_t size) override {
+    if (keep_streams_) {
+      diff_stream_.insert(diff_stream_.end(), data, data + size);
+    }
+    return writer_->WriteDiffStream(data, size);
+  }
 
-  if (bsdiff_patch.size() > patch->size()) {
-    LOG(ERROR) << "Puffin patch is invalid";
+  bool WriteExtraStream(const uint8_t* data, size_t size) override {
+    if (keep_streams_) {
+      extra_stream_.insert(extra_stream_.end(), data, data + size);
+    }
+    return writer_->WriteExtraStream(data, size);
+  }
+
+  bool AddControlEntry(const bsdiff::ControlEntry& entry) override {
+    if (keep_streams_) {
+      control_entries_.push_back(entry);
+    }
+    return writer_->AddControlEntry(entry);
   }
-  return true;
-}
+
+  bool Close() override {
+    TRACE_EVENT0("diff", "CompressPatch");
+    ScopedTimer timer(close_time_ns_);
+    return writer_->Close();
+  }
+
+  // Writes the kept streams into |writer| and adds the time it took to
+  // |*time_ns|.
+  bool Replay(bsdiff::PatchWriterInterface* writer, uint64_t* time_ns) const {
+    TEST_AND_RETURN_FALSE(keep_streams_);
+    ScopedTimer timer(time_ns);
+    TEST_AND_RETURN_FALSE(writer->Init(new_size_));
+    TEST_AND_RETURN_FALSE(
+        writer->WriteDiffStream(diff_stream_.data(), diff_stream_.size()));
+    TEST_AND_RETURN_FALSE(
+        writer->WriteExtraStream(extra_stream_.data(), extra_stream_.size()));
+    for (const auto& entry : control_entries_) {
+      TEST_AND_RETURN_FALSE(writer->AddControlEntry(entry));
+    }
+    TEST_AND_RETURN_FALSE(writer->Close());
+    return true;
+  }
+
+ private:
+  bsdiff::PatchWriterInterface* writer_;
+  uint64_t* close_time_ns_;
+  bool keep_streams_;
+
+  size_t new_size_;
+  Buffer diff_stream_;
+  Buffer extra_stream_;
+  vector<bsdiff::ControlEntry> control_entries_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReportingPatchWriter);
+};
+
+// The memory a puff stream is read into before it is diffed: either a
+// |Buffer| or a file mapped into memory. The pages of a mapped file can be
+// written back and dropped by the kernel when memory runs short, so the puff
+// streams of inputs larger than the memory can still be diffed.
+class PuffStreamBuffer {
+ public:
+  PuffStreamBuffer() : mapped_(nullptr), size_(0) {}
+  ~PuffStreamBuffer() {
+    if (mapped_ != nullptr) {
+      munmap(mapped_, size_);
+    }
+  }
+
+  // Makes room for |size| bytes in memory, or if |path| is not empty, in a new
+  // file whose name starts with |path|. The file is unique, so diffs sharing a
+  // temporary path do not truncate each other's files, and it is removed right
+  // away, so it is gone with the mapping even if the process crashes.
+  bool Allocate(uint64_t size, const string& path) {
+    if (path.empty() || size == 0) {
+      buffer_.resize(size);
+      size_ = size;
+      return true;
+    }
+    auto temp_path = path + "-XXXXXX";
+    int fd = mkstemp(&temp_path[0]);
+    TEST_AND_RETURN_FALSE(fd >= 0);
+    unlink(temp_path.c_str());
+    // The blocks of the file are allocated now, so a full disk fails here
+    // instead of raising SIGBUS when the mapping is written.
+    int error = posix_fallocate(fd, 0, size);
+    void* mapped = MAP_FAILED;
+    if (error == 0) {
+      mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+      LOG(ERROR) << "Failed to allocate " << size << " bytes for the puff "
+                 << "stream in " << temp_path << ": " << strerror(error);
+    }
+    close(fd);
+    TEST_AND_RETURN_FALSE(mapped != MAP_FAILED);
+    mapped_ = static_cast<uint8_t*>(mapped);
+    size_ = size;
+    return true;
+  }
+
+  uint8_t* data() { return mapped_ != nullptr ? mapped_ : buffer_.data(); }
+  uint64_t size() const { return size_; }
+
+ private:
+  Buffer buffer_;
+  uint8_t* mapped_;
+  uint64_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(PuffStreamBuffer);
+};
 
 }  // namespace
 
 bool PuffDiff(UniqueStreamPtr src,
               UniqueStreamPtr dst,
-              const vector<BitExtent>& src_deflates,
-              const vector<BitExtent>& dst_deflates,
+              const DeflateIndex& src_index,
+              const DeflateIndex& dst_index,
               const vector<bsdiff::CompressorType>& compressors,
               const string& tmp_filepath,
-              Buffer* patch) {
+              Buffer* patch,
+              PuffDiffReport* report,
+              PuffFormat format,
+              size_t num_threads,
+              std::shared_ptr<PuffCacheInterface> puff_cache,
+              bool map_puffs) {
+  TRACE_EVENT0("diff", "PuffDiff");
+  if (report) {
+    *report = PuffDiffReport();
+  }
   auto puffer = std::make_shared<Puffer>();
-  auto puff_deflate_stream =
-      [&puffer](UniqueStreamPtr stream, const vector<BitExtent>& deflates,
-                Buffer* puff_buffer, vector<ByteExtent>* puffs) {
-        uint64_t puff_size;
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        TEST_AND_RETURN_FALSE(
-            FindPuffLocations(stream, deflates, puffs, &puff_size));
-        TEST_AND_RETURN_FALSE(stream->Seek(0));
-        auto src_puffin_stream = PuffinStream::CreateForPuff(
-            std::move(stream), puffer, puff_size, deflates, *puffs);
-        puff_buffer->resize(puff_size);
-        TEST_AND_RETURN_FALSE(
-            src_puffin_stream->Read(puff_buffer->data(), puff_buffer->size()));
-        return true;
-      };
-
-  Buffer src_puff_buffer;
-  Buffer dst_puff_buffer;
-  vector<ByteExtent> src_puffs, dst_puffs;
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(src), src_deflates,
-                                            &src_puff_buffer, &src_puffs));
-  TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(dst), dst_deflates,
-                                            &dst_puff_buffer, &dst_puffs));
+  // The destination is puffed with the buffers used for the source.
+  auto pool = CreateBufferPool(kMaxPooledBytes);
+  uint64_t puff_cache_hits = 0;
+  auto puff_deflate_stream = [&puffer, &pool, format, num_threads, &puff_cache,
+                              &puff_cache_hits](UniqueStreamPtr stream,
+                                                const DeflateIndex& index,
+                                                const string& path,
+                                                PuffStreamBuffer* puff_buffer) {
+    TRACE_EVENT1("diff", "Puff", "puff_size", index.puff_size);
+    TEST_AND_RETURN_FALSE(stream->Seek(0));
+    auto src_puffin_stream = PuffinStream::CreateForPuff(
+        std::move(stream), puffer, index.puff_size, index.deflates,
+        index.puffs, 0, pool, format, num_threads, puff_cache);
+    TEST_AND_RETURN_FALSE(src_puffin_stream);
+    TEST_AND_RETURN_FALSE(puff_buffer->Allocate(index.puff_size, path));
+    TEST_AND_RETURN_FALSE(
+        src_puffin_stream->Read(puff_buffer->data(), puff_buffer->size()));
+    puff_cache_hits += static_cast<PuffinStream*>(src_puffin_stream.get())
+                           ->GetStats()
+                           .puff_cache_hits;
+    return true;
+  };
+
+  PuffStreamBuffer src_puff_buffer;
+  PuffStreamBuffer dst_puff_buffer;
+  {
+    ScopedTimer timer(report ? &report->puff_time_ns : nullptr);
+    string src_puff_path, dst_puff_path;
+    if (map_puffs) {
+      src_puff_path = tmp_filepath + ".src_puff";
+      dst_puff_path = tmp_filepath + ".dst_puff";
+    }
+    TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(src), src_index,
+                                              src_puff_path, &src_puff_buffer));
+    TEST_AND_RETURN_FALSE(puff_deflate_stream(std::move(dst), dst_index,
+                                              dst_puff_path, &dst_puff_buffer));
+  }
 
   auto bsdiff_patch_writer = bsdiff::CreateBSDF2PatchWriter(
       tmp_filepath, compressors, kBrotliCompressionQuality);
+  uint64_t bsdiff_time_ns = 0;
+  uint64_t compress_time_ns = 0;
+  ReportingPatchWriter reporting_patch_writer(
+      bsdiff_patch_writer.get(), &compress_time_ns,
+      report != nullptr && compressors.size() > 1);
 
-  TEST_AND_RETURN_FALSE(
-      0 == bsdiff::bsdiff(src_puff_buffer.data(), src_puff_buffer.size(),
-                          dst_puff_buffer.data(), dst_puff_buffer.size(),
-                          bsdiff_patch_writer.get(), nullptr));
-
-  auto bsdiff_patch = FileStream::Open(tmp_filepath, true, false);
-  TEST_AND_RETURN_FALSE(bsdiff_patch);
-  uint64_t patch_size;
-  TEST_AND_RETURN_FALSE(bsdiff_patch->GetSize(&patch_size));
-  Buffer bsdiff_patch_buf(patch_size);
-  TEST_AND_RETURN_FALSE(
-      bsdiff_patch->Read(bsdiff_patch_buf.data(), bsdiff_patch_buf.size()));
-  TEST_AND_RETURN_FALSE(bsdiff_patch->Close());
+  {
+    TRACE_EVENT0("diff", "Bsdiff");
+    ScopedTimer timer(&bsdiff_time_ns);
+    TEST_AND_RETURN_FALSE(
+        0 == bsdiff::bsdiff(src_puff_buffer.data(), src_puff_buffer.size(),
+                            dst_puff_buffer.data(), dst_puff_buffer.size(),
+                            &reporting_patch_writer, nullptr));
+  }
+
+  Buffer bsdiff_patch_buf;
+  {
+    TRACE_EVENT0("diff", "AssemblePatch");
+    ScopedTimer timer(report ? &report->assemble_time_ns : nullptr);
+    auto bsdiff_patch = FileStream::Open(tmp_filepath, true, false);
+    TEST_AND_RETURN_FALSE(bsdiff_patch);
+    uint64_t patch_size;
+    TEST_AND_RETURN_FALSE(bsdiff_patch->GetSize(&patch_size));
+    bsdiff_patch_buf.resize(patch_size);
+    TEST_AND_RETURN_FALSE(
+        bsdiff_patch->Read(bsdiff_patch_buf.data(), bsdiff_patch_buf.size()));
+    TEST_AND_RETURN_FALSE(bsdiff_patch->Close());
+
+    TEST_AND_RETURN_FALSE(CreatePatch(
+        bsdiff_patch_buf, src_index.deflates, dst_index.deflates,
+        src_index.puffs, dst_index.puffs, src_puff_buffer.size(),
+        dst_puff_buffer.size(), format, patch));
+  }
 
-  TEST_AND_RETURN_FALSE(CreatePatch(
-      bsdiff_patch_buf, src_deflates, dst_deflates, src_puffs, dst_puffs,
-      src_puff_buffer.size(), dst_puff_buffer.size(), patch));
+  if (report) {
+    report->src_deflates = src_index.deflates.size();
+    report->dst_deflates = dst_index.deflates.size();
+    report->src_puff_size = src_puff_buffer.size();
+    report->dst_puff_size = dst_puff_buffer.size();
+    report->puff_cache_hits = puff_cache_hits;
+    report->bsdiff_patch_size = bsdiff_patch_buf.size();
+    report->patch_size = patch->size();
+    report->header_size = patch->size() - bsdiff_patch_buf.size() -
+                          kMagicLength - sizeof(uint32_t);
+    report->bsdiff_time_ns = bsdiff_time_ns - compress_time_ns;
+    report->compress_time_ns = compress_time_ns;
+
+    if (compressors.size() == 1) {
+      report->compressor_time_ns.emplace_back(compressors[0],
+                                              compress_time_ns);
+    } else {
+      // The bsdiff patch has already been read, so |tmp_filepath| can be
+      // reused for measuring each compressor.
+      for (const auto& compressor : compressors) {
+        auto writer = bsdiff::CreateBSDF2PatchWriter(
+            tmp_filepath, {compressor}, kBrotliCompressionQuality);
+        uint64_t time_ns = 0;
+        TEST_AND_RETURN_FALSE(
+            reporting_patch_writer.Replay(writer.get(), &time_ns));
+        report->compressor_time_ns.emplace_back(compressor, time_ns);
+      }
+    }
+  }
+  return true;
+}
+
+bool PuffDiffZipArchive(UniqueStreamPtr src,
+                        UniqueStreamPtr dst,
+                        const DeflateIndex& src_index,
+                        const DeflateIndex& dst_index,
+                        const vector<bsdiff::CompressorType>& compressors,
+                        const string& tmp_filepath,
+                        Buffer* patch,
+                        PuffFormat format,
+                        size_t num_threads,
+                        std::shared_ptr<PuffCacheInterface> puff_cache) {
+  TRACE_EVENT0("diff", "PuffDiffZipArchive");
+  vector<ZipEntry> src_entries, dst_entries;
+  if (!LocateZipEntries(src, &src_entries) ||
+      !LocateZipEntries(dst, &dst_entries)) {
+    LOG(WARNING) << "Could not read the zip entries, diffing the whole files.";
+    return PuffDiff(std::move(src), std::move(dst), src_index, dst_index,
+                    compressors, tmp_filepath, patch, nullptr, format,
+                    num_threads, puff_cache);
+  }
+
+  // Only the names that are in each archive once are paired. The value is the
+  // index of the entry, or -1 for a duplicate name.
+  auto index_names = [](const vector<ZipEntry>& entries) {
+    std::map<string, int64_t> names;
+    for (size_t idx = 0; idx < entries.size(); idx++) {
+      auto inserted = names.emplace(entries[idx].name, idx);
+      if (!inserted.second) {
+        inserted.first->second = -1;
+      }
+    }
+    return names;
+  };
+  auto src_names = index_names(src_entries);
+  auto dst_names = index_names(dst_entries);
+
+  // The first part is the rest of the archives: the entries that are not
+  // paired and everything between the entries (like the central directory).
+  vector<vector<ByteExtent>> src_extents(1), dst_extents(1);
+  vector<ByteExtent> paired_src, paired_dst;
+  for (const auto& entry : dst_entries) {
+    auto src_name = src_names.find(entry.name);
+    if (dst_names[entry.name] < 0 || src_name == src_names.end() ||
+        src_name->second < 0) {
+      continue;
+    }
+    const auto& src_extent = src_entries[src_name->second].extent;
+    src_extents.push_back({src_extent});
+    dst_extents.push_back({entry.extent});
+    paired_src.push_back(src_extent);
+    paired_dst.push_back(entry.extent);
+  }
+  std::sort(paired_src.begin(), paired_src.end(),
+            [](const ByteExtent& a, const ByteExtent& b) {
+              return a.offset < b.offset;
+            });
+  uint64_t src_size, dst_size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&src_size));
+  TEST_AND_RETURN_FALSE(dst->GetSize(&dst_size));
+  src_extents[0] = ComplementExtents(paired_src, src_size);
+  dst_extents[0] = ComplementExtents(paired_dst, dst_size);
+
+  // Each part is diffed on its own with only its bytes in memory. The streams
+  // are read by one thread at a time.
+  vector<Buffer> part_patches(src_extents.size());
+  std::mutex stream_mutex;
+  auto diff_part = [&](size_t idx) {
+    TRACE_EVENT1("diff", "PuffDiffPart", "part", idx);
+    Buffer src_data, dst_data;
+    vector<BitExtent> src_deflates, dst_deflates;
+    {
+      std::lock_guard<std::mutex> lock(stream_mutex);
+      TEST_AND_RETURN_FALSE(ReadExtents(src, src_index, src_extents[idx],
+                                        &src_data, &src_deflates));
+      TEST_AND_RETURN_FALSE(ReadExtents(dst, dst_index, dst_extents[idx],
+                                        &dst_data, &dst_deflates));
+    }
+    auto part_tmp_filepath = tmp_filepath + "." + std::to_string(idx);
+    bool success =
+        PuffDiff(MemoryStream::CreateForRead(src_data),
+                 MemoryStream::CreateForRead(dst_data), src_deflates,
+                 dst_deflates, compressors, part_tmp_filepath,
+                 &part_patches[idx], nullptr, format, 1, puff_cache);
+    unlink(part_tmp_filepath.c_str());
+    return success;
+  };
+
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  // The parts take different times, so the threads take the next one from a
+  // shared counter.
+  std::atomic<size_t> next(0);
+  std::atomic<bool> success(true);
+  auto worker = [&]() {
+    for (size_t idx; (idx = next++) < part_patches.size();) {
+      if (!diff_part(idx)) {
+        success = false;
+      }
+    }
+  };
+  vector<std::thread> threads;
+  for (size_t idx = 1; idx < std::min(num_threads, part_patches.size());
+       idx++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  TEST_AND_RETURN_FALSE(success);
+
+  return CreatePartsPatch(src_extents, dst_extents, part_patches, patch);
+}
+
+bool PuffDiff(UniqueStreamPtr src,
+              UniqueStreamPtr dst,
+              const vector<BitExtent>& src_deflates,
+              const vector<BitExtent>& dst_deflates,
+              const vector<bsdiff::CompressorType>& compressors,
+              const string& tmp_filepath,
+              Buffer* patch,
+              PuffDiffReport* report,
+              PuffFormat format,
+              size_t num_threads,
+              std::shared_ptr<PuffCacheInterface> puff_cache,
+              bool map_puffs) {
+  DeflateIndex src_index, dst_index;
+  uint64_t src_locate_time_ns = 0;
+  uint64_t dst_locate_time_ns = 0;
+  {
+    ScopedTimer timer(&src_locate_time_ns);
+    TEST_AND_RETURN_FALSE(CreateDeflateIndex(src, src_deflates, &src_index));
+  }
+  {
+    ScopedTimer timer(&dst_locate_time_ns);
+    TEST_AND_RETURN_FALSE(CreateDeflateIndex(dst, dst_deflates, &dst_index));
+  }
+  TEST_AND_RETURN_FALSE(PuffDiff(std::move(src), std::move(dst), src_index,
+                                 dst_index, compressors, tmp_filepath, patch,
+                                 report, format, num_threads, puff_cache,
+                                 map_puffs));
+  if (report) {
+    report->src_locate_time_ns = src_locate_time_ns;
+    report->dst_locate_time_ns = dst_locate_time_ns;
+  }
   return true;
 }
 
@@ -159,10 +611,12 @@ bool PuffDiff(const Buffer& src,
               const vector<BitExtent>& dst_deflates,
               const vector<bsdiff::CompressorType>& compressors,
               const string& tmp_filepath,
-              Buffer* patch) {
+              Buffer* patch,
+              PuffDiffReport* report,
+              PuffFormat format) {
   return PuffDiff(MemoryStream::CreateForRead(src),
                   MemoryStream::CreateForRead(dst), src_deflates, dst_deflates,
-                  compressors, tmp_filepath, patch);
+                  compressors, tmp_filepath, patch, report, format);
 }
 
 bool PuffDiff(const Buffer& src,
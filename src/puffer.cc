@@ -5,6 +5,7 @@
 #include "puffin/src/include/puffin/puffer.h"
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <string>
 #include <utility>
@@ -16,6 +17,7 @@
 #include "puffin/src/include/puffin/stream.h"
 #include "puffin/src/logging.h"
 #include "puffin/src/puff_data.h"
+#include "puffin/src/puff_decoder.h"
 #include "puffin/src/puff_writer.h"
 
 using std::string;
@@ -23,10 +25,21 @@ using std::vector;
 
 namespace puffin {
 
+namespace {
+
+// Returns the table the dynamic Huffman table of the current block is built
+// in. It is only scratch space while puffing one block, so there is one per
+// thread, shared by all the |Puffer|s on that thread, instead of one per
+// |Puffer|.
+HuffmanTable* GetDynamicHuffmanTable() {
+  thread_local HuffmanTable dyn_ht;
+  return &dyn_ht;
+}
+
+}  // namespace
+
 Puffer::Puffer(bool exclude_bad_distance_caches)
-    : dyn_ht_(new HuffmanTable()),
-      fix_ht_(new HuffmanTable()),
-      exclude_bad_distance_caches_(exclude_bad_distance_caches) {}
+    : exclude_bad_distance_caches_(exclude_bad_distance_caches) {}
 
 Puffer::Puffer() : Puffer(false) {}
 
@@ -35,14 +48,38 @@ Puffer::~Puffer() {}
 bool Puffer::PuffDeflate(BitReaderInterface* br,
                          PuffWriterInterface* pw,
                          vector<BitExtent>* deflates) const {
+  return PuffDeflate(br, pw, deflates, nullptr);
+}
+
+bool Puffer::PuffDeflate(BitReaderInterface* br,
+                         PuffWriterInterface* pw,
+                         vector<BitExtent>* deflates,
+                         PuffStats* stats) const {
+  PuffState state(GetDynamicHuffmanTable());
+  while (!state.done) {
+    TEST_AND_RETURN_FALSE(PuffBlocks(br, pw, deflates, stats, &state,
+                                     std::numeric_limits<size_t>::max()));
+  }
+  TEST_AND_RETURN_FALSE(pw->Flush());
+  return true;
+}
+
+bool Puffer::PuffBlocks(BitReaderInterface* br,
+                        PuffWriterInterface* pw,
+                        vector<BitExtent>* deflates,
+                        PuffStats* stats,
+                        PuffState* state,
+                        size_t max_symbols) const {
   PuffData pd;
-  HuffmanTable* cur_ht;
-  bool end_loop = false;
-  // No bits left to read, return. We try to cache at least eight bits because
-  // the minimum length of a deflate bit stream is 8: (fixed huffman table) 3
-  // bits header + 5 bits just one len/dist symbol.
-  while (!end_loop && br->CacheBits(8)) {
-    auto start_bit_offset = br->OffsetInBits();
+  if (!state->in_block) {
+    // No bits left to read, return. We try to cache at least eight bits
+    // because the minimum length of a deflate bit stream is 8: (fixed huffman
+    // table) 3 bits header + 5 bits just one len/dist symbol.
+    if (state->end_loop || !br->CacheBits(8)) {
+      state->done = true;
+      return true;
+    }
+    state->start_bit_offset = br->OffsetInBits();
 
     TEST_AND_RETURN_FALSE(br->CacheBits(3));
     uint8_t final_bit = br->ReadBits(1);  // BFINAL
@@ -55,7 +92,7 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
     // If it is the final block and we are just looking for deflate locations,
     // we consider this the end of the search.
     if (deflates != nullptr && final_bit) {
-      end_loop = true;
+      state->end_loop = true;
     }
 
     // Header structure
@@ -100,33 +137,48 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         pd.type = PuffData::Type::kEndOfBlock;
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
 
+        if (stats != nullptr) {
+          stats->uncompressed_blocks++;
+          stats->uncompressed_bytes += len;
+        }
+
         // There is no need to insert the location of uncompressed deflates
         // because we do not want the uncompressed blocks when trying to find
         // the bit-addressed location of deflates. They better be ignored.
 
-        // continue the loop. Do not read any literal/length/distance.
-        continue;
+        // Do not read any literal/length/distance.
+        return true;
       }
 
       case BlockType::kFixed:
-        fix_ht_->BuildFixedHuffmanTable();
-        cur_ht = fix_ht_.get();
+        state->cur_ht = &GetFixedHuffmanTable();
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = 1;
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
+        if (stats != nullptr) {
+          stats->fixed_blocks++;
+        }
         break;
 
-      case BlockType::kDynamic:
+      case BlockType::kDynamic: {
+        auto table_start_bit_offset = br->OffsetInBits();
         pd.type = PuffData::Type::kBlockMetadata;
         pd.block_metadata[0] = block_header;
         pd.length = sizeof(pd.block_metadata) - 1;
-        TEST_AND_RETURN_FALSE(dyn_ht_->BuildDynamicHuffmanTable(
+        TEST_AND_RETURN_FALSE(state->dyn_ht->BuildDynamicHuffmanTable(
             br, &pd.block_metadata[1], &pd.length));
         pd.length += 1;  // For the header.
         TEST_AND_RETURN_FALSE(pw->Insert(pd));
-        cur_ht = dyn_ht_.get();
+        state->cur_ht = state->dyn_ht;
+        if (stats != nullptr) {
+          stats->dynamic_blocks++;
+          stats->dynamic_header_bits +=
+              br->OffsetInBits() - table_start_bit_offset;
+          stats->dynamic_header_puff_bytes += pd.length;
+        }
         break;
+      }
 
       default:
         LOG(ERROR) << "Invalid block compression type: "
@@ -134,89 +186,121 @@ bool Puffer::PuffDeflate(BitReaderInterface* br,
         return false;
     }
 
+    state->in_block = true;
     // If true and the list of output |deflates| is non-null, the current
     // deflate location will be added to that list.
-    bool include_deflate = true;
-
-    while (true) {  // Breaks when the end of block is reached.
-      auto max_bits = cur_ht->LitLenMaxBits();
-      if (!br->CacheBits(max_bits)) {
-        // It could be the end of buffer and the bit length of the end_of_block
-        // symbol has less than maximum bit length of current Huffman table. So
-        // only asking for the size of end of block symbol (256).
-        TEST_AND_RETURN_FALSE(cur_ht->EndOfBlockBitLength(&max_bits));
+    state->include_deflate = true;
+    state->literals = 0;
+    state->matches = 0;
+    state->match_length_sum = 0;
+    state->match_distance_sum = 0;
+  }
+
+  // The statistics of the current block are counted in local variables and
+  // kept in |state| between calls.
+  const HuffmanTable* cur_ht = state->cur_ht;
+  uint64_t literals = state->literals;
+  uint64_t matches = state->matches;
+  uint64_t match_length_sum = state->match_length_sum;
+  uint64_t match_distance_sum = state->match_distance_sum;
+
+  // Returns when the end of block is reached.
+  for (size_t symbols = 0; symbols < max_symbols; symbols++) {
+    auto max_bits = cur_ht->LitLenMaxBits();
+    if (!br->CacheBits(max_bits)) {
+      // It could be the end of buffer and the bit length of the end_of_block
+      // symbol has less than maximum bit length of current Huffman table. So
+      // only asking for the size of end of block symbol (256).
+      TEST_AND_RETURN_FALSE(cur_ht->EndOfBlockBitLength(&max_bits));
+    }
+    TEST_AND_RETURN_FALSE(br->CacheBits(max_bits));
+    auto bits = br->ReadBits(max_bits);
+    uint16_t lit_len_alphabet;
+    size_t nbits;
+    TEST_AND_RETURN_FALSE(
+        cur_ht->LitLenAlphabet(bits, &lit_len_alphabet, &nbits));
+    br->DropBits(nbits);
+    if (lit_len_alphabet < 256) {
+      pd.type = PuffData::Type::kLiteral;
+      pd.byte = lit_len_alphabet;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      literals++;
+
+    } else if (256 == lit_len_alphabet) {
+      pd.type = PuffData::Type::kEndOfBlock;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      if (deflates != nullptr && state->include_deflate) {
+        deflates->emplace_back(state->start_bit_offset,
+                               br->OffsetInBits() - state->start_bit_offset);
+      }
+      if (stats != nullptr) {
+        stats->literals += literals;
+        stats->matches += matches;
+        stats->match_length_sum += match_length_sum;
+        stats->match_distance_sum += match_distance_sum;
+        stats->max_block_symbols =
+            std::max(stats->max_block_symbols, literals + matches);
+      }
+      state->in_block = false;
+      return true;
+    } else {
+      TEST_AND_RETURN_FALSE(lit_len_alphabet <= 285);
+      // Reading length.
+      auto len_code_start = lit_len_alphabet - 257;
+      auto extra_bits_len = kLengthExtraBits[len_code_start];
+      uint16_t extra_bits_value = 0;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        extra_bits_value = br->ReadBits(extra_bits_len);
+        br->DropBits(extra_bits_len);
       }
-      TEST_AND_RETURN_FALSE(br->CacheBits(max_bits));
-      auto bits = br->ReadBits(max_bits);
-      uint16_t lit_len_alphabet;
+      auto length = kLengthBases[len_code_start] + extra_bits_value;
+
+      auto bits_to_cache = cur_ht->DistanceMaxBits();
+      if (!br->CacheBits(bits_to_cache)) {
+        // This is a corner case that is present in the older versions of the
+        // puffin. So we need to catch it and correctly discard this kind of
+        // deflate when we encounter it. See crbug.com/915559 for more info.
+        bits_to_cache = br->BitsRemaining();
+        TEST_AND_RETURN_FALSE(br->CacheBits(bits_to_cache));
+        if (exclude_bad_distance_caches_) {
+          state->include_deflate = false;
+        }
+        LOG(WARNING) << "A rare condition that older puffin clients fail to"
+                     << " recognize happened. Nothing to worry about."
+                     << " See crbug.com/915559";
+      }
+      auto bits = br->ReadBits(bits_to_cache);
+      uint16_t distance_alphabet;
       size_t nbits;
       TEST_AND_RETURN_FALSE(
-          cur_ht->LitLenAlphabet(bits, &lit_len_alphabet, &nbits));
+          cur_ht->DistanceAlphabet(bits, &distance_alphabet, &nbits));
       br->DropBits(nbits);
-      if (lit_len_alphabet < 256) {
-        pd.type = PuffData::Type::kLiteral;
-        pd.byte = lit_len_alphabet;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
-
-      } else if (256 == lit_len_alphabet) {
-        pd.type = PuffData::Type::kEndOfBlock;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
-        if (deflates != nullptr && include_deflate) {
-          deflates->emplace_back(start_bit_offset,
-                                 br->OffsetInBits() - start_bit_offset);
-        }
-        break;  // Breaks the loop.
-      } else {
-        TEST_AND_RETURN_FALSE(lit_len_alphabet <= 285);
-        // Reading length.
-        auto len_code_start = lit_len_alphabet - 257;
-        auto extra_bits_len = kLengthExtraBits[len_code_start];
-        uint16_t extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
-        }
-        auto length = kLengthBases[len_code_start] + extra_bits_value;
-
-        auto bits_to_cache = cur_ht->DistanceMaxBits();
-        if (!br->CacheBits(bits_to_cache)) {
-          // This is a corner case that is present in the older versions of the
-          // puffin. So we need to catch it and correctly discard this kind of
-          // deflate when we encounter it. See crbug.com/915559 for more info.
-          bits_to_cache = br->BitsRemaining();
-          TEST_AND_RETURN_FALSE(br->CacheBits(bits_to_cache));
-          if (exclude_bad_distance_caches_) {
-            include_deflate = false;
-          }
-          LOG(WARNING) << "A rare condition that older puffin clients fail to"
-                       << " recognize happened. Nothing to worry about."
-                       << " See crbug.com/915559";
-        }
-        auto bits = br->ReadBits(bits_to_cache);
-        uint16_t distance_alphabet;
-        size_t nbits;
-        TEST_AND_RETURN_FALSE(
-            cur_ht->DistanceAlphabet(bits, &distance_alphabet, &nbits));
-        br->DropBits(nbits);
-
-        // Reading distance.
-        extra_bits_len = kDistanceExtraBits[distance_alphabet];
-        extra_bits_value = 0;
-        if (extra_bits_len) {
-          TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
-          extra_bits_value = br->ReadBits(extra_bits_len);
-          br->DropBits(extra_bits_len);
-        }
 
-        pd.type = PuffData::Type::kLenDist;
-        pd.length = length;
-        pd.distance = kDistanceBases[distance_alphabet] + extra_bits_value;
-        TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      // Reading distance.
+      extra_bits_len = kDistanceExtraBits[distance_alphabet];
+      extra_bits_value = 0;
+      if (extra_bits_len) {
+        TEST_AND_RETURN_FALSE(br->CacheBits(extra_bits_len));
+        extra_bits_value = br->ReadBits(extra_bits_len);
+        br->DropBits(extra_bits_len);
       }
+
+      pd.type = PuffData::Type::kLenDist;
+      pd.length = length;
+      pd.distance = kDistanceBases[distance_alphabet] + extra_bits_value;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      matches++;
+      match_length_sum += pd.length;
+      match_distance_sum += pd.distance;
     }
   }
-  TEST_AND_RETURN_FALSE(pw->Flush());
+
+  // Stopped in the middle of the block.
+  state->literals = literals;
+  state->matches = matches;
+  state->match_length_sum = match_length_sum;
+  state->match_distance_sum = match_distance_sum;
   return true;
 }
 
@@ -0,0 +1,482 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Microbenchmarks for the hot paths of puffin. All the input data is
+// generated synthetically (and deterministically) at startup so the benchmarks
+// can run anywhere, and the results can be emitted in JSON to be tracked
+// across releases.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef USE_BRILLO
+#include "brillo/flag_helper.h"
+#else
+#include "gflags/gflags.h"
+#endif
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/huffman_table.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+#include "puffin/src/puffin_stream.h"
+#include "puffin/src/synthetic_corpus.h"
+
+using puffin::BitExtent;
+using puffin::Buffer;
+using puffin::BufferBitReader;
+using puffin::BufferBitWriter;
+using puffin::BufferPuffReader;
+using puffin::BufferPuffWriter;
+using puffin::ByteExtent;
+using puffin::CompressDeflate;
+using puffin::ContentType;
+using puffin::DeflateOptions;
+using puffin::DeflateStrategy;
+using puffin::GenerateContent;
+using puffin::HuffmanTable;
+using puffin::Huffer;
+using puffin::MemoryStream;
+using puffin::PuffData;
+using puffin::Puffer;
+using puffin::PuffinStream;
+using puffin::Random;
+using std::string;
+using std::vector;
+
+namespace {
+
+// A benchmark runs |run| repeatedly and reports the throughput based on
+// |bytes| processed in each iteration.
+struct Benchmark {
+  string name;
+  uint64_t bytes;
+  std::function<bool()> run;
+};
+
+struct BenchmarkResult {
+  string name;
+  uint64_t bytes;
+  uint64_t iterations;
+  double ns_per_iteration;
+  double mb_per_second;
+};
+
+// The access patterns of the |PuffinStream| benchmarks.
+const uint64_t kSequentialReadSize = 64 * 1024;
+const uint64_t kRandomReadSize = 4 * 1024;
+const uint64_t kRandomReadSeed = 0x5EED;
+
+// Keeps the compiler from optimizing out the values computed by benchmarks.
+volatile uint64_t benchmark_sink;
+
+// The synthetic deflate stream for one type of blocks and its puffed version.
+struct DeflateSample {
+  string block_type;
+  Buffer deflate;
+  Buffer puff;
+};
+
+// Compresses |data| with |options| into |sample|. A level of zero generates
+// only uncompressed (stored) blocks, and the fixed strategy generates only
+// fixed Huffman blocks.
+bool CreateDeflateSample(const Buffer& data,
+                         const string& block_type,
+                         const DeflateOptions& options,
+                         DeflateSample* sample) {
+  sample->block_type = block_type;
+  TEST_AND_RETURN_FALSE(CompressDeflate(data, options, &sample->deflate));
+
+  // Find the size of the puff stream first by puffing into a null buffer.
+  Puffer puffer;
+  BufferBitReader size_br(sample->deflate.data(), sample->deflate.size());
+  BufferPuffWriter size_pw(nullptr, 0);
+  TEST_AND_RETURN_FALSE(puffer.PuffDeflate(&size_br, &size_pw, nullptr));
+  sample->puff.resize(size_pw.Size());
+
+  BufferBitReader br(sample->deflate.data(), sample->deflate.size());
+  BufferPuffWriter pw(sample->puff.data(), sample->puff.size());
+  TEST_AND_RETURN_FALSE(puffer.PuffDeflate(&br, &pw, nullptr));
+  return true;
+}
+
+void AddBitIoBenchmarks(const Buffer& data, vector<Benchmark>* benchmarks) {
+  for (size_t nbits : {3, 8, 15}) {
+    benchmarks->push_back(
+        {"BitReader/ReadBits/" + std::to_string(nbits), data.size(),
+         [&data, nbits]() {
+           BufferBitReader br(data.data(), data.size());
+           uint64_t sum = 0;
+           while (br.CacheBits(nbits)) {
+             sum += br.ReadBits(nbits);
+             br.DropBits(nbits);
+           }
+           benchmark_sink = sum;
+           return true;
+         }});
+
+    benchmarks->push_back(
+        {"BitWriter/WriteBits/" + std::to_string(nbits), data.size(),
+         [&data, nbits]() {
+           Buffer out(data.size() + 4);
+           BufferBitWriter bw(out.data(), out.size());
+           const uint32_t bits = 0x5A5A & ((1 << nbits) - 1);
+           for (size_t count = data.size() * 8 / nbits; count > 0; count--) {
+             TEST_AND_RETURN_FALSE(bw.WriteBits(nbits, bits));
+           }
+           TEST_AND_RETURN_FALSE(bw.Flush());
+           benchmark_sink = out[out.size() / 2];
+           return true;
+         }});
+  }
+}
+
+void AddHuffmanTableBenchmarks(const DeflateSample& sample,
+                               vector<Benchmark>* benchmarks) {
+  // Each iteration builds the table of the first dynamic block only, so the
+  // throughput numbers are based on the size of the table in the puff stream.
+  BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+  PuffData pd;
+  if (!pr.GetNext(&pd) || pd.type != PuffData::Type::kBlockMetadata) {
+    LOG(ERROR) << "Failed to read the first dynamic Huffman table.";
+    return;
+  }
+  auto table_size = pd.length - 1;
+  auto table = std::make_shared<Buffer>(&pd.block_metadata[1],
+                                        &pd.block_metadata[pd.length]);
+
+  // Like |Puffer| and |Huffer|, the same table is rebuilt for every block, so
+  // only the first iteration allocates its arrays.
+  auto decode_table = std::make_shared<HuffmanTable>();
+  benchmarks->push_back(
+      {"HuffmanTable/BuildDynamic/FromDeflate", table_size,
+       [&sample, decode_table]() {
+         BufferBitReader br(sample.deflate.data(), sample.deflate.size());
+         // Skip the block header.
+         TEST_AND_RETURN_FALSE(br.CacheBits(3));
+         br.DropBits(3);
+         uint8_t buffer[sizeof(PuffData::block_metadata)];
+         size_t length = sizeof(buffer);
+         TEST_AND_RETURN_FALSE(
+             decode_table->BuildDynamicHuffmanTable(&br, buffer, &length));
+         return true;
+       }});
+
+  auto encode_table = std::make_shared<HuffmanTable>();
+  benchmarks->push_back(
+      {"HuffmanTable/BuildDynamic/FromPuff", table_size,
+       [table, encode_table]() {
+         uint8_t buffer[sizeof(PuffData::block_metadata)];
+         BufferBitWriter bw(buffer, sizeof(buffer));
+         TEST_AND_RETURN_FALSE(encode_table->BuildDynamicHuffmanTable(
+             table->data(), table->size(), &bw));
+         return true;
+       }});
+}
+
+void AddPuffHuffBenchmarks(const DeflateSample& sample,
+                           vector<Benchmark>* benchmarks) {
+  auto puffer = std::make_shared<Puffer>();
+  benchmarks->push_back(
+      {"Puffer/PuffDeflate/" + sample.block_type, sample.deflate.size(),
+       [&sample, puffer]() {
+         Buffer puff(sample.puff.size());
+         BufferBitReader br(sample.deflate.data(), sample.deflate.size());
+         BufferPuffWriter pw(puff.data(), puff.size());
+         TEST_AND_RETURN_FALSE(puffer->PuffDeflate(&br, &pw, nullptr));
+         return true;
+       }});
+
+  auto huffer = std::make_shared<Huffer>();
+  benchmarks->push_back(
+      {"Huffer/HuffDeflate/" + sample.block_type, sample.deflate.size(),
+       [&sample, huffer]() {
+         Buffer deflate(sample.deflate.size());
+         BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+         BufferBitWriter bw(deflate.data(), deflate.size());
+         TEST_AND_RETURN_FALSE(huffer->HuffDeflate(&pr, &bw));
+         return true;
+       }});
+}
+
+void AddPuffIoBenchmarks(const DeflateSample& sample,
+                         vector<Benchmark>* benchmarks) {
+  benchmarks->push_back(
+      {"PuffReader/GetNext/" + sample.block_type, sample.puff.size(),
+       [&sample]() {
+         Buffer literals(65536);
+         BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+         PuffData pd;
+         while (pr.BytesLeft() != 0) {
+           TEST_AND_RETURN_FALSE(pr.GetNext(&pd));
+           if (pd.type == PuffData::Type::kLiterals) {
+             TEST_AND_RETURN_FALSE(pd.read_fn(literals.data(), pd.length));
+           }
+         }
+         return true;
+       }});
+
+  benchmarks->push_back(
+      {"PuffWriter/Insert/" + sample.block_type, sample.puff.size(),
+       [&sample]() {
+         Buffer puff(sample.puff.size());
+         BufferPuffReader pr(sample.puff.data(), sample.puff.size());
+         BufferPuffWriter pw(puff.data(), puff.size());
+         PuffData pd;
+         while (pr.BytesLeft() != 0) {
+           TEST_AND_RETURN_FALSE(pr.GetNext(&pd));
+           TEST_AND_RETURN_FALSE(pw.Insert(pd));
+         }
+         TEST_AND_RETURN_FALSE(pw.Flush());
+         return true;
+       }});
+}
+
+// The state shared between the |PuffinStream| benchmarks.
+struct PuffinStreamSample {
+  Buffer deflate;
+  vector<BitExtent> deflates;
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+};
+
+void AddPuffinStreamBenchmarks(
+    const std::shared_ptr<PuffinStreamSample>& sample,
+    vector<Benchmark>* benchmarks) {
+  const uint64_t puff_size = sample->puff_size;
+
+  // Each access pattern returns the list of (offset, length) reads that cover
+  // the whole puff stream.
+  auto sequential = [puff_size]() {
+    vector<ByteExtent> reads;
+    for (uint64_t offset = 0; offset < puff_size;
+         offset += kSequentialReadSize) {
+      reads.emplace_back(offset,
+                         std::min(kSequentialReadSize, puff_size - offset));
+    }
+    return reads;
+  };
+  auto reverse = [&sequential]() {
+    auto reads = sequential();
+    std::reverse(reads.begin(), reads.end());
+    return reads;
+  };
+  auto random = [puff_size]() {
+    vector<ByteExtent> reads;
+    Random rand(kRandomReadSeed);
+    auto read_size = std::min(kRandomReadSize, puff_size);
+    for (uint64_t total = 0; total < puff_size; total += read_size) {
+      reads.emplace_back(rand.Next() % (puff_size - read_size + 1), read_size);
+    }
+    return reads;
+  };
+
+  const std::pair<string, vector<ByteExtent>> patterns[] = {
+      {"sequential", sequential()},
+      {"reverse", reverse()},
+      {"random", random()},
+  };
+  const std::pair<string, uint64_t> cache_sizes[] = {
+      {"0", 0},
+      {"1MB", 1024 * 1024},
+      {"all", puff_size},
+  };
+
+  auto puffer = std::make_shared<Puffer>();
+  for (const auto& pattern : patterns) {
+    uint64_t bytes = 0;
+    for (const auto& read : pattern.second) {
+      bytes += read.length;
+    }
+    auto reads = std::make_shared<vector<ByteExtent>>(pattern.second);
+    for (const auto& cache_size : cache_sizes) {
+      benchmarks->push_back(
+          {"PuffinStream/Read/" + pattern.first + "/cache:" + cache_size.first,
+           bytes, [sample, puffer, reads, cache_size]() {
+             auto stream = PuffinStream::CreateForPuff(
+                 MemoryStream::CreateForRead(sample->deflate), puffer,
+                 sample->puff_size, sample->deflates, sample->puffs,
+                 cache_size.second);
+             TEST_AND_RETURN_FALSE(stream);
+             Buffer buffer(kSequentialReadSize);
+             for (const auto& read : *reads) {
+               TEST_AND_RETURN_FALSE(stream->Seek(read.offset));
+               TEST_AND_RETURN_FALSE(stream->Read(buffer.data(), read.length));
+             }
+             return true;
+           }});
+    }
+  }
+}
+
+// Scanning |data|, which has no local file headers, for zip entries. This is
+// the worst case of locating the deflates of truncated or embedded archives.
+void AddZipScanBenchmarks(const Buffer& data, vector<Benchmark>* benchmarks) {
+  benchmarks->push_back(
+      {"LocateDeflatesInZipArchive/scan/buffer", data.size(), [&data]() {
+         vector<BitExtent> deflates;
+         TEST_AND_RETURN_FALSE(
+             puffin::LocateDeflatesInZipArchive(data, &deflates));
+         return deflates.empty();
+       }});
+  benchmarks->push_back(
+      {"LocateDeflatesInZipArchive/scan/stream", data.size(), [&data]() {
+         vector<BitExtent> deflates;
+         TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInZipArchive(
+             MemoryStream::CreateForRead(data), &deflates));
+         return deflates.empty();
+       }});
+}
+
+bool RunBenchmark(const Benchmark& benchmark,
+                  uint64_t min_time_ms,
+                  BenchmarkResult* result) {
+  using Clock = std::chrono::steady_clock;
+  // Warm up and make sure the benchmark actually works.
+  TEST_AND_RETURN_FALSE(benchmark.run());
+
+  const auto min_time = std::chrono::milliseconds(min_time_ms);
+  uint64_t iterations = 0;
+  uint64_t batch = 1;
+  Clock::duration elapsed(0);
+  while (elapsed < min_time) {
+    auto start = Clock::now();
+    for (uint64_t idx = 0; idx < batch; idx++) {
+      TEST_AND_RETURN_FALSE(benchmark.run());
+    }
+    elapsed += Clock::now() - start;
+    iterations += batch;
+    batch *= 2;
+  }
+
+  auto elapsed_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  result->name = benchmark.name;
+  result->bytes = benchmark.bytes;
+  result->iterations = iterations;
+  result->ns_per_iteration = static_cast<double>(elapsed_ns) / iterations;
+  result->mb_per_second = benchmark.bytes * 1e3 / result->ns_per_iteration;
+  return true;
+}
+
+void PrintResults(const vector<BenchmarkResult>& results,
+                  const string& format,
+                  uint64_t data_size) {
+  if (format == "json") {
+    printf("{\n  \"context\": {\"data_size\": %" PRIu64 "},\n", data_size);
+    printf("  \"benchmarks\": [\n");
+    for (size_t idx = 0; idx < results.size(); idx++) {
+      const auto& result = results[idx];
+      printf("    {\"name\": \"%s\", \"bytes_per_iteration\": %" PRIu64
+             ", \"iterations\": %" PRIu64
+             ", \"ns_per_iteration\": %.1f, \"mb_per_second\": %.2f}%s\n",
+             result.name.c_str(), result.bytes, result.iterations,
+             result.ns_per_iteration, result.mb_per_second,
+             idx + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+  } else {
+    printf("%-48s %12s %16s %12s\n", "Benchmark", "Iterations", "ns/iter",
+           "MB/s");
+    for (const auto& result : results) {
+      printf("%-48s %12" PRIu64 " %16.1f %12.2f\n", result.name.c_str(),
+             result.iterations, result.ns_per_iteration, result.mb_per_second);
+    }
+  }
+}
+
+}  // namespace
+
+#define SETUP_FLAGS                                                         \
+  DEFINE_string(filter, "",                                                 \
+                "Only run the benchmarks whose name contains this string"); \
+  DEFINE_uint64(min_time_ms, 500,                                           \
+                "Minimum time to spend running each benchmark");            \
+  DEFINE_uint64(data_size, 4 * 1024 * 1024,                                 \
+                "Size of the synthetic uncompressed data");                 \
+  DEFINE_string(format, "text", "Output format of the results: text or json");
+
+#ifndef USE_BRILLO
+SETUP_FLAGS;
+#endif
+
+// Main entry point to the benchmarks.
+bool Main(int argc, char** argv) {
+#ifdef USE_BRILLO
+  SETUP_FLAGS;
+  brillo::FlagHelper::Init(argc, argv, "Puffin benchmarks");
+#else
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+  TEST_AND_RETURN_FALSE(FLAGS_format == "text" || FLAGS_format == "json");
+  TEST_AND_RETURN_FALSE(FLAGS_data_size > 0);
+
+  const auto data = GenerateContent(ContentType::kText, FLAGS_data_size, 1);
+  DeflateOptions stored_options, fixed_options, dynamic_options;
+  stored_options.level = 0;
+  fixed_options.strategy = DeflateStrategy::kFixed;
+  vector<DeflateSample> samples(3);
+  TEST_AND_RETURN_FALSE(
+      CreateDeflateSample(data, "stored", stored_options, &samples[0]));
+  TEST_AND_RETURN_FALSE(
+      CreateDeflateSample(data, "fixed", fixed_options, &samples[1]));
+  TEST_AND_RETURN_FALSE(
+      CreateDeflateSample(data, "dynamic", dynamic_options, &samples[2]));
+  const auto& dynamic_sample = samples[2];
+
+  auto stream_sample = std::make_shared<PuffinStreamSample>();
+  stream_sample->deflate = dynamic_sample.deflate;
+  TEST_AND_RETURN_FALSE(puffin::LocateDeflatesInDeflateStream(
+      stream_sample->deflate.data(), stream_sample->deflate.size(), 0,
+      &stream_sample->deflates, nullptr));
+  TEST_AND_RETURN_FALSE(puffin::FindPuffLocations(
+      MemoryStream::CreateForRead(stream_sample->deflate),
+      stream_sample->deflates, &stream_sample->puffs,
+      &stream_sample->puff_size));
+
+  vector<Benchmark> benchmarks;
+  AddBitIoBenchmarks(dynamic_sample.deflate, &benchmarks);
+  AddHuffmanTableBenchmarks(dynamic_sample, &benchmarks);
+  for (const auto& sample : samples) {
+    AddPuffHuffBenchmarks(sample, &benchmarks);
+  }
+  for (const auto& sample : samples) {
+    AddPuffIoBenchmarks(sample, &benchmarks);
+  }
+  AddPuffinStreamBenchmarks(stream_sample, &benchmarks);
+  AddZipScanBenchmarks(data, &benchmarks);
+
+  vector<BenchmarkResult> results;
+  for (const auto& benchmark : benchmarks) {
+    if (benchmark.name.find(FLAGS_filter) == string::npos) {
+      continue;
+    }
+    BenchmarkResult result;
+    TEST_AND_RETURN_FALSE(RunBenchmark(benchmark, FLAGS_min_time_ms, &result));
+    results.push_back(result);
+  }
+  PrintResults(results, FLAGS_format, FLAGS_data_size);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (!Main(argc, argv)) {
+    return 1;
+  }
+  return 0;
+}
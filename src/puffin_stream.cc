@@ -5,13 +5,17 @@
 #include "puffin/src/puffin_stream.h"
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
@@ -19,6 +23,8 @@
 #include "puffin/src/logging.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/scoped_timer.h"
+#include "puffin/src/trace_event.h"
 
 using std::shared_ptr;
 using std::unique_ptr;
@@ -28,6 +34,62 @@ namespace puffin {
 
 namespace {
 
+// The size of the chunks |ReadInto| and |WriteFrom| copy through memory.
+constexpr uint64_t kCopyBufferSize = 1024 * 1024;  // 1 MB
+
+// The limits of reading the deflates ahead of puffing them. See |ReadAhead|.
+// Only the deflates of at least |kMinReadAheadLength| bytes are read ahead; the
+// smaller ones are read together with the bytes around them.
+constexpr size_t kReadAheadDeflates = 16;
+constexpr size_t kReadAheadBytes = 4 * 1024 * 1024;  // 4 MB
+constexpr size_t kReadAheadThreads = 2;
+constexpr uint64_t kMinReadAheadLength = 64 * 1024;  // 64 KB
+
+// The size of the reads from the deflate stream (unless more is needed at
+// once) and of the buffer the writes into it are collected in.
+constexpr uint64_t kReadBufferSize = 1024 * 1024;   // 1 MB
+constexpr uint64_t kWriteBufferSize = 1024 * 1024;  // 1 MB
+
+// The value of |read_ahead_ids_| for the deflates that are not read ahead.
+constexpr size_t kNoReadAhead = static_cast<size_t>(-1);
+
+// Without a cache, the puffs larger than this are not puffed at once but only
+// up to the bytes that are read.
+constexpr uint64_t kMaxPuffBufferSize = 1024 * 1024;  // 1 MB
+
+// The maximum size of the deflates puffed or huffed in parallel at once
+// (unless a single deflate is larger). They are all in memory at the same
+// time.
+constexpr uint64_t kMaxParallelBytes = 16 * 1024 * 1024;  // 16 MB
+
+// Calls |work| with each index in [|begin|, |end|) on up to |num_threads|
+// threads, including the calling one. Returns false if any call failed.
+bool ParallelFor(size_t begin,
+                 size_t end,
+                 size_t num_threads,
+                 const std::function<bool(size_t)>& work) {
+  // The deflates take different times, so the threads take the next one from
+  // a shared counter.
+  std::atomic<size_t> next(begin);
+  std::atomic<bool> success(true);
+  auto worker = [&]() {
+    for (size_t idx; (idx = next++) < end;) {
+      if (!work(idx)) {
+        success = false;
+      }
+    }
+  };
+  vector<std::thread> threads;
+  for (size_t idx = 1; idx < std::min(num_threads, end - begin); idx++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return success;
+}
+
 bool CheckArgsIntegrity(uint64_t puff_size,
                         const vector<BitExtent>& deflates,
                         const vector<ByteExtent>& puffs) {
@@ -54,34 +116,45 @@ bool CheckArgsIntegrity(uint64_t puff_size,
 
 }  // namespace
 
-UniqueStreamPtr PuffinStream::CreateForPuff(UniqueStreamPtr stream,
-                                            shared_ptr<Puffer> puffer,
-                                            uint64_t puff_size,
-                                            const vector<BitExtent>& deflates,
-                                            const vector<ByteExtent>& puffs,
-                                            size_t max_cache_size) {
+UniqueStreamPtr PuffinStream::CreateForPuff(
+    UniqueStreamPtr stream,
+    shared_ptr<Puffer> puffer,
+    uint64_t puff_size,
+    const vector<BitExtent>& deflates,
+    const vector<ByteExtent>& puffs,
+    size_t max_cache_size,
+    shared_ptr<BufferPoolInterface> pool,
+    PuffFormat format,
+    size_t num_threads,
+    shared_ptr<PuffCacheInterface> puff_cache) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
-  UniqueStreamPtr puffin_stream(new PuffinStream(std::move(stream), puffer,
-                                                 nullptr, puff_size, deflates,
-                                                 puffs, max_cache_size));
+  UniqueStreamPtr puffin_stream(new PuffinStream(
+      std::move(stream), puffer, nullptr, puff_size, deflates, puffs,
+      max_cache_size, std::move(pool), format, num_threads,
+      std::move(puff_cache)));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
 
-UniqueStreamPtr PuffinStream::CreateForHuff(UniqueStreamPtr stream,
-                                            shared_ptr<Huffer> huffer,
-                                            uint64_t puff_size,
-                                            const vector<BitExtent>& deflates,
-                                            const vector<ByteExtent>& puffs) {
+UniqueStreamPtr PuffinStream::CreateForHuff(
+    UniqueStreamPtr stream,
+    shared_ptr<Huffer> huffer,
+    uint64_t puff_size,
+    const vector<BitExtent>& deflates,
+    const vector<ByteExtent>& puffs,
+    shared_ptr<BufferPoolInterface> pool,
+    PuffFormat format,
+    size_t num_threads) {
   TEST_AND_RETURN_VALUE(CheckArgsIntegrity(puff_size, deflates, puffs),
                         nullptr);
   TEST_AND_RETURN_VALUE(stream->Seek(0), nullptr);
 
   UniqueStreamPtr puffin_stream(new PuffinStream(
-      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0));
+      std::move(stream), nullptr, huffer, puff_size, deflates, puffs, 0,
+      std::move(pool), format, num_threads, nullptr));
   TEST_AND_RETURN_VALUE(puffin_stream->Seek(0), nullptr);
   return puffin_stream;
 }
@@ -92,11 +165,16 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
                            uint64_t puff_size,
                            const vector<BitExtent>& deflates,
                            const vector<ByteExtent>& puffs,
-                           size_t max_cache_size)
+                           size_t max_cache_size,
+                           shared_ptr<BufferPoolInterface> pool,
+                           PuffFormat format,
+                           size_t num_threads,
+                           shared_ptr<PuffCacheInterface> puff_cache)
     : stream_(std::move(stream)),
       puffer_(puffer),
       huffer_(huffer),
       puff_stream_size_(puff_size),
+      format_(format),
       deflates_(deflates),
       puffs_(puffs),
       puff_pos_(0),
@@ -106,8 +184,18 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
       extra_byte_(0),
       is_for_puff_(puffer_ ? true : false),
       closed_(false),
+      pool_(std::move(pool)),
+      num_threads_(num_threads),
+      huffed_begin_(0),
+      huffed_end_(0),
+      decoder_puff_idx_(0),
+      read_buffer_offset_(0),
+      read_buffer_length_(0),
+      write_length_(0),
       max_cache_size_(max_cache_size),
-      cur_cache_size_(0) {
+      cur_cache_size_(0),
+      puff_cache_(std::move(puff_cache)),
+      puffed_(puffs.size(), false) {
   // Building upper bounds for faster seek.
   upper_bounds_.reserve(puffs.size());
   for (const auto& puff : puffs) {
@@ -118,14 +206,14 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
   // We can pass the size of the deflate stream too, but it is not necessary
   // yet. We cannot get the size of stream from itself, because we might be
   // writing into it and its size is not defined yet.
-  uint64_t deflate_stream_size = puff_stream_size_;
+  deflate_stream_size_ = puff_stream_size_;
   if (!puffs.empty()) {
-    deflate_stream_size =
+    deflate_stream_size_ =
         ((deflates.back().offset + deflates.back().length) / 8) +
         puff_stream_size_ - (puffs.back().offset + puffs.back().length);
   }
 
-  deflates_.emplace_back(deflate_stream_size * 8, 0);
+  deflates_.emplace_back(deflate_stream_size_ * 8, 0);
   puffs_.emplace_back(puff_stream_size_, 0);
 
   // Look for the largest puff and deflate extents and get proper size buffers.
@@ -133,16 +221,69 @@ PuffinStream::PuffinStream(UniqueStreamPtr stream,
   for (const auto& puff : puffs) {
     max_puff_length = std::max(max_puff_length, puff.length);
   }
-  puff_buffer_.reset(new Buffer(max_puff_length + 1));
   if (max_cache_size_ < max_puff_length) {
     max_cache_size_ = 0;  // It means we are not caching puffs.
   }
+  if (!pool_) {
+    // Only the evicted caches are given back to the pool before the stream
+    // is destroyed, and those never add up to more than the cache size.
+    pool_ = CreateBufferPool(max_cache_size_);
+  }
+  // Without a cache, the larger puffs are read in pieces. See |PuffDecoder|.
+  // There is no such decoder for huffing, so the whole puffs are always
+  // collected before they are huffed.
+  puff_buffer_ = pool_->Acquire(
+      (is_for_puff_ && max_cache_size_ == 0
+           ? std::min(max_puff_length, kMaxPuffBufferSize)
+           : max_puff_length) +
+      1);
 
+  // The lengths of the deflates are in bits; two more bytes cover their
+  // partial first and last bytes.
   uint64_t max_deflate_length = 0;
   for (const auto& deflate : deflates) {
-    max_deflate_length = std::max(max_deflate_length, deflate.length * 8);
+    max_deflate_length = std::max(max_deflate_length, (deflate.length + 7) / 8);
+  }
+  deflate_buffer_ = pool_->Acquire(max_deflate_length + 2);
+  UpdatePeakBufferBytes();
+
+  if (num_threads_ == 0) {
+    num_threads_ = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  // Reading a file ahead overlaps its latency with puffing the previous
+  // deflates. In-memory streams are puffed in place instead, and the deflates
+  // puffed on several threads are read together.
+  int fd;
+  if (is_for_puff_ && num_threads_ == 1 && stream_->GetFileDescriptor(&fd)) {
+    vector<ByteExtent> deflate_bytes;
+    read_ahead_ids_.assign(deflates_.size(), kNoReadAhead);
+    for (size_t idx = 0; idx < deflates.size(); idx++) {
+      auto start_byte = deflates[idx].offset / 8;
+      auto end_byte = (deflates[idx].offset + deflates[idx].length + 7) / 8;
+      if (end_byte - start_byte >= kMinReadAheadLength) {
+        read_ahead_ids_[idx] = deflate_bytes.size();
+        deflate_bytes.emplace_back(start_byte, end_byte - start_byte);
+        read_ahead_starts_.push_back(start_byte);
+      }
+    }
+    if (deflate_bytes.size() > 1) {
+      read_ahead_ =
+          ReadAhead::Create(fd, deflate_bytes, kReadAheadDeflates,
+                            kReadAheadBytes, kReadAheadThreads, pool_);
+    }
+    if (!read_ahead_) {
+      read_ahead_ids_.clear();
+      read_ahead_starts_.clear();
+    }
+  }
+}
+
+PuffinStream::~PuffinStream() {
+  // The writes into a stream that is not closed are not lost.
+  if (!closed_) {
+    FlushWrites();
   }
-  deflate_buffer_.reset(new Buffer(max_deflate_length + 2));
 }
 
 bool PuffinStream::GetSize(uint64_t* size) const {
@@ -164,6 +305,13 @@ bool PuffinStream::Seek(uint64_t offset) {
 
   TEST_AND_RETURN_FALSE(offset <= puff_stream_size_);
 
+  uint64_t cur_offset = puff_pos_ + skip_bytes_;
+  if (offset != cur_offset) {
+    stats_.seeks++;
+    stats_.seek_distance += offset > cur_offset ? offset - cur_offset
+                                                : cur_offset - offset;
+  }
+
   // We are searching first available puff which either includes the |offset| or
   // it is the next available puff after |offset|.
   auto next_puff_iter =
@@ -191,6 +339,11 @@ bool PuffinStream::Seek(uint64_t offset) {
   }
   skip_bytes_ = offset - puff_pos_;
   if (!is_for_puff_ && offset == 0) {
+    huffed_.clear();
+    huffed_begin_ = huffed_end_ = 0;
+    TEST_AND_RETURN_FALSE(FlushWrites());
+    TRACE_EVENT0("io", "Seek");
+    ScopedTimer timer(&stats_.io_time_ns);
     TEST_AND_RETURN_FALSE(stream_->Seek(0));
     TEST_AND_RETURN_FALSE(SetExtraByte());
   }
@@ -199,6 +352,7 @@ bool PuffinStream::Seek(uint64_t offset) {
 
 bool PuffinStream::Close() {
   closed_ = true;
+  TEST_AND_RETURN_FALSE(FlushWrites());
   return stream_->Close();
 }
 
@@ -211,6 +365,8 @@ bool PuffinStream::Read(void* buffer, size_t count) {
   auto bytes = static_cast<uint8_t*>(buffer);
   uint64_t length = count;
   uint64_t bytes_read = 0;
+  // The puffs before this one have been puffed by |PuffAhead|.
+  size_t puffed_end = 0;
   while (bytes_read < length) {
     if (puff_pos_ < cur_puff_->offset) {
       // Reading between two deflates. We also read bytes that have at least one
@@ -222,8 +378,12 @@ bool PuffinStream::Read(void* buffer, size_t count) {
       auto bytes_to_read = std::min(length - bytes_read, end_byte - start_byte);
       TEST_AND_RETURN_FALSE(bytes_to_read >= 1);
 
-      TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
-      TEST_AND_RETURN_FALSE(stream_->Read(bytes + bytes_read, bytes_to_read));
+      const uint8_t* data;
+      TEST_AND_RETURN_FALSE(
+          ReadStream(start_byte, bytes_to_read, bytes + bytes_read, &data));
+      if (data != bytes + bytes_read) {
+        memcpy(bytes + bytes_read, data, bytes_to_read);
+      }
 
       // If true, we read the first byte of the curret deflate. So we have to
       // mask out the deflate bits (which are most significant bits.)
@@ -266,38 +426,74 @@ bool PuffinStream::Read(void* buffer, size_t count) {
           max_cache_size_ == 0 && (skip_bytes_ == 0) &&
           (length - bytes_read >= cur_puff_->length);
 
-      auto cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
-      if (max_cache_size_ == 0 ||
-          !GetPuffCache(cur_puff_idx, cur_puff_->length, &puff_buffer_)) {
-        // Did not find the puff buffer in cache. We have to build it.
-        deflate_buffer_->resize(bytes_to_read);
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
+      size_t cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
+      auto bytes_to_copy =
+          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
+      if (puff_directly_into_buffer && num_threads_ > 1 &&
+          cur_puff_idx >= puffed_end) {
+        TEST_AND_RETURN_FALSE(PuffAhead(cur_puff_idx, bytes + bytes_read,
+                                        length - bytes_read, &puffed_end));
+      }
+      bool use_decoder = max_cache_size_ == 0 && !puff_directly_into_buffer &&
+                         cur_puff_->length > kMaxPuffBufferSize;
+      if (cur_puff_idx < puffed_end) {
+        // It has been puffed into |bytes| already.
+      } else if (use_decoder) {
+        // The puff is too large for |puff_buffer_|, so only the part of it
+        // up to the requested bytes is puffed. Reading on from there
+        // continues puffing where it stopped.
+        if (!decoder_ || decoder_puff_idx_ != cur_puff_idx ||
+            decoder_->Offset() > skip_bytes_) {
+          const uint8_t* deflate_data;
+          TEST_AND_RETURN_FALSE(ReadDeflate(cur_puff_idx, true, &deflate_data));
+          decoder_ = PuffDecoder::Create(
+              puffer_.get(), deflate_data, bytes_to_read,
+              cur_deflate_->offset & 7, cur_puff_->length, format_);
+          TEST_AND_RETURN_FALSE(decoder_);
+          decoder_puff_idx_ = cur_puff_idx;
+          stats_.deflates_puffed++;
+          if (puffed_[cur_puff_idx]) {
+            stats_.deflates_repuffed++;
+          }
+          puffed_[cur_puff_idx] = true;
+        }
+        TRACE_EVENT1("puff", "PuffDeflate", "puff_size", cur_puff_->length);
+        ScopedTimer timer(&stats_.puff_time_ns);
+        stats_.bytes_puffed += skip_bytes_ + bytes_to_copy - decoder_->Offset();
         TEST_AND_RETURN_FALSE(
-            stream_->Read(deflate_buffer_->data(), bytes_to_read));
-        BufferBitReader bit_reader(deflate_buffer_->data(), bytes_to_read);
-
-        BufferPuffWriter puff_writer(puff_directly_into_buffer
-                                         ? bytes + bytes_read
-                                         : puff_buffer_->data(),
-                                     cur_puff_->length);
-
-        // Drop the first unused bits.
-        size_t extra_bits_len = cur_deflate_->offset & 7;
-        TEST_AND_RETURN_FALSE(bit_reader.CacheBits(extra_bits_len));
-        bit_reader.DropBits(extra_bits_len);
-
+            decoder_->Read(nullptr, skip_bytes_ - decoder_->Offset()));
         TEST_AND_RETURN_FALSE(
-            puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr));
-        TEST_AND_RETURN_FALSE(bytes_to_read == bit_reader.Offset());
-        TEST_AND_RETURN_FALSE(cur_puff_->length == puff_writer.Size());
-      } else {
-        // Just seek to proper location.
-        TEST_AND_RETURN_FALSE(stream_->Seek(start_byte + bytes_to_read));
+            decoder_->Read(bytes + bytes_read, bytes_to_copy));
+      } else if (max_cache_size_ == 0 ||
+                 !GetPuffCache(cur_puff_idx, cur_puff_->length,
+                               &puff_buffer_)) {
+        // Did not find the puff buffer in cache. We have to build it.
+        const uint8_t* deflate_data;
+        TEST_AND_RETURN_FALSE(ReadDeflate(cur_puff_idx, false, &deflate_data));
+        bool from_cache;
+        {
+          TRACE_EVENT1("puff", "PuffDeflate", "puff_size", cur_puff_->length);
+          ScopedTimer timer(&stats_.puff_time_ns);
+          TEST_AND_RETURN_FALSE(PuffDeflate(
+              cur_puff_idx, deflate_data,
+              puff_directly_into_buffer ? bytes + bytes_read
+                                        : puff_buffer_->data(),
+              &from_cache));
+        }
+
+        if (from_cache) {
+          stats_.puff_cache_hits++;
+        } else {
+          stats_.deflates_puffed++;
+          stats_.bytes_puffed += cur_puff_->length;
+          if (puffed_[cur_puff_idx]) {
+            stats_.deflates_repuffed++;
+          }
+        }
+        puffed_[cur_puff_idx] = true;
       }
       // Copy from puff buffer to output if needed.
-      auto bytes_to_copy =
-          std::min(length - bytes_read, cur_puff_->length - skip_bytes_);
-      if (!puff_directly_into_buffer) {
+      if (!puff_directly_into_buffer && !use_decoder) {
         memcpy(bytes + bytes_read, puff_buffer_->data() + skip_bytes_,
                bytes_to_copy);
       }
@@ -339,7 +535,7 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
       auto copy_len =
           std::min((cur_deflate_->offset / 8) - (deflate_bit_pos_ / 8),
                    length - bytes_wrote);
-      TEST_AND_RETURN_FALSE(stream_->Write(bytes + bytes_wrote, copy_len));
+      TEST_AND_RETURN_FALSE(WriteStream(bytes + bytes_wrote, copy_len));
       bytes_wrote += copy_len;
       puff_pos_ += copy_len;
       deflate_bit_pos_ += copy_len * 8;
@@ -360,83 +556,414 @@ bool PuffinStream::Write(const void* buffer, size_t count) {
         TEST_AND_RETURN_FALSE(puff_pos_ == cur_puff_->offset);
       }
 
-      auto copy_len = std::min(length - bytes_wrote,
-                               cur_puff_->length + extra_byte_ - skip_bytes_);
-      TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
-      memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote, copy_len);
-      skip_bytes_ += copy_len;
-      bytes_wrote += copy_len;
+      size_t cur_puff_idx = std::distance(puffs_.begin(), cur_puff_);
+      if (skip_bytes_ == 0 && num_threads_ > 1 && cur_puff_idx >= huffed_end_) {
+        TEST_AND_RETURN_FALSE(
+            HuffAhead(cur_puff_idx, bytes + bytes_wrote, length - bytes_wrote));
+      }
 
-      if (skip_bytes_ == cur_puff_->length + extra_byte_) {
-        // |puff_buffer_| is full, now huff into the |deflate_buffer_|.
-        auto start_byte = cur_deflate_->offset / 8;
-        auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
-        auto bytes_to_write = end_byte - start_byte;
+      auto start_byte = cur_deflate_->offset / 8;
+      auto end_byte = (cur_deflate_->offset + cur_deflate_->length + 7) / 8;
+      auto bytes_to_write = end_byte - start_byte;
+      const uint8_t* puff_data;
+      shared_ptr<Buffer> huffed;
+      uint8_t* deflate_data;
+      if (cur_puff_idx >= huffed_begin_ && cur_puff_idx < huffed_end_) {
+        // It has been huffed by |HuffAhead| already, from the whole puff in
+        // |bytes|.
+        puff_data = bytes + bytes_wrote;
+        skip_bytes_ = cur_puff_->length + extra_byte_;
+        bytes_wrote += skip_bytes_;
+        huffed = std::move(huffed_[cur_puff_idx - huffed_begin_]);
+        deflate_data = huffed->data();
+        deflate_data[0] |= last_byte_;
+        last_byte_ = 0;
+      } else {
+        auto copy_len = std::min(length - bytes_wrote,
+                                 cur_puff_->length + extra_byte_ - skip_bytes_);
+        TEST_AND_RETURN_FALSE(puff_buffer_->size() >= skip_bytes_ + copy_len);
+        memcpy(puff_buffer_->data() + skip_bytes_, bytes + bytes_wrote,
+               copy_len);
+        skip_bytes_ += copy_len;
+        bytes_wrote += copy_len;
+        if (skip_bytes_ < cur_puff_->length + extra_byte_) {
+          continue;
+        }
 
+        // |puff_buffer_| is full, now huff into the |deflate_buffer_|.
+        puff_data = puff_buffer_->data();
         deflate_buffer_->resize(bytes_to_write);
+        UpdatePeakBufferBytes();
         BufferBitWriter bit_writer(deflate_buffer_->data(), bytes_to_write);
-        BufferPuffReader puff_reader(puff_buffer_->data(), cur_puff_->length);
+        BufferPuffReader puff_reader(puff_buffer_->data(), cur_puff_->length,
+                                     format_);
 
         // Write last byte if it has any.
         TEST_AND_RETURN_FALSE(
             bit_writer.WriteBits(cur_deflate_->offset & 7, last_byte_));
         last_byte_ = 0;
 
-        TEST_AND_RETURN_FALSE(huffer_->HuffDeflate(&puff_reader, &bit_writer));
+        {
+          TRACE_EVENT1("huff", "HuffDeflate", "puff_size", cur_puff_->length);
+          ScopedTimer timer(&stats_.huff_time_ns);
+          TEST_AND_RETURN_FALSE(
+              huffer_->HuffDeflate(&puff_reader, &bit_writer));
+        }
         TEST_AND_RETURN_FALSE(bit_writer.Size() == bytes_to_write);
         TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+        deflate_data = deflate_buffer_->data();
+      }
+      stats_.deflates_huffed++;
+      stats_.bytes_huffed += bytes_to_write;
 
-        deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
-        if (extra_byte_ == 1) {
-          deflate_buffer_->data()[bytes_to_write - 1] |=
-              puff_buffer_->data()[cur_puff_->length] << (deflate_bit_pos_ & 7);
-          deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
-        } else if ((deflate_bit_pos_ & 7) != 0) {
-          // This happens if current and next deflate finish and end on the same
-          // byte, then we cannot write into output until we have huffed the
-          // next puff buffer, so untill then we cache it into |last_byte_| and
-          // we won't write it out.
-          last_byte_ = deflate_buffer_->data()[bytes_to_write - 1];
-          bytes_to_write--;
-        }
+      deflate_bit_pos_ = cur_deflate_->offset + cur_deflate_->length;
+      if (extra_byte_ == 1) {
+        deflate_data[bytes_to_write - 1] |= puff_data[cur_puff_->length]
+                                            << (deflate_bit_pos_ & 7);
+        deflate_bit_pos_ = (deflate_bit_pos_ + 7) & ~7ull;
+      } else if ((deflate_bit_pos_ & 7) != 0) {
+        // This happens if current and next deflate finish and end on the same
+        // byte, then we cannot write into output until we have huffed the
+        // next puff buffer, so untill then we cache it into |last_byte_| and
+        // we won't write it out.
+        last_byte_ = deflate_data[bytes_to_write - 1];
+        bytes_to_write--;
+      }
 
-        // Write |deflate_buffer_| into output.
-        TEST_AND_RETURN_FALSE(
-            stream_->Write(deflate_buffer_->data(), bytes_to_write));
+      // Write the deflate into output.
+      TEST_AND_RETURN_FALSE(WriteStream(deflate_data, bytes_to_write));
 
-        // Move to the next deflate/puff.
-        puff_pos_ += skip_bytes_;
-        skip_bytes_ = 0;
-        cur_puff_++;
-        cur_deflate_++;
-        if (cur_puff_ == puffs_.end()) {
-          break;
-        }
-        // Find if need an extra byte to cache at the end.
-        TEST_AND_RETURN_FALSE(SetExtraByte());
+      // Move to the next deflate/puff.
+      puff_pos_ += skip_bytes_;
+      skip_bytes_ = 0;
+      cur_puff_++;
+      cur_deflate_++;
+      if (cur_puff_ == puffs_.end()) {
+        break;
       }
+      // Find if need an extra byte to cache at the end.
+      TEST_AND_RETURN_FALSE(SetExtraByte());
     }
   }
 
   TEST_AND_RETURN_FALSE(bytes_wrote == length);
+  // Nothing is left to be written into |stream_| once the puff stream is
+  // complete.
+  if (puff_pos_ + skip_bytes_ == puff_stream_size_) {
+    TEST_AND_RETURN_FALSE(FlushWrites());
+  }
+  return true;
+}
+
+bool PuffinStream::GetData(uint64_t offset,
+                           uint64_t length,
+                           const uint8_t** data) const {
+  if (!is_for_puff_ || max_cache_size_ == 0) {
+    return false;
+  }
+  auto puff_iter =
+      std::upper_bound(upper_bounds_.begin(), upper_bounds_.end(), offset);
+  auto puff_idx = std::distance(upper_bounds_.begin(), puff_iter);
+  // The last element of |puffs_| is the empty puff at the end of the stream.
+  if (puff_idx + 1 >= static_cast<int64_t>(puffs_.size())) {
+    return false;
+  }
+  const auto& puff = puffs_[puff_idx];
+  if (offset < puff.offset || offset + length > puff.offset + puff.length) {
+    return false;
+  }
+  for (const auto& cache : caches_) {
+    if (cache.first == puff_idx) {
+      *data = cache.second->data() + (offset - puff.offset);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PuffinStream::ReadInto(StreamInterface* dst, uint64_t count) {
+  TEST_AND_RETURN_FALSE(!closed_);
+  TEST_AND_RETURN_FALSE(is_for_puff_);
+  int src_fd, dst_fd;
+  bool copy_in_kernel =
+      stream_->GetFileDescriptor(&src_fd) && dst->GetFileDescriptor(&dst_fd);
+  Buffer buffer;
+  while (count > 0) {
+    TEST_AND_RETURN_FALSE(cur_puff_ != puffs_.end());
+    uint64_t length;
+    if (puff_pos_ < cur_puff_->offset) {
+      // Between two deflates. The whole bytes before the first byte of the
+      // next deflate are the same in the deflate and puff streams.
+      length = std::min(count, cur_puff_->offset - puff_pos_);
+      uint64_t start_byte = deflate_bit_pos_ / 8;
+      uint64_t end_byte = cur_deflate_->offset / 8;
+      if (copy_in_kernel && (deflate_bit_pos_ & 7) == 0 &&
+          start_byte < end_byte) {
+        length = std::min(count, end_byte - start_byte);
+        uint64_t copied;
+        {
+          TRACE_EVENT1("io", "CopyFileRange", "bytes", length);
+          ScopedTimer timer(&stats_.io_time_ns);
+          TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
+          copied = CopyFileRange(src_fd, dst_fd, length);
+        }
+        deflate_bit_pos_ += copied * 8;
+        puff_pos_ += copied;
+        count -= copied;
+        stats_.bytes_copied_in_kernel += copied;
+        if (copied == length) {
+          continue;
+        }
+        // The kernel cannot copy between these files.
+        copy_in_kernel = false;
+        length -= copied;
+      } else if (copy_in_kernel && (deflate_bit_pos_ & 7) != 0) {
+        // The first byte is shared with the previous deflate. After it the
+        // bytes can be copied in the kernel.
+        length = 1;
+      }
+    } else {
+      // The rest of the current puff.
+      length = std::min(count, cur_puff_->offset + cur_puff_->length -
+                                   puff_pos_ - skip_bytes_);
+    }
+    TEST_AND_RETURN_FALSE(length > 0);
+    length = std::min(length, kCopyBufferSize);
+    buffer.resize(std::max(buffer.size(), length));
+    TEST_AND_RETURN_FALSE(Read(buffer.data(), length));
+    TEST_AND_RETURN_FALSE(dst->Write(buffer.data(), length));
+    count -= length;
+  }
+  return true;
+}
+
+bool PuffinStream::WriteFrom(StreamInterface* src, uint64_t count) {
+  TEST_AND_RETURN_FALSE(!closed_);
+  TEST_AND_RETURN_FALSE(!is_for_puff_);
+  int src_fd, dst_fd;
+  bool copy_in_kernel =
+      src->GetFileDescriptor(&src_fd) && stream_->GetFileDescriptor(&dst_fd);
+  Buffer buffer;
+  while (count > 0) {
+    TEST_AND_RETURN_FALSE(cur_puff_ != puffs_.end());
+    uint64_t length;
+    if (deflate_bit_pos_ < (cur_deflate_->offset & ~7ull)) {
+      // Between two deflates. See |Write|.
+      length = std::min(count,
+                        (cur_deflate_->offset / 8) - (deflate_bit_pos_ / 8));
+      if (copy_in_kernel) {
+        // The copied bytes go after the ones written so far.
+        TEST_AND_RETURN_FALSE(FlushWrites());
+        uint64_t copied;
+        {
+          TRACE_EVENT1("io", "CopyFileRange", "bytes", length);
+          ScopedTimer timer(&stats_.io_time_ns);
+          copied = CopyFileRange(src_fd, dst_fd, length);
+        }
+        deflate_bit_pos_ += copied * 8;
+        puff_pos_ += copied;
+        count -= copied;
+        stats_.bytes_copied_in_kernel += copied;
+        if (copied == length) {
+          continue;
+        }
+        copy_in_kernel = false;
+        length -= copied;
+      }
+    } else {
+      // The rest of the current puff, including the bytes it shares with the
+      // neighboring deflates.
+      length = std::min(count, cur_puff_->offset + cur_puff_->length +
+                                   extra_byte_ - puff_pos_ - skip_bytes_);
+    }
+    TEST_AND_RETURN_FALSE(length > 0);
+    length = std::min(length, kCopyBufferSize);
+    buffer.resize(std::max(buffer.size(), length));
+    TEST_AND_RETURN_FALSE(src->Read(buffer.data(), length));
+    TEST_AND_RETURN_FALSE(Write(buffer.data(), length));
+    count -= length;
+  }
   return true;
 }
 
 bool PuffinStream::SetExtraByte() {
   TEST_AND_RETURN_FALSE(cur_deflate_ != deflates_.end());
-  if ((cur_deflate_ + 1) == deflates_.end()) {
-    extra_byte_ = 0;
+  extra_byte_ = GetExtraByte(std::distance(deflates_.begin(), cur_deflate_));
+  return true;
+}
+
+uint64_t PuffinStream::GetExtraByte(size_t puff_idx) const {
+  if (puff_idx + 1 >= deflates_.size()) {
+    return 0;
+  }
+  uint64_t end_bit = deflates_[puff_idx].offset + deflates_[puff_idx].length;
+  if ((end_bit & 7) &&
+      ((end_bit + 7) & ~7ull) <= deflates_[puff_idx + 1].offset) {
+    return 1;
+  }
+  return 0;
+}
+
+bool PuffinStream::PuffAhead(size_t begin,
+                             uint8_t* buffer,
+                             uint64_t length,
+                             size_t* end) {
+  *end = begin;
+  // The last puff is the empty one at the end of the stream.
+  auto base = puffs_[begin].offset;
+  auto start_byte = deflates_[begin].offset / 8;
+  auto end_byte = start_byte;
+  for (auto idx = begin; idx + 1 < puffs_.size(); idx++) {
+    const auto& deflate = deflates_[idx];
+    auto deflate_end_byte = (deflate.offset + deflate.length + 7) / 8;
+    if (puffs_[idx].offset + puffs_[idx].length - base > length ||
+        (idx > begin && deflate_end_byte - start_byte > kMaxParallelBytes)) {
+      break;
+    }
+    end_byte = deflate_end_byte;
+    *end = idx + 1;
+  }
+  if (*end - begin < 2) {
+    *end = begin;
     return true;
   }
-  uint64_t end_bit = cur_deflate_->offset + cur_deflate_->length;
-  if ((end_bit & 7) && ((end_bit + 7) & ~7ull) <= (cur_deflate_ + 1)->offset) {
-    extra_byte_ = 1;
-  } else {
-    extra_byte_ = 0;
+
+  // All the deflates are read at once. The bytes between them are read from
+  // |read_buffer_| afterwards.
+  decoder_.reset();
+  const uint8_t* data;
+  auto span = end_byte - start_byte;
+  if (!stream_->GetData(start_byte, span, &data)) {
+    if (!read_buffer_ || read_buffer_->size() < span) {
+      read_buffer_ = pool_->Acquire(std::max(span, kReadBufferSize));
+      UpdatePeakBufferBytes();
+    }
+    // Forget the buffered bytes if the read fails.
+    read_buffer_length_ = 0;
+    TRACE_EVENT1("io", "Read", "bytes", span);
+    ScopedTimer timer(&stats_.io_time_ns);
+    stats_.stream_reads++;
+    TEST_AND_RETURN_FALSE(stream_->Seek(start_byte));
+    TEST_AND_RETURN_FALSE(stream_->Read(read_buffer_->data(), span));
+    read_buffer_offset_ = start_byte;
+    read_buffer_length_ = span;
+    data = read_buffer_->data();
+  }
+
+  // Not a |vector<bool>|, so the threads can set their elements concurrently.
+  vector<uint8_t> from_cache(*end - begin, 0);
+  {
+    TRACE_EVENT1("puff", "PuffAhead", "deflates", *end - begin);
+    ScopedTimer timer(&stats_.puff_time_ns);
+    // Each deflate ends where the next one starts, so they are puffed on their
+    // own. The bits they share a byte with are masked off by |Read|.
+    TEST_AND_RETURN_FALSE(
+        ParallelFor(begin, *end, num_threads_, [&](size_t idx) {
+          bool hit;
+          TEST_AND_RETURN_FALSE(PuffDeflate(
+              idx, data + (deflates_[idx].offset / 8 - start_byte),
+              buffer + (puffs_[idx].offset - base), &hit));
+          from_cache[idx - begin] = hit;
+          return true;
+        }));
+  }
+
+  for (auto idx = begin; idx < *end; idx++) {
+    if (from_cache[idx - begin]) {
+      stats_.puff_cache_hits++;
+    } else {
+      stats_.deflates_puffed++;
+      stats_.bytes_puffed += puffs_[idx].length;
+      if (puffed_[idx]) {
+        stats_.deflates_repuffed++;
+      }
+    }
+    puffed_[idx] = true;
+  }
+  return true;
+}
+
+bool PuffinStream::PuffDeflate(size_t puff_idx,
+                               const uint8_t* data,
+                               uint8_t* puff,
+                               bool* from_cache) const {
+  const auto& deflate = deflates_[puff_idx];
+  const auto& puff_extent = puffs_[puff_idx];
+  auto start_bits = deflate.offset & 7;
+  auto length = (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+  *from_cache = false;
+  bool use_cache = puff_cache_ && puff_extent.length >= kMinCachedPuffSize;
+  uint64_t key = 0;
+  if (use_cache) {
+    key = ComputePuffCacheKey(data, start_bits, deflate.length,
+                              puff_extent.length, format_);
+    if (puff_cache_->Get(key, puff, puff_extent.length)) {
+      *from_cache = true;
+      return true;
+    }
+  }
+
+  BufferBitReader bit_reader(data, length);
+  BufferPuffWriter puff_writer(puff, puff_extent.length, format_);
+  // Drop the first unused bits.
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(start_bits));
+  bit_reader.DropBits(start_bits);
+  TEST_AND_RETURN_FALSE(
+      puffer_->PuffDeflate(&bit_reader, &puff_writer, nullptr));
+  TEST_AND_RETURN_FALSE(bit_reader.Offset() == length);
+  TEST_AND_RETURN_FALSE(puff_writer.Size() == puff_extent.length);
+  if (use_cache) {
+    // Failing to add it only means puffing it again next time.
+    puff_cache_->Put(key, puff, puff_extent.length);
   }
   return true;
 }
 
+bool PuffinStream::HuffAhead(size_t begin,
+                             const uint8_t* buffer,
+                             uint64_t length) {
+  huffed_begin_ = huffed_end_ = begin;
+  // Each puff needs its extra byte too, see |extra_byte_|.
+  auto base = puffs_[begin].offset;
+  auto start_byte = deflates_[begin].offset / 8;
+  for (auto idx = begin; idx + 1 < puffs_.size(); idx++) {
+    const auto& deflate = deflates_[idx];
+    auto end_byte = (deflate.offset + deflate.length + 7) / 8;
+    if (puffs_[idx].offset + puffs_[idx].length + GetExtraByte(idx) - base >
+            length ||
+        (idx > begin && end_byte - start_byte > kMaxParallelBytes)) {
+      break;
+    }
+    huffed_end_ = idx + 1;
+  }
+  if (huffed_end_ - begin < 2) {
+    huffed_end_ = begin;
+    return true;
+  }
+
+  TRACE_EVENT1("huff", "HuffAhead", "deflates", huffed_end_ - begin);
+  ScopedTimer timer(&stats_.huff_time_ns);
+  huffed_.clear();
+  huffed_.resize(huffed_end_ - begin);
+  // The bits a deflate shares with the previous one are added by |Write|.
+  return ParallelFor(begin, huffed_end_, num_threads_, [&](size_t idx) {
+    const auto& deflate = deflates_[idx];
+    const auto& puff = puffs_[idx];
+    auto deflate_length =
+        (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+    auto deflate_buffer = pool_->Acquire(deflate_length);
+    BufferBitWriter bit_writer(deflate_buffer->data(), deflate_length);
+    BufferPuffReader puff_reader(buffer + (puff.offset - base), puff.length,
+                                 format_);
+    TEST_AND_RETURN_FALSE(bit_writer.WriteBits(deflate.offset & 7, 0));
+    TEST_AND_RETURN_FALSE(huffer_->HuffDeflate(&puff_reader, &bit_writer));
+    TEST_AND_RETURN_FALSE(bit_writer.Size() == deflate_length);
+    TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+    huffed_[idx - begin] = std::move(deflate_buffer);
+    return true;
+  });
+}
+
 bool PuffinStream::GetPuffCache(int puff_id,
                                 uint64_t puff_size,
                                 shared_ptr<Buffer>* buffer) {
@@ -458,25 +985,23 @@ bool PuffinStream::GetPuffCache(int puff_id,
   // If not found, either create one or get one from the list.
   if (!found) {
     // If |caches_| were full, remove last ones in the list (least used), until
-    // we have enough space for the new cache.
+    // we have enough space for the new cache. The removed buffers go back to
+    // |pool_|, so one of them is most likely reused below.
     while (!caches_.empty() && cur_cache_size_ + puff_size > max_cache_size_) {
-      cache = std::move(caches_.back());
+      TRACE_EVENT_INSTANT1("cache", "EvictPuffCache", "puff_id",
+                           caches_.back().first);
+      cur_cache_size_ -= caches_.back().second->size();
       caches_.pop_back();  // Remove it from the list.
-      cur_cache_size_ -= cache.second->capacity();
-    }
-    // If we have not populated the cache yet, create one.
-    if (!cache.second) {
-      cache.second.reset(new Buffer(puff_size));
+      stats_.cache_evictions++;
     }
-    cache.second->resize(puff_size);
-
-    constexpr uint64_t kMaxSizeDifference = 20 * 1024;
-    if (puff_size + kMaxSizeDifference < cache.second->capacity()) {
-      cache.second->shrink_to_fit();
-    }
-
-    cur_cache_size_ += cache.second->capacity();
+    cache.second = pool_->Acquire(puff_size);
+    cur_cache_size_ += puff_size;
     cache.first = puff_id;
+    stats_.peak_cache_bytes =
+        std::max(stats_.peak_cache_bytes, cur_cache_size_);
+    stats_.cache_misses++;
+  } else {
+    stats_.cache_hits++;
   }
 
   *buffer = cache.second;
@@ -487,4 +1012,126 @@ bool PuffinStream::GetPuffCache(int puff_id,
   return found;
 }
 
+bool PuffinStream::ReadDeflate(size_t puff_idx,
+                               bool keep,
+                               const uint8_t** data) {
+  // The bytes |decoder_| puffs may be overwritten.
+  decoder_.reset();
+  auto start_byte = deflates_[puff_idx].offset / 8;
+  auto end_byte =
+      (deflates_[puff_idx].offset + deflates_[puff_idx].length + 7) / 8;
+  auto length = end_byte - start_byte;
+  // If the deflate stream is in memory, it is puffed in place; then the stored
+  // blocks are copied only once.
+  if (stream_->GetData(start_byte, length, data)) {
+    return true;
+  }
+  if (read_ahead_ && read_ahead_ids_[puff_idx] != kNoReadAhead) {
+    TRACE_EVENT1("io", "Read", "bytes", length);
+    ScopedTimer timer(&stats_.io_time_ns);
+    bool read_ahead;
+    TEST_AND_RETURN_FALSE(read_ahead_->Get(read_ahead_ids_[puff_idx],
+                                           &deflate_buffer_, &read_ahead));
+    TEST_AND_RETURN_FALSE(deflate_buffer_->size() == length);
+    if (read_ahead) {
+      stats_.deflates_read_ahead++;
+    }
+    UpdatePeakBufferBytes();
+    *data = deflate_buffer_->data();
+    return true;
+  }
+  deflate_buffer_->resize(length);
+  UpdatePeakBufferBytes();
+  TEST_AND_RETURN_FALSE(
+      ReadStream(start_byte, length, deflate_buffer_->data(), data));
+  if (keep && *data != deflate_buffer_->data()) {
+    memcpy(deflate_buffer_->data(), *data, length);
+    *data = deflate_buffer_->data();
+  }
+  return true;
+}
+
+bool PuffinStream::ReadStream(uint64_t offset,
+                              uint64_t length,
+                              uint8_t* buffer,
+                              const uint8_t** data) {
+  if (offset >= read_buffer_offset_ &&
+      offset + length <= read_buffer_offset_ + read_buffer_length_) {
+    *data = read_buffer_->data() + (offset - read_buffer_offset_);
+    return true;
+  }
+  // The bytes after the requested ones are read too, but not those of the
+  // next deflate that is read ahead.
+  auto end = std::min(offset + kReadBufferSize, deflate_stream_size_);
+  auto next_read_ahead = std::lower_bound(
+      read_ahead_starts_.begin(), read_ahead_starts_.end(), offset + length);
+  if (next_read_ahead != read_ahead_starts_.end()) {
+    end = std::min(end, *next_read_ahead);
+  }
+  if (end < offset + length) {
+    end = offset + length;
+    *data = buffer;
+  } else {
+    if (!read_buffer_) {
+      read_buffer_ = pool_->Acquire(kReadBufferSize);
+      UpdatePeakBufferBytes();
+    }
+    // Forget the buffered bytes if the read fails.
+    read_buffer_length_ = 0;
+    *data = read_buffer_->data();
+  }
+
+  TRACE_EVENT1("io", "Read", "bytes", end - offset);
+  ScopedTimer timer(&stats_.io_time_ns);
+  stats_.stream_reads++;
+  TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+  TEST_AND_RETURN_FALSE(
+      stream_->Read(const_cast<uint8_t*>(*data), end - offset));
+  if (*data != buffer) {
+    read_buffer_offset_ = offset;
+    read_buffer_length_ = end - offset;
+  }
+  return true;
+}
+
+bool PuffinStream::WriteStream(const uint8_t* data, uint64_t length) {
+  if (write_length_ + length > kWriteBufferSize) {
+    TEST_AND_RETURN_FALSE(FlushWrites());
+  }
+  if (length >= kWriteBufferSize) {
+    TRACE_EVENT1("io", "Write", "bytes", length);
+    ScopedTimer timer(&stats_.io_time_ns);
+    stats_.stream_writes++;
+    TEST_AND_RETURN_FALSE(stream_->Write(data, length));
+    return true;
+  }
+  if (!write_buffer_) {
+    write_buffer_ = pool_->Acquire(kWriteBufferSize);
+    UpdatePeakBufferBytes();
+  }
+  memcpy(write_buffer_->data() + write_length_, data, length);
+  write_length_ += length;
+  return true;
+}
+
+bool PuffinStream::FlushWrites() {
+  if (write_length_ == 0) {
+    return true;
+  }
+  TRACE_EVENT1("io", "Write", "bytes", write_length_);
+  ScopedTimer timer(&stats_.io_time_ns);
+  stats_.stream_writes++;
+  TEST_AND_RETURN_FALSE(stream_->Write(write_buffer_->data(), write_length_));
+  write_length_ = 0;
+  return true;
+}
+
+void PuffinStream::UpdatePeakBufferBytes() {
+  uint64_t buffer_bytes =
+      puff_buffer_->capacity() + deflate_buffer_->capacity() +
+      (read_buffer_ ? read_buffer_->capacity() : 0) +
+      (write_buffer_ ? write_buffer_->capacity() : 0);
+  stats_.peak_buffer_bytes = std::max(stats_.peak_buffer_bytes, buffer_bytes);
+}
+
 }  // namespace puffin
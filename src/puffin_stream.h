@@ -11,10 +11,15 @@
 #include <utility>
 #include <vector>
 
+#include "puffin/src/include/puffin/buffer_pool.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puff_cache.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/stream.h"
+#include "puffin/src/include/puffin/stream_stats.h"
+#include "puffin/src/puff_decoder.h"
+#include "puffin/src/read_ahead.h"
 
 namespace puffin {
 
@@ -30,7 +35,7 @@ namespace puffin {
 // reading and writing at the same time.
 class PuffinStream : public StreamInterface {
  public:
-  ~PuffinStream() override = default;
+  ~PuffinStream() override;
 
   // Creates a |PuffinStream| for reading puff buffers from a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -43,12 +48,31 @@ class PuffinStream : public StreamInterface {
   //                      If the mount is smaller than the maximum puff buffer
   //                      size in |puffs|, then its value will be set to zero
   //                      and no puff will be cached.
-  static UniqueStreamPtr CreateForPuff(UniqueStreamPtr stream,
-                                       std::shared_ptr<Puffer> puffer,
-                                       uint64_t puff_size,
-                                       const std::vector<BitExtent>& deflates,
-                                       const std::vector<ByteExtent>& puffs,
-                                       size_t max_cache_size = 0);
+  // |pool|      IN  The pool the puff, deflate and cache buffers are taken
+  //                 from. If null, the stream creates its own pool which only
+  //                 recycles the evicted cache buffers.
+  // |format|    IN  The layout of the puffs.
+  // |num_threads| IN  The number of threads puffing the deflates that a
+  //                   |Read| fills whole puffs of, or one per CPU if zero.
+  //                   Without a cache, each deflate (which is usually one
+  //                   deflate block) is puffed on its own directly into the
+  //                   read buffer.
+  // |puff_cache| IN  If not null, the puffs of at least |kMinCachedPuffSize|
+  //                  bytes are read from it instead of being puffed, and the
+  //                  ones it does not have are added to it. The puffs read in
+  //                  pieces (see |PuffDecoder|) are never whole in memory, so
+  //                  they do not use it.
+  static UniqueStreamPtr CreateForPuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Puffer> puffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      size_t max_cache_size = 0,
+      std::shared_ptr<BufferPoolInterface> pool = nullptr,
+      PuffFormat format = PuffFormat::kV1,
+      size_t num_threads = 1,
+      std::shared_ptr<PuffCacheInterface> puff_cache = nullptr);
 
   // Creates a |PuffinStream| for writing puff buffers into a deflate stream.
   // |stream|    IN  The deflate stream.
@@ -57,11 +81,21 @@ class PuffinStream : public StreamInterface {
   //                 completely puffed.
   // |deflates|  IN  The location of deflates in |stream|.
   // |puffs|     IN  The location of puffs into the input puff stream.
-  static UniqueStreamPtr CreateForHuff(UniqueStreamPtr stream,
-                                       std::shared_ptr<Huffer> huffer,
-                                       uint64_t puff_size,
-                                       const std::vector<BitExtent>& deflates,
-                                       const std::vector<ByteExtent>& puffs);
+  // |pool|      IN  The pool the puff and deflate buffers are taken from. Can
+  //                 be null.
+  // |format|    IN  The layout of the puffs.
+  // |num_threads| IN  The number of threads huffing the puffs that a |Write|
+  //                   has whole, or one per CPU if zero. The deflates are
+  //                   huffed separately and stitched together in order.
+  static UniqueStreamPtr CreateForHuff(
+      UniqueStreamPtr stream,
+      std::shared_ptr<Huffer> huffer,
+      uint64_t puff_size,
+      const std::vector<BitExtent>& deflates,
+      const std::vector<ByteExtent>& puffs,
+      std::shared_ptr<BufferPoolInterface> pool = nullptr,
+      PuffFormat format = PuffFormat::kV1,
+      size_t num_threads = 1);
 
   bool GetSize(uint64_t* size) const override;
 
@@ -85,6 +119,27 @@ class PuffinStream : public StreamInterface {
 
   bool Close() override;
 
+  // If the |length| bytes at |offset| of the puff stream are all in one puff
+  // that is in the puff cache, sets |data| to them without puffing or copying
+  // anything. A |Read| may evict the puff from the cache, which is why
+  // |StreamInterface::GetData| is only valid until the next |Read|.
+  bool GetData(uint64_t offset,
+               uint64_t length,
+               const uint8_t** data) const override;
+
+  // Same as reading |count| bytes and writing them into |dst|, except that the
+  // bytes between the deflates, which are the same in the puff stream, are
+  // copied inside the kernel if both |stream_| and |dst| are files.
+  bool ReadInto(StreamInterface* dst, uint64_t count);
+
+  // Same as reading |count| bytes from |src| and writing them, except that the
+  // bytes between the deflates are copied inside the kernel if both |src| and
+  // |stream_| are files.
+  bool WriteFrom(StreamInterface* src, uint64_t count);
+
+  // Returns the statistics collected by this stream so far.
+  const PuffinStreamStats& GetStats() const { return stats_; }
+
  protected:
   // The non-public internal Ctor.
   PuffinStream(UniqueStreamPtr stream,
@@ -93,27 +148,95 @@ class PuffinStream : public StreamInterface {
                uint64_t puff_size,
                const std::vector<BitExtent>& deflates,
                const std::vector<ByteExtent>& puffs,
-               size_t max_cache_size);
+               size_t max_cache_size,
+               std::shared_ptr<BufferPoolInterface> pool,
+               PuffFormat format,
+               size_t num_threads,
+               std::shared_ptr<PuffCacheInterface> puff_cache);
 
  private:
   // See |extra_byte_|.
   bool SetExtraByte();
 
-  // Returns the cache for the |puff_id|th puff. If it does not find it, either
-  // returns the least accessed cached (if cache is full) or creates a new empty
-  // buffer. It returns false if it cannot find the |puff_id|th puff cache.
+  // Returns the |extra_byte_| of the |puff_idx|th puff.
+  uint64_t GetExtraByte(size_t puff_idx) const;
+
+  // Puffs the deflates from the |begin|th one on |num_threads_| threads, as
+  // long as their puffs fit in the |length| bytes of |buffer|, which starts
+  // at the first one. The deflates are puffed directly into |buffer| and
+  // |end| is set to the index after the last one. If there are not at least
+  // two of them, nothing is puffed and |end| is set to |begin|.
+  bool PuffAhead(size_t begin, uint8_t* buffer, uint64_t length, size_t* end);
+
+  // Same as |PuffAhead| for huffing the puffs in the |length| bytes of
+  // |buffer| from the |begin|th one. The deflates are kept in |huffed_| until
+  // they are written.
+  bool HuffAhead(size_t begin, const uint8_t* buffer, uint64_t length);
+
+  // Puffs the deflate of the |puff_idx|th puff from |data|, which has its
+  // bytes, into |puff|, or reads the puff from |puff_cache_| if it is there.
+  // Sets |from_cache| to whether it was. The puffs not in |puff_cache_| are
+  // added to it.
+  bool PuffDeflate(size_t puff_idx,
+                   const uint8_t* data,
+                   uint8_t* puff,
+                   bool* from_cache) const;
+
+  // Updates the peak size of the buffers of this stream (not including the
+  // cache) in |stats_|.
+  void UpdatePeakBufferBytes();
+
+  // Sets |data| to the bytes of the deflate of the |puff_idx|th puff. If |keep|
+  // is true, they stay valid until the next call; otherwise only until the
+  // next read from |stream_|.
+  bool ReadDeflate(size_t puff_idx, bool keep, const uint8_t** data);
+
+  // Sets |data| to the |length| bytes at |offset| of |stream_|. The bytes after
+  // them are read into |read_buffer_| too, so reading the following gaps and
+  // deflates does not need another read from |stream_|. If there are too many
+  // bytes for |read_buffer_|, they are read into |buffer| instead. |data| is
+  // valid until the next call.
+  bool ReadStream(uint64_t offset,
+                  uint64_t length,
+                  uint8_t* buffer,
+                  const uint8_t** data);
+
+  // Writes |length| bytes of |data| into |stream_| through |write_buffer_|.
+  bool WriteStream(const uint8_t* data, uint64_t length);
+
+  // Writes |write_buffer_| into |stream_|.
+  bool FlushWrites();
+
+  // Returns the cache for the |puff_id|th puff. If it does not find it, evicts
+  // the least recently used caches until there is enough space and takes a new
+  // buffer from |pool_|. It returns false if it cannot find the |puff_id|th
+  // puff cache.
   bool GetPuffCache(int puff_id,
                     uint64_t puff_size,
                     std::shared_ptr<Buffer>* buffer);
 
   UniqueStreamPtr stream_;
 
+  // Reads the large deflates ahead of puffing them if |stream_| is a file. It
+  // is declared after |stream_| so it is destroyed first.
+  std::unique_ptr<ReadAhead> read_ahead_;
+  // The index of each deflate in |read_ahead_|, and the first bytes of the
+  // deflates in it.
+  std::vector<size_t> read_ahead_ids_;
+  std::vector<uint64_t> read_ahead_starts_;
+
   std::shared_ptr<Puffer> puffer_;
   std::shared_ptr<Huffer> huffer_;
 
   // The size of the imaginary puff stream.
   uint64_t puff_stream_size_;
 
+  // The size of the deflate stream |stream_|.
+  uint64_t deflate_stream_size_;
+
+  // The layout of the puffs in the imaginary puff stream.
+  PuffFormat format_;
+
   std::vector<BitExtent> deflates_;
   // The current deflate is being processed.
   std::vector<BitExtent>::iterator cur_deflate_;
@@ -151,17 +274,54 @@ class PuffinStream : public StreamInterface {
   // True if the |Close()| is called.
   bool closed_;
 
-  std::unique_ptr<Buffer> deflate_buffer_;
+  // All the buffers below are taken from here.
+  std::shared_ptr<BufferPoolInterface> pool_;
+
+  std::shared_ptr<Buffer> deflate_buffer_;
   std::shared_ptr<Buffer> puff_buffer_;
 
+  // The number of threads puffing or huffing the deflates of one |Read| or
+  // |Write|.
+  size_t num_threads_;
+
+  // The deflates of the puffs in [|huffed_begin_|, |huffed_end_|) which were
+  // huffed by |HuffAhead| but not written yet. Their bits before the deflate
+  // in the first byte are zero.
+  std::vector<std::shared_ptr<Buffer>> huffed_;
+  size_t huffed_begin_;
+  size_t huffed_end_;
+
+  // Puffs the |decoder_puff_idx_|th puff in pieces when it is too large to be
+  // puffed at once.
+  std::unique_ptr<PuffDecoder> decoder_;
+  size_t decoder_puff_idx_;
+
+  // The |read_buffer_length_| bytes of |stream_| at |read_buffer_offset_|.
+  std::shared_ptr<Buffer> read_buffer_;
+  uint64_t read_buffer_offset_;
+  uint64_t read_buffer_length_;
+
+  // The |write_length_| bytes written but not written into |stream_| yet.
+  std::shared_ptr<Buffer> write_buffer_;
+  uint64_t write_length_;
+
   // The list of puff buffer caches.
   std::list<std::pair<int, std::shared_ptr<Buffer>>> caches_;
   // The maximum memory (in bytes) kept for caching puff buffers by an object of
   // this class.
   size_t max_cache_size_;
-  // The current amount of memory (in bytes) used for caching puff buffers.
+  // The total size (in bytes) of the cached puff buffers. Their capacity can
+  // be slightly larger because of the size classes of |pool_|.
   uint64_t cur_cache_size_;
 
+  // The puffs kept across runs. Can be null.
+  std::shared_ptr<PuffCacheInterface> puff_cache_;
+
+  // Whether each puff has already been puffed once. Used for counting re-puffs.
+  std::vector<bool> puffed_;
+
+  PuffinStreamStats stats_;
+
   DISALLOW_COPY_AND_ASSIGN(PuffinStream);
 };
 
@@ -3,19 +3,26 @@
 // found in the LICENSE file.
 
 #include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "gtest/gtest.h"
 
 #include "puffin/src/bit_reader.h"
 #include "puffin/src/bit_writer.h"
+#include "puffin/src/file_stream.h"
+#include "puffin/src/huffman_table.h"
 #include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/deflate_index.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/include/puffin/verify.h"
 #include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_decoder.h"
 #include "puffin/src/puff_reader.h"
 #include "puffin/src/puff_writer.h"
 #include "puffin/src/puffin_stream.h"
@@ -262,6 +269,42 @@ TEST_F(PuffinTest, FixedHuffmanTableCompressedTest) {
   CheckSample(kRaw5, kDeflate, kPuff);
 }
 
+// Tests that the Huffman code of each alphabet in the fixed Huffman table is
+// decoded back into the same alphabet, and that the codes are the ones in
+// RFC1951 with their bits reversed.
+TEST_F(PuffinTest, FixedHuffmanTableCodesTest) {
+  const auto& ht = GetFixedHuffmanTable();
+  for (uint16_t alphabet = 0; alphabet < 288; alphabet++) {
+    uint16_t huffman, decoded;
+    size_t nbits, decoded_nbits;
+    ASSERT_TRUE(ht.LitLenHuffman(alphabet, &huffman, &nbits));
+    size_t expected_nbits = 8;
+    if (alphabet >= 144 && alphabet < 256) {
+      expected_nbits = 9;
+    } else if (alphabet >= 256 && alphabet < 280) {
+      expected_nbits = 7;
+    }
+    EXPECT_EQ(nbits, expected_nbits);
+    ASSERT_TRUE(ht.LitLenAlphabet(huffman, &decoded, &decoded_nbits));
+    EXPECT_EQ(decoded, alphabet);
+    EXPECT_EQ(decoded_nbits, nbits);
+  }
+  uint16_t huffman;
+  size_t nbits;
+  // 0 is 00110000 and 256 is 0000000 in RFC1951.
+  ASSERT_TRUE(ht.LitLenHuffman(0, &huffman, &nbits));
+  EXPECT_EQ(huffman, 0x0C);
+  ASSERT_TRUE(ht.LitLenHuffman(256, &huffman, &nbits));
+  EXPECT_EQ(huffman, 0);
+  EXPECT_EQ(nbits, 7u);
+  // 29 is 11101 in RFC1951.
+  ASSERT_TRUE(ht.DistanceHuffman(29, &huffman, &nbits));
+  EXPECT_EQ(huffman, 0x17);
+  EXPECT_EQ(nbits, 5u);
+  EXPECT_FALSE(ht.LitLenHuffman(288, &huffman, &nbits));
+  EXPECT_FALSE(ht.DistanceHuffman(30, &huffman, &nbits));
+}
+
 // Tests that uncompressed deflate blocks are not ignored when the output
 // deflate location pointer is null.
 TEST_F(PuffinTest, NoIgnoreUncompressedBlocksTest) {
@@ -446,6 +489,201 @@ TEST_F(PuffinTest, DynamicHuffmanTableTest) {
   CheckSample(kDynamicHTRaw, kDynamicHTDeflate, kDynamicHTPuff);
 }
 
+TEST_F(PuffinTest, PuffStatsTest) {
+  auto puff_with_stats = [this](const Buffer& deflate, PuffStats* stats) {
+    BufferBitReader bit_reader(deflate.data(), deflate.size());
+    BufferPuffWriter puff_writer(nullptr, 0);
+    return puffer_.PuffDeflate(&bit_reader, &puff_writer, nullptr, stats);
+  };
+
+  // An uncompressed block of five bytes.
+  PuffStats stats;
+  ASSERT_TRUE(puff_with_stats({0x01, 0x05, 0x00, 0xFA, 0xFF, 0x01, 0x02, 0x03,
+                               0x04, 0x05},
+                              &stats));
+  EXPECT_EQ(stats.uncompressed_blocks, 1u);
+  EXPECT_EQ(stats.uncompressed_bytes, 5u);
+  EXPECT_EQ(stats.fixed_blocks + stats.dynamic_blocks, 0u);
+
+  // A fixed Huffman block with five literals.
+  ASSERT_TRUE(
+      puff_with_stats({0x63, 0x64, 0x62, 0x66, 0x61, 0x05, 0x00}, &stats));
+  EXPECT_EQ(stats.fixed_blocks, 1u);
+  EXPECT_EQ(stats.literals, 5u);
+  EXPECT_EQ(stats.matches, 0u);
+  EXPECT_EQ(stats.max_block_symbols, 5u);
+
+  // A dynamic Huffman block.
+  stats = PuffStats();
+  ASSERT_TRUE(puff_with_stats(kDynamicHTDeflate, &stats));
+  EXPECT_EQ(stats.dynamic_blocks, 1u);
+  EXPECT_GT(stats.matches, 0u);
+  EXPECT_EQ(stats.literals + stats.match_length_sum, kDynamicHTRaw.size());
+  EXPECT_EQ(stats.max_block_symbols, stats.literals + stats.matches);
+  EXPECT_GT(stats.match_distance_sum, 0u);
+  EXPECT_GT(stats.dynamic_header_bits, 0u);
+  EXPECT_GT(stats.dynamic_header_puff_bytes, 0u);
+}
+
+// Tests that one |Puffer| and one |Huffer| can be used by multiple threads at
+// the same time, on both fixed and dynamic Huffman blocks.
+TEST_F(PuffinTest, ConcurrentPuffHuffTest) {
+  const std::pair<Buffer, Buffer> kSamples[] = {
+      {kDynamicHTDeflate, kDynamicHTPuff},
+      {{0x63, 0x64, 0x62, 0x66, 0x61, 0x05, 0x00},
+       {0x00, 0x00, 0xA0, 0x04, 0x01, 0x02, 0x03, 0x04, 0x05, 0xFF, 0x81}},
+  };
+  const size_t kNumThreads = 4;
+  const size_t kIterations = 200;
+  std::atomic<size_t> failures(0);
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread < kNumThreads; thread++) {
+    threads.emplace_back([&, thread]() {
+      const auto& sample = kSamples[thread % 2];
+      for (size_t idx = 0; idx < kIterations; idx++) {
+        Buffer puff(sample.second.size());
+        BufferBitReader br(sample.first.data(), sample.first.size());
+        BufferPuffWriter pw(puff.data(), puff.size());
+        Buffer deflate(sample.first.size());
+        BufferPuffReader pr(sample.second.data(), sample.second.size());
+        BufferBitWriter bw(deflate.data(), deflate.size());
+        if (!puffer_.PuffDeflate(&br, &pw, nullptr) || !pw.Flush() ||
+            puff != sample.second || !huffer_.HuffDeflate(&pr, &bw) ||
+            !bw.Flush() || deflate != sample.first) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(failures, 0u);
+}
+
+// Tests that |PuffFormat::kV2| puffs have the same size as |PuffFormat::kV1|
+// puffs, have the literals of each block after its other records and are
+// huffed back into the same deflates.
+TEST_F(PuffinTest, PuffFormatV2Test) {
+  const Buffer kDeflate = {0x63, 0x64, 0x62, 0x66, 0x61, 0x05, 0x00};
+  const Buffer kPuffV1 = {0x00, 0x00, 0xA0, 0x04, 0x01, 0x02,
+                          0x03, 0x04, 0x05, 0xFF, 0x81};
+  const Buffer kPuffV2 = {0x00, 0x00, 0xA0, 0x04, 0xFF, 0x81,
+                          0x01, 0x02, 0x03, 0x04, 0x05};
+  const std::pair<Buffer, Buffer> kSamples[] = {
+      {kDeflate, kPuffV1},
+      {kDynamicHTDeflate, kDynamicHTPuff},
+  };
+  for (const auto& sample : kSamples) {
+    BufferBitReader br(sample.first.data(), sample.first.size());
+    BufferPuffWriter size_pw(nullptr, 0, PuffFormat::kV2);
+    ASSERT_TRUE(puffer_.PuffDeflate(&br, &size_pw, nullptr));
+    EXPECT_EQ(size_pw.Size(), sample.second.size());
+
+    Buffer puff(sample.second.size());
+    BufferBitReader br2(sample.first.data(), sample.first.size());
+    BufferPuffWriter pw(puff.data(), puff.size(), PuffFormat::kV2);
+    ASSERT_TRUE(puffer_.PuffDeflate(&br2, &pw, nullptr));
+    EXPECT_EQ(pw.Size(), puff.size());
+    if (sample.second == kPuffV1) {
+      EXPECT_EQ(puff, kPuffV2);
+    }
+
+    Buffer deflate(sample.first.size());
+    BufferPuffReader pr(puff.data(), puff.size(), PuffFormat::kV2);
+    BufferBitWriter bw(deflate.data(), deflate.size());
+    ASSERT_TRUE(huffer_.HuffDeflate(&pr, &bw));
+    ASSERT_TRUE(bw.Flush());
+    EXPECT_EQ(pr.BytesLeft(), 0u);
+    EXPECT_EQ(deflate, sample.first);
+  }
+}
+
+// Tests that |PuffDecoder| puffs the same bytes as |Puffer| in both formats,
+// whatever the sizes of the reads.
+TEST_F(PuffinTest, PuffDecoderTest) {
+  Buffer fixed_deflate, fixed_puff;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(3, 10000, &fixed_deflate, &fixed_puff));
+  // The same deflate starting at the fourth bit of its first byte.
+  vector<BitExtent> blocks;
+  BufferBitReader blocks_br(fixed_deflate.data(), fixed_deflate.size());
+  BufferPuffWriter blocks_pw(nullptr, 0);
+  ASSERT_TRUE(puffer_.PuffDeflate(&blocks_br, &blocks_pw, &blocks));
+  Buffer shifted_deflate(fixed_deflate.size() + 1, 0x05);
+  for (size_t idx = 0; idx < fixed_deflate.size(); idx++) {
+    shifted_deflate[idx] |= fixed_deflate[idx] << 3;
+    shifted_deflate[idx + 1] = fixed_deflate[idx] >> 5;
+  }
+  shifted_deflate.resize((blocks.back().offset + blocks.back().length + 10) /
+                         8);
+  // Two stored blocks.
+  Buffer stored_deflate;
+  for (uint8_t final_bit : {0, 1}) {
+    stored_deflate.insert(stored_deflate.end(),
+                          {final_bit, 0x40, 0x9C, 0xBF, 0x63});
+    for (size_t idx = 0; idx < 40000; idx++) {
+      stored_deflate.push_back(idx & 0xFF);
+    }
+  }
+  const std::pair<Buffer, size_t> kSamples[] = {
+      {kDynamicHTDeflate, 0},
+      {fixed_deflate, 0},
+      {shifted_deflate, 3},
+      {stored_deflate, 0},
+  };
+
+  for (auto format : {PuffFormat::kV1, PuffFormat::kV2}) {
+    for (const auto& sample : kSamples) {
+      const auto& deflate = sample.first;
+      auto start_bits = sample.second;
+      BufferBitReader size_br(deflate.data(), deflate.size());
+      ASSERT_TRUE(size_br.CacheBits(start_bits));
+      size_br.DropBits(start_bits);
+      BufferPuffWriter size_pw(nullptr, 0, format);
+      ASSERT_TRUE(puffer_.PuffDeflate(&size_br, &size_pw, nullptr));
+      Buffer puff(size_pw.Size());
+      BufferBitReader br(deflate.data(), deflate.size());
+      ASSERT_TRUE(br.CacheBits(start_bits));
+      br.DropBits(start_bits);
+      BufferPuffWriter pw(puff.data(), puff.size(), format);
+      ASSERT_TRUE(puffer_.PuffDeflate(&br, &pw, nullptr));
+
+      for (size_t read_size : {size_t(1), size_t(7), size_t(4096),
+                               size_t(100000), puff.size()}) {
+        auto decoder =
+            PuffDecoder::Create(&puffer_, deflate.data(), deflate.size(),
+                                start_bits, puff.size(), format);
+        ASSERT_TRUE(decoder);
+        Buffer read_puff(puff.size());
+        // Every third read is skipped.
+        for (size_t offset = 0, reads = 0; offset < puff.size(); reads++) {
+          auto count = std::min(read_size, puff.size() - offset);
+          ASSERT_TRUE(decoder->Read(
+              reads % 3 == 2 ? nullptr : &read_puff[offset], count));
+          if (reads % 3 == 2) {
+            std::copy(puff.begin() + offset, puff.begin() + offset + count,
+                      read_puff.begin() + offset);
+          }
+          offset += count;
+          EXPECT_EQ(decoder->Offset(), offset);
+        }
+        EXPECT_EQ(read_puff, puff);
+        // Nothing is left to read.
+        uint8_t byte;
+        EXPECT_FALSE(decoder->Read(&byte, 1));
+      }
+    }
+  }
+
+  // A puff that is larger than the deflate.
+  auto decoder = PuffDecoder::Create(&puffer_, fixed_deflate.data(),
+                                     fixed_deflate.size(), 0,
+                                     fixed_puff.size() + 1, PuffFormat::kV1);
+  ASSERT_TRUE(decoder);
+  Buffer read_puff(fixed_puff.size() + 1);
+  EXPECT_FALSE(decoder->Read(read_puff.data(), read_puff.size()));
+}
+
 // Tests an uncompressed deflate block with invalid LEN/NLEN.
 TEST_F(PuffinTest, PuffInvalidUncompressedLengthDeflateTest) {
   const Buffer kDeflate = {0x01, 0x05, 0x00, 0xFF, 0xFF,
@@ -574,6 +812,104 @@ TEST_F(PuffinTest, BitExtentPuffAndHuffTest) {
                              kGapPuffs, kGapPuffExtents);
 }
 
+TEST_F(PuffinTest, PuffinStreamStatsTest) {
+  auto puffer = std::make_shared<Puffer>();
+  const uint64_t num_puffs = kGapPuffExtents.size();
+  uint64_t puffs_length = 0;
+  for (const auto& puff : kGapPuffExtents) {
+    puffs_length += puff.length;
+  }
+
+  // Without a cache, every read of a puff has to puff its deflate again.
+  auto stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kGapDeflates), puffer, kGapPuffs.size(),
+      kGapSubblockDeflateExtents, kGapPuffExtents);
+  ASSERT_TRUE(stream);
+  const auto* puffin_stream = static_cast<PuffinStream*>(stream.get());
+  Buffer puff_buffer(kGapPuffs.size());
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(stream->Seek(0));
+    ASSERT_TRUE(stream->Read(puff_buffer.data(), puff_buffer.size()));
+    EXPECT_EQ(puff_buffer, kGapPuffs);
+  }
+  auto stats = puffin_stream->GetStats();
+  EXPECT_EQ(stats.deflates_puffed, 2 * num_puffs);
+  EXPECT_EQ(stats.deflates_repuffed, num_puffs);
+  EXPECT_EQ(stats.bytes_puffed, 2 * puffs_length);
+  EXPECT_EQ(stats.cache_hits + stats.cache_misses, 0u);
+  EXPECT_EQ(stats.seeks, 1u);
+  EXPECT_EQ(stats.seek_distance, kGapPuffs.size());
+  EXPECT_GT(stats.peak_buffer_bytes, 0u);
+
+  // With a cache large enough for all puffs, the second read is all hits.
+  stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kGapDeflates), puffer, kGapPuffs.size(),
+      kGapSubblockDeflateExtents, kGapPuffExtents, kGapPuffs.size());
+  ASSERT_TRUE(stream);
+  puffin_stream = static_cast<PuffinStream*>(stream.get());
+  for (int i = 0; i < 2; i++) {
+    ASSERT_TRUE(stream->Seek(0));
+    ASSERT_TRUE(stream->Read(puff_buffer.data(), puff_buffer.size()));
+    EXPECT_EQ(puff_buffer, kGapPuffs);
+  }
+  stats = puffin_stream->GetStats();
+  EXPECT_EQ(stats.deflates_puffed, num_puffs);
+  EXPECT_EQ(stats.deflates_repuffed, 0u);
+  EXPECT_EQ(stats.cache_misses, num_puffs);
+  EXPECT_EQ(stats.cache_hits, num_puffs);
+  EXPECT_EQ(stats.cache_evictions, 0u);
+  EXPECT_GT(stats.peak_cache_bytes, 0u);
+
+  // Huffing the puffs back.
+  Buffer deflate_buffer;
+  stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&deflate_buffer),
+      std::make_shared<Huffer>(), kGapPuffs.size(), kGapSubblockDeflateExtents,
+      kGapPuffExtents);
+  ASSERT_TRUE(stream);
+  puffin_stream = static_cast<PuffinStream*>(stream.get());
+  ASSERT_TRUE(stream->Write(kGapPuffs.data(), kGapPuffs.size()));
+  EXPECT_EQ(deflate_buffer, kGapDeflates);
+  stats = puffin_stream->GetStats();
+  EXPECT_EQ(stats.deflates_huffed, num_puffs);
+  EXPECT_EQ(stats.deflates_puffed, 0u);
+}
+
+TEST_F(PuffinTest, VerifyDeflatesTest) {
+  DeflateIndex index;
+  index.deflates = kGapSubblockDeflateExtents;
+  index.puffs = kGapPuffExtents;
+  index.puff_size = kGapPuffs.size();
+  auto memory_stream = MemoryStream::CreateForRead(kGapDeflates);
+  for (size_t num_threads : {1, 4}) {
+    for (auto format : {PuffFormat::kV1, PuffFormat::kV2}) {
+      vector<BitExtent> mismatches;
+      ASSERT_TRUE(VerifyDeflates(memory_stream, index, num_threads,
+                                 &mismatches, format));
+      EXPECT_TRUE(mismatches.empty());
+    }
+  }
+
+  // The deflates of a file are read into memory.
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  auto file_stream = FileStream::Open(filepath, true, true);
+  ASSERT_TRUE(file_stream);
+  ASSERT_TRUE(file_stream->Write(kGapDeflates.data(), kGapDeflates.size()));
+  vector<BitExtent> mismatches;
+  ASSERT_TRUE(VerifyDeflates(file_stream, index, 0, &mismatches));
+  EXPECT_TRUE(mismatches.empty());
+
+  // A deflate that does not end where it should or does not have the puff size
+  // in the index is reported.
+  index.deflates[1].length--;
+  index.puffs[2].length++;
+  ASSERT_TRUE(VerifyDeflates(memory_stream, index, 0, &mismatches));
+  EXPECT_EQ(mismatches,
+            (vector<BitExtent>{index.deflates[1], index.deflates[2]}));
+}
+
 TEST_F(PuffinTest, ExcludeBadDistanceCaches) {
   BufferBitReader br(kProblematicCache.data(), kProblematicCache.size());
   BufferPuffWriter pw(nullptr, 0);
@@ -6,6 +6,7 @@
 
 #include <endian.h>
 #include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -15,6 +16,8 @@
 #include "bsdiff/bspatch.h"
 #include "bsdiff/file_interface.h"
 
+#include "puffin/src/extent_stream.h"
+#include "puffin/src/include/puffin/buffer_pool.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
@@ -22,6 +25,7 @@
 #include "puffin/src/logging.h"
 #include "puffin/src/puffin.pb.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/trace_event.h"
 
 using std::string;
 using std::unique_ptr;
@@ -31,6 +35,7 @@ namespace puffin {
 
 const char kMagic[] = "PUF1";
 const size_t kMagicLength = 4;
+const int32_t kPartsPatchVersion = 3;
 
 namespace {
 
@@ -45,37 +50,87 @@ void CopyRpfToVector(
   }
 }
 
+// The maximum size of the window |BsdiffStream| reads the source puff stream
+// into and of the buffer it collects the writes into the destination in.
+// bspatch reads and writes a few bytes at a time, which would each go through
+// the state machine of |PuffinStream|.
+constexpr size_t kReadWindowSize = 1024 * 1024;  // 1 MB
+constexpr size_t kWriteBufferSize = 1024 * 1024;  // 1 MB
+
+// Adapts a stream to the file interface of bspatch. The reads are served from a
+// window of the stream, which starts and ends on the boundaries of |puffs_| if
+// it can, so each puff is puffed once for all the reads around it. The reads
+// inside a puff that |PuffinStream| has in its cache are copied from the cache
+// instead. The writes are collected and written into the stream in large
+// chunks. A stream is either read or written.
 class BsdiffStream : public bsdiff::FileInterface {
  public:
   ~BsdiffStream() override = default;
 
-  static unique_ptr<bsdiff::FileInterface> Create(UniqueStreamPtr stream) {
+  // |puffs| are the puffs of |stream| when reading it, and the buffers are
+  // taken from |pool|.
+  static unique_ptr<bsdiff::FileInterface> Create(
+      UniqueStreamPtr stream,
+      const vector<ByteExtent>& puffs,
+      std::shared_ptr<BufferPoolInterface> pool) {
     TEST_AND_RETURN_VALUE(stream, nullptr);
+    uint64_t size;
+    TEST_AND_RETURN_VALUE(stream->GetSize(&size), nullptr);
     return unique_ptr<bsdiff::FileInterface>(
-        new BsdiffStream(std::move(stream)));
+        new BsdiffStream(std::move(stream), size, puffs, std::move(pool)));
   }
 
   bool Read(void* buf, size_t count, size_t* bytes_read) override {
     *bytes_read = 0;
-    if (stream_->Read(buf, count)) {
-      *bytes_read = count;
-      return true;
+    TEST_AND_RETURN_FALSE(count <= size_ && offset_ <= size_ - count);
+    const uint8_t* data;
+    if (offset_ >= window_offset_ &&
+        offset_ + count <= window_offset_ + window_length_) {
+      memcpy(buf, window_->data() + offset_ - window_offset_, count);
+    } else if (stream_->GetData(offset_, count, &data)) {
+      // |data| is only valid until the next read of |stream_|.
+      memcpy(buf, data, count);
+    } else if (count >= kReadWindowSize) {
+      TEST_AND_RETURN_FALSE(ReadStream(offset_, buf, count));
+    } else {
+      TEST_AND_RETURN_FALSE(FillWindow(count));
+      memcpy(buf, window_->data() + offset_ - window_offset_, count);
     }
-    return false;
+    offset_ += count;
+    *bytes_read = count;
+    return true;
   }
 
   bool Write(const void* buf, size_t count, size_t* bytes_written) override {
     *bytes_written = 0;
-    if (stream_->Write(buf, count)) {
-      *bytes_written = count;
-      return true;
+    if (write_length_ + count > kWriteBufferSize) {
+      TEST_AND_RETURN_FALSE(FlushWrites());
     }
-    return false;
+    if (count >= kWriteBufferSize) {
+      TEST_AND_RETURN_FALSE(stream_->Write(buf, count));
+    } else {
+      if (!write_buffer_) {
+        write_buffer_ = pool_->Acquire(kWriteBufferSize);
+      }
+      memcpy(write_buffer_->data() + write_length_, buf, count);
+      write_length_ += count;
+    }
+    *bytes_written = count;
+    return true;
   }
 
-  bool Seek(off_t pos) override { return stream_->Seek(pos); }
+  bool Seek(off_t pos) override {
+    TEST_AND_RETURN_FALSE(FlushWrites());
+    TEST_AND_RETURN_FALSE(stream_->Seek(pos));
+    offset_ = pos;
+    stream_offset_ = pos;
+    return true;
+  }
 
-  bool Close() override { return stream_->Close(); }
+  bool Close() override {
+    TEST_AND_RETURN_FALSE(FlushWrites());
+    return stream_->Close();
+  }
 
   bool GetSize(uint64_t* size) override {
     uint64_t my_size;
@@ -85,25 +140,107 @@ class BsdiffStream : public bsdiff::FileInterface {
   }
 
  private:
-  explicit BsdiffStream(UniqueStreamPtr stream) : stream_(std::move(stream)) {}
+  BsdiffStream(UniqueStreamPtr stream,
+               uint64_t size,
+               const vector<ByteExtent>& puffs,
+               std::shared_ptr<BufferPoolInterface> pool)
+      : stream_(std::move(stream)),
+        size_(size),
+        offset_(0),
+        stream_offset_(0),
+        puffs_(puffs),
+        pool_(std::move(pool)),
+        window_offset_(0),
+        window_length_(0),
+        write_length_(0) {}
+
+  // Returns the puff that |offset| is in, or nullptr if it is not in a puff.
+  const ByteExtent* FindPuff(uint64_t offset) const {
+    auto puff = std::upper_bound(
+        puffs_.begin(), puffs_.end(), offset,
+        [](uint64_t offset, const ByteExtent& puff) {
+          return offset < puff.offset + puff.length;
+        });
+    return puff != puffs_.end() && puff->offset <= offset ? &*puff : nullptr;
+  }
+
+  // Reads the window with the |count| bytes at |offset_|. It starts at the
+  // beginning of the puff |offset_| is in and ends before the puff it would
+  // end in, unless those make it larger than |kReadWindowSize| or do not
+  // leave the requested bytes in it.
+  bool FillWindow(size_t count) {
+    auto start = offset_;
+    auto first_puff = FindPuff(start);
+    if (first_puff && offset_ + count - first_puff->offset <= kReadWindowSize) {
+      start = first_puff->offset;
+    }
+    auto end = std::min(size_, start + kReadWindowSize);
+    auto last_puff = FindPuff(end);
+    if (last_puff && last_puff->offset >= offset_ + count) {
+      end = last_puff->offset;
+    }
+    if (!window_) {
+      window_ = pool_->Acquire(kReadWindowSize);
+    }
+    // Forget the current window if the read fails.
+    window_length_ = 0;
+    TEST_AND_RETURN_FALSE(ReadStream(start, window_->data(), end - start));
+    window_offset_ = start;
+    window_length_ = end - start;
+    return true;
+  }
+
+  // Reads |count| bytes at |offset| of |stream_| into |buf|.
+  bool ReadStream(uint64_t offset, void* buf, size_t count) {
+    if (offset != stream_offset_) {
+      TEST_AND_RETURN_FALSE(stream_->Seek(offset));
+    }
+    // On failure the offset of |stream_| is unknown.
+    stream_offset_ = size_ + 1;
+    TEST_AND_RETURN_FALSE(stream_->Read(buf, count));
+    stream_offset_ = offset + count;
+    return true;
+  }
+
+  bool FlushWrites() {
+    if (write_length_ > 0) {
+      TEST_AND_RETURN_FALSE(
+          stream_->Write(write_buffer_->data(), write_length_));
+      write_length_ = 0;
+    }
+    return true;
+  }
 
   UniqueStreamPtr stream_;
+  uint64_t size_;
+
+  // The offset bspatch is at, and the offset |stream_| is at after the last
+  // read.
+  uint64_t offset_;
+  uint64_t stream_offset_;
+
+  vector<ByteExtent> puffs_;
+  std::shared_ptr<BufferPoolInterface> pool_;
+
+  // The |window_length_| bytes of |stream_| at |window_offset_|.
+  std::shared_ptr<Buffer> window_;
+  uint64_t window_offset_;
+  uint64_t window_length_;
+
+  // The |write_length_| bytes written but not written into |stream_| yet.
+  std::shared_ptr<Buffer> write_buffer_;
+  size_t write_length_;
 
   DISALLOW_COPY_AND_ASSIGN(BsdiffStream);
 };
 
-}  // namespace
-
-bool DecodePatch(const uint8_t* patch,
-                 size_t patch_length,
-                 size_t* bsdiff_patch_offset,
-                 size_t* bsdiff_patch_size,
-                 vector<BitExtent>* src_deflates,
-                 vector<BitExtent>* dst_deflates,
-                 vector<ByteExtent>* src_puffs,
-                 vector<ByteExtent>* dst_puffs,
-                 uint64_t* src_puff_size,
-                 uint64_t* dst_puff_size) {
+// Parses the header of |patch| into |header| and sets |body_offset| to the
+// first byte after it.
+bool DecodePatchHeader(const uint8_t* patch,
+                       size_t patch_length,
+                       metadata::PatchHeader* header,
+                       size_t* body_offset,
+                       PuffFormat* format) {
   size_t offset = 0;
   uint32_t header_size;
   TEST_AND_RETURN_FALSE(patch_length >= (kMagicLength + sizeof(header_size)));
@@ -121,10 +258,165 @@ bool DecodePatch(const uint8_t* patch,
   offset += sizeof(header_size);
   TEST_AND_RETURN_FALSE(header_size <= (patch_length - offset));
 
-  metadata::PatchHeader header;
-  TEST_AND_RETURN_FALSE(header.ParseFromArray(patch + offset, header_size));
+  TEST_AND_RETURN_FALSE(header->ParseFromArray(patch + offset, header_size));
   offset += header_size;
 
+  // Only the patches of |kPartsPatchVersion| have parts, and they have nothing
+  // else. Their parts have their own versions.
+  if (header->version() == kPartsPatchVersion) {
+    TEST_AND_RETURN_FALSE(header->parts_size() > 0);
+    *format = PuffFormat::kV1;
+    *body_offset = offset;
+    return true;
+  }
+  if (header->parts_size() > 0) {
+    LOG(ERROR) << "Puffin patch of version " << header->version()
+               << " has parts.";
+    return false;
+  }
+  // The version of the patch is the layout of its puff streams.
+  switch (header->version()) {
+    case static_cast<int32_t>(PuffFormat::kV1):
+      *format = PuffFormat::kV1;
+      break;
+    case static_cast<int32_t>(PuffFormat::kV2):
+      *format = PuffFormat::kV2;
+      break;
+    default:
+      LOG(ERROR) << "Unsupported Puffin patch version: " << header->version();
+      return false;
+  }
+  *body_offset = offset;
+  return true;
+}
+
+// Adds the counts and times of |from| to |to|, and keeps the larger peaks.
+void AddStats(const PuffinStreamStats& from, PuffinStreamStats* to) {
+  to->cache_hits += from.cache_hits;
+  to->cache_misses += from.cache_misses;
+  to->cache_evictions += from.cache_evictions;
+  to->deflates_puffed += from.deflates_puffed;
+  to->bytes_puffed += from.bytes_puffed;
+  to->deflates_repuffed += from.deflates_repuffed;
+  to->deflates_huffed += from.deflates_huffed;
+  to->bytes_huffed += from.bytes_huffed;
+  to->puff_time_ns += from.puff_time_ns;
+  to->huff_time_ns += from.huff_time_ns;
+  to->io_time_ns += from.io_time_ns;
+  to->deflates_read_ahead += from.deflates_read_ahead;
+  to->stream_reads += from.stream_reads;
+  to->stream_writes += from.stream_writes;
+  to->bytes_copied_in_kernel += from.bytes_copied_in_kernel;
+  to->seeks += from.seeks;
+  to->seek_distance += from.seek_distance;
+  to->peak_buffer_bytes =
+      std::max(to->peak_buffer_bytes, from.peak_buffer_bytes);
+  to->peak_cache_bytes = std::max(to->peak_cache_bytes, from.peak_cache_bytes);
+}
+
+// A stream that forwards everything to a stream it does not own, except
+// |Close|, so the parts of a patch can each be applied to the same streams.
+class BorrowedStream : public StreamInterface {
+ public:
+  explicit BorrowedStream(StreamInterface* stream) : stream_(stream) {}
+  ~BorrowedStream() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    return stream_->GetSize(size);
+  }
+  bool GetOffset(uint64_t* offset) const override {
+    return stream_->GetOffset(offset);
+  }
+  bool Seek(uint64_t offset) override { return stream_->Seek(offset); }
+  bool Read(void* buffer, size_t length) override {
+    return stream_->Read(buffer, length);
+  }
+  bool Write(const void* buffer, size_t length) override {
+    return stream_->Write(buffer, length);
+  }
+  bool Close() override { return true; }
+
+ private:
+  StreamInterface* stream_;
+
+  DISALLOW_COPY_AND_ASSIGN(BorrowedStream);
+};
+
+// Converts the extents of a part, which are in bits, into byte extents.
+bool ToByteExtents(
+    const google::protobuf::RepeatedPtrField<metadata::BitExtent>& extents,
+    vector<ByteExtent>* byte_extents) {
+  for (const auto& extent : extents) {
+    TEST_AND_RETURN_FALSE(extent.offset() % 8 == 0 && extent.length() % 8 == 0);
+    byte_extents->emplace_back(extent.offset() / 8, extent.length() / 8);
+  }
+  return true;
+}
+
+// Applies the parts of a patch with |header|. Their puffin patches are the
+// |patch_length| bytes at |patch|. Each part is applied like a whole patch,
+// from an |ExtentStream| over its source extents of |src| into one over its
+// destination extents of |dst|, so the memory used does not depend on the
+// size of the parts. See |PuffPatch| for the other arguments.
+bool PuffPatchParts(const UniqueStreamPtr& src,
+                    const UniqueStreamPtr& dst,
+                    const metadata::PatchHeader& header,
+                    const uint8_t* patch,
+                    size_t patch_length,
+                    size_t max_cache_size,
+                    PuffinStreamStats* src_stats,
+                    PuffinStreamStats* dst_stats,
+                    std::shared_ptr<BufferPoolInterface> pool,
+                    size_t num_threads) {
+  TRACE_EVENT1("patch", "PuffPatchParts", "parts", header.parts_size());
+  size_t patch_offset = 0;
+  for (const auto& part : header.parts()) {
+    TEST_AND_RETURN_FALSE(part.patch_length() <= patch_length - patch_offset);
+    vector<ByteExtent> src_extents, dst_extents;
+    TEST_AND_RETURN_FALSE(ToByteExtents(part.src_extents(), &src_extents));
+    TEST_AND_RETURN_FALSE(ToByteExtents(part.dst_extents(), &dst_extents));
+    auto src_part = ExtentStream::CreateForRead(
+        UniqueStreamPtr(new BorrowedStream(src.get())), src_extents);
+    auto dst_part = ExtentStream::CreateForWrite(
+        UniqueStreamPtr(new BorrowedStream(dst.get())), dst_extents);
+    TEST_AND_RETURN_FALSE(src_part && dst_part);
+    PuffinStreamStats part_src_stats, part_dst_stats;
+    TEST_AND_RETURN_FALSE(PuffPatch(
+        std::move(src_part), std::move(dst_part), patch + patch_offset,
+        part.patch_length(), max_cache_size, &part_src_stats,
+        &part_dst_stats, pool, num_threads));
+    if (src_stats) {
+      AddStats(part_src_stats, src_stats);
+    }
+    if (dst_stats) {
+      AddStats(part_dst_stats, dst_stats);
+    }
+    patch_offset += part.patch_length();
+  }
+  TEST_AND_RETURN_FALSE(patch_offset == patch_length);
+  return true;
+}
+
+}  // namespace
+
+bool DecodePatch(const uint8_t* patch,
+                 size_t patch_length,
+                 size_t* bsdiff_patch_offset,
+                 size_t* bsdiff_patch_size,
+                 vector<BitExtent>* src_deflates,
+                 vector<BitExtent>* dst_deflates,
+                 vector<ByteExtent>* src_puffs,
+                 vector<ByteExtent>* dst_puffs,
+                 uint64_t* src_puff_size,
+                 uint64_t* dst_puff_size,
+                 PuffFormat* format) {
+  metadata::PatchHeader header;
+  size_t offset;
+  TEST_AND_RETURN_FALSE(
+      DecodePatchHeader(patch, patch_length, &header, &offset, format));
+  // The parts have their own patches.
+  TEST_AND_RETURN_FALSE(header.parts_size() == 0);
+
   CopyRpfToVector(header.src().deflates(), src_deflates, 1);
   CopyRpfToVector(header.dst().deflates(), dst_deflates, 1);
   CopyRpfToVector(header.src().puffs(), src_puffs, 8);
@@ -143,35 +435,90 @@ bool PuffPatch(UniqueStreamPtr src,
                const uint8_t* patch,
                size_t patch_length,
                size_t max_cache_size) {
+  return PuffPatch(std::move(src), std::move(dst), patch, patch_length,
+                   max_cache_size, nullptr, nullptr);
+}
+
+bool PuffPatch(UniqueStreamPtr src,
+               UniqueStreamPtr dst,
+               const uint8_t* patch,
+               size_t patch_length,
+               size_t max_cache_size,
+               PuffinStreamStats* src_stats,
+               PuffinStreamStats* dst_stats,
+               std::shared_ptr<BufferPoolInterface> pool,
+               size_t num_threads) {
+  TRACE_EVENT0("patch", "PuffPatch");
+  metadata::PatchHeader header;
   size_t bsdiff_patch_offset;  // bsdiff offset in |patch|.
-  size_t bsdiff_patch_size = 0;
+  PuffFormat format;
+
+  // Decode the patch and get the bsdiff_patch.
+  TEST_AND_RETURN_FALSE(DecodePatchHeader(patch, patch_length, &header,
+                                          &bsdiff_patch_offset, &format));
+  size_t bsdiff_patch_size = patch_length - bsdiff_patch_offset;
+  if (!pool) {
+    // One pool for both streams, scoped to this patch.
+    pool = CreateBufferPool(max_cache_size);
+  }
+  if (header.parts_size() > 0) {
+    if (src_stats) {
+      *src_stats = PuffinStreamStats();
+    }
+    if (dst_stats) {
+      *dst_stats = PuffinStreamStats();
+    }
+    return PuffPatchParts(src, dst, header, &patch[bsdiff_patch_offset],
+                          bsdiff_patch_size, max_cache_size, src_stats,
+                          dst_stats, pool, num_threads);
+  }
+
   vector<BitExtent> src_deflates, dst_deflates;
   vector<ByteExtent> src_puffs, dst_puffs;
-  uint64_t src_puff_size, dst_puff_size;
+  CopyRpfToVector(header.src().deflates(), &src_deflates, 1);
+  CopyRpfToVector(header.dst().deflates(), &dst_deflates, 1);
+  CopyRpfToVector(header.src().puffs(), &src_puffs, 8);
+  CopyRpfToVector(header.dst().puffs(), &dst_puffs, 8);
+  uint64_t src_puff_size = header.src().puff_length();
+  uint64_t dst_puff_size = header.dst().puff_length();
 
-  // Decode the patch and get the bsdiff_patch.
-  TEST_AND_RETURN_FALSE(DecodePatch(patch, patch_length, &bsdiff_patch_offset,
-                                    &bsdiff_patch_size, &src_deflates,
-                                    &dst_deflates, &src_puffs, &dst_puffs,
-                                    &src_puff_size, &dst_puff_size));
   auto puffer = std::make_shared<Puffer>();
   auto huffer = std::make_shared<Huffer>();
 
   // For reading from source.
-  auto reader = BsdiffStream::Create(
-      PuffinStream::CreateForPuff(std::move(src), puffer, src_puff_size,
-                                  src_deflates, src_puffs, max_cache_size));
+  auto puff_stream = PuffinStream::CreateForPuff(
+      std::move(src), puffer, src_puff_size, src_deflates, src_puffs,
+      max_cache_size, pool, format, num_threads);
+  TEST_AND_RETURN_FALSE(puff_stream);
+  // The Bsdiff streams own the puffin streams until the end of this function,
+  // so it is safe to hold on to these pointers for getting the statistics.
+  const auto* src_puffin_stream = static_cast<PuffinStream*>(puff_stream.get());
+  auto reader = BsdiffStream::Create(std::move(puff_stream), src_puffs, pool);
   TEST_AND_RETURN_FALSE(reader);
 
   // For writing into destination.
-  auto writer = BsdiffStream::Create(PuffinStream::CreateForHuff(
-      std::move(dst), huffer, dst_puff_size, dst_deflates, dst_puffs));
+  auto huff_stream =
+      PuffinStream::CreateForHuff(std::move(dst), huffer, dst_puff_size,
+                                  dst_deflates, dst_puffs, pool, format,
+                                  num_threads);
+  TEST_AND_RETURN_FALSE(huff_stream);
+  const auto* dst_puffin_stream = static_cast<PuffinStream*>(huff_stream.get());
+  auto writer = BsdiffStream::Create(std::move(huff_stream), {}, pool);
   TEST_AND_RETURN_FALSE(writer);
 
   // Running bspatch itself.
-  TEST_AND_RETURN_FALSE(0 == bspatch(reader, writer,
-                                     &patch[bsdiff_patch_offset],
-                                     bsdiff_patch_size));
+  {
+    TRACE_EVENT1("patch", "Bspatch", "patch_size", bsdiff_patch_size);
+    TEST_AND_RETURN_FALSE(0 == bspatch(reader, writer,
+                                       &patch[bsdiff_patch_offset],
+                                       bsdiff_patch_size));
+  }
+  if (src_stats) {
+    *src_stats = src_puffin_stream->GetStats();
+  }
+  if (dst_stats) {
+    *dst_stats = dst_puffin_stream->GetStats();
+  }
   return true;
 }
 
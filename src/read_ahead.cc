@@ -0,0 +1,186 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/read_ahead.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/trace_event.h"
+
+using std::shared_ptr;
+using std::unique_ptr;
+using std::vector;
+
+namespace puffin {
+
+unique_ptr<ReadAhead> ReadAhead::Create(int fd,
+                                        const vector<ByteExtent>& extents,
+                                        size_t max_extents,
+                                        size_t max_bytes,
+                                        size_t num_threads,
+                                        shared_ptr<BufferPoolInterface> pool) {
+  TEST_AND_RETURN_VALUE(fd >= 0, nullptr);
+  TEST_AND_RETURN_VALUE(pool, nullptr);
+  unique_ptr<ReadAhead> read_ahead(
+      new ReadAhead(fd, extents, max_extents, max_bytes, std::move(pool)));
+  for (size_t idx = 0; idx < std::max(num_threads, size_t(1)); idx++) {
+    read_ahead->threads_.emplace_back(&ReadAhead::ReadExtents,
+                                      read_ahead.get());
+  }
+  return read_ahead;
+}
+
+ReadAhead::ReadAhead(int fd,
+                     const vector<ByteExtent>& extents,
+                     size_t max_extents,
+                     size_t max_bytes,
+                     shared_ptr<BufferPoolInterface> pool)
+    : fd_(fd),
+      extents_(extents),
+      max_extents_(max_extents),
+      max_bytes_(max_bytes),
+      pool_(std::move(pool)),
+      stopping_(false),
+      slots_(extents.size()),
+      window_begin_(0),
+      window_end_(0),
+      window_bytes_(0) {}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+bool ReadAhead::Get(size_t index,
+                    shared_ptr<Buffer>* buffer,
+                    bool* read_ahead) {
+  TEST_AND_RETURN_FALSE(index < extents_.size());
+  *read_ahead = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Going back to an extent before the window (like when a puff is not in
+    // the cache anymore) does not change the window.
+    if (index >= window_begin_) {
+      if (index < window_end_) {
+        auto& slot = slots_[index];
+        // If no thread has started reading the extent, it is faster to read it
+        // here than to wait for one.
+        if (slot.state != Slot::State::kQueued) {
+          done_.wait(lock, [&slot] {
+            return slot.state == Slot::State::kDone ||
+                   slot.state == Slot::State::kFailed;
+          });
+          if (slot.state == Slot::State::kDone) {
+            *buffer = std::move(slot.buffer);
+            *read_ahead = true;
+          }
+        }
+      }
+      DropExtents(index + 1);
+      QueueExtents();
+    }
+  }
+  if (*read_ahead) {
+    return true;
+  }
+  // Failed reads are tried again too.
+  return ReadExtent(index, buffer);
+}
+
+void ReadAhead::ReadExtents() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    queued_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (stopping_) {
+      return;
+    }
+    auto index = queue_.front().first;
+    auto generation = queue_.front().second;
+    queue_.pop_front();
+    auto& slot = slots_[index];
+    if (slot.state != Slot::State::kQueued || slot.generation != generation) {
+      // It has been dropped or taken by |Get|.
+      continue;
+    }
+    slot.state = Slot::State::kReading;
+    lock.unlock();
+
+    shared_ptr<Buffer> buffer;
+    bool success;
+    {
+      TRACE_EVENT1("io", "ReadAhead", "bytes", extents_[index].length);
+      success = ReadExtent(index, &buffer);
+    }
+
+    lock.lock();
+    if (slot.state == Slot::State::kReading && slot.generation == generation) {
+      slot.state = success ? Slot::State::kDone : Slot::State::kFailed;
+      slot.buffer = std::move(buffer);
+      done_.notify_all();
+    }
+  }
+}
+
+void ReadAhead::DropExtents(size_t end) {
+  for (; window_begin_ < std::min(end, window_end_); window_begin_++) {
+    auto& slot = slots_[window_begin_];
+    slot.state = Slot::State::kIdle;
+    slot.buffer.reset();
+    window_bytes_ -= extents_[window_begin_].length;
+  }
+  if (window_begin_ < end) {
+    // The window was passed entirely.
+    window_begin_ = end;
+    window_end_ = end;
+  }
+}
+
+void ReadAhead::QueueExtents() {
+  bool queued = false;
+  while (window_end_ < extents_.size() &&
+         window_end_ - window_begin_ < max_extents_ &&
+         window_bytes_ + extents_[window_end_].length <= max_bytes_) {
+    auto& slot = slots_[window_end_];
+    slot.state = Slot::State::kQueued;
+    slot.generation++;
+    queue_.emplace_back(window_end_, slot.generation);
+    window_bytes_ += extents_[window_end_].length;
+    window_end_++;
+    queued = true;
+  }
+  if (queued) {
+    queued_.notify_all();
+  }
+}
+
+bool ReadAhead::ReadExtent(size_t index, shared_ptr<Buffer>* buffer) {
+  const auto& extent = extents_[index];
+  *buffer = pool_->Acquire(extent.length);
+  auto data = (*buffer)->data();
+  uint64_t total_bytes_read = 0;
+  while (total_bytes_read < extent.length) {
+    auto bytes_read = pread(fd_, data + total_bytes_read,
+                            extent.length - total_bytes_read,
+                            extent.offset + total_bytes_read);
+    // If |bytes_read| is zero, the extent is past the end of the file.
+    TEST_AND_RETURN_FALSE(bytes_read > 0);
+    total_bytes_read += bytes_read;
+  }
+  return true;
+}
+
+}  // namespace puffin
@@ -0,0 +1,121 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_READ_AHEAD_H_
+#define SRC_READ_AHEAD_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "puffin/src/include/puffin/buffer_pool.h"
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// Reads the extents of a file (the deflates of a puff stream) on background
+// threads before they are needed, so the storage latency of one extent is
+// overlapped with puffing the previous ones. The extents are expected to be
+// asked for mostly in their order; after each request the next extents are
+// read ahead, as long as there are at most |max_extents| of them with at most
+// |max_bytes| bytes in total. The file is read with |pread|, so the file
+// offset of the descriptor is never changed and it can still be used by its
+// owner. Not thread safe; only the background reads run concurrently.
+class ReadAhead {
+ public:
+  ~ReadAhead();
+
+  // |fd|          IN  The file. It must stay open during the lifetime of the
+  //                   returned object.
+  // |extents|     IN  The byte extents of the file that will be read.
+  // |max_extents| IN  The maximum number of extents read ahead.
+  // |max_bytes|   IN  The maximum total size of the extents read ahead.
+  // |num_threads| IN  The number of background threads reading the extents.
+  // |pool|        IN  The pool the buffers of the extents are taken from.
+  static std::unique_ptr<ReadAhead> Create(
+      int fd,
+      const std::vector<ByteExtent>& extents,
+      size_t max_extents,
+      size_t max_bytes,
+      size_t num_threads,
+      std::shared_ptr<BufferPoolInterface> pool);
+
+  // Sets |buffer| to the content of the |index|th extent and starts reading
+  // the extents after it. If the extent has not been read ahead, it is read
+  // now; |read_ahead| is set to whether it was (even if it was still being
+  // read and we had to wait for it). The extents before |index| which were
+  // read ahead but not asked for are dropped.
+  bool Get(size_t index, std::shared_ptr<Buffer>* buffer, bool* read_ahead);
+
+ private:
+  struct Slot {
+    enum class State {
+      kIdle,
+      kQueued,
+      kReading,
+      kDone,
+      kFailed,
+    };
+    State state = State::kIdle;
+    // Incremented each time the extent is queued, so a read that was dropped
+    // while in progress does not complete a later one.
+    uint64_t generation = 0;
+    std::shared_ptr<Buffer> buffer;
+  };
+
+  ReadAhead(int fd,
+            const std::vector<ByteExtent>& extents,
+            size_t max_extents,
+            size_t max_bytes,
+            std::shared_ptr<BufferPoolInterface> pool);
+
+  // The loop of the background threads.
+  void ReadExtents();
+
+  // Drops the extents in [|window_begin_|, |end|). |mutex_| must be held.
+  void DropExtents(size_t end);
+
+  // Queues the extents after |window_end_| that fit in the limits. |mutex_|
+  // must be held.
+  void QueueExtents();
+
+  // Reads the |index|th extent into |buffer|.
+  bool ReadExtent(size_t index, std::shared_ptr<Buffer>* buffer);
+
+  int fd_;
+  std::vector<ByteExtent> extents_;
+  size_t max_extents_;
+  size_t max_bytes_;
+  std::shared_ptr<BufferPoolInterface> pool_;
+
+  std::vector<std::thread> threads_;
+
+  // Guards everything below.
+  std::mutex mutex_;
+  // Signaled when an extent is queued or the threads should stop.
+  std::condition_variable queued_;
+  // Signaled when an extent has been read.
+  std::condition_variable done_;
+  bool stopping_;
+
+  std::vector<Slot> slots_;
+  // The indices and generations of the queued extents.
+  std::deque<std::pair<size_t, uint64_t>> queue_;
+  // The extents in [|window_begin_|, |window_end_|) are being read ahead or
+  // have been read ahead and not asked for yet.
+  size_t window_begin_;
+  size_t window_end_;
+  // The total size of the extents in the window.
+  uint64_t window_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReadAhead);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_READ_AHEAD_H_
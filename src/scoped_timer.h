@@ -0,0 +1,41 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_SCOPED_TIMER_H_
+#define SRC_SCOPED_TIMER_H_
+
+#include <chrono>
+#include <cstdint>
+
+#include "puffin/src/include/puffin/common.h"
+
+namespace puffin {
+
+// Adds the time elapsed during its lifetime to |*time_ns|. If |time_ns| is
+// nullptr, it does nothing.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(uint64_t* time_ns) : time_ns_(time_ns) {
+    if (time_ns_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedTimer() {
+    if (time_ns_) {
+      *time_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start_)
+                       .count();
+    }
+  }
+
+ private:
+  uint64_t* time_ns_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTimer);
+};
+
+}  // namespace puffin
+
+#endif  // SRC_SCOPED_TIMER_H_
@@ -2,16 +2,25 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+#include <fstream>
 #include <numeric>
+#include <sstream>
 
 #include "gtest/gtest.h"
 
+#include "puffin/src/bit_reader.h"
 #include "puffin/src/extent_stream.h"
 #include "puffin/src/file_stream.h"
+#include "puffin/src/include/puffin/buffer_pool.h"
 #include "puffin/src/include/puffin/huffer.h"
 #include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/include/puffin/trace.h"
+#include "puffin/src/include/puffin/utils.h"
 #include "puffin/src/memory_stream.h"
+#include "puffin/src/puff_writer.h"
 #include "puffin/src/puffin_stream.h"
+#include "puffin/src/read_ahead.h"
 #include "puffin/src/unittest_common.h"
 
 using std::string;
@@ -246,6 +255,439 @@ TEST_F(StreamTest, PuffinStreamTest) {
   TestClose(write_stream.get());
 }
 
+TEST_F(StreamTest, BufferPoolTest) {
+  auto pool = CreateBufferPool(1024 * 1024);
+  auto buffer = pool->Acquire(10000);
+  ASSERT_EQ(buffer->size(), 10000u);
+  EXPECT_LE(buffer->capacity(), 10000u * 5 / 4);
+  auto data = buffer->data();
+
+  // A released buffer is reused for a request in the same size class, even
+  // after the pool is gone.
+  buffer.reset();
+  buffer = pool->Acquire(9000);
+  EXPECT_EQ(buffer->size(), 9000u);
+  EXPECT_EQ(buffer->data(), data);
+  pool.reset();
+  buffer.reset();
+
+  // A buffer larger than the pool is not kept.
+  pool = CreateBufferPool(1024);
+  buffer = pool->Acquire(100);
+  EXPECT_EQ(buffer->size(), 100u);
+  buffer = pool->Acquire(2000);
+  EXPECT_EQ(buffer->size(), 2000u);
+}
+
+// A pool that counts the buffers taken from it.
+class CountingBufferPool : public BufferPoolInterface {
+ public:
+  CountingBufferPool() : pool_(CreateBufferPool(1024 * 1024)) {}
+  std::shared_ptr<Buffer> Acquire(size_t size) override {
+    acquired_++;
+    return pool_->Acquire(size);
+  }
+  size_t acquired_ = 0;
+
+ private:
+  std::shared_ptr<BufferPoolInterface> pool_;
+};
+
+TEST_F(StreamTest, PuffinStreamBufferPoolTest) {
+  auto pool = std::make_shared<CountingBufferPool>();
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffsSample1.size() /* max_cache_size */, pool);
+  TestRead(read_stream.get(), kPuffsSample1);
+  // The puff and deflate buffers and at least one cache.
+  EXPECT_GT(pool->acquired_, 2u);
+
+  pool->acquired_ = 0;
+  Buffer buf(kDeflatesSample1.size());
+  auto write_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&buf), std::make_shared<Huffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+      kPuffExtentsSample1, pool);
+  ASSERT_TRUE(write_stream->Write(kPuffsSample1.data(), kPuffsSample1.size()));
+  EXPECT_EQ(buf, kDeflatesSample1);
+  // The puff, deflate and write buffers.
+  EXPECT_EQ(pool->acquired_, 3u);
+}
+
+TEST_F(StreamTest, PuffinStreamTraceTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+
+  StartTracing();
+  EXPECT_TRUE(IsTracingEnabled());
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1);
+  Buffer buf(kPuffsSample1.size());
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  ASSERT_TRUE(StopTracing(filepath));
+  EXPECT_FALSE(IsTracingEnabled());
+
+  std::ifstream file(filepath);
+  std::stringstream trace;
+  trace << file.rdbuf();
+  EXPECT_EQ(trace.str().find("{\"traceEvents\":["), 0u);
+#ifndef PUFFIN_DISABLE_TRACING
+  EXPECT_NE(trace.str().find("\"name\":\"PuffDeflate\",\"ph\":\"X\""),
+            string::npos);
+  EXPECT_NE(trace.str().find("\"name\":\"Read\""), string::npos);
+#endif  // PUFFIN_DISABLE_TRACING
+
+  // Nothing is recorded after tracing is stopped.
+  ASSERT_TRUE(read_stream->Seek(0));
+  ASSERT_TRUE(read_stream->Read(buf.data(), buf.size()));
+  StartTracing();
+  ASSERT_TRUE(StopTracing(filepath));
+  std::ifstream empty_file(filepath);
+  trace.str("");
+  trace << empty_file.rdbuf();
+  EXPECT_EQ(trace.str().find("\"name\""), string::npos);
+}
+
+// Puffs |deflate| into a file with |PuffinStream::ReadInto| and huffs it back
+// into another file with |PuffinStream::WriteFrom|.
+void TestCopyBetweenFiles(const Buffer& deflate,
+                          const vector<BitExtent>& deflates,
+                          const vector<ByteExtent>& puffs,
+                          const Buffer& puff) {
+  string deflate_path, puff_path, huff_path;
+  ASSERT_TRUE(MakeTempFile(&deflate_path, nullptr));
+  ScopedPathUnlinker deflate_unlinker(deflate_path);
+  ASSERT_TRUE(MakeTempFile(&puff_path, nullptr));
+  ScopedPathUnlinker puff_unlinker(puff_path);
+  ASSERT_TRUE(MakeTempFile(&huff_path, nullptr));
+  ScopedPathUnlinker huff_unlinker(huff_path);
+  auto deflate_file = FileStream::Open(deflate_path, false, true);
+  ASSERT_TRUE(deflate_file->Write(deflate.data(), deflate.size()));
+  ASSERT_TRUE(deflate_file->Close());
+
+  auto puff_stream = PuffinStream::CreateForPuff(
+      FileStream::Open(deflate_path, true, false), std::make_shared<Puffer>(),
+      puff.size(), deflates, puffs);
+  auto puff_file = FileStream::Open(puff_path, true, true);
+  auto* puffin_stream = static_cast<PuffinStream*>(puff_stream.get());
+  ASSERT_TRUE(puffin_stream->ReadInto(puff_file.get(), puff.size()));
+  // Only the bytes between the deflates can be copied by the kernel.
+  EXPECT_GT(puffin_stream->GetStats().bytes_copied_in_kernel, 0u);
+  EXPECT_LT(puffin_stream->GetStats().bytes_copied_in_kernel, puff.size());
+  Buffer buf(puff.size());
+  ASSERT_TRUE(puff_file->Seek(0));
+  ASSERT_TRUE(puff_file->Read(buf.data(), buf.size()));
+  EXPECT_EQ(buf, puff);
+
+  auto huff_stream = PuffinStream::CreateForHuff(
+      FileStream::Open(huff_path, false, true), std::make_shared<Huffer>(),
+      puff.size(), deflates, puffs);
+  ASSERT_TRUE(puff_file->Seek(0));
+  ASSERT_TRUE(static_cast<PuffinStream*>(huff_stream.get())
+                  ->WriteFrom(puff_file.get(), puff.size()));
+  EXPECT_GT(static_cast<PuffinStream*>(huff_stream.get())
+                ->GetStats()
+                .bytes_copied_in_kernel,
+            0u);
+  ASSERT_TRUE(huff_stream->Close());
+  auto huff_file = FileStream::Open(huff_path, true, false);
+  buf.resize(deflate.size());
+  ASSERT_TRUE(huff_file->Read(buf.data(), buf.size()));
+  EXPECT_EQ(buf, deflate);
+}
+
+TEST_F(StreamTest, PuffinStreamCopyTest) {
+  TestCopyBetweenFiles(kDeflatesSample1, kSubblockDeflateExtentsSample1,
+                       kPuffExtentsSample1, kPuffsSample1);
+  TestCopyBetweenFiles(kDeflatesSample2, kSubblockDeflateExtentsSample2,
+                       kPuffExtentsSample2, kPuffsSample2);
+
+  // Streams that are not both files are copied through memory.
+  Buffer buf;
+  auto read_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1);
+  auto* puffin_stream = static_cast<PuffinStream*>(read_stream.get());
+  ASSERT_TRUE(puffin_stream->ReadInto(MemoryStream::CreateForWrite(&buf).get(),
+                                      kPuffsSample1.size()));
+  EXPECT_EQ(buf, kPuffsSample1);
+  EXPECT_EQ(puffin_stream->GetStats().bytes_copied_in_kernel, 0u);
+
+  Buffer huff_buf;
+  auto write_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&huff_buf), std::make_shared<Huffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+      kPuffExtentsSample1);
+  ASSERT_TRUE(static_cast<PuffinStream*>(write_stream.get())
+                  ->WriteFrom(MemoryStream::CreateForRead(buf).get(),
+                              buf.size()));
+  EXPECT_EQ(huff_buf, kDeflatesSample1);
+}
+
+TEST_F(StreamTest, PuffinStreamGetDataTest) {
+  // The second puff is at [15, 20) of the puff stream.
+  auto stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1,
+      kPuffsSample1.size());
+  const uint8_t* data;
+  // Not puffed yet.
+  EXPECT_FALSE(stream->GetData(16, 2, &data));
+  Buffer buf(kPuffsSample1.size());
+  ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+  ASSERT_TRUE(stream->GetData(16, 2, &data));
+  EXPECT_EQ(Buffer(data, data + 2),
+            Buffer(&kPuffsSample1[16], &kPuffsSample1[18]));
+  ASSERT_TRUE(stream->GetData(15, 5, &data));
+  EXPECT_EQ(Buffer(data, data + 5),
+            Buffer(&kPuffsSample1[15], &kPuffsSample1[20]));
+  // Not entirely in one puff.
+  EXPECT_FALSE(stream->GetData(14, 2, &data));
+  EXPECT_FALSE(stream->GetData(19, 2, &data));
+  EXPECT_FALSE(stream->GetData(kPuffsSample1.size(), 0, &data));
+
+  // Nothing is kept without a cache.
+  stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(kDeflatesSample1),
+      std::make_shared<Puffer>(), kPuffsSample1.size(),
+      kSubblockDeflateExtentsSample1, kPuffExtentsSample1);
+  ASSERT_TRUE(stream->Read(buf.data(), buf.size()));
+  EXPECT_FALSE(stream->GetData(16, 2, &data));
+}
+
+TEST_F(StreamTest, ReadAheadTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  Buffer data(1000);
+  std::iota(data.begin(), data.end(), 0);
+  auto file = FileStream::Open(filepath, true, true);
+  ASSERT_TRUE(file->Write(data.data(), data.size()));
+  int fd;
+  ASSERT_TRUE(file->GetFileDescriptor(&fd));
+
+  vector<ByteExtent> extents;
+  for (uint64_t offset = 0; offset < data.size(); offset += 100) {
+    extents.emplace_back(offset + 10, 50);
+  }
+  extents.emplace_back(990, 20);  // Past the end of the file.
+  // At most three extents or 120 bytes are read ahead.
+  auto read_ahead =
+      ReadAhead::Create(fd, extents, 3, 120, 2, CreateBufferPool(0));
+  ASSERT_TRUE(read_ahead);
+  auto check_extent = [&](size_t index) {
+    std::shared_ptr<Buffer> buffer;
+    bool from_read_ahead;
+    ASSERT_TRUE(read_ahead->Get(index, &buffer, &from_read_ahead));
+    EXPECT_EQ(*buffer, Buffer(data.begin() + extents[index].offset,
+                              data.begin() + extents[index].offset +
+                                  extents[index].length));
+  };
+  // In order, skipping ahead, going back and again.
+  for (size_t index : {0, 1, 2, 3, 6, 9, 4, 2, 5, 0, 7, 8, 9, 9}) {
+    check_extent(index);
+  }
+  std::shared_ptr<Buffer> buffer;
+  bool from_read_ahead;
+  EXPECT_FALSE(read_ahead->Get(10, &buffer, &from_read_ahead));
+  EXPECT_FALSE(read_ahead->Get(11, &buffer, &from_read_ahead));
+  // It can be destroyed while reading.
+  check_extent(0);
+  read_ahead.reset();
+}
+
+TEST_F(StreamTest, PuffinStreamReadAheadTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  auto file = FileStream::Open(filepath, false, true);
+  ASSERT_TRUE(file->Write(kDeflatesSample1.data(), kDeflatesSample1.size()));
+  ASSERT_TRUE(file->Close());
+
+  auto stream = PuffinStream::CreateForPuff(
+      FileStream::Open(filepath, true, false), std::make_shared<Puffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+      kPuffExtentsSample1);
+  ASSERT_TRUE(stream);
+  TestRead(stream.get(), kPuffsSample1);
+  const auto& stats = static_cast<PuffinStream*>(stream.get())->GetStats();
+  // Whether a deflate was read in time depends on the threads.
+  EXPECT_LE(stats.deflates_read_ahead, stats.deflates_puffed);
+}
+
+TEST_F(StreamTest, PuffinStreamCoalescedIOTest) {
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  auto file = FileStream::Open(filepath, false, true);
+  ASSERT_TRUE(file->Write(kDeflatesSample1.data(), kDeflatesSample1.size()));
+  ASSERT_TRUE(file->Close());
+
+  // The deflates are too small to be read ahead, so the whole file is read at
+  // once with its gaps.
+  auto read_stream = PuffinStream::CreateForPuff(
+      FileStream::Open(filepath, true, false), std::make_shared<Puffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+      kPuffExtentsSample1);
+  Buffer puff(kPuffsSample1.size());
+  ASSERT_TRUE(read_stream->Read(puff.data(), puff.size()));
+  EXPECT_EQ(puff, kPuffsSample1);
+  const auto& read_stats =
+      static_cast<PuffinStream*>(read_stream.get())->GetStats();
+  EXPECT_EQ(read_stats.deflates_read_ahead, 0u);
+  EXPECT_EQ(read_stats.stream_reads, 1u);
+
+  // The deflates and gaps are written at once too, when the last byte of the
+  // puff stream is written.
+  Buffer deflate(kDeflatesSample1.size());
+  auto write_stream = PuffinStream::CreateForHuff(
+      MemoryStream::CreateForWrite(&deflate), std::make_shared<Huffer>(),
+      kPuffsSample1.size(), kSubblockDeflateExtentsSample1,
+      kPuffExtentsSample1);
+  for (size_t idx = 0; idx < kPuffsSample1.size(); idx++) {
+    ASSERT_TRUE(write_stream->Write(&kPuffsSample1[idx], 1));
+  }
+  EXPECT_EQ(deflate, kDeflatesSample1);
+  EXPECT_EQ(
+      static_cast<PuffinStream*>(write_stream.get())->GetStats().stream_writes,
+      1u);
+}
+
+TEST_F(StreamTest, PuffinStreamLargePuffTest) {
+  Buffer deflate, puff;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(2, 600000, &deflate, &puff));
+  vector<BitExtent> deflates;
+  BufferBitReader br(deflate.data(), deflate.size());
+  BufferPuffWriter pw(nullptr, 0);
+  ASSERT_TRUE(Puffer().PuffDeflate(&br, &pw, &deflates));
+  deflates = {{0, deflates.back().offset + deflates.back().length}};
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflate), deflates,
+                                &puffs, &puff_size));
+  ASSERT_EQ(puffs.size(), 1u);
+  ASSERT_GT(puffs[0].length, 1024 * 1024u);
+
+  // Without a cache, the puff is not puffed again for each read, and its
+  // start is read without puffing the rest of it.
+  auto stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflate), std::make_shared<Puffer>(),
+      puff_size, deflates, puffs, 0 /* max_cache_size */);
+  const auto& stats = static_cast<PuffinStream*>(stream.get())->GetStats();
+  Buffer read_puff(puff_size);
+  ASSERT_TRUE(stream->Read(read_puff.data(), 1000));
+  EXPECT_EQ(stats.bytes_puffed, 1000u);
+  for (uint64_t offset = 1000; offset < puff_size; offset += 65536) {
+    auto count = std::min(uint64_t(65536), puff_size - offset);
+    ASSERT_TRUE(stream->Read(&read_puff[offset], count));
+  }
+  EXPECT_TRUE(std::equal(puff.begin(), puff.end(), read_puff.begin()));
+  EXPECT_EQ(stats.deflates_puffed, 1u);
+  EXPECT_EQ(stats.bytes_puffed, puffs[0].length);
+
+  // Going back puffs it again from the start, and skipping ahead does not.
+  Buffer piece(100);
+  for (uint64_t offset : {500000, 100, 900000}) {
+    ASSERT_TRUE(stream->Seek(offset));
+    ASSERT_TRUE(stream->Read(piece.data(), piece.size()));
+    EXPECT_TRUE(std::equal(piece.begin(), piece.end(), puff.begin() + offset));
+  }
+  EXPECT_EQ(stats.deflates_puffed, 3u);
+  EXPECT_EQ(stats.deflates_repuffed, 2u);
+
+  // The puff is huffed whole, whether it is written at once or in pieces.
+  for (size_t num_threads : {1, 4}) {
+    for (uint64_t piece : {puff_size, uint64_t(65536)}) {
+      Buffer huffed(deflate.size());
+      auto huff_stream = PuffinStream::CreateForHuff(
+          MemoryStream::CreateForWrite(&huffed), std::make_shared<Huffer>(),
+          puff_size, deflates, puffs, nullptr, PuffFormat::kV1, num_threads);
+      ASSERT_TRUE(huff_stream);
+      for (uint64_t offset = 0; offset < puff_size; offset += piece) {
+        ASSERT_TRUE(huff_stream->Write(&read_puff[offset],
+                                       std::min(piece, puff_size - offset)));
+      }
+      EXPECT_EQ(huffed, deflate);
+    }
+  }
+}
+
+TEST_F(StreamTest, PuffinStreamThreadsTest) {
+  // Each block of the deflate is puffed and huffed on its own. They do not
+  // start or end on byte boundaries.
+  Buffer deflate, puff;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(20, 1000, &deflate, &puff));
+  vector<BitExtent> deflates;
+  BufferBitReader br(deflate.data(), deflate.size());
+  BufferPuffWriter pw(nullptr, 0);
+  ASSERT_TRUE(Puffer().PuffDeflate(&br, &pw, &deflates));
+  ASSERT_EQ(deflates.size(), 20u);
+  vector<ByteExtent> puffs;
+  uint64_t puff_size;
+  ASSERT_TRUE(FindPuffLocations(MemoryStream::CreateForRead(deflate), deflates,
+                                &puffs, &puff_size));
+
+  string filepath;
+  ASSERT_TRUE(MakeTempFile(&filepath, nullptr));
+  ScopedPathUnlinker scoped_unlinker(filepath);
+  auto file = FileStream::Open(filepath, false, true);
+  ASSERT_TRUE(file->Write(deflate.data(), deflate.size()));
+  ASSERT_TRUE(file->Close());
+
+  Buffer expected_puff(puff_size);
+  auto single_stream = PuffinStream::CreateForPuff(
+      MemoryStream::CreateForRead(deflate), std::make_shared<Puffer>(),
+      puff_size, deflates, puffs);
+  ASSERT_TRUE(single_stream->Read(expected_puff.data(), puff_size));
+
+  // In memory and from a file, where all the deflates are read at once.
+  for (bool in_memory : {true, false}) {
+    auto stream = PuffinStream::CreateForPuff(
+        in_memory ? MemoryStream::CreateForRead(deflate)
+                  : FileStream::Open(filepath, true, false),
+        std::make_shared<Puffer>(), puff_size, deflates, puffs, 0, nullptr,
+        PuffFormat::kV1, 4 /* num_threads */);
+    ASSERT_TRUE(stream);
+    Buffer read_puff(puff_size);
+    ASSERT_TRUE(stream->Read(read_puff.data(), puff_size));
+    EXPECT_EQ(read_puff, expected_puff);
+    const auto& stats = static_cast<PuffinStream*>(stream.get())->GetStats();
+    EXPECT_EQ(stats.deflates_puffed, 20u);
+    if (!in_memory) {
+      EXPECT_EQ(stats.stream_reads, 1u);
+    }
+    // Reads of parts of the puffs still work.
+    ASSERT_TRUE(stream->Seek(0));
+    TestRead(stream.get(), expected_puff);
+  }
+
+  // Huffing the whole puff stream at once, or in pieces that only hold some
+  // of the puffs.
+  for (size_t piece : {puff_size, uint64_t(2500)}) {
+    Buffer huffed(deflate.size());
+    auto stream = PuffinStream::CreateForHuff(
+        MemoryStream::CreateForWrite(&huffed), std::make_shared<Huffer>(),
+        puff_size, deflates, puffs, nullptr, PuffFormat::kV1,
+        4 /* num_threads */);
+    ASSERT_TRUE(stream);
+    for (uint64_t offset = 0; offset < puff_size; offset += piece) {
+      ASSERT_TRUE(stream->Write(&expected_puff[offset],
+                                std::min(piece, puff_size - offset)));
+    }
+    EXPECT_EQ(huffed, deflate);
+    EXPECT_EQ(
+        static_cast<PuffinStream*>(stream.get())->GetStats().deflates_huffed,
+        20u);
+  }
+}
+
 TEST_F(StreamTest, ExtentStreamTest) {
   Buffer buf(100);
   std::iota(buf.begin(), buf.end(), 0);
@@ -0,0 +1,343 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/synthetic_corpus.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/logging.h"
+
+using std::string;
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+// The maximum distance of a deflate match.
+constexpr size_t kMaxDistance = 32 * 1024;
+
+// The size of the chunks the output of zlib is collected in.
+constexpr size_t kOutputChunkSize = 64 * 1024;
+
+int ToZlibStrategy(DeflateStrategy strategy) {
+  switch (strategy) {
+    case DeflateStrategy::kFixed:
+      return Z_FIXED;
+    case DeflateStrategy::kHuffmanOnly:
+      return Z_HUFFMAN_ONLY;
+    case DeflateStrategy::kRle:
+      return Z_RLE;
+    case DeflateStrategy::kFiltered:
+      return Z_FILTERED;
+    default:
+      return Z_DEFAULT_STRATEGY;
+  }
+}
+
+// Compresses |content| with zlib. |window_bits| selects the format of the
+// output the same way as in |deflateInit2|: negative for a raw deflate stream,
+// 15 for zlib and 31 for gzip.
+bool Compress(const Buffer& content,
+              const DeflateOptions& options,
+              int window_bits,
+              Buffer* out) {
+  z_stream strm = {};
+  TEST_AND_RETURN_FALSE(deflateInit2(&strm, options.level, Z_DEFLATED,
+                                     window_bits, 8,
+                                     ToZlibStrategy(options.strategy)) == Z_OK);
+  out->clear();
+  Buffer chunk(kOutputChunkSize);
+  size_t offset = 0;
+  int ret = Z_OK;
+  do {
+    auto length = content.size() - offset;
+    if (options.block_size != 0) {
+      length = std::min(length, options.block_size);
+    }
+    strm.next_in = const_cast<uint8_t*>(content.data() + offset);
+    strm.avail_in = length;
+    offset += length;
+    int flush = Z_FINISH;
+    if (offset < content.size()) {
+      flush = options.byte_aligned_blocks ? Z_SYNC_FLUSH : Z_BLOCK;
+    }
+    do {
+      strm.next_out = chunk.data();
+      strm.avail_out = chunk.size();
+      ret = deflate(&strm, flush);
+      if (ret == Z_STREAM_ERROR) {
+        break;
+      }
+      out->insert(out->end(), chunk.data(),
+                  chunk.data() + chunk.size() - strm.avail_out);
+    } while (strm.avail_out == 0);
+  } while (ret != Z_STREAM_ERROR && offset < content.size());
+  deflateEnd(&strm);
+  TEST_AND_RETURN_FALSE(ret == Z_STREAM_END);
+  return true;
+}
+
+void AppendUint16(uint16_t value, Buffer* out) {
+  out->push_back(value & 0xFF);
+  out->push_back(value >> 8);
+}
+
+void AppendUint32(uint32_t value, Buffer* out) {
+  AppendUint16(value & 0xFFFF, out);
+  AppendUint16(value >> 16, out);
+}
+
+// Creates a zip archive with one deflate compressed file per entry of
+// |entries|.
+bool CreateZip(const vector<Buffer>& entries,
+               const DeflateOptions& options,
+               Buffer* file) {
+  TEST_AND_RETURN_FALSE(entries.size() <= UINT16_MAX);
+  // The parts of the local file header and the central directory file header
+  // that are the same: version, flags, method, time, date, CRC-32, sizes and
+  // file name length. The date is 1980-01-01.
+  auto append_common_header = [](uint32_t crc, uint32_t compressed_size,
+                                 uint32_t size, const string& name,
+                                 Buffer* out) {
+    AppendUint16(20, out);
+    AppendUint16(0, out);
+    AppendUint16(Z_DEFLATED, out);
+    AppendUint16(0, out);
+    AppendUint16(0x21, out);
+    AppendUint32(crc, out);
+    AppendUint32(compressed_size, out);
+    AppendUint32(size, out);
+    AppendUint16(name.size(), out);
+    AppendUint16(0, out);  // Extra field length.
+  };
+
+  file->clear();
+  Buffer central_directory;
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    const auto& entry = entries[idx];
+    TEST_AND_RETURN_FALSE(entry.size() <= UINT32_MAX);
+    Buffer deflate;
+    TEST_AND_RETURN_FALSE(CompressDeflate(entry, options, &deflate));
+    TEST_AND_RETURN_FALSE(deflate.size() <= UINT32_MAX);
+    auto crc = crc32(0, entry.data(), entry.size());
+    auto name = "entry" + std::to_string(idx);
+    TEST_AND_RETURN_FALSE(file->size() <= UINT32_MAX);
+    uint32_t local_header_offset = file->size();
+
+    AppendUint32(0x04034B50, file);
+    append_common_header(crc, deflate.size(), entry.size(), name, file);
+    file->insert(file->end(), name.begin(), name.end());
+    file->insert(file->end(), deflate.begin(), deflate.end());
+
+    AppendUint32(0x02014B50, &central_directory);
+    AppendUint16(20, &central_directory);  // Version made by.
+    append_common_header(crc, deflate.size(), entry.size(), name,
+                         &central_directory);
+    AppendUint16(0, &central_directory);  // File comment length.
+    AppendUint16(0, &central_directory);  // Disk number start.
+    AppendUint16(0, &central_directory);  // Internal file attributes.
+    AppendUint32(0, &central_directory);  // External file attributes.
+    AppendUint32(local_header_offset, &central_directory);
+    central_directory.insert(central_directory.end(), name.begin(), name.end());
+  }
+  TEST_AND_RETURN_FALSE(file->size() + central_directory.size() <=
+                        UINT32_MAX);
+  uint32_t central_directory_offset = file->size();
+  file->insert(file->end(), central_directory.begin(), central_directory.end());
+
+  // End of central directory record.
+  AppendUint32(0x06054B50, file);
+  AppendUint16(0, file);
+  AppendUint16(0, file);
+  AppendUint16(entries.size(), file);
+  AppendUint16(entries.size(), file);
+  AppendUint32(central_directory.size(), file);
+  AppendUint32(central_directory_offset, file);
+  AppendUint16(0, file);  // Comment length.
+  return true;
+}
+
+}  // namespace
+
+bool StringToContentType(const string& name, ContentType* type) {
+  if (name == "text") {
+    *type = ContentType::kText;
+  } else if (name == "literal") {
+    *type = ContentType::kLiteralHeavy;
+  } else if (name == "match") {
+    *type = ContentType::kMatchHeavy;
+  } else if (name == "random") {
+    *type = ContentType::kRandom;
+  } else {
+    LOG(ERROR) << "Unknown content type: " << name;
+    return false;
+  }
+  return true;
+}
+
+bool StringToContainerType(const string& name, ContainerType* type) {
+  if (name == "deflate") {
+    *type = ContainerType::kDeflate;
+  } else if (name == "zlib") {
+    *type = ContainerType::kZlib;
+  } else if (name == "gzip") {
+    *type = ContainerType::kGzip;
+  } else if (name == "zip") {
+    *type = ContainerType::kZip;
+  } else {
+    LOG(ERROR) << "Unknown container type: " << name;
+    return false;
+  }
+  return true;
+}
+
+bool StringToDeflateStrategy(const string& name, DeflateStrategy* strategy) {
+  if (name == "default") {
+    *strategy = DeflateStrategy::kDefault;
+  } else if (name == "fixed") {
+    *strategy = DeflateStrategy::kFixed;
+  } else if (name == "huffman_only") {
+    *strategy = DeflateStrategy::kHuffmanOnly;
+  } else if (name == "rle") {
+    *strategy = DeflateStrategy::kRle;
+  } else if (name == "filtered") {
+    *strategy = DeflateStrategy::kFiltered;
+  } else {
+    LOG(ERROR) << "Unknown deflate strategy: " << name;
+    return false;
+  }
+  return true;
+}
+
+Buffer GenerateContent(ContentType type, size_t size, uint64_t seed) {
+  static const char* const kWords[] = {
+      "puffin", "deflate",  "huffman", "block",   "stream", "literal",
+      "length", "distance", "bsdiff",  "patch",   "update", "android",
+      "chrome", "kernel",   "image",   "archive", "the",    "of",
+      "and",    "to",       "in",      "is",      "for",    "with",
+  };
+  const size_t kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+  Random random(seed);
+  Buffer data;
+  data.reserve(size);
+  while (data.size() < size) {
+    auto value = random.Next();
+    switch (type) {
+      case ContentType::kText:
+        if (value % 64 == 0) {
+          for (size_t idx = 0; idx < 32; idx++) {
+            data.push_back(random.Next() & 0xFF);
+          }
+        } else {
+          const char* word = kWords[(value >> 8) % kNumWords];
+          data.insert(data.end(), word, word + strlen(word));
+          data.push_back((value >> 16) % 16 == 0 ? '\n' : ' ');
+        }
+        break;
+
+      case ContentType::kLiteralHeavy:
+        // Each bit is set with a probability of 1/4, so the bytes have about
+        // 6.5 bits of entropy.
+        data.push_back(value & (value >> 8) & 0xFF);
+        break;
+
+      case ContentType::kMatchHeavy:
+        if (data.empty() || value % 8 == 0) {
+          data.push_back((value >> 8) & 0xFF);
+        } else {
+          auto length = 8 + (value >> 8) % 250;
+          auto distance =
+              1 + (value >> 16) % std::min(data.size(), kMaxDistance);
+          // Byte by byte, because the copy can overlap itself.
+          auto start = data.size() - distance;
+          for (size_t idx = 0; idx < length; idx++) {
+            data.push_back(data[start + idx]);
+          }
+        }
+        break;
+
+      case ContentType::kRandom:
+        for (size_t idx = 0; idx < 8; idx++) {
+          data.push_back((value >> (idx * 8)) & 0xFF);
+        }
+        break;
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+Buffer EditContent(const Buffer& content,
+                   ContentType type,
+                   size_t num_edits,
+                   size_t max_edit_size,
+                   uint64_t seed) {
+  Random random(seed);
+  vector<size_t> offsets;
+  for (size_t idx = 0; idx < num_edits; idx++) {
+    offsets.push_back(random.Next() % (content.size() + 1));
+  }
+  // Edit from the end, so the offsets of the remaining edits do not change.
+  std::sort(offsets.begin(), offsets.end(), std::greater<size_t>());
+
+  Buffer edited(content);
+  for (auto offset : offsets) {
+    auto length = 1 + random.Next() % std::max(max_edit_size, size_t(1));
+    auto removed = std::min(length, edited.size() - offset);
+    auto new_bytes = GenerateContent(type, length, random.Next());
+    switch (random.Next() % 3) {
+      case 0:  // Replace.
+        edited.erase(edited.begin() + offset,
+                     edited.begin() + offset + removed);
+        edited.insert(edited.begin() + offset, new_bytes.begin(),
+                      new_bytes.end());
+        break;
+      case 1:  // Insert.
+        edited.insert(edited.begin() + offset, new_bytes.begin(),
+                      new_bytes.end());
+        break;
+      default:  // Delete.
+        edited.erase(edited.begin() + offset,
+                     edited.begin() + offset + removed);
+        break;
+    }
+  }
+  return edited;
+}
+
+bool CompressDeflate(const Buffer& content,
+                     const DeflateOptions& options,
+                     Buffer* deflate) {
+  return Compress(content, options, -15, deflate);
+}
+
+bool CreateContainer(ContainerType container,
+                     const vector<Buffer>& entries,
+                     const DeflateOptions& options,
+                     Buffer* file) {
+  if (container == ContainerType::kZip) {
+    return CreateZip(entries, options, file);
+  }
+  TEST_AND_RETURN_FALSE(entries.size() == 1);
+  switch (container) {
+    case ContainerType::kDeflate:
+      return Compress(entries[0], options, -15, file);
+    case ContainerType::kZlib:
+      return Compress(entries[0], options, 15, file);
+    case ContainerType::kGzip:
+      return Compress(entries[0], options, 31, file);
+    default:
+      return false;
+  }
+}
+
+}  // namespace puffin
@@ -0,0 +1,108 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_SYNTHETIC_CORPUS_H_
+#define SRC_SYNTHETIC_CORPUS_H_
+
+#include <string>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+
+// Helpers for generating synthetic deflate based files with controlled
+// properties for the benchmarks. Everything is deterministic for a given seed
+// and does not depend on the platform, so results are reproducible anywhere.
+// These depend on zlib, so they are only built into the benchmark binaries.
+
+namespace puffin {
+
+// A simple deterministic pseudo random number generator (xorshift64*). The
+// distributions in <random> are implementation defined, so they are not used.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed ? seed : 1) {}
+
+  uint64_t Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ULL;
+  }
+
+ private:
+  uint64_t state_;
+
+  DISALLOW_COPY_AND_ASSIGN(Random);
+};
+
+// The kind of the uncompressed content.
+enum class ContentType {
+  // Words with an occasional run of random bytes.
+  kText,
+  // Skewed random bytes that Huffman coding compresses but which have few
+  // matches.
+  kLiteralHeavy,
+  // Long copies of earlier content with small changes between them.
+  kMatchHeavy,
+  // Uniformly random bytes which end up in uncompressed blocks.
+  kRandom,
+};
+
+// The kind of the file containing the deflate streams.
+enum class ContainerType { kDeflate, kZlib, kGzip, kZip };
+
+// The zlib strategies, which control the type of the generated blocks.
+enum class DeflateStrategy { kDefault, kFixed, kHuffmanOnly, kRle, kFiltered };
+
+struct DeflateOptions {
+  // The zlib compression level. Zero generates only uncompressed blocks.
+  int level = 6;
+  DeflateStrategy strategy = DeflateStrategy::kDefault;
+  // If non-zero, a deflate block is ended after every |block_size| bytes of
+  // input.
+  size_t block_size = 0;
+  // If true, the blocks ended because of |block_size| are followed by an
+  // empty uncompressed block so the next block starts on a byte boundary.
+  // Otherwise the blocks can start in the middle of a byte.
+  bool byte_aligned_blocks = false;
+};
+
+// Returns the type matching |name| ("text", "literal", "match" or "random")
+// in |type|.
+bool StringToContentType(const std::string& name, ContentType* type);
+// Returns the type matching |name| ("deflate", "zlib", "gzip" or "zip") in
+// |type|.
+bool StringToContainerType(const std::string& name, ContainerType* type);
+// Returns the strategy matching |name| ("default", "fixed", "huffman_only",
+// "rle" or "filtered") in |strategy|.
+bool StringToDeflateStrategy(const std::string& name,
+                             DeflateStrategy* strategy);
+
+// Generates |size| bytes of |type| content from |seed|.
+Buffer GenerateContent(ContentType type, size_t size, uint64_t seed);
+
+// Creates the next version of |content| by applying |num_edits| edits at
+// random locations. Each edit replaces, inserts or deletes up to
+// |max_edit_size| bytes. The new bytes are of the same |type| as |content|.
+Buffer EditContent(const Buffer& content,
+                   ContentType type,
+                   size_t num_edits,
+                   size_t max_edit_size,
+                   uint64_t seed);
+
+// Compresses |content| into a raw deflate stream.
+bool CompressDeflate(const Buffer& content,
+                     const DeflateOptions& options,
+                     Buffer* deflate);
+
+// Creates a file of |container| type from |entries|. Only zip archives can
+// have more than one entry; their entries are named by their index.
+bool CreateContainer(ContainerType container,
+                     const std::vector<Buffer>& entries,
+                     const DeflateOptions& options,
+                     Buffer* file);
+
+}  // namespace puffin
+
+#endif  // SRC_SYNTHETIC_CORPUS_H_
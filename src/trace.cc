@@ -0,0 +1,162 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/trace.h"
+
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/trace_event.h"
+
+using std::string;
+using std::vector;
+using std::chrono::steady_clock;
+
+namespace puffin {
+
+std::atomic<bool> g_tracing_enabled(false);
+
+namespace {
+
+struct TraceEvent {
+  const char* category;
+  const char* name;
+  const char* arg_name;
+  uint64_t arg;
+  uint32_t thread_id;
+  // 'X' for complete events and 'i' for instant events.
+  char phase;
+  steady_clock::time_point start;
+  steady_clock::time_point end;
+};
+
+// The events recorded since |StartTracing|.
+class TraceLog {
+ public:
+  TraceLog() = default;
+
+  void Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.clear();
+    origin_ = steady_clock::now();
+    g_tracing_enabled.store(true, std::memory_order_release);
+  }
+
+  void Add(const TraceEvent& event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Drop the events that ended after |StopTracing|.
+    if (g_tracing_enabled.load(std::memory_order_relaxed)) {
+      events_.push_back(event);
+    }
+  }
+
+  // Stops recording and returns the recorded events in the Chrome trace event
+  // JSON format.
+  string Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    g_tracing_enabled.store(false, std::memory_order_release);
+    string json = "{\"traceEvents\":[";
+    auto pid = static_cast<int>(getpid());
+    auto to_us = [](steady_clock::duration duration) {
+      return std::chrono::duration<double, std::micro>(duration).count();
+    };
+    char buffer[512];
+    for (size_t idx = 0; idx < events_.size(); idx++) {
+      const auto& event = events_[idx];
+      snprintf(buffer, sizeof(buffer),
+               "%s\n{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"%c\","
+               "\"pid\":%d,\"tid\":%" PRIu32 ",\"ts\":%.3f",
+               idx == 0 ? "" : ",", event.category, event.name, event.phase,
+               pid, event.thread_id, to_us(event.start - origin_));
+      json += buffer;
+      if (event.phase == 'X') {
+        snprintf(buffer, sizeof(buffer), ",\"dur\":%.3f",
+                 to_us(event.end - event.start));
+        json += buffer;
+      } else {
+        // Instant events are shown on their thread only.
+        json += ",\"s\":\"t\"";
+      }
+      if (event.arg_name) {
+        snprintf(buffer, sizeof(buffer), ",\"args\":{\"%s\":%" PRIu64 "}",
+                 event.arg_name, event.arg);
+        json += buffer;
+      }
+      json += "}";
+    }
+    json += "\n],\"displayTimeUnit\":\"ms\"}\n";
+    events_.clear();
+    return json;
+  }
+
+ private:
+  std::mutex mutex_;
+  vector<TraceEvent> events_;
+  steady_clock::time_point origin_;
+
+  DISALLOW_COPY_AND_ASSIGN(TraceLog);
+};
+
+TraceLog* GetTraceLog() {
+  // Leaked so events can still be added while the program exits.
+  static auto* trace_log = new TraceLog();
+  return trace_log;
+}
+
+// Returns a small number identifying the calling thread in the trace.
+uint32_t GetTraceThreadId() {
+  static std::atomic<uint32_t> next_thread_id(1);
+  thread_local uint32_t thread_id = next_thread_id++;
+  return thread_id;
+}
+
+}  // namespace
+
+void AddTraceEvent(const char* category,
+                   const char* name,
+                   const char* arg_name,
+                   uint64_t arg,
+                   const steady_clock::time_point* start) {
+  TraceEvent event;
+  event.category = category;
+  event.name = name;
+  event.arg_name = arg_name;
+  event.arg = arg;
+  event.thread_id = GetTraceThreadId();
+  event.end = steady_clock::now();
+  event.phase = start ? 'X' : 'i';
+  event.start = start ? *start : event.end;
+  GetTraceLog()->Add(event);
+}
+
+void StartTracing() {
+#ifndef PUFFIN_DISABLE_TRACING
+  GetTraceLog()->Start();
+#endif  // PUFFIN_DISABLE_TRACING
+}
+
+bool StopTracing(const string& path) {
+  auto json = GetTraceLog()->Stop();
+  std::ofstream file(path, std::ios::trunc);
+  TEST_AND_RETURN_FALSE(file);
+  file << json;
+  TEST_AND_RETURN_FALSE(file);
+  return true;
+}
+
+bool IsTracingEnabled() {
+  return g_tracing_enabled.load(std::memory_order_relaxed);
+}
+
+}  // namespace puffin
@@ -0,0 +1,97 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef SRC_TRACE_EVENT_H_
+#define SRC_TRACE_EVENT_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/trace.h"
+
+namespace puffin {
+
+// Set by |StartTracing| and cleared by |StopTracing|.
+extern std::atomic<bool> g_tracing_enabled;
+
+// Records a complete event that started at |start| and ends now, or an instant
+// event if |start| is nullptr. |category|, |name| and |arg_name| must be string
+// literals (they are kept until the events are written) and |arg_name| can be
+// nullptr if the event has no argument.
+void AddTraceEvent(const char* category,
+                   const char* name,
+                   const char* arg_name,
+                   uint64_t arg,
+                   const std::chrono::steady_clock::time_point* start);
+
+// Records a complete event covering its lifetime, if tracing was enabled when
+// it was created. Use it through the |TRACE_EVENT*| macros below.
+class ScopedTraceEvent {
+ public:
+  ScopedTraceEvent(const char* category,
+                   const char* name,
+                   const char* arg_name = nullptr,
+                   uint64_t arg = 0)
+      : name_(nullptr) {
+    if (g_tracing_enabled.load(std::memory_order_relaxed)) {
+      category_ = category;
+      name_ = name;
+      arg_name_ = arg_name;
+      arg_ = arg;
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedTraceEvent() {
+    if (name_) {
+      AddTraceEvent(category_, name_, arg_name_, arg_, &start_);
+    }
+  }
+
+ private:
+  const char* category_;
+  // nullptr if the event is not recorded.
+  const char* name_;
+  const char* arg_name_;
+  uint64_t arg_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTraceEvent);
+};
+
+}  // namespace puffin
+
+#ifdef PUFFIN_DISABLE_TRACING
+
+#define TRACE_EVENT0(category, name)
+#define TRACE_EVENT1(category, name, arg_name, arg)
+#define TRACE_EVENT_INSTANT1(category, name, arg_name, arg)
+
+#else  // PUFFIN_DISABLE_TRACING
+
+#define PUFFIN_TRACE_CONCAT_INNER(a, b) a##b
+#define PUFFIN_TRACE_CONCAT(a, b) PUFFIN_TRACE_CONCAT_INNER(a, b)
+#define PUFFIN_TRACE_VARIABLE PUFFIN_TRACE_CONCAT(trace_event_, __LINE__)
+
+// Records an event from here to the end of the enclosing scope.
+#define TRACE_EVENT0(category, name) \
+  ::puffin::ScopedTraceEvent PUFFIN_TRACE_VARIABLE(category, name)
+
+// Same as |TRACE_EVENT0| with an integer argument shown with the event.
+#define TRACE_EVENT1(category, name, arg_name, arg)                 \
+  ::puffin::ScopedTraceEvent PUFFIN_TRACE_VARIABLE(category, name, \
+                                                   arg_name, arg)
+
+// Records an event without a duration.
+#define TRACE_EVENT_INSTANT1(category, name, arg_name, arg)            \
+  do {                                                                 \
+    if (::puffin::g_tracing_enabled.load(std::memory_order_relaxed)) { \
+      ::puffin::AddTraceEvent(category, name, arg_name, arg, nullptr); \
+    }                                                                  \
+  } while (0)
+
+#endif  // PUFFIN_DISABLE_TRACING
+
+#endif  // SRC_TRACE_EVENT_H_
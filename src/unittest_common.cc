@@ -4,6 +4,14 @@
 
 #include "puffin/src/unittest_common.h"
 
+#include <algorithm>
+
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/huffman_table.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+
 using std::string;
 using std::vector;
 
@@ -28,6 +36,118 @@ bool MakeTempFile(string* filename, int* fd) {
   return true;
 }
 
+bool MakeFixedHuffmanDeflate(size_t num_blocks,
+                             size_t block_symbols,
+                             Buffer* deflate,
+                             Buffer* puff) {
+  // The puff is written first and then huffed into the deflate.
+  auto write_puff = [num_blocks, block_symbols](PuffWriterInterface* pw) {
+    uint32_t random = 1;
+    auto next = [&random]() {
+      random = random * 1103515245 + 12345;
+      return random >> 16;
+    };
+    PuffData pd;
+    uint64_t output_size = 0;
+    for (size_t block = 0; block < num_blocks; block++) {
+      bool final_block = block + 1 == num_blocks;
+      pd.type = PuffData::Type::kBlockMetadata;
+      pd.block_metadata[0] =
+          (final_block << 7) | (static_cast<uint8_t>(BlockType::kFixed) << 5);
+      pd.length = 1;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+      for (size_t symbols = 0; symbols < block_symbols;) {
+        // Runs of up to 299 literals, so both the short and the long headers
+        // of the literals are used.
+        for (auto run = next() % 300; run > 0 && symbols < block_symbols;
+             run--, symbols++, output_size++) {
+          pd.type = PuffData::Type::kLiteral;
+          pd.byte = next() & 0xFF;
+          TEST_AND_RETURN_FALSE(pw->Insert(pd));
+        }
+        if (symbols < block_symbols && output_size > 0) {
+          pd.type = PuffData::Type::kLenDist;
+          pd.length = 3 + next() % 256;
+          pd.distance = 1 + next() % std::min(output_size, uint64_t(32768));
+          TEST_AND_RETURN_FALSE(pw->Insert(pd));
+          symbols++;
+          output_size += pd.length;
+        }
+      }
+      pd.type = PuffData::Type::kEndOfBlock;
+      TEST_AND_RETURN_FALSE(pw->Insert(pd));
+    }
+    return pw->Flush();
+  };
+
+  BufferPuffWriter size_pw(nullptr, 0);
+  TEST_AND_RETURN_FALSE(write_puff(&size_pw));
+  puff->resize(size_pw.Size());
+  BufferPuffWriter pw(puff->data(), puff->size());
+  TEST_AND_RETURN_FALSE(write_puff(&pw));
+
+  // No fixed Huffman code is longer than 31 bits with its extra bits.
+  deflate->resize(num_blocks * (block_symbols + 1) * 4 + 1);
+  BufferPuffReader pr(puff->data(), puff->size());
+  BufferBitWriter bw(deflate->data(), deflate->size());
+  TEST_AND_RETURN_FALSE(Huffer().HuffDeflate(&pr, &bw));
+  TEST_AND_RETURN_FALSE(bw.Flush());
+  deflate->resize(bw.Size());
+  return true;
+}
+
+void MakeZipArchive(const vector<std::pair<string, Buffer>>& entries,
+                    Buffer* zip) {
+  auto append = [](uint64_t value, size_t size, Buffer* buffer) {
+    for (size_t idx = 0; idx < size; idx++, value >>= 8) {
+      buffer->push_back(value & 0xFF);
+    }
+  };
+  Buffer cd;
+  zip->clear();
+  for (const auto& entry : entries) {
+    const auto& name = entry.first;
+    const auto& data = entry.second;
+    auto offset = zip->size();
+    // Signature, version, flags and deflate compression method.
+    append(0x04034b50, 4, zip);
+    append(20, 2, zip);
+    append(0, 2, zip);
+    append(8, 2, zip);
+    // Time, date and CRC-32, which are not checked.
+    append(0, 8, zip);
+    append(data.size(), 4, zip);
+    append(data.size() * 4, 4, zip);
+    append(name.size(), 2, zip);
+    append(0, 2, zip);
+    zip->insert(zip->end(), name.begin(), name.end());
+    zip->insert(zip->end(), data.begin(), data.end());
+
+    append(0x02014b50, 4, &cd);
+    append(20, 2, &cd);
+    append(20, 2, &cd);
+    append(0, 2, &cd);
+    append(8, 2, &cd);
+    append(0, 8, &cd);
+    append(data.size(), 4, &cd);
+    append(data.size() * 4, 4, &cd);
+    append(name.size(), 2, &cd);
+    // Extra field and comment lengths, disk number and file attributes.
+    append(0, 12, &cd);
+    append(offset, 4, &cd);
+    cd.insert(cd.end(), name.begin(), name.end());
+  }
+  auto cd_offset = zip->size();
+  zip->insert(zip->end(), cd.begin(), cd.end());
+  append(0x06054b50, 4, zip);
+  append(0, 4, zip);
+  append(entries.size(), 2, zip);
+  append(entries.size(), 2, zip);
+  append(cd.size(), 4, zip);
+  append(cd_offset, 4, zip);
+  append(0, 2, zip);
+}
+
 // clang-format off
 const Buffer kDeflatesSample1 = {
     /* raw   0 */ 0x11, 0x22,
@@ -6,6 +6,7 @@
 #define SRC_UNITTEST_COMMON_H_
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "puffin/src/include/puffin/common.h"
@@ -34,6 +35,21 @@ class ScopedPathUnlinker {
 // values.
 bool MakeTempFile(std::string* filename, int* fd);
 
+// Makes a deflate of |num_blocks| fixed Huffman blocks with |block_symbols|
+// literals and length/distance pairs each, in |deflate|, and its puff in
+// |puff|. The symbols are pseudo random but the same on every call.
+bool MakeFixedHuffmanDeflate(size_t num_blocks,
+                             size_t block_symbols,
+                             Buffer* deflate,
+                             Buffer* puff);
+
+// Makes a zip archive in |zip| of |entries|, each a file name and the already
+// deflated data of the file, with a central directory after them. The local
+// file headers have no extra field.
+void MakeZipArchive(
+    const std::vector<std::pair<std::string, Buffer>>& entries,
+    Buffer* zip);
+
 extern const Buffer kDeflatesSample1;
 extern const Buffer kPuffsSample1;
 extern const std::vector<ByteExtent> kDeflateExtentsSample1;
@@ -5,6 +5,13 @@
 #include "puffin/src/include/puffin/utils.h"
 
 #include <inttypes.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <algorithm>
 #include <iterator>
@@ -19,6 +26,7 @@
 #include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/puff_writer.h"
+#include "puffin/src/trace_event.h"
 
 using std::set;
 using std::string;
@@ -128,6 +136,286 @@ bool LocateDeflatesInZlib(const Buffer& data, vector<BitExtent>* deflates) {
   return true;
 }
 
+namespace {
+// The initial size of the window used by the stream-based locators when the
+// size of a deflate stream is not known beforehand. The window doubles every
+// time the deflate stream does not fit in it.
+constexpr uint64_t kDefaultLocateWindowSize = 1024 * 1024;  // 1 MB
+
+// The bytes added to a window whose size is the expected size of the deflate
+// stream. The decoder asks for as many bits as the longest Huffman code before
+// decoding each symbol, including the last end of block symbol, which would
+// otherwise reach the end of the window and make it grow for nothing.
+constexpr uint64_t kLocateWindowPadding = 8;
+
+// The size of the window used for scanning a zip archive for local file
+// headers.
+constexpr uint64_t kZipScanWindowSize = 4 * 1024 * 1024;  // 4 MB
+
+// The signature of a zip local file header.
+constexpr uint8_t kZipLocalFileHeaderSignature[] = {'P', 'K', 3, 4};
+// The size of a zip local file header without its file name and extra field.
+constexpr uint64_t kZipLocalFileHeaderSize = 30;
+
+// The signatures and sizes (without their variable length fields) of the end
+// of central directory record and of a central directory file header. The end
+// of central directory record is followed by a comment of at most 64 KB.
+constexpr uint8_t kZipEndOfCentralDirectorySignature[] = {'P', 'K', 5, 6};
+constexpr uint64_t kZipEndOfCentralDirectorySize = 22;
+constexpr uint64_t kZipMaxCommentSize = 0xFFFF;
+constexpr uint8_t kZipCentralDirectoryHeaderSignature[] = {'P', 'K', 1, 2};
+constexpr uint64_t kZipCentralDirectoryHeaderSize = 46;
+// The optional signature of a data descriptor.
+constexpr uint8_t kZipDataDescriptorSignature[] = {'P', 'K', 7, 8};
+
+// Returns the offset of the first local file header signature in the |size|
+// bytes at |data|, or |size| if there is none. With SSE2 or AVX2, each of the
+// four signature bytes is compared against 16 or 32 consecutive offsets at
+// once. The rest is scanned with |memchr| for the first signature byte.
+size_t FindZipLocalFileHeaderSignature(const uint8_t* data, size_t size) {
+  const auto& signature = kZipLocalFileHeaderSignature;
+  size_t pos = 0;
+#if defined(__AVX2__)
+  const auto sig0 = _mm256_set1_epi8(signature[0]);
+  const auto sig1 = _mm256_set1_epi8(signature[1]);
+  const auto sig2 = _mm256_set1_epi8(signature[2]);
+  const auto sig3 = _mm256_set1_epi8(signature[3]);
+  auto load = [data](size_t offset) {
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+  };
+  for (; pos + 32 + 3 <= size; pos += 32) {
+    auto match = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(load(pos), sig0),
+                         _mm256_cmpeq_epi8(load(pos + 1), sig1)),
+        _mm256_and_si256(_mm256_cmpeq_epi8(load(pos + 2), sig2),
+                         _mm256_cmpeq_epi8(load(pos + 3), sig3)));
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(match));
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const auto sig0 = _mm_set1_epi8(signature[0]);
+  const auto sig1 = _mm_set1_epi8(signature[1]);
+  const auto sig2 = _mm_set1_epi8(signature[2]);
+  const auto sig3 = _mm_set1_epi8(signature[3]);
+  auto load = [data](size_t offset) {
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+  };
+  for (; pos + 16 + 3 <= size; pos += 16) {
+    auto match =
+        _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(load(pos), sig0),
+                                    _mm_cmpeq_epi8(load(pos + 1), sig1)),
+                      _mm_and_si128(_mm_cmpeq_epi8(load(pos + 2), sig2),
+                                    _mm_cmpeq_epi8(load(pos + 3), sig3)));
+    auto mask = static_cast<uint32_t>(_mm_movemask_epi8(match));
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while (pos + sizeof(signature) <= size) {
+    auto found = static_cast<const uint8_t*>(
+        memchr(data + pos, signature[0], size - pos - sizeof(signature) + 1));
+    if (found == nullptr) {
+      break;
+    }
+    pos = found - data;
+    if (memcmp(found, signature, sizeof(signature)) == 0) {
+      return pos;
+    }
+    pos++;
+  }
+  return size;
+}
+
+// Checks the fields of the local file header at |pos| of a zip archive of
+// |size| bytes, before the entry is decoded. |header| points to the header
+// and has |available| bytes, at least |kZipLocalFileHeaderSize|. Returns true
+// if the entry can be a deflate entry within the archive and sets the size of
+// the header (including the file name and extra field) and the compressed size
+// given in the header.
+bool CheckZipLocalFileHeader(const uint8_t* header,
+                             uint64_t available,
+                             uint64_t pos,
+                             uint64_t size,
+                             uint64_t* header_size,
+                             uint32_t* compressed_size) {
+  // local file header format
+  // 0      4     0x04034b50
+  // 4      2     minimum version needed to extract
+  // 6      2     general purpose bit flag
+  // 8      2     compression method
+  // 10     4     file last modification date & time
+  // 14     4     CRC-32
+  // 18     4     compressed size
+  // 22     4     uncompressed size
+  // 26     2     file name length
+  // 28     2     extra field length
+  // 30     n     file name
+  // 30+n   m     extra field
+  auto compression_method = get_unaligned<uint16_t>(header + 8);
+  if (compression_method != 8) {  // non-deflate type
+    return false;
+  }
+  // Encrypted entries are not deflate streams.
+  auto flags = get_unaligned<uint16_t>(header + 6);
+  if (flags & 1) {
+    return false;
+  }
+
+  *compressed_size = get_unaligned<uint32_t>(header + 18);
+  auto file_name_length = get_unaligned<uint16_t>(header + 26);
+  auto extra_field_length = get_unaligned<uint16_t>(header + 28);
+  *header_size =
+      kZipLocalFileHeaderSize + file_name_length + extra_field_length;
+
+  // sanity check
+  if (*header_size + *compressed_size > size ||
+      pos > size - *header_size - *compressed_size) {
+    return false;
+  }
+  // The block type 3 is reserved, so the entry cannot start with it.
+  if (*header_size < available && ((header[*header_size] >> 1) & 3) == 3) {
+    return false;
+  }
+  return true;
+}
+
+// A |BitReaderInterface| that forwards everything to a |BufferBitReader|, but
+// remembers whether a read has ever failed because the end of the buffer was
+// reached. The stream-based locators use this to decide whether they need a
+// larger window or the input is simply not a valid deflate stream.
+class WindowBitReader : public BitReaderInterface {
+ public:
+  WindowBitReader(const uint8_t* in_buf, size_t in_size)
+      : br_(in_buf, in_size), reached_end_(false) {}
+  ~WindowBitReader() override = default;
+
+  bool CacheBits(size_t nbits) override {
+    if (!br_.CacheBits(nbits)) {
+      reached_end_ = true;
+      return false;
+    }
+    return true;
+  }
+  uint32_t ReadBits(size_t nbits) override { return br_.ReadBits(nbits); }
+  void DropBits(size_t nbits) override { br_.DropBits(nbits); }
+  uint8_t ReadBoundaryBits() override { return br_.ReadBoundaryBits(); }
+  size_t SkipBoundaryBits() override { return br_.SkipBoundaryBits(); }
+  bool GetByteReaderFn(
+      size_t length,
+      std::function<bool(uint8_t* buffer, size_t count)>* read_fn) override {
+    if (!br_.GetByteReaderFn(length, read_fn)) {
+      reached_end_ = true;
+      return false;
+    }
+    return true;
+  }
+  size_t Offset() const override { return br_.Offset(); }
+  uint64_t OffsetInBits() const override { return br_.OffsetInBits(); }
+  uint64_t BitsRemaining() const override { return br_.BitsRemaining(); }
+
+  // Returns true if any read went past the end of the buffer.
+  bool ReachedEnd() const { return reached_end_; }
+
+ private:
+  BufferBitReader br_;
+  bool reached_end_;
+
+  DISALLOW_COPY_AND_ASSIGN(WindowBitReader);
+};
+
+// Reads |length| bytes at |offset| of |src| into |buffer|.
+bool ReadStreamAt(const UniqueStreamPtr& src,
+                  uint64_t offset,
+                  uint64_t length,
+                  Buffer* buffer) {
+  buffer->resize(length);
+  TEST_AND_RETURN_FALSE(src->Seek(offset));
+  TEST_AND_RETURN_FALSE(src->Read(buffer->data(), length));
+  return true;
+}
+
+// Similar to |LocateDeflatesInDeflateStream| on streams, but the deflate
+// stream can be at most |max_size| bytes long. |size_hint| is the expected
+// length of the deflate stream and is used (with |kLocateWindowPadding|) as the
+// initial window size if non-zero.
+bool LocateDeflatesInDeflateStreamWindow(const UniqueStreamPtr& src,
+                                         uint64_t offset,
+                                         uint64_t max_size,
+                                         uint64_t size_hint,
+                                         vector<BitExtent>* deflates,
+                                         uint64_t* compressed_size) {
+  Puffer puffer;
+  Buffer window;
+  uint64_t window_size = size_hint > 0 ? size_hint + kLocateWindowPadding
+                                       : kDefaultLocateWindowSize;
+  while (true) {
+    window_size = std::min(window_size, max_size);
+    TEST_AND_RETURN_FALSE(ReadStreamAt(src, offset, window_size, &window));
+    WindowBitReader bit_reader(window.data(), window.size());
+    BufferPuffWriter puff_writer(nullptr, 0);
+    vector<BitExtent> sub_deflates;
+    bool success = puffer.PuffDeflate(&bit_reader, &puff_writer, &sub_deflates);
+    // If we never reached the end of the window, the result would have been
+    // the same had we passed the whole remaining stream. Otherwise we have to
+    // retry with a larger window unless there is nothing more to read.
+    if (!bit_reader.ReachedEnd() || window_size == max_size) {
+      TEST_AND_RETURN_FALSE(success);
+      for (const auto& deflate : sub_deflates) {
+        deflates->emplace_back(deflate.offset + offset * 8, deflate.length);
+      }
+      if (compressed_size) {
+        *compressed_size = bit_reader.Offset();
+      }
+      return true;
+    }
+    window_size *= 2;
+  }
+}
+}  // namespace
+
+bool LocateDeflatesInDeflateStream(const UniqueStreamPtr& src,
+                                   uint64_t offset,
+                                   vector<BitExtent>* deflates,
+                                   uint64_t* compressed_size) {
+  TRACE_EVENT1("locate", "LocateDeflatesInDeflateStream", "offset", offset);
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  TEST_AND_RETURN_FALSE(offset <= size);
+  return LocateDeflatesInDeflateStreamWindow(src, offset, size - offset, 0,
+                                             deflates, compressed_size);
+}
+
+bool LocateDeflatesInZlib(const UniqueStreamPtr& src,
+                          vector<BitExtent>* deflates) {
+  TRACE_EVENT0("locate", "LocateDeflatesInZlib");
+  // See |LocateDeflatesInZlib| for buffers for the format of a zlib stream.
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  TEST_AND_RETURN_FALSE(size >= 6 + 4);  // Header + Footer
+  Buffer header;
+  TEST_AND_RETURN_FALSE(ReadStreamAt(src, 0, 2, &header));
+  uint16_t cmf = header[0];
+  auto compression_method = cmf & 0x0F;
+  TEST_AND_RETURN_FALSE(compression_method == 8);
+  auto cinfo = (cmf & 0xF0) >> 4;
+  TEST_AND_RETURN_FALSE(cinfo <= 7);
+  auto flag = header[1];
+  TEST_AND_RETURN_FALSE(((cmf << 8) + flag) % 31 == 0);
+
+  uint64_t header_len = 2;
+  if (flag & 0x20) {
+    header_len += 4;  // 4 bytes for the preset dictionary.
+  }
+
+  // 4 is for ADLER32.
+  TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStreamWindow(
+      src, header_len, size - header_len - 4, 0, deflates, nullptr));
+  return true;
+}
+
 bool FindDeflateSubBlocks(const UniqueStreamPtr& src,
                           const vector<ByteExtent>& deflates,
                           vector<BitExtent>* subblock_deflates) {
@@ -247,46 +535,172 @@ bool LocateDeflatesInGzip(const Buffer& data, vector<BitExtent>* deflates) {
   return true;
 }
 
+bool LocateDeflatesInGzip(const UniqueStreamPtr& src,
+                          vector<BitExtent>* deflates) {
+  TRACE_EVENT0("locate", "LocateDeflatesInGzip");
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  // Gzip headers are small, so we read them in chunks of this size. Only the
+  // optional file name and comment fields can be longer than this.
+  constexpr uint64_t kHeaderChunkSize = 512;
+  Buffer header;
+  // Makes sure the bytes [|offset|, |offset| + |length|) of the stream are in
+  // |header|, which starts at |header_offset|.
+  uint64_t header_offset = 0;
+  auto ensure = [&](uint64_t offset, uint64_t length) {
+    TEST_AND_RETURN_FALSE(offset + length <= size);
+    if (offset < header_offset ||
+        offset + length > header_offset + header.size()) {
+      header_offset = offset;
+      TEST_AND_RETURN_FALSE(ReadStreamAt(
+          src, offset,
+          std::min(std::max(length, kHeaderChunkSize), size - offset),
+          &header));
+    }
+    return true;
+  };
+  auto at = [&](uint64_t offset) { return header[offset - header_offset]; };
+
+  TEST_AND_RETURN_FALSE(ensure(0, std::min(size, kHeaderChunkSize)));
+  TEST_AND_RETURN_FALSE(IsValidGzipHeader(header.data(), header.size()));
+  uint64_t member_start = 0;
+  while (true) {
+    // See |LocateDeflatesInGzip| for buffers for the format of a gzip member.
+    uint64_t offset = member_start + 10;
+    int flag = at(member_start + 3);
+    // Extra field
+    if (flag & 4) {
+      TEST_AND_RETURN_FALSE(ensure(offset, 2));
+      uint16_t extra_length = at(offset++);
+      extra_length |= static_cast<uint16_t>(at(offset++)) << 8;
+      TEST_AND_RETURN_FALSE(offset + extra_length <= size);
+      offset += extra_length;
+    }
+    // File name field and file comment field.
+    for (int field_flag : {8, 16}) {
+      if (flag & field_flag) {
+        while (true) {
+          TEST_AND_RETURN_FALSE(ensure(offset, 1));
+          if (at(offset++) == 0) {
+            break;
+          }
+        }
+      }
+    }
+    // CRC16 field
+    if (flag & 2) {
+      offset += 2;
+    }
+
+    TEST_AND_RETURN_FALSE(offset <= size);
+    uint64_t compressed_size = 0;
+    TEST_AND_RETURN_FALSE(LocateDeflatesInDeflateStreamWindow(
+        src, offset, size - offset, 0, deflates, &compressed_size));
+    offset += compressed_size;
+
+    // Ignore CRC32 and uncompressed size.
+    TEST_AND_RETURN_FALSE(offset + 8 <= size);
+    offset += 8;
+    member_start = offset;
+
+    if (size - member_start < 10) {
+      break;
+    }
+    TEST_AND_RETURN_FALSE(ensure(member_start, 10));
+    if (!IsValidGzipHeader(&header[member_start - header_offset], 10)) {
+      break;
+    }
+  }
+  return true;
+}
+
 // For more information about the zip format, refer to
 // https://support.pkware.com/display/PKZIP/APPNOTE
 bool LocateDeflatesInZipArchive(const Buffer& data,
                                 vector<BitExtent>* deflates) {
   uint64_t pos = 0;
-  while (pos + 30 <= data.size()) {
-    // TODO(xunchang) add support for big endian system when searching for
-    // magic numbers.
-    if (get_unaligned<uint32_t>(data.data() + pos) != 0x04034b50) {
-      pos++;
+  while (pos + kZipLocalFileHeaderSize <= data.size()) {
+    pos += FindZipLocalFileHeaderSignature(data.data() + pos,
+                                           data.size() - pos);
+    if (pos + kZipLocalFileHeaderSize > data.size()) {
+      break;
+    }
+
+    uint64_t header_size;
+    uint32_t compressed_size;
+    if (!CheckZipLocalFileHeader(data.data() + pos, data.size() - pos, pos,
+                                 data.size(), &header_size,
+                                 &compressed_size)) {
+      pos += 4;
       continue;
     }
 
-    // local file header format
-    // 0      4     0x04034b50
-    // 4      2     minimum version needed to extract
-    // 6      2     general purpose bit flag
-    // 8      2     compression method
-    // 10     4     file last modification date & time
-    // 14     4     CRC-32
-    // 18     4     compressed size
-    // 22     4     uncompressed size
-    // 26     2     file name length
-    // 28     2     extra field length
-    // 30     n     file name
-    // 30+n   m     extra field
-    auto compression_method = get_unaligned<uint16_t>(data.data() + pos + 8);
-    if (compression_method != 8) {  // non-deflate type
+    vector<BitExtent> tmp_deflates;
+    uint64_t offset = pos + header_size;
+    uint64_t calculated_compressed_size = 0;
+    if (!LocateDeflatesInDeflateStream(
+            data.data() + offset, data.size() - offset, offset, &tmp_deflates,
+            &calculated_compressed_size)) {
+      LOG(ERROR) << "Failed to decompress the zip entry starting from: " << pos
+                 << ", skip adding deflates for this entry.";
       pos += 4;
       continue;
     }
 
-    auto compressed_size = get_unaligned<uint32_t>(data.data() + pos + 18);
-    auto file_name_length = get_unaligned<uint16_t>(data.data() + pos + 26);
-    auto extra_field_length = get_unaligned<uint16_t>(data.data() + pos + 28);
-    uint64_t header_size = 30 + file_name_length + extra_field_length;
+    // Double check the compressed size if it is available in the file header.
+    if (compressed_size > 0 && compressed_size != calculated_compressed_size) {
+      LOG(WARNING) << "Compressed size in the file header: " << compressed_size
+                   << " doesn't equal the real size: "
+                   << calculated_compressed_size;
+    }
+
+    deflates->insert(deflates->end(), tmp_deflates.begin(), tmp_deflates.end());
+    pos += header_size + calculated_compressed_size;
+  }
+
+  return true;
+}
+
+bool LocateDeflatesInZipArchive(const UniqueStreamPtr& src,
+                                vector<BitExtent>* deflates) {
+  TRACE_EVENT0("locate", "LocateDeflatesInZipArchive");
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+
+  // The part of the archive currently loaded for scanning. It starts at
+  // |window_offset| in the archive.
+  Buffer window;
+  uint64_t window_offset = 0;
+  auto ensure = [&](uint64_t offset, uint64_t length) {
+    if (offset < window_offset ||
+        offset + length > window_offset + window.size()) {
+      window_offset = offset;
+      TEST_AND_RETURN_FALSE(ReadStreamAt(
+          src, offset,
+          std::min(std::max(length, kZipScanWindowSize), size - offset),
+          &window));
+    }
+    return true;
+  };
+
+  uint64_t pos = 0;
+  while (pos + kZipLocalFileHeaderSize <= size) {
+    TEST_AND_RETURN_FALSE(ensure(pos, kZipLocalFileHeaderSize));
+    const uint8_t* header = window.data() + (pos - window_offset);
+    uint64_t available = window_offset + window.size() - pos;
+    auto skip = FindZipLocalFileHeaderSignature(header, available);
+    if (skip != 0) {
+      // There is no signature before |skip|. If none was found, one can still
+      // start in the last three bytes of the window.
+      pos += std::min<uint64_t>(
+          skip, available - sizeof(kZipLocalFileHeaderSignature) + 1);
+      continue;
+    }
 
-    // sanity check
-    if (static_cast<uint64_t>(header_size) + compressed_size > data.size() ||
-        pos > data.size() - header_size - compressed_size) {
+    uint64_t header_size;
+    uint32_t compressed_size;
+    if (!CheckZipLocalFileHeader(header, available, pos, size, &header_size,
+                                 &compressed_size)) {
       pos += 4;
       continue;
     }
@@ -294,9 +708,9 @@ bool LocateDeflatesInZipArchive(const Buffer& data,
     vector<BitExtent> tmp_deflates;
     uint64_t offset = pos + header_size;
     uint64_t calculated_compressed_size = 0;
-    if (!LocateDeflatesInDeflateStream(
-            data.data() + offset, data.size() - offset, offset, &tmp_deflates,
-            &calculated_compressed_size)) {
+    if (!LocateDeflatesInDeflateStreamWindow(src, offset, size - offset,
+                                             compressed_size, &tmp_deflates,
+                                             &calculated_compressed_size)) {
       LOG(ERROR) << "Failed to decompress the zip entry starting from: " << pos
                  << ", skip adding deflates for this entry.";
       pos += 4;
@@ -317,10 +731,139 @@ bool LocateDeflatesInZipArchive(const Buffer& data,
   return true;
 }
 
+bool LocateZipEntries(const UniqueStreamPtr& src,
+                      vector<ZipEntry>* entries) {
+  TRACE_EVENT0("locate", "LocateZipEntries");
+  uint64_t size;
+  TEST_AND_RETURN_FALSE(src->GetSize(&size));
+  TEST_AND_RETURN_FALSE(size >= kZipEndOfCentralDirectorySize);
+
+  // end of central directory record format
+  // 0      4     0x06054b50
+  // 4      2     number of this disk
+  // 6      2     disk where central directory starts
+  // 8      2     number of central directory records on this disk
+  // 10     2     total number of central directory records
+  // 12     4     size of central directory
+  // 16     4     offset of start of central directory
+  // 20     2     comment length
+  // 22     n     comment
+  Buffer tail;
+  auto tail_size =
+      std::min(size, kZipEndOfCentralDirectorySize + kZipMaxCommentSize);
+  TEST_AND_RETURN_FALSE(ReadStreamAt(src, size - tail_size, tail_size, &tail));
+  // The last record whose comment reaches the end of the archive.
+  const uint8_t* eocd = nullptr;
+  for (auto pos = tail_size - kZipEndOfCentralDirectorySize + 1; pos-- > 0;) {
+    if (memcmp(&tail[pos], kZipEndOfCentralDirectorySignature, 4) == 0 &&
+        pos + kZipEndOfCentralDirectorySize +
+                get_unaligned<uint16_t>(&tail[pos + 20]) ==
+            tail_size) {
+      eocd = &tail[pos];
+      break;
+    }
+  }
+  TEST_AND_RETURN_FALSE(eocd != nullptr);
+  uint64_t num_entries = get_unaligned<uint16_t>(eocd + 10);
+  uint64_t cd_size = get_unaligned<uint32_t>(eocd + 12);
+  uint64_t cd_offset = get_unaligned<uint32_t>(eocd + 16);
+  // The fields of a zip64 archive are in another record.
+  TEST_AND_RETURN_FALSE(num_entries != 0xFFFF && cd_size != 0xFFFFFFFF &&
+                        cd_offset != 0xFFFFFFFF);
+  TEST_AND_RETURN_FALSE(cd_offset + cd_size <= size);
+
+  // central directory file header format
+  // 0      4     0x02014b50
+  // 8      2     general purpose bit flag
+  // 20     4     compressed size
+  // 28     2     file name length
+  // 30     2     extra field length
+  // 32     2     file comment length
+  // 42     4     offset of local file header
+  // 46     n     file name
+  Buffer cd;
+  TEST_AND_RETURN_FALSE(ReadStreamAt(src, cd_offset, cd_size, &cd));
+  struct CentralEntry {
+    string name;
+    uint64_t offset;
+    uint64_t compressed_size;
+    bool has_data_descriptor;
+  };
+  vector<CentralEntry> central_entries;
+  uint64_t pos = 0;
+  for (uint64_t idx = 0; idx < num_entries; idx++) {
+    TEST_AND_RETURN_FALSE(pos + kZipCentralDirectoryHeaderSize <= cd.size());
+    const uint8_t* header = &cd[pos];
+    TEST_AND_RETURN_FALSE(
+        memcmp(header, kZipCentralDirectoryHeaderSignature, 4) == 0);
+    auto name_length = get_unaligned<uint16_t>(header + 28);
+    auto variable_length = name_length +
+                           get_unaligned<uint16_t>(header + 30) +
+                           get_unaligned<uint16_t>(header + 32);
+    TEST_AND_RETURN_FALSE(pos + kZipCentralDirectoryHeaderSize +
+                              variable_length <=
+                          cd.size());
+    CentralEntry entry;
+    entry.name.assign(
+        reinterpret_cast<const char*>(header + kZipCentralDirectoryHeaderSize),
+        name_length);
+    entry.offset = get_unaligned<uint32_t>(header + 42);
+    entry.compressed_size = get_unaligned<uint32_t>(header + 20);
+    entry.has_data_descriptor = get_unaligned<uint16_t>(header + 8) & 8;
+    TEST_AND_RETURN_FALSE(entry.offset != 0xFFFFFFFF &&
+                          entry.compressed_size != 0xFFFFFFFF);
+    central_entries.push_back(std::move(entry));
+    pos += kZipCentralDirectoryHeaderSize + variable_length;
+  }
+  std::sort(central_entries.begin(), central_entries.end(),
+            [](const CentralEntry& a, const CentralEntry& b) {
+              return a.offset < b.offset;
+            });
+
+  // The local file header has its own file name and extra field lengths. The
+  // data may be followed by a data descriptor, with or without a signature.
+  // Anything after that (like the signing block of an APK) is not part of the
+  // entry.
+  entries->clear();
+  entries->reserve(central_entries.size());
+  for (size_t idx = 0; idx < central_entries.size(); idx++) {
+    const auto& entry = central_entries[idx];
+    uint64_t next_offset = idx + 1 < central_entries.size()
+                               ? central_entries[idx + 1].offset
+                               : cd_offset;
+    TEST_AND_RETURN_FALSE(entry.offset + kZipLocalFileHeaderSize <=
+                          next_offset);
+    Buffer header;
+    TEST_AND_RETURN_FALSE(
+        ReadStreamAt(src, entry.offset, kZipLocalFileHeaderSize, &header));
+    TEST_AND_RETURN_FALSE(
+        memcmp(header.data(), kZipLocalFileHeaderSignature, 4) == 0);
+    uint64_t end = entry.offset + kZipLocalFileHeaderSize +
+                   get_unaligned<uint16_t>(&header[26]) +
+                   get_unaligned<uint16_t>(&header[28]) +
+                   entry.compressed_size;
+    TEST_AND_RETURN_FALSE(end <= next_offset);
+    if (entry.has_data_descriptor) {
+      // CRC-32, compressed size and uncompressed size.
+      uint64_t descriptor_size = 12;
+      Buffer signature;
+      if (end + 4 <= next_offset &&
+          ReadStreamAt(src, end, 4, &signature) &&
+          memcmp(signature.data(), kZipDataDescriptorSignature, 4) == 0) {
+        descriptor_size += 4;
+      }
+      end = std::min(end + descriptor_size, next_offset);
+    }
+    entries->push_back({entry.name, {entry.offset, end - entry.offset}});
+  }
+  return true;
+}
+
 bool FindPuffLocations(const UniqueStreamPtr& src,
                        const vector<BitExtent>& deflates,
                        vector<ByteExtent>* puffs,
                        uint64_t* out_puff_size) {
+  TRACE_EVENT1("locate", "FindPuffLocations", "deflates", deflates.size());
   Puffer puffer;
   Buffer deflate_buffer;
 
@@ -4,6 +4,8 @@
 
 #include <unistd.h>
 
+#include <map>
+#include <utility>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -11,6 +13,7 @@
 #include "puffin/src/file_stream.h"
 #include "puffin/src/include/puffin/common.h"
 #include "puffin/src/include/puffin/utils.h"
+#include "puffin/src/logging.h"
 #include "puffin/src/memory_stream.h"
 #include "puffin/src/unittest_common.h"
 
@@ -110,6 +113,39 @@ void CheckFindPuffLocation(const Buffer& compressed,
   EXPECT_EQ(puffs, expected_puffs);
   EXPECT_EQ(puff_size, expected_puff_size);
 }
+
+// A stream that forwards everything to |stream| and counts the reads starting
+// at each offset.
+class ReadCountingStream : public StreamInterface {
+ public:
+  ReadCountingStream(UniqueStreamPtr stream, std::map<uint64_t, int>* reads)
+      : stream_(std::move(stream)), reads_(reads) {}
+  ~ReadCountingStream() override = default;
+
+  bool GetSize(uint64_t* size) const override {
+    return stream_->GetSize(size);
+  }
+  bool GetOffset(uint64_t* offset) const override {
+    return stream_->GetOffset(offset);
+  }
+  bool Seek(uint64_t offset) override { return stream_->Seek(offset); }
+  bool Read(void* buffer, size_t length) override {
+    uint64_t offset;
+    TEST_AND_RETURN_FALSE(stream_->GetOffset(&offset));
+    (*reads_)[offset]++;
+    return stream_->Read(buffer, length);
+  }
+  bool Write(const void* /* buffer */, size_t /* length */) override {
+    return false;
+  }
+  bool Close() override { return stream_->Close(); }
+
+ private:
+  UniqueStreamPtr stream_;
+  std::map<uint64_t, int>* reads_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReadCountingStream);
+};
 }  // namespace
 
 // Test Simple Puffing of the source.
@@ -186,6 +222,55 @@ TEST(UtilsTest, LocateDeflatesInZipArchiveErrorChecks) {
   EXPECT_TRUE(deflates_incomplete.empty());
 }
 
+TEST(UtilsTest, LocateDeflatesInZipArchiveAfterJunk) {
+  // Junk with partial signatures before the archive. The largest prefix puts
+  // the first local file header across the 4 MB scanning window of streams.
+  for (size_t junk_size : {1, 3, 17, 31, 64, 4 * 1024 * 1024 - 2}) {
+    const uint8_t kJunk[] = {'P', 'K', 3, 'P', 'K', 'P'};
+    Buffer zip_entries(junk_size);
+    for (size_t idx = 0; idx < junk_size; idx++) {
+      zip_entries[idx] = kJunk[idx % sizeof(kJunk)];
+    }
+    zip_entries.insert(zip_entries.end(), kZipEntries, std::end(kZipEntries));
+    vector<BitExtent> expected_deflates = {{472 + junk_size * 8, 46},
+                                           {992 + junk_size * 8, 46}};
+
+    vector<BitExtent> deflates;
+    EXPECT_TRUE(LocateDeflatesInZipArchive(zip_entries, &deflates));
+    EXPECT_EQ(deflates, expected_deflates);
+    deflates.clear();
+    EXPECT_TRUE(LocateDeflatesInZipArchive(
+        MemoryStream::CreateForRead(zip_entries), &deflates));
+    EXPECT_EQ(deflates, expected_deflates);
+  }
+}
+
+TEST(UtilsTest, LocateZipEntries) {
+  Buffer zip;
+  MakeZipArchive({{"a", {1, 2, 3}}, {"bb", {}}, {"c", {4, 5}}}, &zip);
+  vector<ZipEntry> entries;
+  ASSERT_TRUE(LocateZipEntries(MemoryStream::CreateForRead(zip), &entries));
+  ASSERT_EQ(entries.size(), 3u);
+  EXPECT_EQ(entries[0].name, "a");
+  EXPECT_EQ(entries[0].extent, ByteExtent(0, 34));
+  EXPECT_EQ(entries[1].name, "bb");
+  EXPECT_EQ(entries[1].extent, ByteExtent(34, 32));
+  EXPECT_EQ(entries[2].name, "c");
+  EXPECT_EQ(entries[2].extent, ByteExtent(66, 33));
+
+  // A comment after the end of central directory record.
+  zip[zip.size() - 2] = 3;
+  zip.insert(zip.end(), {'P', 'K', 5});
+  entries.clear();
+  ASSERT_TRUE(LocateZipEntries(MemoryStream::CreateForRead(zip), &entries));
+  EXPECT_EQ(entries.size(), 3u);
+
+  // Local file headers without a central directory are not enough.
+  Buffer zip_entries(kZipEntries, std::end(kZipEntries));
+  EXPECT_FALSE(
+      LocateZipEntries(MemoryStream::CreateForRead(zip_entries), &entries));
+}
+
 TEST(UtilsTest, LocateDeflatesInGzip) {
   Buffer gzip_data(kGzipEntryWithMultipleMembers,
                    std::end(kGzipEntryWithMultipleMembers));
@@ -222,6 +307,132 @@ TEST(UtilsTest, LocateDeflatesInGzipWithExtraField) {
   EXPECT_EQ(deflates, expected_deflates);
 }
 
+TEST(UtilsTest, LocateDeflatesInDeflateStreamFromStream) {
+  auto src = MemoryStream::CreateForRead(kDeflatesSample2);
+  vector<BitExtent> deflates;
+  uint64_t compressed_size;
+  EXPECT_TRUE(LocateDeflatesInDeflateStream(src, 0, &deflates,
+                                            &compressed_size));
+  vector<BitExtent> expected_deflates = {{0, 50}};
+  EXPECT_EQ(deflates, expected_deflates);
+  EXPECT_EQ(compressed_size, 7);
+
+  // The offsets are relative to the beginning of the stream.
+  deflates.clear();
+  EXPECT_TRUE(LocateDeflatesInDeflateStream(src, 19, &deflates,
+                                            &compressed_size));
+  expected_deflates = {{152, 18}};
+  EXPECT_EQ(deflates, expected_deflates);
+  EXPECT_EQ(compressed_size, 3);
+
+  EXPECT_FALSE(LocateDeflatesInDeflateStream(src, 7, &deflates, nullptr));
+}
+
+TEST(UtilsTest, LocateDeflatesInZlibFromStream) {
+  Buffer zlib_data(kZlibEntry, std::end(kZlibEntry));
+  vector<BitExtent> deflates;
+  vector<BitExtent> expected_deflates = {{16, 98}};
+  EXPECT_TRUE(
+      LocateDeflatesInZlib(MemoryStream::CreateForRead(zlib_data), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  zlib_data[0] &= 0xF0;
+  EXPECT_FALSE(
+      LocateDeflatesInZlib(MemoryStream::CreateForRead(zlib_data), &deflates));
+}
+
+TEST(UtilsTest, LocateDeflatesInGzipFromStream) {
+  Buffer gzip_data(kGzipEntryWithMultipleMembers,
+                   std::end(kGzipEntryWithMultipleMembers));
+  vector<BitExtent> deflates;
+  vector<BitExtent> expected_deflates = {{160, 98}, {488, 98}};
+  EXPECT_TRUE(
+      LocateDeflatesInGzip(MemoryStream::CreateForRead(gzip_data), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  // With padding.
+  gzip_data.resize(gzip_data.size() + 100);
+  deflates.clear();
+  EXPECT_TRUE(
+      LocateDeflatesInGzip(MemoryStream::CreateForRead(gzip_data), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  Buffer extra_field_data(kGzipEntryWithExtraField,
+                          std::end(kGzipEntryWithExtraField));
+  deflates.clear();
+  expected_deflates = {{256, 98}};
+  EXPECT_TRUE(LocateDeflatesInGzip(
+      MemoryStream::CreateForRead(extra_field_data), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  gzip_data[0] ^= 1;
+  EXPECT_FALSE(
+      LocateDeflatesInGzip(MemoryStream::CreateForRead(gzip_data), &deflates));
+}
+
+TEST(UtilsTest, LocateDeflatesInZipArchiveFromStream) {
+  Buffer zip_entries(kZipEntries, std::end(kZipEntries));
+  vector<BitExtent> deflates;
+  vector<BitExtent> expected_deflates = {{472, 46}, {992, 46}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_entries), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  Buffer zip_with_descriptor(kZipEntryWithDataDescriptor,
+                             std::end(kZipEntryWithDataDescriptor));
+  deflates.clear();
+  expected_deflates = {{472, 46}, {1120, 46}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_with_descriptor), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  // A compressed size smaller than the real one does not matter. See
+  // |LocateDeflatesInZipArchiveReadsEntryOnce| for the window growing.
+  zip_entries[18] = 1;
+  deflates.clear();
+  expected_deflates = {{472, 46}, {992, 46}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_entries), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+
+  // Same as the error checks for the buffer variant.
+  zip_entries[29] = 0xff;
+  deflates.clear();
+  expected_deflates = {{992, 46}};
+  EXPECT_TRUE(LocateDeflatesInZipArchive(
+      MemoryStream::CreateForRead(zip_entries), &deflates));
+  EXPECT_EQ(deflates, expected_deflates);
+}
+
+// Tests that an entry whose compressed size is in its local file header is
+// read once, even though its last symbol is decoded at the end of the window.
+TEST(UtilsTest, LocateDeflatesInZipArchiveReadsEntryOnce) {
+  Buffer deflate, puff, zip;
+  ASSERT_TRUE(MakeFixedHuffmanDeflate(2, 5000, &deflate, &puff));
+  MakeZipArchive({{"a", deflate}}, &zip);
+  std::map<uint64_t, int> reads;
+  vector<BitExtent> deflates;
+  ASSERT_TRUE(LocateDeflatesInZipArchive(
+      UniqueStreamPtr(
+          new ReadCountingStream(MemoryStream::CreateForRead(zip), &reads)),
+      &deflates));
+  ASSERT_FALSE(deflates.empty());
+  // The data of the entry starts after its 30 byte header and its name.
+  EXPECT_EQ(reads[31], 1);
+
+  // A compressed size smaller than the real one makes the window grow.
+  zip[18] = 100;
+  zip[19] = zip[20] = zip[21] = 0;
+  reads.clear();
+  vector<BitExtent> grown_deflates;
+  ASSERT_TRUE(LocateDeflatesInZipArchive(
+      UniqueStreamPtr(
+          new ReadCountingStream(MemoryStream::CreateForRead(zip), &reads)),
+      &grown_deflates));
+  EXPECT_EQ(grown_deflates, deflates);
+  EXPECT_GT(reads[31], 1);
+}
+
 TEST(UtilsTest, RemoveEqualBitExtents) {
   Buffer data1 = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
   Buffer data2 = {1, 2, 3, 4, 5, 5, 6, 7, 8, 9};
@@ -0,0 +1,173 @@
+// Copyright 2018 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "puffin/src/include/puffin/verify.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "puffin/src/bit_reader.h"
+#include "puffin/src/bit_writer.h"
+#include "puffin/src/include/puffin/common.h"
+#include "puffin/src/include/puffin/huffer.h"
+#include "puffin/src/include/puffin/puffer.h"
+#include "puffin/src/logging.h"
+#include "puffin/src/puff_reader.h"
+#include "puffin/src/puff_writer.h"
+#include "puffin/src/trace_event.h"
+
+using std::vector;
+
+namespace puffin {
+
+namespace {
+
+// The maximum size of the deflates read from the stream at once (unless a
+// single deflate is larger). They are verified before the next ones are read.
+constexpr uint64_t kMaxBatchSize = 32 * 1024 * 1024;  // 32 MB
+
+// Puffs |deflate| into |puff_buffer| and huffs it back into |deflate_buffer|.
+// |data| has the bytes of the deflate, from the one with its first bit to the
+// one with its last bit. Returns true if the deflate comes back the same.
+bool VerifyDeflate(const Puffer& puffer,
+                   const Huffer& huffer,
+                   const BitExtent& deflate,
+                   uint64_t puff_size,
+                   const uint8_t* data,
+                   PuffFormat format,
+                   Buffer* puff_buffer,
+                   Buffer* deflate_buffer) {
+  auto start_bits = deflate.offset & 7;
+  auto length = (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+  TEST_AND_RETURN_FALSE(length > 0);
+
+  BufferBitReader bit_reader(data, length);
+  TEST_AND_RETURN_FALSE(bit_reader.CacheBits(start_bits));
+  bit_reader.DropBits(start_bits);
+  puff_buffer->resize(puff_size);
+  BufferPuffWriter puff_writer(puff_buffer->data(), puff_size, format);
+  {
+    TRACE_EVENT1("puff", "PuffDeflate", "puff_size", puff_size);
+    TEST_AND_RETURN_FALSE(
+        puffer.PuffDeflate(&bit_reader, &puff_writer, nullptr));
+  }
+  TEST_AND_RETURN_FALSE(bit_reader.OffsetInBits() ==
+                        start_bits + deflate.length);
+  TEST_AND_RETURN_FALSE(puff_writer.Size() == puff_size);
+
+  deflate_buffer->resize(length);
+  BufferBitWriter bit_writer(deflate_buffer->data(), length);
+  BufferPuffReader puff_reader(puff_buffer->data(), puff_size, format);
+  // The bits before the deflate in its first byte are copied as they are.
+  TEST_AND_RETURN_FALSE(bit_writer.WriteBits(start_bits, data[0]));
+  {
+    TRACE_EVENT1("huff", "HuffDeflate", "puff_size", puff_size);
+    TEST_AND_RETURN_FALSE(huffer.HuffDeflate(&puff_reader, &bit_writer));
+  }
+  TEST_AND_RETURN_FALSE(bit_writer.Size() == length);
+  TEST_AND_RETURN_FALSE(puff_reader.BytesLeft() == 0);
+
+  // The bits after the deflate in its last byte are not compared.
+  auto end_bits = (deflate.offset + deflate.length) & 7;
+  uint8_t last_byte_mask = end_bits ? (1 << end_bits) - 1 : 0xFF;
+  return memcmp(data, deflate_buffer->data(), length - 1) == 0 &&
+         ((data[length - 1] ^ (*deflate_buffer)[length - 1]) &
+          last_byte_mask) == 0;
+}
+
+}  // namespace
+
+bool VerifyDeflates(const UniqueStreamPtr& stream,
+                    const DeflateIndex& index,
+                    size_t num_threads,
+                    vector<BitExtent>* mismatches,
+                    PuffFormat format) {
+  TRACE_EVENT1("verify", "VerifyDeflates", "deflates", index.deflates.size());
+  const auto& deflates = index.deflates;
+  TEST_AND_RETURN_FALSE(deflates.size() == index.puffs.size());
+  if (num_threads == 0) {
+    num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+
+  Puffer puffer;
+  Huffer huffer;
+  auto start_byte = [](const BitExtent& deflate) {
+    return deflate.offset / 8;
+  };
+  auto deflate_bytes = [](const BitExtent& deflate) {
+    return (deflate.offset + deflate.length + 7) / 8 - deflate.offset / 8;
+  };
+
+  // Not a |vector<bool>|, so the threads can set their elements concurrently.
+  vector<uint8_t> matches(deflates.size(), 0);
+  Buffer batch;
+  vector<const uint8_t*> deflate_data(deflates.size(), nullptr);
+  for (size_t begin = 0; begin < deflates.size();) {
+    size_t end = begin;
+    uint64_t batch_size = 0;
+    while (end < deflates.size() &&
+           (end == begin ||
+            batch_size + deflate_bytes(deflates[end]) <= kMaxBatchSize)) {
+      batch_size += deflate_bytes(deflates[end]);
+      end++;
+    }
+
+    // In-memory streams are verified in place. A |Read| invalidates the data
+    // of |GetData|, so the whole batch is read unless all of it is in memory.
+    bool in_place = true;
+    for (auto idx = begin; idx < end && in_place; idx++) {
+      in_place = stream->GetData(start_byte(deflates[idx]),
+                                 deflate_bytes(deflates[idx]),
+                                 &deflate_data[idx]);
+    }
+    if (!in_place) {
+      TRACE_EVENT1("io", "Read", "bytes", batch_size);
+      batch.resize(batch_size);
+      uint64_t batch_offset = 0;
+      for (auto idx = begin; idx < end; idx++) {
+        auto length = deflate_bytes(deflates[idx]);
+        TEST_AND_RETURN_FALSE(stream->Seek(start_byte(deflates[idx])));
+        TEST_AND_RETURN_FALSE(
+            stream->Read(batch.data() + batch_offset, length));
+        deflate_data[idx] = batch.data() + batch_offset;
+        batch_offset += length;
+      }
+    }
+
+    // The deflates take different times, so the threads take the next one from
+    // a shared counter.
+    std::atomic<size_t> next(begin);
+    auto worker = [&]() {
+      Buffer puff_buffer, deflate_buffer;
+      for (size_t idx; (idx = next++) < end;) {
+        matches[idx] = VerifyDeflate(puffer, huffer, deflates[idx],
+                                     index.puffs[idx].length,
+                                     deflate_data[idx], format, &puff_buffer,
+                                     &deflate_buffer);
+      }
+    };
+    vector<std::thread> threads;
+    for (size_t idx = 1; idx < std::min(num_threads, end - begin); idx++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    begin = end;
+  }
+
+  for (size_t idx = 0; idx < deflates.size(); idx++) {
+    if (!matches[idx]) {
+      mismatches->push_back(deflates[idx]);
+    }
+  }
+  return true;
+}
+
+}  // namespace puffin